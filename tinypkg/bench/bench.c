@@ -0,0 +1,419 @@
+/*
+ * bench.c - Query-path benchmark harness for tinypkg
+ *
+ * Usage: bench [-n runs] [-t tolerance] [-b baseline.tsv] [-o results.tsv]
+ *              <tinypkg> <workdir> <size>...
+ *
+ * Expects <workdir>/<size> to hold a repository made by gen_repo. For each
+ * size and query command it measures:
+ *
+ *   cold_ms     one run after evicting the binary and cache files from the
+ *               page cache (posix_fadvise, no root needed)
+ *   warm_ms     median of repeated runs, p95_ms its 95th percentile
+ *   qps         queries per second (1000 / warm_ms; batch mode: measured)
+ *   max_rss_kb  peak resident set size of the tinypkg process
+ *
+ * Results are written as TSV. When a baseline TSV exists, any warm latency,
+ * RSS or throughput worse than the baseline by more than the tolerance
+ * (plus a small absolute slack for noise) is reported and the exit status
+ * is 1.
+ */
+
+#define _DEFAULT_SOURCE     /* wait4() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define PATH_LEN 2048
+#define MAX_RUNS 1000
+#define MAX_RESULTS 256
+#define WARM_BUDGET_SEC 10.0
+#define BATCH_QUERIES 1000
+#define SLACK_MS 2.0
+#define SLACK_KB 2048
+
+#define FMT_OVERFLOW(dst, ...) \
+    (snprintf((dst), sizeof(dst), __VA_ARGS__) >= (int)sizeof(dst))
+
+struct result {
+    long size;
+    char cmd[32];
+    double cold_ms;
+    double warm_ms;
+    double p95_ms;
+    double qps;
+    long max_rss_kb;
+};
+
+static const char *tinypkg_bin;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/* Run tinypkg once with HOME pointed at the synthetic repository */
+static int run_once(const char *home, char *const args[], const char *input,
+                    double *ms, long *rss_kb) {
+    struct rusage ru;
+    double start = now_ms();
+    int status;
+    pid_t pid;
+
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_RDWR);
+        int in = input ? open(input, O_RDONLY) : devnull;
+
+        setenv("HOME", home, 1);
+        setenv("TINYPKG_NO_DAEMON", "1", 1);
+        dup2(in, STDIN_FILENO);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        execv(tinypkg_bin, args);
+        _exit(127);
+    }
+
+    if (wait4(pid, &status, 0, &ru) < 0) {
+        perror("wait4");
+        return -1;
+    }
+
+    *ms = now_ms() - start;
+    *rss_kb = ru.ru_maxrss;
+
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+        fprintf(stderr, "bench: could not execute %s\n", tinypkg_bin);
+        return -1;
+    }
+    /* A command that fails fast would pass for a fast sample */
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "bench: '%s %s' failed in %s (%s %d); not timing it\n",
+                args[1], args[2] ? args[2] : "", home,
+                WIFEXITED(status) ? "exit status" : "signal",
+                WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status));
+        return -1;
+    }
+    return 0;
+}
+
+/* Write back and evict a file from the page cache */
+static void evict(const char *path) {
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        return;
+    }
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static void evict_all(const char *home, const char *manifest) {
+    static const char *files[] = {
+        "index.yaml", "installed.db", "pkgindex.db", NULL
+    };
+    char path[PATH_LEN];
+
+    evict(tinypkg_bin);
+    for (int i = 0; files[i]; i++) {
+        if (!FMT_OVERFLOW(path, "%s/.cache/tinypkg/%s", home, files[i])) {
+            evict(path);
+        }
+    }
+    if (manifest && !FMT_OVERFLOW(path, "%s/.cache/tinypkg/repo/packages/%s/manifest.yaml",
+                                  home, manifest)) {
+        evict(path);
+    }
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static int measure(const char *home, long size, const char *name,
+                   char *const args[], const char *manifest, int runs,
+                   struct result *r) {
+    static double samples[MAX_RUNS];
+    double ms, start;
+    long rss;
+    int n = 0;
+
+    memset(r, 0, sizeof(*r));
+    r->size = size;
+    snprintf(r->cmd, sizeof(r->cmd), "%s", name);
+
+    evict_all(home, manifest);
+    if (run_once(home, args, NULL, &r->cold_ms, &rss) != 0) {
+        return -1;
+    }
+    r->max_rss_kb = rss;
+
+    /* Warm runs: at least three, at most 'runs' or the time budget */
+    start = now_ms();
+    while (n < runs && n < MAX_RUNS &&
+           (n < 3 || now_ms() - start < WARM_BUDGET_SEC * 1000.0)) {
+        if (run_once(home, args, NULL, &ms, &rss) != 0) {
+            return -1;
+        }
+        samples[n++] = ms;
+        if (rss > r->max_rss_kb) {
+            r->max_rss_kb = rss;
+        }
+    }
+
+    qsort(samples, (size_t)n, sizeof(samples[0]), cmp_double);
+    r->warm_ms = samples[n / 2];
+    r->p95_ms = samples[(n * 95) / 100 < n ? (n * 95) / 100 : n - 1];
+    r->qps = r->warm_ms > 0 ? 1000.0 / r->warm_ms : 0;
+    return 0;
+}
+
+/* One batch process answering BATCH_QUERIES mixed queries */
+static int measure_batch(const char *home, long size, struct result *r) {
+    char input[PATH_LEN];
+    char *args[] = { (char *)tinypkg_bin, "batch", NULL };
+    double ms;
+    long rss;
+    FILE *f;
+
+    if (FMT_OVERFLOW(input, "%s/batch.in", home) || !(f = fopen(input, "w"))) {
+        return -1;
+    }
+    for (long i = 0; i < BATCH_QUERIES; i++) {
+        long pkg = 1 + (i * 7919) % size;
+        if (i % 10 == 0) {
+            fprintf(f, "search kw%02ld\n", i % 100);
+        } else if (i % 2) {
+            fprintf(f, "info pkg%06ld\n", pkg);
+        } else {
+            fprintf(f, "is-installed pkg%06ld\n", pkg);
+        }
+    }
+    fclose(f);
+
+    memset(r, 0, sizeof(*r));
+    r->size = size;
+    snprintf(r->cmd, sizeof(r->cmd), "batch");
+
+    evict_all(home, NULL);
+    if (run_once(home, args, input, &r->cold_ms, &rss) != 0 ||
+        run_once(home, args, input, &ms, &r->max_rss_kb) != 0) {
+        return -1;
+    }
+
+    r->warm_ms = ms;
+    r->p95_ms = ms;
+    r->qps = ms > 0 ? BATCH_QUERIES * 1000.0 / ms : 0;
+    return 0;
+}
+
+static int write_results(const char *path, const struct result *res, int n) {
+    FILE *f = fopen(path, "w");
+
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    fprintf(f, "size\tcmd\tcold_ms\twarm_ms\tp95_ms\tqps\tmax_rss_kb\n");
+    for (int i = 0; i < n; i++) {
+        fprintf(f, "%ld\t%s\t%.3f\t%.3f\t%.3f\t%.1f\t%ld\n", res[i].size,
+                res[i].cmd, res[i].cold_ms, res[i].warm_ms, res[i].p95_ms,
+                res[i].qps, res[i].max_rss_kb);
+    }
+
+    fclose(f);
+    return 0;
+}
+
+/* Compare against a baseline TSV; returns the number of regressions */
+static int compare(const char *path, const struct result *res, int n, double tol) {
+    char line[512];
+    int regressions = 0, matched = 0;
+    FILE *f = fopen(path, "r");
+
+    if (!f) {
+        printf("No baseline at %s (run 'make bench-baseline' to create one)\n", path);
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        struct result b;
+
+        if (sscanf(line, "%ld\t%31s\t%lf\t%lf\t%lf\t%lf\t%ld", &b.size, b.cmd,
+                   &b.cold_ms, &b.warm_ms, &b.p95_ms, &b.qps, &b.max_rss_kb) != 7) {
+            continue;   /* Header */
+        }
+
+        for (int i = 0; i < n; i++) {
+            const struct result *r = &res[i];
+
+            if (r->size != b.size || strcmp(r->cmd, b.cmd) != 0) {
+                continue;
+            }
+            matched++;
+
+            if (r->warm_ms > b.warm_ms * (1.0 + tol) + SLACK_MS) {
+                printf("REGRESSION %ld %s: warm %.3f ms -> %.3f ms\n",
+                       r->size, r->cmd, b.warm_ms, r->warm_ms);
+                regressions++;
+            }
+            if (r->max_rss_kb > (long)(b.max_rss_kb * (1.0 + tol)) + SLACK_KB) {
+                printf("REGRESSION %ld %s: rss %ld KB -> %ld KB\n",
+                       r->size, r->cmd, b.max_rss_kb, r->max_rss_kb);
+                regressions++;
+            }
+            if (strcmp(r->cmd, "batch") == 0 && r->qps < b.qps / (1.0 + tol)) {
+                printf("REGRESSION %ld %s: %.1f q/s -> %.1f q/s\n",
+                       r->size, r->cmd, b.qps, r->qps);
+                regressions++;
+            }
+        }
+    }
+
+    fclose(f);
+    printf("Compared %d result(s) with %s: %d regression(s)\n", matched, path, regressions);
+    return regressions;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n runs] [-t tolerance] [-b baseline.tsv] "
+            "[-o results.tsv] <tinypkg> <workdir> <size>...\n", prog);
+}
+
+/*
+ * The keyword gen_repo gave pkg, so 'search' is sure to match: with few
+ * packages a fixed keyword may be unused, and a search with no results
+ * exits 1
+ */
+static void keyword_of(const char *home, const char *pkg, char kw[8]) {
+    char path[PATH_LEN], line[256];
+    FILE *f;
+
+    snprintf(kw, 8, "kw42");
+    if (FMT_OVERFLOW(path, "%s/.cache/tinypkg/repo/packages/%s/manifest.yaml", home, pkg) ||
+        !(f = fopen(path, "r"))) {
+        return;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char *p = strstr(line, " kw");
+        if (strncmp(line, "description:", 12) == 0 && p) {
+            snprintf(kw, 8, "%.4s", p + 1);
+            break;
+        }
+    }
+    fclose(f);
+}
+
+int main(int argc, char *argv[]) {
+    static struct result results[MAX_RESULTS];
+    const char *baseline = NULL, *out = NULL;
+    double tol = 0.25;
+    int runs = 20, nres = 0, opt;
+
+    while ((opt = getopt(argc, argv, "n:t:b:o:")) != -1) {
+        switch (opt) {
+        case 'n': runs = atoi(optarg); break;
+        case 't': tol = atof(optarg); break;
+        case 'b': baseline = optarg; break;
+        case 'o': out = optarg; break;
+        default: usage(argv[0]); return 2;
+        }
+    }
+
+    if (argc - optind < 3 || runs < 1) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    tinypkg_bin = argv[optind];
+    printf("%8s %-13s %10s %10s %10s %10s %10s\n", "size", "cmd",
+           "cold_ms", "warm_ms", "p95_ms", "qps", "rss_kb");
+
+    for (int s = optind + 2; s < argc; s++) {
+        long size = atol(argv[s]);
+        char home[PATH_LEN], target[32], installed[32], kw[8];
+        long inst = size >= 10 ? size - size % 10 : 1;
+
+        if (size < 1 || FMT_OVERFLOW(home, "%s/%ld", argv[optind + 1], size)) {
+            fprintf(stderr, "bench: bad size %s\n", argv[s]);
+            return 2;
+        }
+        snprintf(target, sizeof(target), "pkg%06ld", size / 2 + 1);
+        snprintf(installed, sizeof(installed), "pkg%06ld", inst);
+        keyword_of(home, target, kw);
+
+        char *const list_args[] = { (char *)tinypkg_bin, "list", NULL };
+        char *const search_args[] = { (char *)tinypkg_bin, "search", kw, NULL };
+        char *const info_args[] = { (char *)tinypkg_bin, "info", target, NULL };
+        char *const inst_args[] = { (char *)tinypkg_bin, "is-installed", installed, NULL };
+        char *const rdeps_args[] = { (char *)tinypkg_bin, "rdeps", "pkg000001",
+                                     "--transitive", NULL };
+        char *const sync_args[] = { (char *)tinypkg_bin, "repo", "sync", NULL };
+
+        struct {
+            const char *name;
+            char *const *args;
+            const char *manifest;
+        } cmds[] = {
+            { "sync", sync_args, NULL },
+            { "list", list_args, NULL },
+            { "search", search_args, NULL },
+            { "info", info_args, target },
+            { "is-installed", inst_args, NULL },
+            { "rdeps", rdeps_args, NULL },
+        };
+
+        for (size_t c = 0; c < sizeof(cmds) / sizeof(cmds[0]) && nres < MAX_RESULTS - 1; c++) {
+            struct result *r = &results[nres];
+            if (measure(home, size, cmds[c].name, cmds[c].args, cmds[c].manifest,
+                        runs, r) != 0) {
+                return 1;
+            }
+            nres++;
+            printf("%8ld %-13s %10.3f %10.3f %10.3f %10.1f %10ld\n", r->size, r->cmd,
+                   r->cold_ms, r->warm_ms, r->p95_ms, r->qps, r->max_rss_kb);
+            fflush(stdout);
+        }
+
+        if (measure_batch(home, size, &results[nres]) != 0) {
+            return 1;
+        }
+        struct result *r = &results[nres++];
+        printf("%8ld %-13s %10.3f %10.3f %10.3f %10.1f %10ld\n", r->size, r->cmd,
+               r->cold_ms, r->warm_ms, r->p95_ms, r->qps, r->max_rss_kb);
+        fflush(stdout);
+    }
+
+    if (out && write_results(out, results, nres) != 0) {
+        return 1;
+    }
+    if (out) {
+        printf("Results written to %s\n", out);
+    }
+
+    if (baseline && compare(baseline, results, nres, tol) > 0) {
+        fprintf(stderr, "bench: performance regression against %s\n", baseline);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,205 @@
+/*
+ * gen_repo.c - Generate a synthetic tinypkg repository for benchmarking
+ *
+ * Usage: gen_repo <home> <count>
+ *
+ * Creates <home>/.cache/tinypkg/ as if 'tinypkg repo sync' had run against
+ * a repository of <count> packages:
+ *
+ *   origin.git/          bare repository standing in for REPO_URL
+ *   repo/packages/       index.yaml + <name>/manifest.yaml (git checkout)
+ *   index.yaml           cached copy used by list/search
+ *   installed.db         every tenth package marked installed
+ *
+ * Package contents are deterministic, so runs are comparable. Each
+ * package depends on up to three earlier ones and its description carries
+ * one of 100 keywords ("kw00".."kw99"), so a keyword search matches ~1%.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define PATH_LEN 4096
+
+/* snprintf into an array, true if the result did not fit */
+#define FMT_OVERFLOW(dst, ...) \
+    (snprintf((dst), sizeof(dst), __VA_ARGS__) >= (int)sizeof(dst))
+
+static unsigned long rng_state = 2463534242UL;
+
+/* xorshift: fast and reproducible across platforms */
+static unsigned long rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state & 0xffffffffUL;
+}
+
+static int mkdir_p(const char *path) {
+    char tmp[PATH_LEN];
+    size_t len = strlen(path);
+
+    if (len >= sizeof(tmp)) {
+        return -1;
+    }
+    memcpy(tmp, path, len + 1);
+
+    for (char *p = tmp + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            if (mkdir(tmp, 0755) != 0 && errno != EEXIST) {
+                return -1;
+            }
+            *p = '/';
+        }
+    }
+    return (mkdir(tmp, 0755) != 0 && errno != EEXIST) ? -1 : 0;
+}
+
+static int run(const char *cmd) {
+    if (system(cmd) != 0) {
+        fprintf(stderr, "gen_repo: command failed: %s\n", cmd);
+        return -1;
+    }
+    return 0;
+}
+
+static int write_manifest(const char *pkgs, long i, long count, unsigned long kw) {
+    char dir[PATH_LEN], path[PATH_LEN];
+    FILE *f;
+    int ndeps = (i > 1) ? (int)(rng() % 4) : 0;
+
+    if (FMT_OVERFLOW(dir, "%s/pkg%06ld", pkgs, i) ||
+        FMT_OVERFLOW(path, "%s/manifest.yaml", dir) ||
+        mkdir_p(dir) != 0 || !(f = fopen(path, "w"))) {
+        perror(path);
+        return -1;
+    }
+
+    fprintf(f, "name: pkg%06ld\n", i);
+    fprintf(f, "version: 1.%ld.%ld\n", i / 1000, i % 1000);
+    fprintf(f, "description: Synthetic tool kw%02lu for benchmarking\n", kw);
+    fprintf(f, "architecture: aarch64\nos: linux\n");
+
+    if (ndeps > 0) {
+        fprintf(f, "depends:\n");
+        for (int d = 0; d < ndeps; d++) {
+            /* Skew towards low numbers so some packages have many dependents */
+            long dep = 1 + (long)(rng() % (unsigned long)(i - 1));
+            if (rng() % 2) {
+                dep = 1 + dep % (count / 100 + 1);
+            }
+            if (dep >= i) {
+                dep = i - 1;
+            }
+            fprintf(f, "  - pkg%06ld\n", dep);
+        }
+    }
+
+    fprintf(f, "\nsource: https://example.invalid/pkg%06ld-1.%ld.%ld.tar.gz\n\n",
+            i, i / 1000, i % 1000);
+    fprintf(f, "build: |\n  cd pkg%06ld\n  ./configure --prefix=$PREFIX\n  make -j$(nproc)\n\n", i);
+    fprintf(f, "install: |\n  cd pkg%06ld\n  make install\n\n", i);
+    fprintf(f, "checksum: sha256:%08lx%08lx%08lx%08lx%08lx%08lx%08lx%08lx\n",
+            rng(), rng(), rng(), rng(), rng(), rng(), rng(), rng());
+
+    fclose(f);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    char cache[PATH_LEN], repo[PATH_LEN], pkgs[PATH_LEN];
+    char path[PATH_LEN], stamp[PATH_LEN], cmd[PATH_LEN * 3];
+    FILE *index, *db, *f;
+    long count;
+    char *end;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <home> <count>\n", argv[0]);
+        return 2;
+    }
+
+    count = strtol(argv[2], &end, 10);
+    if (*end || count < 1 || count > 999999) {
+        fprintf(stderr, "gen_repo: count must be 1..999999\n");
+        return 2;
+    }
+
+    if (FMT_OVERFLOW(cache, "%s/.cache/tinypkg", argv[1]) ||
+        FMT_OVERFLOW(repo, "%s/repo", cache) ||
+        FMT_OVERFLOW(pkgs, "%s/packages", repo) ||
+        FMT_OVERFLOW(stamp, "%s/.gen_repo-%ld", cache, count)) {
+        fprintf(stderr, "gen_repo: path too long\n");
+        return 2;
+    }
+
+    /* Reuse a previous generation of the same size */
+    if (access(stamp, F_OK) == 0) {
+        printf("gen_repo: reusing %s (%ld packages)\n", cache, count);
+        return 0;
+    }
+
+    if (FMT_OVERFLOW(cmd, "rm -rf '%s'", cache) ||
+        run(cmd) != 0 || mkdir_p(pkgs) != 0) {
+        return 1;
+    }
+
+    printf("gen_repo: generating %ld packages in %s\n", count, cache);
+
+    index = FMT_OVERFLOW(path, "%s/index.yaml", pkgs) ? NULL : fopen(path, "w");
+    db = FMT_OVERFLOW(path, "%s/installed.db", cache) ? NULL : fopen(path, "w");
+    if (!index || !db) {
+        perror("fopen");
+        return 1;
+    }
+
+    fprintf(index, "version: 1\n\npackages:\n");
+
+    for (long i = 1; i <= count; i++) {
+        unsigned long kw = rng() % 100;
+
+        if (write_manifest(pkgs, i, count, kw) != 0) {
+            return 1;
+        }
+
+        fprintf(index, "  pkg%06ld:\n", i);
+        fprintf(index, "    description: Synthetic tool kw%02lu for benchmarking\n", kw);
+        fprintf(index, "    latest: 1.%ld.%ld\n    \n", i / 1000, i % 1000);
+
+        if (i % 10 == 0) {
+            fprintf(db, "pkg%06ld 1.%ld.%ld\n", i, i / 1000, i % 1000);
+        }
+    }
+
+    fclose(index);
+    fclose(db);
+
+    if (FMT_OVERFLOW(cmd, "cp '%s/index.yaml' '%s/index.yaml'", pkgs, cache) ||
+        run(cmd) != 0) {
+        return 1;
+    }
+
+    /* Bare origin so 'repo sync' can pull without network access */
+    if (FMT_OVERFLOW(cmd,
+             "cd '%s' && git init -q && git add -A && "
+             "git -c user.name=bench -c user.email=bench@localhost commit -qm synthetic && "
+             "git init -q --bare '%s/origin.git' && "
+             "git remote add origin '%s/origin.git' && "
+             "git push -q -u origin HEAD", repo, cache, cache) ||
+        run(cmd) != 0) {
+        return 1;
+    }
+
+    f = fopen(stamp, "w");
+    if (f) {
+        fclose(f);
+    }
+
+    printf("gen_repo: done\n");
+    return 0;
+}
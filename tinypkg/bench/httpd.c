@@ -0,0 +1,325 @@
+/*
+ * httpd.c - Minimal static HTTP/1.1 server for offline pipeline tests
+ *
+ * Usage: httpd [-p port] [-r KB/s] [-l ms] [-d KB] [-v] <docroot>
+ *
+ * Serves regular files below <docroot> on 127.0.0.1 with GET and HEAD,
+ * persistent connections and single byte ranges ("Range: bytes=a-b"), so
+ * downloads behave like they would against a real mirror. Options:
+ *
+ *   -p port   listen port (default 0: pick a free one)
+ *   -r KB/s   throttle each response body to this rate
+ *   -l ms     delay before every response (simulated round trip)
+ *   -d KB     drop the connection after this much of each body (flaky
+ *             mirror; downloads only finish by resuming)
+ *   -v        log each request to stderr
+ *
+ * The chosen port is printed to stdout as "port <n>" once listening.
+ * Every connection is served by its own forked process.
+ */
+
+#define _DEFAULT_SOURCE     /* strcasecmp(), strncasecmp() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#define REQ_MAX 8192
+#define CHUNK 16384
+#define IDLE_TIMEOUT_SEC 5
+
+static long rate_bps;
+static long latency_ms;
+static long drop_bytes;
+static int verbose;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_sec(double sec) {
+    struct timespec ts;
+
+    if (sec <= 0) {
+        return;
+    }
+    ts.tv_sec = (time_t)sec;
+    ts.tv_nsec = (long)((sec - (double)ts.tv_sec) * 1e9);
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+}
+
+static int send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Send len bytes of file from off, holding the configured rate */
+static int send_body(int fd, int file, off_t off, off_t len) {
+    char buf[CHUNK];
+    double start = now_sec();
+    off_t sent = 0;
+
+    while (sent < len) {
+        size_t want = (len - sent) < (off_t)sizeof(buf) ? (size_t)(len - sent) : sizeof(buf);
+        ssize_t n;
+
+        if (drop_bytes > 0 && sent >= drop_bytes) {
+            return -1;
+        }
+        if (drop_bytes > 0 && (off_t)want > drop_bytes - sent) {
+            want = (size_t)(drop_bytes - sent);
+        }
+
+        n = pread(file, buf, want, off + sent);
+
+        if (n <= 0 || send_all(fd, buf, (size_t)n) != 0) {
+            return -1;
+        }
+        sent += n;
+
+        if (rate_bps > 0) {
+            sleep_sec((double)sent / (double)rate_bps - (now_sec() - start));
+        }
+    }
+    return 0;
+}
+
+static int send_status(int fd, int code, const char *reason, int keep_alive) {
+    char hdr[256];
+    int n = snprintf(hdr, sizeof(hdr),
+                     "HTTP/1.1 %d %s\r\nContent-Length: 0\r\nConnection: %s\r\n\r\n",
+                     code, reason, keep_alive ? "keep-alive" : "close");
+    return send_all(fd, hdr, (size_t)n);
+}
+
+/* Read one request head; returns its length, 0 on EOF, -1 on error */
+static int read_head(int fd, char *buf, size_t size) {
+    size_t used = 0;
+
+    while (used + 1 < size) {
+        ssize_t n = read(fd, buf + used, size - used - 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            return used == 0 ? 0 : -1;
+        }
+        used += (size_t)n;
+        buf[used] = '\0';
+        if (strstr(buf, "\r\n\r\n")) {
+            return (int)used;
+        }
+    }
+    return -1;
+}
+
+/* Serve requests on one connection until it closes; returns when done */
+static void serve(int fd, const char *root) {
+    char req[REQ_MAX];
+    struct timeval tv = { IDLE_TIMEOUT_SEC, 0 };
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    for (;;) {
+        char method[16], target[1024], version[16], path[2048], hdr[512];
+        long long first = -1, last = -1;
+        int keep_alive, head, file, n;
+        off_t off, len;
+        struct stat st;
+        char *line;
+
+        if (read_head(fd, req, sizeof(req)) <= 0) {
+            return;
+        }
+
+        if (sscanf(req, "%15s %1023s %15s", method, target, version) != 3) {
+            send_status(fd, 400, "Bad Request", 0);
+            return;
+        }
+
+        /* Static files only: the query string plays no part */
+        target[strcspn(target, "?")] = '\0';
+
+        keep_alive = strcmp(version, "HTTP/1.1") == 0;
+        for (line = strstr(req, "\r\n"); line; line = strstr(line + 2, "\r\n")) {
+            const char *h = line + 2;
+
+            if (strncasecmp(h, "Connection:", 11) == 0) {
+                keep_alive = strncasecmp(h + 11 + strspn(h + 11, " "), "close", 5) != 0;
+            } else if (strncasecmp(h, "Range:", 6) == 0) {
+                const char *r = strstr(h, "bytes=");
+                if (r && sscanf(r + 6, "%lld-%lld", &first, &last) < 1) {
+                    first = -1;
+                }
+            }
+        }
+
+        if (verbose) {
+            fprintf(stderr, "httpd[%d]: %s %s range=%lld-%lld\n",
+                    (int)getpid(), method, target, first, last);
+        }
+
+        if (latency_ms > 0) {
+            sleep_sec(latency_ms / 1000.0);
+        }
+
+        head = strcmp(method, "HEAD") == 0;
+        if (!head && strcmp(method, "GET") != 0) {
+            send_status(fd, 405, "Method Not Allowed", 0);
+            return;
+        }
+
+        if (target[0] != '/' || strstr(target, "..") ||
+            snprintf(path, sizeof(path), "%s%s", root, target) >= (int)sizeof(path) ||
+            (file = open(path, O_RDONLY)) < 0) {
+            if (send_status(fd, 404, "Not Found", keep_alive) != 0 || !keep_alive) {
+                return;
+            }
+            continue;
+        }
+
+        if (fstat(file, &st) != 0 || !S_ISREG(st.st_mode)) {
+            close(file);
+            if (send_status(fd, 404, "Not Found", keep_alive) != 0 || !keep_alive) {
+                return;
+            }
+            continue;
+        }
+
+        off = 0;
+        len = st.st_size;
+
+        if (first >= 0) {
+            if (first >= st.st_size) {
+                close(file);
+                n = snprintf(hdr, sizeof(hdr),
+                             "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                             "Content-Range: bytes */%lld\r\nContent-Length: 0\r\n"
+                             "Connection: %s\r\n\r\n",
+                             (long long)st.st_size, keep_alive ? "keep-alive" : "close");
+                if (send_all(fd, hdr, (size_t)n) != 0 || !keep_alive) {
+                    return;
+                }
+                continue;
+            }
+            if (last < first || last >= st.st_size) {
+                last = st.st_size - 1;
+            }
+            off = (off_t)first;
+            len = (off_t)(last - first + 1);
+            n = snprintf(hdr, sizeof(hdr),
+                         "HTTP/1.1 206 Partial Content\r\nContent-Length: %lld\r\n"
+                         "Content-Range: bytes %lld-%lld/%lld\r\nAccept-Ranges: bytes\r\n"
+                         "Connection: %s\r\n\r\n",
+                         (long long)len, first, last, (long long)st.st_size,
+                         keep_alive ? "keep-alive" : "close");
+        } else {
+            n = snprintf(hdr, sizeof(hdr),
+                         "HTTP/1.1 200 OK\r\nContent-Length: %lld\r\n"
+                         "Accept-Ranges: bytes\r\nConnection: %s\r\n\r\n",
+                         (long long)len, keep_alive ? "keep-alive" : "close");
+        }
+
+        if (send_all(fd, hdr, (size_t)n) != 0 ||
+            (!head && send_body(fd, file, off, len) != 0)) {
+            close(file);
+            return;
+        }
+        close(file);
+
+        if (!keep_alive) {
+            return;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int port = 0, opt, listen_fd, one = 1;
+
+    while ((opt = getopt(argc, argv, "p:r:l:d:v")) != -1) {
+        switch (opt) {
+        case 'p': port = atoi(optarg); break;
+        case 'r': rate_bps = atol(optarg) * 1024; break;
+        case 'l': latency_ms = atol(optarg); break;
+        case 'd': drop_bytes = atol(optarg) * 1024; break;
+        case 'v': verbose = 1; break;
+        default:
+            fprintf(stderr, "Usage: %s [-p port] [-r KB/s] [-l ms] [-d KB] [-v] <docroot>\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-p port] [-r KB/s] [-l ms] [-d KB] [-v] <docroot>\n", argv[0]);
+        return 2;
+    }
+
+    /* Children are never waited for */
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        perror("socket");
+        return 1;
+    }
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((unsigned short)port);
+
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listen_fd, 128) != 0 ||
+        getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len) != 0) {
+        perror("bind");
+        return 1;
+    }
+
+    printf("port %d\n", ntohs(addr.sin_port));
+    fflush(stdout);
+
+    for (;;) {
+        int client = accept(listen_fd, NULL, NULL);
+        pid_t pid;
+
+        if (client < 0) {
+            if (errno == EINTR) continue;
+            perror("accept");
+            return 1;
+        }
+
+        pid = fork();
+        if (pid == 0) {
+            close(listen_fd);
+            serve(client, argv[optind]);
+            close(client);
+            _exit(0);
+        }
+        close(client);
+    }
+}
@@ -0,0 +1,411 @@
+/*
+ * index_check.c - Check the incremental index update against a full rebuild
+ *
+ * Usage: index_check [-n pkgs] [-r rounds] [-c changes] <tinypkg> <workdir>
+ *
+ * Under <workdir> it creates:
+ *
+ *   seed/         git working tree of a repository of <pkgs> packages
+ *   origin.git    bare repository used as TINYPKG_REPO_URL
+ *   mirror/       'tinypkg mirror' output, for its snapshot/ directory
+ *   pub/          HOME of the publisher, which syncs and mirrors each commit
+ *   git/, snap/   HOME of a client syncing with git and one using snapshots
+ *   logs/         output of every tinypkg run
+ *
+ * Each round makes two commits of <changes> random edits: packages are
+ * added, deleted, given new versions and dependencies (some on packages
+ * that no longer exist), and their index.yaml 'latest:' put out of step,
+ * so the diagnostics change too. Both clients then sync, which must patch
+ * pkgindex.db and diagnostics in place. The two files are set aside,
+ * pkgindex.db is deleted and the sync repeated, which must rebuild both
+ * from scratch; they must come out byte-for-byte the same.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define PATH_LEN 2048
+#define MAX_PKGS 999
+#define MAX_DEPS 3
+
+#define FMT_OVERFLOW(dst, ...) \
+    (snprintf((dst), sizeof(dst), __VA_ARGS__) >= (int)sizeof(dst))
+
+struct pkg {
+    int live;
+    int version;
+    int stale;                  /* index.yaml 'latest:' differs */
+    int deps[MAX_DEPS];
+    int ndeps;
+};
+
+static const char *tinypkg_bin;
+static char work[PATH_LEN], seed[PATH_LEN], origin[PATH_LEN], mirror[PATH_LEN];
+static char logs[PATH_LEN], tarball[PATH_LEN], checksum[80];
+static struct pkg pkgs[MAX_PKGS + 1];
+static int npkgs;
+static int snap_deltas;         /* The last snapshot sync applied deltas */
+
+static unsigned long rng_state = 362436069UL;
+
+static unsigned long rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state & 0xffffffffUL;
+}
+
+static int run_shell(const char *cmd) {
+    if (system(cmd) != 0) {
+        fprintf(stderr, "index_check: command failed: %s\n", cmd);
+        return -1;
+    }
+    return 0;
+}
+
+/* ============================================================================
+ * Fixtures
+ * ============================================================================
+ */
+
+static int write_manifest(int i) {
+    char dir[PATH_LEN], path[PATH_LEN];
+    struct pkg *p = &pkgs[i];
+    FILE *f;
+
+    if (FMT_OVERFLOW(dir, "%s/packages/p%03d", seed, i) ||
+        FMT_OVERFLOW(path, "%s/manifest.yaml", dir) ||
+        (mkdir(dir, 0755) != 0 && access(dir, F_OK) != 0) || !(f = fopen(path, "w"))) {
+        return -1;
+    }
+
+    fprintf(f, "name: p%03d\nversion: 1.%d\n"
+               "description: Index check fixture %d\n\n"
+               "source: file://%s\nchecksum: sha256:%s\n\n",
+            i, p->version, i, tarball, checksum);
+    if (p->ndeps > 0) {
+        fprintf(f, "depends:\n");
+        for (int d = 0; d < p->ndeps; d++) {
+            fprintf(f, "  - p%03d\n", p->deps[d]);
+        }
+        fprintf(f, "\n");
+    }
+    fprintf(f, "build: |\n  true\n\ninstall: |\n  true\n");
+    fclose(f);
+    return 0;
+}
+
+static int write_index(void) {
+    char path[PATH_LEN];
+    FILE *f;
+
+    if (FMT_OVERFLOW(path, "%s/packages/index.yaml", seed) || !(f = fopen(path, "w"))) {
+        return -1;
+    }
+    fprintf(f, "version: 1\n\npackages:\n");
+    for (int i = 1; i <= npkgs; i++) {
+        if (pkgs[i].live) {
+            fprintf(f, "  p%03d:\n    description: Index check fixture %d\n"
+                       "    latest: 1.%d\n    \n",
+                    i, i, pkgs[i].version + pkgs[i].stale);
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+/* Up to MAX_DEPS other packages, live or not; a dead one is a diagnostic */
+static void pick_deps(int i) {
+    pkgs[i].ndeps = 0;
+    for (int d = (int)(rng() % (MAX_DEPS + 1)); d > 0; d--) {
+        int dep = 1 + (int)(rng() % (unsigned long)npkgs);
+        int dup = dep == i;
+
+        for (int k = 0; k < pkgs[i].ndeps; k++) {
+            dup |= pkgs[i].deps[k] == dep;
+        }
+        if (!dup) {
+            pkgs[i].deps[pkgs[i].ndeps++] = dep;
+        }
+    }
+}
+
+static int add_pkg(void) {
+    int i = ++npkgs;
+
+    pkgs[i].live = 1;
+    pkgs[i].version = 0;
+    pkgs[i].stale = 0;
+    pick_deps(i);
+    return write_manifest(i);
+}
+
+/* One random edit: add, delete or change a package */
+static int mutate(void) {
+    char cmd[PATH_LEN * 2];
+    int kind = (int)(rng() % 4);
+    int i;
+
+    if (kind == 0 && npkgs < MAX_PKGS) {
+        return add_pkg();
+    }
+
+    i = 1 + (int)(rng() % (unsigned long)npkgs);
+    if (!pkgs[i].live) {
+        /* Bring a deleted name back */
+        pkgs[i].live = 1;
+        pick_deps(i);
+        return write_manifest(i);
+    }
+    if (kind == 1) {
+        pkgs[i].live = 0;
+        if (FMT_OVERFLOW(cmd, "rm -rf '%s/packages/p%03d'", seed, i)) {
+            return -1;
+        }
+        return run_shell(cmd);
+    }
+
+    pkgs[i].version++;
+    pkgs[i].stale = rng() % 5 == 0;
+    if (kind == 2) {
+        pick_deps(i);
+    }
+    return write_manifest(i);
+}
+
+static int commit(const char *msg) {
+    char cmd[PATH_LEN * 3];
+
+    if (write_index() != 0 ||
+        FMT_OVERFLOW(cmd,
+             "cd '%s' && git add -A && "
+             "git -c user.name=bench -c user.email=bench@localhost commit -qm '%s' && "
+             "git push -q '%s' HEAD", seed, msg, origin)) {
+        return -1;
+    }
+    return run_shell(cmd);
+}
+
+static int sha256_of(const char *path, char *hex) {
+    char cmd[PATH_LEN + 32];
+    FILE *p;
+    int ok;
+
+    if (FMT_OVERFLOW(cmd, "sha256sum '%s'", path) || !(p = popen(cmd, "r"))) {
+        return -1;
+    }
+    ok = fscanf(p, "%64s", hex) == 1 && strlen(hex) == 64;
+    return pclose(p) == 0 && ok ? 0 : -1;
+}
+
+static int setup(int count) {
+    char cmd[PATH_LEN * 4];
+
+    if (FMT_OVERFLOW(seed, "%s/seed", work) || FMT_OVERFLOW(origin, "%s/origin.git", work) ||
+        FMT_OVERFLOW(mirror, "%s/mirror", work) || FMT_OVERFLOW(logs, "%s/logs", work) ||
+        FMT_OVERFLOW(tarball, "%s/src.tar.gz", work) ||
+        FMT_OVERFLOW(cmd, "rm -rf '%s' && mkdir -p '%s/packages' '%s' '%s/src' && "
+                          "echo fixture > '%s/src/README' && tar -czf '%s' -C '%s' src",
+                     work, seed, logs, work, work, tarball, work) ||
+        run_shell(cmd) != 0 || sha256_of(tarball, checksum) != 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (add_pkg() != 0) {
+            return -1;
+        }
+    }
+    if (write_index() != 0 ||
+        FMT_OVERFLOW(cmd,
+             "cd '%s' && git init -q && git add -A && "
+             "git -c user.name=bench -c user.email=bench@localhost commit -qm fixtures && "
+             "git clone -q --bare '%s' '%s'", seed, seed, origin)) {
+        return -1;
+    }
+    return run_shell(cmd);
+}
+
+/* ============================================================================
+ * Running tinypkg
+ * ============================================================================
+ */
+
+/* Run tinypkg with HOME=<work>/<home>; its output goes to <logs>/<home>.log */
+static int run(const char *home, const char *arg1, const char *arg2) {
+    char dir[PATH_LEN], log[PATH_LEN], snap[PATH_LEN];
+    int status;
+    pid_t pid;
+
+    if (FMT_OVERFLOW(dir, "%s/%s", work, home) || FMT_OVERFLOW(log, "%s/%s.log", logs, home) ||
+        FMT_OVERFLOW(snap, "file://%s/snapshot", mirror)) {
+        return -1;
+    }
+
+    pid = fork();
+    if (pid == 0) {
+        int fd = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        setenv("HOME", dir, 1);
+        setenv("TINYPKG_REPO_URL", origin, 1);
+        setenv("TINYPKG_NO_DAEMON", "1", 1);
+        setenv("TINYPKG_METRICS", "0", 1);
+        if (strcmp(home, "snap") == 0) {
+            setenv("TINYPKG_REPO_SNAPSHOT", snap, 1);
+        } else {
+            unsetenv("TINYPKG_REPO_SNAPSHOT");
+        }
+        if (fd >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+        }
+        execl(tinypkg_bin, tinypkg_bin, arg1, arg2, (char *)NULL);
+        _exit(127);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 ||
+        !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "index_check: '%s %s' failed for %s, see %s\n", arg1, arg2, home, log);
+        return -1;
+    }
+    return 0;
+}
+
+/* Whether the last run for home printed a line containing text */
+static int logged(const char *home, const char *text) {
+    char path[PATH_LEN], line[1024];
+    int found = 0;
+    FILE *f;
+
+    if (FMT_OVERFLOW(path, "%s/%s.log", logs, home) || !(f = fopen(path, "r"))) {
+        return 0;
+    }
+    while (!found && fgets(line, sizeof(line), f)) {
+        found = strstr(line, text) != NULL;
+    }
+    fclose(f);
+    return found;
+}
+
+static int publish(void) {
+    if (run("pub", "repo", "sync") != 0) {
+        return -1;
+    }
+    return run("pub", "mirror", mirror);
+}
+
+/* Sync incrementally, then from scratch, and compare what each left */
+static int check_client(const char *home, int round) {
+    static const char *files[] = { "pkgindex.db", "diagnostics" };
+    char cache[PATH_LEN], path[PATH_LEN], kept[PATH_LEN + 8], cmd[PATH_LEN * 3];
+    int ret = 0;
+
+    if (FMT_OVERFLOW(cache, "%s/%s/.cache/tinypkg", work, home) ||
+        run(home, "repo", "sync") != 0) {
+        return -1;
+    }
+    if (round > 0 && !logged(home, "Package index updated to")) {
+        fprintf(stderr, "index_check: round %d: %s did not update the index in place, "
+                        "see %s/%s.log\n", round, home, logs, home);
+        return -1;
+    }
+    if (strcmp(home, "snap") == 0) {
+        snap_deltas = logged(home, "Fetching") && logged(home, " delta");
+    }
+
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        if (FMT_OVERFLOW(path, "%s/%s", cache, files[i]) ||
+            FMT_OVERFLOW(kept, "%s.incremental", path) || rename(path, kept) != 0) {
+            fprintf(stderr, "index_check: round %d: %s has no %s\n", round, home, files[i]);
+            return -1;
+        }
+    }
+
+    if (run(home, "repo", "sync") != 0) {
+        return -1;
+    }
+    if (!logged(home, "Compiling package index")) {
+        fprintf(stderr, "index_check: round %d: %s did not rebuild the index\n", round, home);
+        return -1;
+    }
+
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        if (FMT_OVERFLOW(path, "%s/%s", cache, files[i]) ||
+            FMT_OVERFLOW(kept, "%s.incremental", path) ||
+            FMT_OVERFLOW(cmd, "cmp -s '%s' '%s'", kept, path)) {
+            return -1;
+        }
+        if (system(cmd) != 0) {
+            fprintf(stderr, "index_check: round %d: %s: incremental %s differs "
+                            "from a full rebuild:\n", round, home, files[i]);
+            snprintf(cmd, sizeof(cmd), "diff -u '%s' '%s' >&2", kept, path);
+            if (system(cmd) < 0) {
+                perror("diff");
+            }
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    int count = 300, rounds = 8, changes = 6;
+    char msg[64];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:r:c:")) != -1) {
+        switch (opt) {
+        case 'n': count = atoi(optarg); break;
+        case 'r': rounds = atoi(optarg); break;
+        case 'c': changes = atoi(optarg); break;
+        default: goto usage;
+        }
+    }
+    if (argc - optind != 2 || count < 1 || count > MAX_PKGS / 2 || rounds < 1 ||
+        changes < 1) {
+        goto usage;
+    }
+    tinypkg_bin = argv[optind];
+    if (FMT_OVERFLOW(work, "%s", argv[optind + 1])) {
+        goto usage;
+    }
+
+    if (setup(count) != 0 || publish() != 0 ||
+        check_client("git", 0) != 0 || check_client("snap", 0) != 0) {
+        return 1;
+    }
+
+    for (int round = 1; round <= rounds; round++) {
+        for (int c = 0; c < 2; c++) {
+            for (int k = 0; k < changes; k++) {
+                if (mutate() != 0) {
+                    return 1;
+                }
+            }
+            snprintf(msg, sizeof(msg), "round %d.%d", round, c + 1);
+            if (commit(msg) != 0 || publish() != 0) {
+                return 1;
+            }
+        }
+
+        if (check_client("git", round) != 0 || check_client("snap", round) != 0) {
+            return 1;
+        }
+        printf("Round %d: index and diagnostics match a full rebuild (git, snapshot %s)\n",
+               round, snap_deltas ? "deltas" : "in full");
+    }
+
+    printf("Incremental index matches full rebuilds after %d rounds of %d changes\n",
+           rounds, 2 * changes);
+    return 0;
+
+usage:
+    fprintf(stderr, "Usage: %s [-n pkgs] [-r rounds] [-c changes] <tinypkg> <workdir>\n",
+            argv[0]);
+    return 2;
+}
@@ -0,0 +1,549 @@
+/*
+ * pipeline.c - End-to-end download/extract/build/install benchmark
+ *
+ * Usage: pipeline [-n pkgs] [-f files] [-s KB] [-j jobs] [-r KB/s] [-l ms]
+ *                 [-o results.tsv] <tinypkg> <httpd> <workdir>
+ *
+ * Runs the whole pipeline offline. Under <workdir> it creates:
+ *
+ *   www/          fixture tarballs (<files> files, <KB> KiB of incompressible
+ *                 data each) served by <httpd> on 127.0.0.1
+ *   origin.git    bare repository used as TINYPKG_REPO_URL
+ *   home/         HOME for every tinypkg run
+ *   logs/         output of every tinypkg run
+ *
+ * It then clones the repository, builds every package one at a time and
+ * installs them, then deletes the build tree and rebuilds them all with
+ * --force and <jobs> concurrent builds, so the second pass downloads,
+ * extracts and builds everything again instead of finding it up to date.
+ * The "wall" rows cover the build passes only.
+ * Per-phase timings come from TINYPKG_TIMINGS and are reported as count,
+ * mean, median and maximum for each mode; -o writes the same as TSV.
+ * -r and -l throttle the server and add latency to each response.
+ */
+
+#define _DEFAULT_SOURCE     /* kill() with SIGTERM under -std=c99 */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define PATH_LEN 2048
+#define MAX_PKGS 999
+
+#define FMT_OVERFLOW(dst, ...) \
+    (snprintf((dst), sizeof(dst), __VA_ARGS__) >= (int)sizeof(dst))
+
+struct sample {
+    char phase[16];
+    double ms;
+};
+
+struct samples {
+    struct sample *items;
+    size_t count;
+};
+
+static const char *tinypkg_bin;
+static char work[PATH_LEN], home[PATH_LEN], origin[PATH_LEN];
+static char timings[PATH_LEN], logs[PATH_LEN];
+static pid_t httpd_pid;
+static FILE *tsv;
+static int force_builds;    /* Pass --force to build */
+
+static unsigned long rng_state = 88172645UL;
+
+static unsigned long rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state & 0xffffffffUL;
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static int run_shell(const char *cmd) {
+    if (system(cmd) != 0) {
+        fprintf(stderr, "pipeline: command failed: %s\n", cmd);
+        return -1;
+    }
+    return 0;
+}
+
+static void stop_httpd(void) {
+    if (httpd_pid > 0) {
+        kill(httpd_pid, SIGTERM);
+        waitpid(httpd_pid, NULL, 0);
+        httpd_pid = 0;
+    }
+}
+
+/* ============================================================================
+ * Fixtures
+ * ============================================================================
+ */
+
+static int write_fixture(const char *src, int i, int files, long kb) {
+    char dir[PATH_LEN], path[PATH_LEN];
+    long per_file = kb * 1024 / files;
+    FILE *f;
+
+    if (FMT_OVERFLOW(dir, "%s/pipe%03d/data", src, i) ||
+        FMT_OVERFLOW(path, "mkdir -p '%s'", dir) || run_shell(path) != 0) {
+        return -1;
+    }
+
+    for (int k = 0; k < files; k++) {
+        if (FMT_OVERFLOW(path, "%s/file%05d", dir, k) || !(f = fopen(path, "w"))) {
+            return -1;
+        }
+        for (long b = 0; b < per_file; b += 4) {
+            unsigned long v = rng();
+            fwrite(&v, 1, (size_t)(per_file - b < 4 ? per_file - b : 4), f);
+        }
+        fclose(f);
+    }
+
+    if (FMT_OVERFLOW(path, "%s/pipe%03d/build.sh", src, i) || !(f = fopen(path, "w"))) {
+        return -1;
+    }
+    /* Reads every input file once, like a compiler would */
+    fprintf(f, "#!/bin/sh\nset -e\n"
+               "cat data/* | cksum > checksum.txt\n"
+               "mkdir -p \"$PREFIX/bin\"\n"
+               "printf '#!/bin/sh\\necho pipe%03d\\n' > \"$PREFIX/bin/pipe%03d\"\n"
+               "chmod 755 \"$PREFIX/bin/pipe%03d\"\n", i, i, i);
+    fclose(f);
+    return 0;
+}
+
+static int sha256_of(const char *path, char *hex) {
+    char cmd[PATH_LEN + 32];
+    FILE *p;
+    int ok;
+
+    if (FMT_OVERFLOW(cmd, "sha256sum '%s'", path) || !(p = popen(cmd, "r"))) {
+        return -1;
+    }
+    ok = fscanf(p, "%64s", hex) == 1 && strlen(hex) == 64;
+    return pclose(p) == 0 && ok ? 0 : -1;
+}
+
+/* checksum: comes after install:, as in the repo's own manifests */
+static int write_manifest(const char *pkgs, const char *www, int i, int port) {
+    char dir[PATH_LEN], path[PATH_LEN], sum[80];
+    FILE *f;
+
+    if (FMT_OVERFLOW(path, "%s/pipe%03d.tar.gz", www, i) || sha256_of(path, sum) != 0 ||
+        FMT_OVERFLOW(dir, "%s/pipe%03d", pkgs, i) ||
+        FMT_OVERFLOW(path, "%s/manifest.yaml", dir) ||
+        mkdir(dir, 0755) != 0 || !(f = fopen(path, "w"))) {
+        return -1;
+    }
+
+    fprintf(f, "name: pipe%03d\nversion: 1.0.%d\n"
+               "description: Pipeline fixture %d\n"
+               "architecture: aarch64\nos: linux\n\n"
+               "source: http://127.0.0.1:%d/pipe%03d.tar.gz\n\n"
+               "build: |\n  cd pipe%03d\n  sh build.sh\n\n"
+               "install: |\n  true\n\n"
+               "checksum: sha256:%s\n",
+            i, i, i, port, i, i, sum);
+    fclose(f);
+    return 0;
+}
+
+/* Start the fixture server and read back the port it picked */
+static int start_httpd(const char *httpd, const char *www, long rate, long latency) {
+    char rate_arg[32], lat_arg[32], line[64];
+    int fds[2], port = -1;
+    FILE *f;
+
+    snprintf(rate_arg, sizeof(rate_arg), "%ld", rate);
+    snprintf(lat_arg, sizeof(lat_arg), "%ld", latency);
+
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+
+    httpd_pid = fork();
+    if (httpd_pid < 0) {
+        return -1;
+    }
+    if (httpd_pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execl(httpd, httpd, "-r", rate_arg, "-l", lat_arg, www, (char *)NULL);
+        _exit(127);
+    }
+
+    close(fds[1]);
+    f = fdopen(fds[0], "r");
+    if (f && fgets(line, sizeof(line), f)) {
+        sscanf(line, "port %d", &port);
+    }
+    if (f) {
+        fclose(f);
+    }
+    return port;
+}
+
+static int setup(const char *httpd, int npkgs, int files, long kb, long rate, long latency) {
+    char www[PATH_LEN], src[PATH_LEN], seed[PATH_LEN], pkgs[PATH_LEN];
+    char cmd[PATH_LEN * 3];
+    FILE *index;
+    int port;
+
+    if (FMT_OVERFLOW(www, "%s/www", work) || FMT_OVERFLOW(src, "%s/src", work) ||
+        FMT_OVERFLOW(seed, "%s/seed", work) || FMT_OVERFLOW(pkgs, "%s/packages", seed) ||
+        FMT_OVERFLOW(cmd, "rm -rf '%s' && mkdir -p '%s' '%s' '%s' '%s'",
+                     work, www, src, pkgs, logs) ||
+        run_shell(cmd) != 0) {
+        return -1;
+    }
+
+    printf("Generating %d fixture tarballs (%d files, %ld KiB each)...\n", npkgs, files, kb);
+    for (int i = 1; i <= npkgs; i++) {
+        if (write_fixture(src, i, files, kb) != 0 ||
+            FMT_OVERFLOW(cmd, "tar -czf '%s/pipe%03d.tar.gz' -C '%s' pipe%03d",
+                         www, i, src, i) ||
+            run_shell(cmd) != 0) {
+            return -1;
+        }
+    }
+
+    port = start_httpd(httpd, www, rate, latency);
+    if (port <= 0) {
+        fprintf(stderr, "pipeline: could not start %s\n", httpd);
+        return -1;
+    }
+    printf("Serving %s on 127.0.0.1:%d\n", www, port);
+
+    if (FMT_OVERFLOW(cmd, "%s/index.yaml", pkgs) || !(index = fopen(cmd, "w"))) {
+        return -1;
+    }
+    fprintf(index, "version: 1\n\npackages:\n");
+    for (int i = 1; i <= npkgs; i++) {
+        if (write_manifest(pkgs, www, i, port) != 0) {
+            fclose(index);
+            return -1;
+        }
+        fprintf(index, "  pipe%03d:\n    description: Pipeline fixture %d\n"
+                       "    latest: 1.0.%d\n    \n", i, i, i);
+    }
+    fclose(index);
+
+    if (FMT_OVERFLOW(cmd,
+             "cd '%s' && git init -q && git add -A && "
+             "git -c user.name=bench -c user.email=bench@localhost commit -qm fixtures && "
+             "git clone -q --bare '%s' '%s'", seed, seed, origin) ||
+        run_shell(cmd) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* ============================================================================
+ * Running tinypkg
+ * ============================================================================
+ */
+
+static pid_t spawn(const char *cmd, const char *pkg) {
+    char log[PATH_LEN];
+    pid_t pid;
+
+    if (FMT_OVERFLOW(log, "%s/%s-%s.log", logs, cmd, pkg ? pkg : "all")) {
+        return -1;
+    }
+
+    pid = fork();
+    if (pid == 0) {
+        int fd = open(log, O_WRONLY | O_CREAT | O_APPEND, 0644);
+
+        setenv("HOME", home, 1);
+        setenv("TINYPKG_REPO_URL", origin, 1);
+        setenv("TINYPKG_TIMINGS", timings, 1);
+        setenv("TINYPKG_NO_DAEMON", "1", 1);
+        if (fd >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+        }
+        if (strcmp(cmd, "sync") == 0) {
+            execl(tinypkg_bin, tinypkg_bin, "repo", "sync", (char *)NULL);
+        } else if (strcmp(cmd, "build") == 0 && force_builds) {
+            execl(tinypkg_bin, tinypkg_bin, cmd, "--force", pkg, (char *)NULL);
+        } else {
+            execl(tinypkg_bin, tinypkg_bin, cmd, pkg, (char *)NULL);
+        }
+        _exit(127);
+    }
+    return pid;
+}
+
+static int finish(pid_t pid, const char *cmd, const char *pkg) {
+    int status;
+
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 ||
+        !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "pipeline: '%s %s' failed, see %s/%s-%s.log\n",
+                cmd, pkg ? pkg : "", logs, cmd, pkg ? pkg : "all");
+        return -1;
+    }
+    return 0;
+}
+
+static int run(const char *cmd, const char *pkg) {
+    return finish(spawn(cmd, pkg), cmd, pkg);
+}
+
+/* Whether the build log of pkg says its download matched the checksum */
+static int verified(const char *pkg) {
+    char path[PATH_LEN], line[512];
+    int found = 0;
+    FILE *f;
+
+    if (FMT_OVERFLOW(path, "%s/build-%s.log", logs, pkg) || !(f = fopen(path, "r"))) {
+        return 0;
+    }
+    while (!found && fgets(line, sizeof(line), f)) {
+        found = strstr(line, "sha256 verified") != NULL;
+    }
+    fclose(f);
+    if (!found) {
+        fprintf(stderr, "pipeline: %s was downloaded without checking its checksum, "
+                        "see %s\n", pkg, path);
+    }
+    return found;
+}
+
+/* Move everything recorded in the timings file into s */
+static void collect(struct samples *s) {
+    char line[256];
+    FILE *f = fopen(timings, "r");
+
+    if (!f) {
+        return;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        struct sample smp;
+        char pkg[128];
+
+        if (sscanf(line, "%127s %15s %lf", pkg, smp.phase, &smp.ms) != 3) {
+            continue;
+        }
+        s->items = realloc(s->items, (s->count + 1) * sizeof(*s->items));
+        if (!s->items) {
+            perror("realloc");
+            exit(1);
+        }
+        s->items[s->count++] = smp;
+    }
+
+    fclose(f);
+    unlink(timings);
+}
+
+/* ============================================================================
+ * Reporting
+ * ============================================================================
+ */
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void report_row(const char *mode, const char *phase, double *v, size_t n) {
+    double sum = 0;
+
+    if (n == 0) {
+        return;
+    }
+    qsort(v, n, sizeof(*v), cmp_double);
+    for (size_t i = 0; i < n; i++) {
+        sum += v[i];
+    }
+
+    printf("%-11s %-9s %5zu %10.1f %10.1f %10.1f\n",
+           mode, phase, n, sum / n, v[n / 2], v[n - 1]);
+    if (tsv) {
+        fprintf(tsv, "%s\t%s\t%zu\t%.3f\t%.3f\t%.3f\n",
+                mode, phase, n, sum / n, v[n / 2], v[n - 1]);
+    }
+}
+
+static void report(const char *mode, const struct samples *s, double wall_ms) {
+    static const char *phases[] = {
+        "sync", "parse", "download", "extract", "build", "store", "gc",
+        "total", "install", NULL
+    };
+    double *v = malloc((s->count + 1) * sizeof(*v));
+
+    if (!v) {
+        return;
+    }
+
+    for (int p = 0; phases[p]; p++) {
+        size_t n = 0;
+        for (size_t i = 0; i < s->count; i++) {
+            if (strcmp(s->items[i].phase, phases[p]) == 0) {
+                v[n++] = s->items[i].ms;
+            }
+        }
+        report_row(mode, phases[p], v, n);
+    }
+
+    v[0] = wall_ms;
+    report_row(mode, "wall", v, 1);
+    free(v);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n pkgs] [-f files] [-s KB] [-j jobs] [-r KB/s] [-l ms]\n"
+                    "       [-o results.tsv] <tinypkg> <httpd> <workdir>\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    struct samples single = { NULL, 0 }, concurrent = { NULL, 0 };
+    struct sample sync_sample;
+    pid_t pids[MAX_PKGS + 1];
+    char name[16], cmd[PATH_LEN + 32];
+    int npkgs = 8, files = 200, jobs = 4, opt, ret = 1;
+    long kb = 4096, rate = 0, latency = 0;
+    const char *out = NULL;
+    double start, single_ms, concurrent_ms;
+
+    while ((opt = getopt(argc, argv, "n:f:s:j:r:l:o:")) != -1) {
+        switch (opt) {
+        case 'n': npkgs = atoi(optarg); break;
+        case 'f': files = atoi(optarg); break;
+        case 's': kb = atol(optarg); break;
+        case 'j': jobs = atoi(optarg); break;
+        case 'r': rate = atol(optarg); break;
+        case 'l': latency = atol(optarg); break;
+        case 'o': out = optarg; break;
+        default: usage(argv[0]); return 2;
+        }
+    }
+
+    if (argc - optind != 3 || npkgs < 1 || npkgs > MAX_PKGS ||
+        files < 1 || kb < 1 || jobs < 1) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    tinypkg_bin = argv[optind];
+    if (FMT_OVERFLOW(work, "%s", argv[optind + 2]) ||
+        FMT_OVERFLOW(home, "%s/home", work) ||
+        FMT_OVERFLOW(origin, "%s/origin.git", work) ||
+        FMT_OVERFLOW(timings, "%s/timings", work) ||
+        FMT_OVERFLOW(logs, "%s/logs", work)) {
+        fprintf(stderr, "pipeline: path too long\n");
+        return 2;
+    }
+
+    if (setup(argv[optind + 1], npkgs, files, kb, rate, latency) != 0) {
+        goto out;
+    }
+
+    /* Clone from the local origin */
+    start = now_ms();
+    if (run("sync", NULL) != 0) {
+        goto out;
+    }
+    snprintf(sync_sample.phase, sizeof(sync_sample.phase), "sync");
+    sync_sample.ms = now_ms() - start;
+
+    /* One package at a time; installs are timed separately */
+    printf("Building %d packages sequentially...\n", npkgs);
+    start = now_ms();
+    for (int i = 1; i <= npkgs; i++) {
+        snprintf(name, sizeof(name), "pipe%03d", i);
+        if (run("build", name) != 0 || !verified(name)) {
+            goto out;
+        }
+    }
+    single_ms = now_ms() - start;
+
+    for (int i = 1; i <= npkgs; i++) {
+        snprintf(name, sizeof(name), "pipe%03d", i);
+        if (run("install", name) != 0) {
+            goto out;
+        }
+    }
+    collect(&single);
+    single.items = realloc(single.items, (single.count + 1) * sizeof(*single.items));
+    if (!single.items) {
+        goto out;
+    }
+    single.items[single.count++] = sync_sample;
+
+    /*
+     * Cold build tree, then up to 'jobs' builds at once. The stamps and the
+     * installed prefixes would otherwise mark every package up to date
+     */
+    if (FMT_OVERFLOW(cmd, "rm -rf '%s/.cache/tinypkg/build'", home) || run_shell(cmd) != 0) {
+        goto out;
+    }
+    force_builds = 1;
+
+    printf("Building %d packages, %d at a time...\n", npkgs, jobs);
+    start = now_ms();
+    for (int i = 1, done = 1; done <= npkgs; ) {
+        if (i <= npkgs && i - done < jobs) {
+            snprintf(name, sizeof(name), "pipe%03d", i);
+            pids[i] = spawn("build", name);
+            i++;
+            continue;
+        }
+        snprintf(name, sizeof(name), "pipe%03d", done);
+        if (finish(pids[done], "build", name) != 0) {
+            goto out;
+        }
+        done++;
+    }
+    concurrent_ms = now_ms() - start;
+    collect(&concurrent);
+
+    if (out && !(tsv = fopen(out, "w"))) {
+        perror(out);
+        goto out;
+    }
+    if (tsv) {
+        fprintf(tsv, "mode\tphase\tn\tmean_ms\tp50_ms\tmax_ms\n");
+    }
+
+    printf("\n%-11s %-9s %5s %10s %10s %10s\n", "mode", "phase", "n",
+           "mean_ms", "p50_ms", "max_ms");
+    report("single", &single, single_ms);
+    report("concurrent", &concurrent, concurrent_ms);
+    printf("\nSource data: %.1f MiB per pass; concurrent speedup %.2fx\n",
+           npkgs * kb / 1024.0, single_ms / concurrent_ms);
+
+    if (tsv) {
+        fclose(tsv);
+        printf("Results written to %s\n", out);
+    }
+    ret = 0;
+
+out:
+    stop_httpd();
+    free(single.items);
+    free(concurrent.items);
+    return ret;
+}
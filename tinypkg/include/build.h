@@ -10,22 +10,105 @@ struct manifest {
     char name[128];
     char version[64];
     char source[512];           /* Download URL */
+    char mirrors[4][512];       /* Alternative URLs for the same file */
+    int mirror_count;
+    char checksum[128];         /* "sha256:<hex>", empty if not given */
     char build_script[4096];    /* Build commands */
+    char train_script[4096];    /* Workload for the pgo profile, run against $PREFIX */
     char install_script[4096];  /* Install commands */
+    char profile[16];           /* Resolved by profile_for(), see profile.h */
 };
 
+/*
+ * When set to a file path, every pipeline phase appends one line
+ * "<package>\t<phase>\t<milliseconds>" to it (used by bench/pipeline)
+ */
+#define BUILD_TIMINGS_ENV "TINYPKG_TIMINGS"
+
+/*
+ * Multi-package builds download and extract up to TINYPKG_PREFETCH packages
+ * ahead of the one compiling, while those take less than
+ * TINYPKG_PREFETCH_DISK on disk. TINYPKG_PREFETCH_RATE caps the bandwidth
+ * of these downloads so the build itself keeps some (sizes as for
+ * TINYPKG_CACHE_BUDGET, e.g. "500M", "2M" per second)
+ */
+#define PREFETCH_ENV "TINYPKG_PREFETCH"
+#define PREFETCH_DISK_ENV "TINYPKG_PREFETCH_DISK"
+#define PREFETCH_RATE_ENV "TINYPKG_PREFETCH_RATE"
+
+/*
+ * Build trees go under TINYPKG_BUILD_ROOT instead of ~/.cache/tinypkg/build
+ * when it is set. The source tarball and the PKG prefix stay in the cache.
+ */
+#define BUILD_ROOT_ENV "TINYPKG_BUILD_ROOT"
+
+/*
+ * With --build-in-ram (or TINYPKG_BUILD_IN_RAM=1) a package is extracted
+ * and compiled on tmpfs: TINYPKG_RAM_DIR, else $XDG_RUNTIME_DIR/tinypkg-build,
+ * else /dev/shm/tinypkg-build-<uid>. A tree goes there only if its expected
+ * size (from the last build, else scaled from the tarball) fits beside the
+ * others in the smallest of the free tmpfs space, a share of available
+ * memory and TINYPKG_RAM_BUDGET; otherwise it is built on disk as usual.
+ * A build that fills the tmpfs is retried on disk.
+ */
+#define BUILD_IN_RAM_ENV "TINYPKG_BUILD_IN_RAM"
+#define BUILD_RAM_DIR_ENV "TINYPKG_RAM_DIR"
+#define BUILD_RAM_BUDGET_ENV "TINYPKG_RAM_BUDGET"
+
+void build_use_ram(int enable);
+
+/*
+ * Build and training output goes to ~/.cache/tinypkg/<package>/build.log.gz
+ * (build.log without gzip), compressed as it is written, rewritten by each
+ * build. Only the last TINYPKG_LOG_TAIL bytes (default 16K, as for
+ * TINYPKG_CACHE_BUDGET) are kept in memory and shown when a script fails;
+ * the terminal gets one summary line per script instead. With --verbose
+ * (or TINYPKG_VERBOSE=1) the output is also copied to the terminal.
+ */
+#define BUILD_LOG_FILE "build.log"
+#define BUILD_LOG_TAIL_ENV "TINYPKG_LOG_TAIL"
+#define BUILD_LOG_TAIL_DEFAULT (16 * 1024)
+#define BUILD_VERBOSE_ENV "TINYPKG_VERBOSE"
+
+void build_verbose(int enable);
+
+/*
+ * Each phase's inputs are hashed into <cache>/<package>/stamps when it
+ * completes; a rebuild starts at the first phase whose inputs changed or
+ * whose output is gone, and does nothing if the prefix is current.
+ * 'build --force' starts from the download regardless.
+ */
+#define BUILD_STAMP_FILE "stamps"
+#define BUILD_STAMP_MAGIC "tinypkg-stamps 1"
+
+void build_force(int enable);
+
 /* Main build operations */
 int build_package(const char *name);
+
+/*
+ * Up to 'jobs' builds at once, longest remaining dependency chain first
+ * by the durations of earlier builds (see sched.h)
+ */
+int build_packages(char *const names[], int count, int jobs);
 int install_package(const char *name);
-int remove_package(const char *name);
+int remove_package(const char *name, int force);
 
 /* Helper functions */
 int parse_manifest(const char *name, struct manifest *m);
-int download_source(const char *name, const char *url);
+int download_source(const char *name, const struct manifest *m);
 int extract_tarball(const char *name);
 int execute_build(const char *name, struct manifest *m);
 int execute_install(const char *name);
-int track_installation(const char *name, const char *version);
+int track_installation(const char *name, const char *version, const char *profile);
+
+/*
+ * Between these, installs are recorded in memory and then written to
+ * installed.db in one atomic rewrite, replacing any older entries for the
+ * same packages. Installs may run in several threads meanwhile.
+ */
+void track_begin(void);
+int track_commit(void);
 int is_installed(const char *name);
 
 #endif
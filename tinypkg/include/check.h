@@ -0,0 +1,77 @@
+/*
+ * check.h - Manifest validation at sync time
+ */
+
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stddef.h>
+#include "index.h"
+
+/*
+ * What the last sync found, relative to the cache directory:
+ *
+ *   tinypkg-diagnostics 1
+ *   commit <sha of the repository HEAD checked>
+ *   <package>\t<error|warning>\t<check>\t<message>
+ *
+ * sorted by package, errors first. Checks are "schema" and "checksum"
+ * (one manifest on its own) and "depends", "version" and "index" (the
+ * manifests against each other and against packages/index.yaml).
+ */
+#define CHECK_REPORT_FILE "diagnostics"
+#define CHECK_REPORT_MAGIC "tinypkg-diagnostics 1"
+
+struct check_issue {
+    char package[128];
+    char check[16];
+    int error;          /* Else a warning */
+    char message[256];
+};
+
+struct check_report {
+    struct check_issue *issues;
+    size_t count;
+    size_t cap;
+    char commit[64];
+};
+
+/*
+ * Parse packages/<name>/manifest.yaml for each entry (only name set), one
+ * thread per CPU, filling in version and depends; found[i] is 0 where there
+ * is no manifest. Only valid, distinct dependency names other than the
+ * package itself go into depends. Problems of a single manifest are added
+ * to report.
+ */
+int check_manifests(struct index_entry *entries, size_t count, char *found,
+                    struct check_report *report);
+
+/*
+ * Replace the cross-manifest problems in report with those of idx:
+ * dependencies the repository does not provide, and packages/index.yaml
+ * entries whose version disagrees with the manifest, or that are missing
+ * on either side
+ */
+int check_index(const struct pkg_index *idx, struct check_report *report);
+
+/*
+ * Drop what report says about these packages on their own, before they are
+ * checked again; entries are sorted by name
+ */
+void check_forget(struct check_report *report, const struct index_entry *entries,
+                  size_t count);
+
+/* Sort, then write atomically (temp file + rename) */
+int check_write(struct check_report *report);
+
+/* TINYPKG_NOT_FOUND when there is none, TINYPKG_ERR if it is unreadable */
+int check_load(struct check_report *report);
+void check_free(struct check_report *report);
+
+/* The sync's summary line, with the first few problems */
+void check_summary(const struct check_report *report, size_t packages);
+
+/* 'tinypkg repo check': print the last report; 1 if it has errors */
+int check_print(void);
+
+#endif
@@ -24,6 +24,9 @@
 #define TINYPKG_DIR ".cache/tinypkg"
 #define REPO_URL "https://github.com/Night-Traders-Dev/tinypkg-repo.git"
 
+/* Overrides REPO_URL, e.g. a local bare repository for offline testing */
+#define REPO_URL_ENV "TINYPKG_REPO_URL"
+
 /* Buffer sizes */
 #define PATH_MAX_LEN 1024
 #define CMD_MAX_LEN 8192
@@ -42,11 +45,15 @@ char* get_build_dir(void);
 char* get_local_bin(void);
 char* get_tinypkg_dir(void);
 int mkdir_p(const char *path);
+int remove_tree(const char *path);
 int is_valid_package_name(const char *name);
 int safe_execute(char *const argv[]);
 int safe_execute_in_dir(const char *workdir, char *const argv[]);
+int in_path(const char *prog);
+char *slurp(const char *path, size_t max, size_t *len);
 void log_error(const char *func, const char *msg);
 void log_info(const char *msg);
 void log_warn(const char *msg);
+void log_redirect(FILE *out, FILE *err);
 
 #endif
@@ -15,4 +15,33 @@
 #define TINYPKG_BUILD_DATE __DATE__
 #define TINYPKG_BUILD_TIME __TIME__
 
+/* Cache budget enforced by 'tinypkg gc' and after each build (4 GiB) */
+#define GC_DEFAULT_BUDGET (4ULL << 30)
+
+/* Downloads: files of at least twice this size are fetched in ranges */
+#define FETCH_SEGMENT_MIN (4LL << 20)
+#define FETCH_MAX_SEGMENTS 4
+#define FETCH_MAX_PARALLEL 8        /* Concurrent transfers in one batch */
+#define FETCH_RETRIES 5             /* Attempts after the first */
+#define FETCH_BACKOFF_MS 500        /* Doubled after every failed attempt */
+
+/* Multi-package builds: sources fetched and extracted ahead of the build */
+#define PREFETCH_DEPTH 2
+#define PREFETCH_DISK_BUDGET (1ULL << 30)
+
+/* Build estimates for packages never built before */
+#define SCHED_DEFAULT_MS_PER_MIB 2000.0     /* Per MiB of compressed source */
+#define SCHED_DEFAULT_BUILD_MS 30000.0      /* Source size unknown as well */
+
+/* Parallel builds: a build starts only if its recorded peak RSS fits */
+#define ADMIT_MARGIN_PCT 25                 /* Added to the recorded peak */
+#define ADMIT_MIN_BYTES (256LL << 20)       /* Assumed need without history */
+#define ADMIT_PSI_LIMIT 10.0                /* Memory "some" avg10, percent */
+#define ADMIT_RECHECK_MS 1000
+
+/* --build-in-ram: trees on tmpfs while their expected size fits */
+#define BUILD_RAM_TREE_FACTOR 6             /* Tree size per tarball byte, unbuilt */
+#define BUILD_RAM_SHARE_PCT 50              /* Of available memory at most */
+#define BUILD_RAM_FULL_BYTES (16LL << 20)   /* Less free after a failure: spill */
+
 #endif
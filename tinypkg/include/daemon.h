@@ -0,0 +1,32 @@
+/*
+ * daemon.h - Persistent query daemon and its Unix-socket client
+ */
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+/* Socket file, relative to the cache directory */
+#define DAEMON_SOCKET_FILE "daemon.sock"
+
+/* Set to bypass a running daemon and always answer in-process */
+#define DAEMON_DISABLE_ENV "TINYPKG_NO_DAEMON"
+
+/* Client-side timeout waiting for an answer (seconds) */
+#define DAEMON_TIMEOUT_SEC 10
+
+/* Server side: connections served at once, and how long each may take */
+#define DAEMON_MAX_CLIENTS 64
+#define DAEMON_CLIENT_TIMEOUT_MS 2000
+
+/* Serve queries in the foreground until stopped */
+int daemon_run(void);
+int daemon_stop(void);
+
+/*
+ * Forward one query (search, info, list, is-installed) to a running
+ * daemon. Returns TINYPKG_OK if the daemon answered, with the command's
+ * own result in *status; otherwise the caller should answer locally.
+ */
+int daemon_query(const char *cmd, const char *arg, int *status);
+
+#endif
@@ -0,0 +1,79 @@
+/*
+ * fetch.h - Segmented, resumable downloads
+ */
+
+#ifndef FETCH_H
+#define FETCH_H
+
+#include <stddef.h>
+
+/* What one download took */
+struct fetch_stats {
+    long long size;         /* Bytes in the finished file */
+    long long resumed;      /* Bytes not refetched thanks to resuming (all attempts) */
+    double seconds;         /* Wall time until the file was complete */
+    int segments;           /* Parallel range requests (1 = single stream) */
+    int retries;            /* Attempts after the first */
+    int failovers;          /* Switches to another mirror */
+    int verified;           /* Matched the expected checksum */
+    char host[128];         /* Host the file finally came from */
+};
+
+struct fetch_job {
+    const char *url;            /* Used when there are no urls[] */
+    char *const *urls;          /* Mirror candidates, preferred first */
+    int url_count;
+    const char *dest;
+    long long rate_limit;       /* Bytes per second, 0 for no limit */
+    const char *checksum;       /* "sha256:<hex>", hashed while downloading */
+    struct fetch_stats stats;   /* Filled in by fetch_files() */
+    int status;                 /* TINYPKG_OK once dest is complete */
+};
+
+/*
+ * A job whose checksum is not sha256:<64 hex digits> fails unless this is
+ * set (to anything but "0"), in which case it is downloaded unverified
+ */
+#define FETCH_UNVERIFIED_ENV "TINYPKG_ALLOW_UNVERIFIED"
+
+/*
+ * Download every job. All mirror candidates are probed at once and tried
+ * fastest first, falling over to the next one when a transfer fails.
+ * Transfers run concurrently and share connections to the same host; large
+ * files are split into byte ranges. A job with a checksum is hashed as it
+ * arrives, and a mirror that sends bad data is skipped like a dead one.
+ * Interrupted downloads leave <dest>.part* behind and resume from there on
+ * retry or on the next call.
+ * Returns TINYPKG_OK if all jobs succeeded.
+ */
+int fetch_files(struct fetch_job *jobs, size_t count);
+int fetch_file(const char *url, const char *dest, struct fetch_stats *stats);
+
+/* Validators of a conditionally fetched file, kept between runs */
+struct fetch_cond {
+    char etag[256];         /* ETag, quotes included; "" if none */
+    char modified[64];      /* Last-Modified; "" if none */
+};
+
+/* fetch_if_changed(): the server says the file has not changed */
+#define FETCH_NOT_MODIFIED 1
+
+/*
+ * Download url to dest only if it changed since cond was filled in by an
+ * earlier call: If-None-Match and If-Modified-Since are sent, and a 304
+ * leaves dest alone. A file:// URL is compared by size and modification
+ * time instead. TINYPKG_OK when dest was replaced (and cond updated),
+ * FETCH_NOT_MODIFIED, or TINYPKG_ERR.
+ */
+int fetch_if_changed(const char *url, const char *dest, struct fetch_cond *cond);
+
+/* Content-Length of each URL from one batch of HEADs, -1 where unknown */
+int fetch_sizes(const char *const urls[], long long sizes[], size_t count);
+
+/* Whether each URL answers (200, or an existing file://), from one batch */
+int fetch_exists(const char *const urls[], int found[], size_t count);
+
+/* One-line summary: size, time, throughput, segments, retries */
+void fetch_print_stats(const char *label, const struct fetch_stats *stats);
+
+#endif
@@ -0,0 +1,46 @@
+/*
+ * gc.h - Size-budgeted LRU garbage collection of build trees and caches
+ */
+
+#ifndef GC_H
+#define GC_H
+
+/* Cache entry kinds tracked in the size ledger */
+#define GC_KIND_BUILD    "build"     /* Extracted tree: build/<name>/ */
+#define GC_KIND_SOURCE   "source"    /* Tarball: build/<name>/source.tar.gz */
+#define GC_KIND_ARTIFACT "artifact"  /* Install prefix: <name>/PKG */
+#define GC_KIND_DEBUG    "debug"     /* Split debug info: debug/<name>/ */
+
+/* Ledger file, relative to the cache directory */
+#define GC_LEDGER_FILE "gc.ledger"
+#define GC_LEDGER_MAGIC "tinypkg-gc 1"
+
+/* Budget override (e.g. "2G", "500M"); falls back to GC_DEFAULT_BUDGET */
+#define GC_BUDGET_ENV "TINYPKG_CACHE_BUDGET"
+
+/* Ledger maintenance (called from the build pipeline) */
+int gc_record(const char *kind, const char *name);
+int gc_touch(const char *kind, const char *name);
+
+/* Bytes an entry occupies on disk right now (not recorded) */
+unsigned long long gc_usage(const char *kind, const char *name);
+
+/* Same for any path, e.g. a build tree outside the cache */
+unsigned long long gc_path_usage(const char *path);
+
+/* Eviction */
+int gc_collect(unsigned long long budget, int dry_run);
+int gc_auto(void);
+
+/*
+ * gc_auto() sparing every entry of the packages in keep, e.g. ones just
+ * built that are about to be installed
+ */
+int gc_auto_except(const char *const *keep, int nkeep);
+int gc_rescan(void);
+
+/* Budget helpers */
+unsigned long long gc_budget(void);
+int gc_parse_size(const char *str, unsigned long long *out);
+
+#endif
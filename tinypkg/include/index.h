@@ -0,0 +1,52 @@
+/*
+ * index.h - Derived package index (compiled from manifests at sync time)
+ */
+
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stddef.h>
+
+/* Derived index file, relative to the cache directory */
+#define INDEX_DB_FILE "pkgindex.db"
+#define INDEX_DB_MAGIC "tinypkg-index 2"
+
+/* One package in the derived index */
+struct index_entry {
+    char name[128];
+    char version[64];
+    char *depends;      /* Space-separated forward dependencies */
+    char *rdepends;     /* Space-separated reverse dependencies */
+};
+
+/* In-memory index, entries sorted by name */
+struct pkg_index {
+    struct index_entry *entries;
+    size_t count;
+    char commit[64];    /* Repository commit it was compiled from, "-" if unknown */
+};
+
+/* Build/load operations */
+int index_build(void);
+
+/*
+ * Bring the index up to the repository's HEAD: only manifests that git (or
+ * the snapshot journal, see snapshot.h) reports added, changed or deleted
+ * since the indexed commit are reparsed
+ * and patched in, and rechecked (see check.h). Falls back to index_build()
+ * when there is no usable index (missing, older format, corrupt), no
+ * diagnostics for it, or no usable history.
+ */
+int index_sync(void);
+
+/* The commit or snapshot id the repository tree is at, "-" if unknown */
+void index_head(char commit[64]);
+int index_load(struct pkg_index *idx);
+void index_free(struct pkg_index *idx);
+struct index_entry *index_find(const struct pkg_index *idx, const char *name);
+
+/* Reverse dependency queries */
+int index_installed_dependents(const char *name);
+int index_print_rdeps(const char *name, int transitive);
+
+#endif
@@ -0,0 +1,48 @@
+/*
+ * lock.h - Lockfiles: export the installed set, restore it elsewhere
+ */
+
+#ifndef LOCK_H
+#define LOCK_H
+
+#include "sha256.h"
+
+/*
+ * A lockfile is text:
+ *
+ *   tinypkg-lock 1
+ *   <package> <version> <profile> <source checksum> <tree digest>
+ *
+ * one line per installed package, "-" where a field is unknown. The source
+ * checksum is the manifest's "sha256:<hex>"; the tree digest is
+ * tpk_digest() of the built prefix, so an artifact from any machine can be
+ * checked against it.
+ */
+#define LOCK_FILE "tinypkg.lock"
+#define LOCK_MAGIC "tinypkg-lock 1"
+
+/* Restore downloads artifacts here (relative to the cache) while unpacking */
+#define LOCK_ARTIFACT_DIR "artifacts"
+
+struct lock_entry {
+    char name[128];
+    char version[64];
+    char profile[32];
+    char checksum[128];
+    char digest[SHA256_HEX_LEN];
+};
+
+/* 'tinypkg lock [file]': write every installed package to a lockfile */
+int lock_write(const char *path);
+
+/*
+ * 'tinypkg restore [file]': make each locked package installed. A prefix
+ * already here with the locked digest is reused; otherwise its artifact
+ * (<name>-<version>-<profile>.tpk) is fetched from the repo mirrors, all at
+ * once, and unpacked in parallel; only packages with no matching artifact
+ * are built from source, jobs at a time. Everything is then installed in
+ * parallel and recorded in installed.db in one transaction.
+ */
+int lock_restore(const char *path, int jobs);
+
+#endif
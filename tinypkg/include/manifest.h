@@ -0,0 +1,33 @@
+/*
+ * manifest.h - The one reader of packages/<name>/manifest.yaml
+ */
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+enum manifest_event {
+    MANIFEST_KEY,       /* "key: value" at column 0 */
+    MANIFEST_TEXT,      /* An indented line: a list item or a script line */
+    MANIFEST_BAD        /* Column 0 without a colon */
+};
+
+struct manifest_line {
+    int event;
+    int lineno;
+    const char *key;    /* The top-level key the line is, or belongs to; "" if none */
+    const char *value;  /* KEY: after the colon, trimmed. TEXT, BAD: the line */
+    const char *item;   /* TEXT: what follows "- ", trimmed; NULL if not an item */
+};
+
+/*
+ * Call fn for each line of the manifest at path, in order, with line
+ * endings removed. Keys may come in any order; an indented line belongs
+ * to the last key above it, and blank lines and '#' comments are skipped.
+ * The build (parse_manifest) and the sync-time check both read manifests
+ * this way, so what one accepts the other sees. A non-zero return from fn
+ * stops the scan and is returned; TINYPKG_ERR if path cannot be read.
+ */
+int manifest_scan(const char *path, int (*fn)(const struct manifest_line *line, void *ctx),
+                  void *ctx);
+
+#endif
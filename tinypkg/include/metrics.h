@@ -0,0 +1,65 @@
+/*
+ * metrics.h - Cumulative counters and histograms in Prometheus format
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <time.h>
+
+/* Totals across runs, relative to the cache directory */
+#define METRICS_FILE "metrics.db"
+#define METRICS_MAGIC "tinypkg-metrics 1"
+
+/*
+ * When set, every run that changed a metric rewrites this file with all of
+ * them (write to a temporary, then rename), for node_exporter's textfile
+ * collector, e.g. /var/lib/node_exporter/textfile/tinypkg.prom
+ */
+#define METRICS_TEXTFILE_ENV "TINYPKG_METRICS_TEXTFILE"
+
+/* Setting TINYPKG_METRICS=0 turns recording off */
+#define METRICS_ENV "TINYPKG_METRICS"
+
+enum metric {
+    METRIC_RUNS,                /* counter, label command */
+    METRIC_PHASE_SECONDS,       /* histogram, label phase */
+    METRIC_DOWNLOAD_BYTES,      /* counter, label host */
+    METRIC_DOWNLOAD_SECONDS,    /* counter, label host */
+    METRIC_DOWNLOAD_THROUGHPUT, /* histogram of bytes/second, label host */
+    METRIC_CACHE_HITS,          /* counter, label cache */
+    METRIC_CACHE_MISSES,        /* counter, label cache */
+    METRIC_QUERY_SECONDS,       /* histogram, label command */
+    METRIC_LOCK_WAIT_SECONDS,   /* histogram, label lock */
+    METRIC_COUNT
+};
+
+/*
+ * Record in memory; cheap and thread-safe. Nothing touches the disk until
+ * metrics_flush(), which main() arranges to run once at exit.
+ */
+void metrics_add(int metric, const char *label, double value);
+void metrics_observe(int metric, const char *label, double value);
+
+/* Seconds between two CLOCK_MONOTONIC readings, for callers timing things */
+double metrics_since(const struct timespec *start);
+
+/*
+ * Append this process's changes to the log next to METRICS_FILE, folding
+ * the log into it once it has grown; with METRICS_TEXTFILE_ENV set, fold
+ * and refresh the textfile every time. A crash before this loses only the
+ * changes of the run that crashed.
+ */
+int metrics_flush(void);
+
+/* Run metrics_flush() when this process exits (not its forked children) */
+void metrics_at_exit(void);
+
+/* 'tinypkg metrics': the totals in text exposition format */
+int metrics_print(FILE *out);
+
+/* Write the exposition to path, atomically */
+int metrics_write_textfile(const char *path);
+
+#endif
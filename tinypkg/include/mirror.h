@@ -0,0 +1,74 @@
+/*
+ * mirror.h - Source mirrors and per-host download statistics
+ */
+
+#ifndef MIRROR_H
+#define MIRROR_H
+
+#include <stddef.h>
+
+/* Most candidate URLs considered for one download */
+#define MIRROR_MAX 8
+
+/*
+ * Repo-level mirrors: one base URL per line in <cache>/mirrors.conf, or
+ * space-separated in TINYPKG_MIRRORS (which takes precedence). A base
+ * serves <base>/sources/<package>/<file>, the layout 'tinypkg mirror'
+ * writes; http://, https:// and file:// bases all work.
+ */
+#define MIRROR_CONF_FILE "mirrors.conf"
+#define MIRROR_ENV "TINYPKG_MIRRORS"
+
+/* Host table, relative to the cache directory */
+#define MIRROR_HOSTS_FILE "hosts.db"
+#define MIRROR_HOSTS_MAGIC "tinypkg-hosts 1"
+
+/* One observation of a host, from a probe or a transfer */
+struct host_sample {
+    char host[128];
+    double latency_ms;      /* Time to first byte, 0 if not measured */
+    long long bytes;        /* Bytes transferred, 0 for probes */
+    double seconds;         /* Transfer time for those bytes */
+    int ok;
+};
+
+/*
+ * Candidate URLs for a package source, in preference order: repo-level
+ * mirrors, then the manifest's mirrors, then its source. Each out[i] is
+ * malloc'd; returns the count.
+ */
+int mirror_candidates(const char *name, const char *source,
+                      char *const manifest_mirrors[], int nmirrors,
+                      char *out[], int max);
+
+/*
+ * Published builds of a package, <base>/artifacts/<name>/<file> on each
+ * repo-level mirror; returns the count as mirror_candidates()
+ */
+int mirror_artifact_candidates(const char *name, const char *file, char *out[], int max);
+
+/* "host[:port]" of a URL ("file" for file:// URLs) */
+void mirror_host(const char *url, char *host, size_t len);
+
+/* Expected seconds to fetch size bytes from url (lower is better) */
+double mirror_score(const char *url, double probe_ms, long long size);
+
+/* Merge observations into the host table */
+int mirror_record(const struct host_sample *samples, size_t count);
+
+/*
+ * 'tinypkg mirror <dir>': copy the synced repo to <dir>/repo.git (served as
+ * a dumb git repository), every package source to
+ * <dir>/sources/<package>/<file>, verified against its checksum, and with
+ * artifacts set every built PKG prefix to
+ * <dir>/artifacts/<package>/<package>-<version>-<profile>.tpk.
+ * Re-running only fetches what is missing or fails verification.
+ */
+int mirror_create(const char *dir, int artifacts);
+
+/* Repo-level mirror configuration ('repo mirror ...') */
+int mirror_add(const char *base);
+int mirror_remove(const char *base);
+int mirror_list(void);
+
+#endif
@@ -0,0 +1,74 @@
+/*
+ * profile.h - Named optimization profiles for package builds
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stddef.h>
+
+/*
+ * A profile is chosen per package from <cache>/profiles.conf
+ * ("<package> <profile>" per line), else for the whole run by
+ * 'build --profile' or TINYPKG_PROFILE, else "generic"
+ */
+#define PROFILE_CONF_FILE "profiles.conf"
+#define PROFILE_ENV "TINYPKG_PROFILE"
+#define PROFILE_DEFAULT "generic"
+
+/*
+ * What a built PKG prefix was built as, beside it in <cache>/<package>/:
+ * "<version> <profile>". Profile data of pgo builds is kept in pgo/.
+ */
+#define PROFILE_BUILT_FILE "PKG.built"
+#define PROFILE_PGO_DIR "pgo"
+
+/* PGO stages; profiles without training build once, as PROFILE_SINGLE */
+enum profile_stage {
+    PROFILE_SINGLE,
+    PROFILE_INSTRUMENT,     /* Build that writes profile data to the pgo dir */
+    PROFILE_OPTIMIZE        /* Rebuild using that data */
+};
+
+struct build_profile {
+    const char *name;
+    const char *cflags;
+    const char *ldflags;
+    int trained;            /* Two-stage build around the manifest's train: */
+    const char *summary;
+};
+
+const struct build_profile *profile_find(const char *name);
+
+/* Whole-run selection ('build --profile'); TINYPKG_ERR if unknown */
+int profile_use(const char *name);
+
+/*
+ * Per-package selection for this run ('restore' rebuilding what a lockfile
+ * records); overrides everything else. Pin before any build starts.
+ */
+int profile_pin(const char *package, const char *name);
+
+/* The profile a package builds with */
+const struct build_profile *profile_for(const char *package);
+
+/*
+ * CFLAGS and LDFLAGS for one stage, ahead of any the user exported so
+ * those still win. pgo_dir is only used by the PGO stages.
+ */
+void profile_flags(const struct build_profile *p, int stage, const char *pgo_dir,
+                   char *cflags, size_t cflags_len, char *ldflags, size_t ldflags_len);
+
+/* Record and read back what <cache>/<package>/PKG was built as */
+int profile_record_built(const char *package, const char *version, const char *profile);
+int profile_built(const char *package, char *version, size_t version_len,
+                  char *profile, size_t profile_len);
+
+/* Artifact cache key of a build: "<version>-<profile>" */
+void profile_key(const char *version, const char *profile, char *key, size_t len);
+
+/* 'tinypkg profile': list profiles and settings, set or unset a package */
+int profile_list(void);
+int profile_set(const char *package, const char *profile);
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ * sched.h - Build duration history and critical-path build ordering
+ */
+
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stddef.h>
+
+/* Duration history, relative to the cache directory */
+#define SCHED_DB_FILE "builds.db"
+#define SCHED_DB_MAGIC "tinypkg-builds 3"
+#define SCHED_DB_VERSION 3      /* Versions 1 and 2 are still read */
+
+/* Concurrent builds for 'tinypkg build' when -j is not given */
+#define SCHED_JOBS_ENV "TINYPKG_JOBS"
+
+/* Where an estimate came from, best first */
+enum sched_basis {
+    SCHED_EXACT,            /* This version built before */
+    SCHED_OTHER_VERSION,    /* Another version of the package built before */
+    SCHED_SIZE,             /* Scaled from the source size */
+    SCHED_DEFAULT           /* Nothing known */
+};
+
+struct sched_job {
+    /* Set by the caller */
+    const char *name;
+    const char *version;
+    long long source_bytes;     /* Compressed source, -1 if unknown */
+
+    /* Set by sched_plan() */
+    double estimate_ms;         /* Expected wall time of the build step */
+    double cores;               /* CPU time / wall time of that build */
+    long long peak_kb;          /* Peak RSS of that build, 0 if unknown */
+    int basis;                  /* enum sched_basis */
+    double path_ms;             /* Longest chain of builds from here to the end */
+    int *deps;                  /* Indices of requested packages this one needs */
+    int ndeps;
+};
+
+/* What one successful build step cost */
+struct build_sample {
+    double wall_ms;
+    double cpu_ms;
+    long long source_bytes;     /* Compressed source */
+    long long peak_kb;          /* ru_maxrss of the build script */
+    long long tree_bytes;       /* Build tree once built */
+};
+
+int sched_record(const char *name, const char *version, const struct build_sample *s);
+
+/* Build tree size of the package's most recent recorded build, -1 if none */
+long long sched_tree_bytes(const char *name);
+
+/* 1 if any version of the package has built before */
+int sched_known(const char *name);
+
+/*
+ * Estimate every job, link dependencies among them from the package index
+ * and order them for 'slots' concurrent builders: whenever a builder is
+ * free it takes the ready job with the longest remaining critical path
+ * (for independent jobs, the longest first) whose memory need fits in
+ * mem_bytes beside the running ones (-1: no limit). order[] receives job
+ * indices in start order. Returns the estimated total time in milliseconds.
+ */
+double sched_plan(struct sched_job *jobs, int count, int slots, long long mem_bytes,
+                  int order[]);
+
+/* Memory a build should be admitted with: recorded peak plus a margin */
+long long sched_need(const struct sched_job *job);
+void sched_free(struct sched_job *jobs, int count);
+
+/*
+ * Bytes of memory we may still use (MemAvailable, capped by the cgroup
+ * limit), and the memory PSI "some" avg10 percentage; -1 if unknown
+ */
+long long sched_mem_available(void);
+double sched_mem_pressure(void);
+
+/* "1h 05m", "4m 10s", "12s", "<1s" */
+void sched_format(double ms, char *buf, size_t len);
+
+#endif
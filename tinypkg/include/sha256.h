@@ -0,0 +1,46 @@
+/*
+ * sha256.h - Streaming SHA-256 (FIPS 180-4)
+ */
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_LEN 32
+#define SHA256_HEX_LEN 65   /* 64 hex digits + NUL */
+
+struct sha256_ctx {
+    uint32_t state[8];
+    uint64_t total;         /* Bytes hashed so far */
+    uint8_t buf[64];
+    size_t buf_len;
+};
+
+/* Incremental interface: feed data as it arrives */
+void sha256_init(struct sha256_ctx *ctx);
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len);
+void sha256_final(struct sha256_ctx *ctx, uint8_t digest[SHA256_DIGEST_LEN]);
+
+/*
+ * Block function backends ("sha-ni", "armv8-ce", "portable"). The fastest
+ * one the CPU supports is used unless TINYPKG_SHA256 names another.
+ */
+#define SHA256_BACKEND_ENV "TINYPKG_SHA256"
+
+const char *sha256_backend(void);
+int sha256_backends(const char *names[], int max);      /* Supported here */
+int sha256_use_backend(const char *name);               /* Switch for all contexts */
+
+/* Helpers */
+void sha256_to_hex(const uint8_t digest[SHA256_DIGEST_LEN], char hex[SHA256_HEX_LEN]);
+int sha256_file(const char *path, char hex[SHA256_HEX_LEN]);
+
+/*
+ * The 64 hex digits of a manifest checksum ("sha256:<hex>" or bare hex),
+ * or NULL if it is anything else; the one test of what can be verified
+ */
+const char *sha256_checksum_hex(const char *checksum);
+
+#endif
@@ -0,0 +1,79 @@
+/*
+ * snapshot.h - Repository snapshots: package metadata without git
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+/*
+ * When set to a base URL (http://, https:// or file://), 'repo sync' reads
+ * the repository from snapshots published there by 'tinypkg mirror'
+ * (<mirror>/snapshot) instead of cloning it with git:
+ *
+ *   <base>/head          which snapshot is current, and recent deltas
+ *   <base>/<id>.snap     every file under packages/ at commit <id>
+ *   <base>/<id>.delta    what changed since the snapshot before <id>
+ *
+ * head is text:
+ *
+ *   tinypkg-snapshot-head 1
+ *   snapshot <id> <sha256> <size>
+ *   delta <from> <to> <sha256> <size>
+ *
+ * newest delta first. .snap and .delta files are gzip streams of records:
+ * "file <size> <path>" followed by the bytes, "delete <path>", and "end",
+ * after a "tinypkg-snapshot 1" or "tinypkg-delta 1" line and the ids.
+ */
+#define SNAPSHOT_ENV "TINYPKG_REPO_SNAPSHOT"
+#define SNAPSHOT_HEAD "head"
+#define SNAPSHOT_HEAD_MAGIC "tinypkg-snapshot-head 1"
+#define SNAPSHOT_MAGIC "tinypkg-snapshot 1"
+#define SNAPSHOT_DELTA_MAGIC "tinypkg-delta 1"
+
+/* Deltas a publisher keeps, and so the most snapshots a client can lag */
+#define SNAPSHOT_DELTAS 16
+
+/*
+ * Client state, relative to the cache directory: the snapshot the repo
+ * tree is at with the validators of its head file, and the packages/
+ * paths each applied step changed, for index_sync()
+ */
+#define SNAPSHOT_DIR "snapshot"
+#define SNAPSHOT_STATE_MAGIC "tinypkg-snapshot-state 1"
+#define SNAPSHOT_CHANGES_MAGIC "tinypkg-snapshot-changes 1"
+
+/* The base URL from SNAPSHOT_ENV, NULL when git is the transport */
+const char *snapshot_base(void);
+
+/*
+ * Bring <cache>/repo up to the snapshot base serves. The head file is
+ * fetched conditionally (If-None-Match, If-Modified-Since), so an
+ * unchanged repository costs one 304. Otherwise the chain of deltas from
+ * the current snapshot is applied if there is one and it is smaller than
+ * the full snapshot, which is fetched in its place when not. Every file is
+ * checked against the sha256 the head file gives.
+ */
+int snapshot_sync(const char *base);
+
+/* The snapshot <cache>/repo is at; TINYPKG_NOT_FOUND if it is a git tree */
+int snapshot_id(char id[64]);
+
+/*
+ * Call fn with every packages/ path the steps from one snapshot to another
+ * changed (a path may come twice). TINYPKG_ERR if the steps between them
+ * are not on record.
+ */
+int snapshot_changes(const char *from, const char *to,
+                     int (*fn)(const char *path, void *ctx), void *ctx);
+
+/* Forget the client state, once the repo tree is a git checkout again */
+void snapshot_forget(void);
+
+/*
+ * Publish <cache>/repo at its current commit into dir: a full snapshot,
+ * the delta from the previously published one, and a new head file,
+ * written last so clients never see it name a missing file
+ */
+int snapshot_publish(const char *dir);
+
+#endif
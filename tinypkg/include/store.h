@@ -0,0 +1,40 @@
+/*
+ * store.h - Content-addressed file store shared by installed prefixes
+ */
+
+#ifndef STORE_H
+#define STORE_H
+
+/* Store layout, relative to the cache directory */
+#define STORE_DIR "store"
+#define STORE_HASHCACHE_MAGIC "tinypkg-hashcache 1"
+
+/* Set to a non-empty value other than "0" to enable store mode */
+#define STORE_ENV "TINYPKG_STORE"
+
+int store_enabled(void);
+
+/* Deduplicate a package's PKG prefix into the object store */
+int store_ingest(const char *name);
+int store_release(const char *name);
+
+/* Link a stored file to dst (hardlink, then reflink); no copy fallback */
+int store_link_file(const char *src, const char *dst);
+
+/*
+ * Reflink only: dst gets its own inode sharing src's blocks, so changing
+ * it cannot reach the object. For installed files; fails where the
+ * filesystem has no reflinks, and the caller copies instead.
+ */
+int store_clone_file(const char *src, const char *dst);
+
+/*
+ * Remove objects no prefix links to any more (link count 1), adding the
+ * bytes freed to *freed. Run by gc after it evicts prefixes.
+ */
+int store_sweep(unsigned long long *freed);
+
+/* Per-package disk savings */
+int store_report(void);
+
+#endif
@@ -0,0 +1,42 @@
+/*
+ * strip.h - Post-build stripping of ELF files with split debug info
+ */
+
+#ifndef STRIP_H
+#define STRIP_H
+
+/*
+ * Enabled by 'build --strip' or TINYPKG_STRIP=1; "compress" (--strip=compress)
+ * also compresses the debug sections kept aside
+ */
+#define STRIP_ENV "TINYPKG_STRIP"
+
+/*
+ * Debug info, relative to the cache directory:
+ * debug/<package>/<path in PKG>.debug, plus debug/.build-id/xx/<rest>.debug
+ * links so 'set debug-file-directory ~/.cache/tinypkg/debug' finds it
+ */
+#define STRIP_DEBUG_DIR "debug"
+
+enum strip_mode { STRIP_OFF, STRIP_SPLIT, STRIP_COMPRESS };
+
+struct strip_stats {
+    int files;                      /* ELF files stripped */
+    int failed;
+    unsigned long long before;      /* Their bytes before and after */
+    unsigned long long after;
+    unsigned long long debug;       /* Bytes of split debug files */
+};
+
+/* Whole-run selection (command line); otherwise STRIP_ENV decides */
+void strip_use(int mode);
+int strip_mode(void);
+
+/*
+ * Strip every ELF file with symbols or debug sections in the package's
+ * PKG prefix, several at a time, keeping their debug info aside
+ */
+int strip_package(const char *name, struct strip_stats *stats);
+void strip_print_stats(const char *name, const struct strip_stats *stats);
+
+#endif
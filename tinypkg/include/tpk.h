@@ -0,0 +1,62 @@
+/*
+ * tpk.h - Binary package files: pack a built prefix, install from one
+ */
+
+#ifndef TPK_H
+#define TPK_H
+
+#include "sha256.h"
+
+/*
+ * A .tpk is a tar stream, zstd-compressed (gzip where zstd is not
+ * installed), of:
+ *
+ *   .TPKINFO     "tinypkg-tpk 1", then name, version, profile, arch lines
+ *   .MANIFEST    the manifest the package was built from
+ *   PKG/...      the prefix
+ *   .FILES       "<sha256> <path>" for every regular file (hardlinks
+ *                repeat their target's hash), in stream order
+ *
+ * Plain 'tar -tf' lists one. Metadata comes first so an installer knows
+ * where the prefix goes before it arrives; the hashes come last so the
+ * packer reads every file once.
+ */
+#define TPK_EXT ".tpk"
+#define TPK_MAGIC "tinypkg-tpk 1"
+#define TPK_INFO ".TPKINFO"
+#define TPK_MANIFEST ".MANIFEST"
+#define TPK_FILES ".FILES"
+
+/* The installed copy of .MANIFEST, beside the prefix */
+#define TPK_MANIFEST_FILE "PKG.manifest"
+
+/* What a package file held, once unpacked */
+struct tpk_info {
+    char name[128];
+    char version[64];
+    char profile[32];
+    char digest[SHA256_HEX_LEN];    /* Tree digest, as tpk_digest() */
+};
+
+/* Pack <cache>/<name>/PKG; out NULL: ./<name>-<version>-<profile>.tpk */
+int tpk_pack(const char *name, const char *out);
+
+/*
+ * Unpack a .tpk straight into the package's prefix, verifying every file
+ * as it is written. Safe to run for different packages at once.
+ */
+int tpk_unpack(const char *path, struct tpk_info *info);
+
+/* tpk_unpack(), then install it as if it had been built here */
+int tpk_install(const char *path);
+
+/*
+ * Digest of a built prefix: sha256 of the .FILES list packing it would
+ * write. Equal digests mean identical contents, whichever machine built it.
+ */
+int tpk_digest(const char *name, char hex[SHA256_HEX_LEN]);
+
+/* 1 if an install argument names a package file rather than a package */
+int tpk_is_file(const char *arg);
+
+#endif
@@ -5,9 +5,50 @@
 #ifndef UTIL_H
 #define UTIL_H
 
-/* Search and info utilities */
+#include <stdio.h>
+#include <stddef.h>
+
+/* One package from index.yaml */
+struct catalog_entry {
+    char name[128];
+    char version[64];
+    char desc[256];
+    char *manifest;     /* Formatted manifest, loaded on first 'info' */
+};
+
+/* One line of installed.db */
+struct installed_entry {
+    char name[128];
+    char version[64];
+    char profile[32];       /* Empty for entries from before profiles */
+};
+
+/* Parsed index plus installed DB snapshot */
+struct catalog {
+    struct catalog_entry *entries;  /* In index order */
+    size_t count;
+    size_t *by_name;                /* Entry indices sorted by name */
+    struct installed_entry *installed;  /* Sorted by name */
+    size_t installed_count;
+};
+
+/* Search and info utilities (one-shot, print to stdout) */
 int util_search(const char *term);
 int util_info(const char *name);
 int util_list(void);
+int util_is_installed(const char *name);
+
+/* Catalog operations for long-lived callers (daemon, batch mode) */
+int catalog_load(struct catalog *cat);
+void catalog_free(struct catalog *cat);
+int catalog_search(const struct catalog *cat, const char *term, FILE *out);
+int catalog_info(struct catalog *cat, const char *name, FILE *out);
+int catalog_list(const struct catalog *cat, FILE *out);
+int catalog_is_installed(const struct catalog *cat, const char *name, FILE *out);
+int catalog_dispatch(struct catalog *cat, const char *cmd, const char *arg, FILE *out);
+
+/* Batch mode: many queries from one stream, one record per query */
+#define BATCH_RECORD_SEP '\x1e'
+int util_batch(FILE *in, FILE *out);
 
 #endif
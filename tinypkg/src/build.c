@@ -11,20 +11,47 @@
  * 7. Remove/uninstall packages
  */
 
+#define _DEFAULT_SOURCE     /* wait4() */
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/statfs.h>
+#include <sys/statvfs.h>
+#include <sys/wait.h>
 
 #include "build.h"
+#include "config.h"
 #include "util.h"
 #include "repo.h"
+#include "index.h"
+#include "gc.h"
+#include "store.h"
+#include "fetch.h"
+#include "mirror.h"
+#include "sched.h"
+#include "profile.h"
+#include "sha256.h"
+#include "strip.h"
+#include "metrics.h"
+#include "manifest.h"
 
 /* Forward declarations for util.c functions we'll use */
 extern char* get_cache_path(void);
+extern int in_path(const char *prog);
+extern int remove_tree(const char *path);
+extern int safe_execute(char *const argv[]);
+extern int safe_execute_in_dir(const char *workdir, char *const argv[]);
 #define BUILD_DIR ".cache/tinypkg/build"
 #define LOCAL_BIN_DIR ".local/bin"
 #define TINYPKG_DIR ".cache/tinypkg"
@@ -34,10 +61,17 @@ extern char* get_cache_path(void);
  * ============================================================================
  */
 
+/*
+ * Paths are filled in on first use and never rewritten, so the prefetch
+ * worker can read them while the main thread builds.
+ */
+
 /* Get home directory */
 static char* get_home_dir(void) {
     static char home[512];
-    const char *env_home = getenv("HOME");
+    const char *env_home;
+    if (home[0]) return home;
+    env_home = getenv("HOME");
     if (!env_home) {
         fprintf(stderr, "Error: HOME environment variable not set\n");
         return NULL;
@@ -47,10 +81,17 @@ static char* get_home_dir(void) {
     return home;
 }
 
-/* Get build directory (~/tinypkg-build) */
+/* Get build directory (~/.cache/tinypkg/build or TINYPKG_BUILD_ROOT) */
 static char* get_build_dir(void) {
     static char path[1024];
-    const char *home = get_home_dir();
+    const char *home, *root;
+    if (path[0]) return path;
+    root = getenv(BUILD_ROOT_ENV);
+    if (root && *root) {
+        snprintf(path, sizeof(path), "%s", root);
+        return path;
+    }
+    home = get_home_dir();
     if (!home) return NULL;
     snprintf(path, sizeof(path), "%s/%s", home, BUILD_DIR);
     return path;
@@ -59,7 +100,9 @@ static char* get_build_dir(void) {
 /* Get local bin directory (~/.local/bin) */
 static char* get_local_bin(void) {
     static char path[1024];
-    const char *home = get_home_dir();
+    const char *home;
+    if (path[0]) return path;
+    home = get_home_dir();
     if (!home) return NULL;
     snprintf(path, sizeof(path), "%s/%s", home , LOCAL_BIN_DIR);
     return path;
@@ -68,7 +111,9 @@ static char* get_local_bin(void) {
 /* Get tinypkg metadata directory (~/.tinypkg) */
 static char* get_tinypkg_dir(void) {
     static char path[1024];
-    const char *home = get_home_dir();
+    const char *home;
+    if (path[0]) return path;
+    home = get_home_dir();
     if (!home) return NULL;
     snprintf(path, sizeof(path), "%s/%s", home, TINYPKG_DIR);
     return path;
@@ -102,88 +147,111 @@ static int mkdir_p(const char *path) {
     return 0;
 }
 
+/* ============================================================================
+ * Helper Functions - Phase Timings
+ * ============================================================================
+ */
+
+static double phase_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/* Append one phase duration to $TINYPKG_TIMINGS, if set */
+static void phase_write(const char *name, const char *phase, double ms) {
+    const char *path = getenv(BUILD_TIMINGS_ENV);
+    int fd;
+
+    metrics_observe(METRIC_PHASE_SECONDS, phase, ms / 1000.0);
+    if (!path || !*path) return;
+
+    /* One write per line with O_APPEND, so concurrent builds don't interleave */
+    fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) return;
+    dprintf(fd, "%s\t%s\t%.3f\n", name, phase, ms);
+    close(fd);
+}
+
+static void phase_record(const char *name, const char *phase, double start) {
+    phase_write(name, phase, phase_clock() - start);
+}
+
 /* ============================================================================
  * Phase 1: Parse Manifest
  * ============================================================================
  */
 
+/* Append one script line to a block, dropping lines that no longer fit */
+static void block_add(char *dst, size_t dst_len, const char *text) {
+    size_t offset = strlen(dst);
+    size_t len = strlen(text);
+
+    if (offset + len + 1 < dst_len - 1) {
+        memcpy(dst + offset, text, len);
+        dst[offset + len] = '\n';
+        dst[offset + len + 1] = '\0';
+    }
+}
+
+static int manifest_field(const struct manifest_line *l, void *ctx) {
+    struct manifest *m = ctx;
+
+    if (l->event == MANIFEST_KEY) {
+        if (strcmp(l->key, "version") == 0) {
+            sscanf(l->value, "%63s", m->version);
+        } else if (strcmp(l->key, "source") == 0) {
+            sscanf(l->value, "%511s", m->source);
+        } else if (strcmp(l->key, "checksum") == 0) {
+            sscanf(l->value, "%127s", m->checksum);
+        }
+        return 0;
+    }
+    if (l->event != MANIFEST_TEXT) {
+        return 0;
+    }
+
+    if (strcmp(l->key, "mirrors") == 0) {
+        if (l->item && m->mirror_count < (int)(sizeof(m->mirrors) / sizeof(m->mirrors[0])) &&
+            sscanf(l->item, "%511s", m->mirrors[m->mirror_count]) == 1) {
+            m->mirror_count++;
+        }
+    } else if (strcmp(l->key, "build") == 0) {
+        block_add(m->build_script, sizeof(m->build_script), l->value);
+    } else if (strcmp(l->key, "train") == 0) {
+        block_add(m->train_script, sizeof(m->train_script), l->value);
+    } else if (strcmp(l->key, "install") == 0) {
+        block_add(m->install_script, sizeof(m->install_script), l->value);
+    }
+    return 0;
+}
+
 int parse_manifest(const char *name, struct manifest *m) {
     char *cache = get_cache_path();
     char manifest_path[2048];
-    FILE *f;
-    char line[512];
 
     if (!name || !m) return -1;
 
     snprintf(manifest_path, sizeof(manifest_path),
              "%s/repo/packages/%s/manifest.yaml", cache, name);
 
-    f = fopen(manifest_path, "r");
-    if (!f) {
-        fprintf(stderr, "Error: Package '%s' manifest not found\n", name);
-        return -1;
-    }
-
     memset(m, 0, sizeof(*m));
     strncpy(m->name, name, sizeof(m->name) - 1);
     m->name[sizeof(m->name) - 1] = '\0';
 
-    /* Parse YAML manifest */
-    while (fgets(line, sizeof(line), f)) {
-        /* Extract version */
-        if (strstr(line, "version:")) {
-            char *start = strchr(line, ':') + 1;
-            while (*start == ' ') start++;
-            sscanf(start, "%63s", m->version);
-        }
-
-        /* Extract source URL */
-        if (strstr(line, "source:")) {
-            char *start = strchr(line, ':') + 1;
-            while (*start == ' ') start++;
-            sscanf(start, "%511s", m->source);
-        }
-
-        /* Extract build script (multi-line) */
-        if (strstr(line, "build:") && line[0] != ' ') {
-            size_t offset = 0;
-            while (fgets(line, sizeof(line), f)) {
-                /* Stop at next top-level key or end of file */
-                if (line[0] != ' ' || (line[0] == ' ' && line[1] != ' ')) {
-                    break;
-                }
-                if (offset + strlen(line) < sizeof(m->build_script) - 1) {
-                    strcat(m->build_script, line);
-                    offset += strlen(line);
-                }
-            }
-            continue;
-        }
-
-        /* Extract install script (multi-line) */
-        if (strstr(line, "install:") && line[0] != ' ') {
-            size_t offset = 0;
-            while (fgets(line, sizeof(line), f)) {
-                /* Stop at next top-level key or end of file */
-                if (line[0] != ' ' || (line[0] == ' ' && line[1] != ' ')) {
-                    break;
-                }
-                if (offset + strlen(line) < sizeof(m->install_script) - 1) {
-                    strcat(m->install_script, line);
-                    offset += strlen(line);
-                }
-            }
-            break;
-        }
+    /* Same reader as the sync-time check, so keys may come in any order */
+    if (manifest_scan(manifest_path, manifest_field, m) != 0) {
+        fprintf(stderr, "Error: Package '%s' manifest not found\n", name);
+        return -1;
     }
 
-    fclose(f);
-
     if (m->source[0] == 0) {
         fprintf(stderr, "Error: No source URL found in manifest\n");
         return -1;
     }
 
+    snprintf(m->profile, sizeof(m->profile), "%s", profile_for(name)->name);
+
     return 0;
 }
 
@@ -192,11 +260,10 @@ int parse_manifest(const char *name, struct manifest *m) {
  * ============================================================================
  */
 
-int download_source(const char *name, const char *url) {
+/* Source tarball location for a package */
+static int source_path(const char *name, char *path, size_t len) {
     char *build_base = get_build_dir();
     char pkg_dir[1024];
-    char cmd[4096];
-    int ret;
 
     if (!build_base) return -1;
 
@@ -208,273 +275,1853 @@ int download_source(const char *name, const char *url) {
         return -1;
     }
 
-    printf("Downloading %s from %s...\n", name, url);
+    snprintf(path, len, "%s/source.tar.gz", pkg_dir);
+    return 0;
+}
 
-    /* Download with wget or curl */
-    snprintf(cmd, sizeof(cmd),
-             "cd %s && wget -q --show-progress %s -O source.tar.gz 2>&1",
-             pkg_dir, url);
+/* Mirror candidates for a manifest's source, best guess first */
+static int source_urls(const char *name, const struct manifest *m, char *urls[]) {
+    char *mirrors[4];
 
-    ret = system(cmd);
-    if (ret != 0) {
-        fprintf(stderr, "Error: Failed to download source\n");
-        return -1;
+    for (int i = 0; i < m->mirror_count; i++) {
+        mirrors[i] = (char *)m->mirrors[i];
     }
-
-    printf("✓ Downloaded to %s/source.tar.gz\n", pkg_dir);
-    return 0;
+    return mirror_candidates(name, m->source, mirrors, m->mirror_count,
+                             urls, MIRROR_MAX);
 }
 
-/* ============================================================================
- * Phase 3: Extract Tarball
- * ============================================================================
- */
+static void free_urls(char *urls[], int count) {
+    for (int i = 0; i < count; i++) {
+        free(urls[i]);
+    }
+}
 
-int extract_tarball(const char *name) {
-    char *build_base = get_build_dir();
-    char pkg_dir[1024];
-    char cmd[4096];
+int download_source(const char *name, const struct manifest *m) {
+    struct fetch_job job;
+    char *urls[MIRROR_MAX];
+    char dest[1100];
     int ret;
 
-    if (!build_base) return -1;
-
-    snprintf(pkg_dir, sizeof(pkg_dir), "%s/%s", build_base, name);
+    if (source_path(name, dest, sizeof(dest)) != 0) return -1;
 
-    printf("Extracting source...\n");
+    metrics_add(METRIC_CACHE_MISSES, "source", 1);
+    printf("Downloading %s from %s...\n", name, m->source);
 
-    snprintf(cmd, sizeof(cmd), "cd %s && tar -xzf source.tar.gz", pkg_dir);
+    /* Segmented and resumable; partial downloads survive a failed run */
+    memset(&job, 0, sizeof(job));
+    job.url = m->source;
+    job.url_count = source_urls(name, m, urls);
+    job.urls = urls;
+    job.checksum = m->checksum;
+    job.dest = dest;
 
-    ret = system(cmd);
+    ret = fetch_files(&job, 1);
+    free_urls(urls, job.url_count);
     if (ret != 0) {
-        fprintf(stderr, "Error: Failed to extract tarball\n");
+        fprintf(stderr, "Error: Failed to download source\n");
         return -1;
     }
 
-    printf("✓ Extracted to %s/\n", pkg_dir);
+    gc_record(GC_KIND_SOURCE, name);
+
+    printf("✓ Downloaded to %s\n", dest);
+    fetch_print_stats(name, &job.stats);
     return 0;
 }
 
 /* ============================================================================
- * Phase 4: Execute Build
+ * Phase 3: Extract Tarball
  * ============================================================================
  */
 
-int execute_build(const char *name, struct manifest *m) {
-    char *build_base = get_build_dir();
-    char *home = get_home_dir();
-    char pkg_dir[1024];
-    char prefix[1024];
-    char cmd[8192];
-    int ret;
-
-    if (!build_base || !home) return -1;
-
-    snprintf(pkg_dir, sizeof(pkg_dir), "%s/%s", build_base, name);
-    snprintf(prefix, sizeof(prefix), "%s/.cache/tinypkg/%s/PKG", home, name);
+/*
+ * With --build-in-ram the tarball stays in build/<name>/ and the tree is
+ * unpacked into <ram>/<name>/ instead, as long as it is expected to fit.
+ * The budget is taken once, before the first tree, and each tree in RAM
+ * holds its expected size until it is removed, so trees still growing
+ * count in full. Only the trees placed by this run are used; one left by
+ * an earlier run is removed when the package is extracted again.
+ */
 
-    /* Create PKG (installation prefix) directory with parents */
-    if (mkdir_p(prefix) != 0) {
-        fprintf(stderr, "Error: Failed to create prefix directory\n");
-        return -1;
-    }
+#define TMPFS_SUPER_MAGIC 0x01021994
 
-    printf("Building %s...\n", name);
+struct ram_tree {
+    char name[128];
+    long long bytes;                    /* Expected size, reserved */
+};
 
-    /* Execute build script with PREFIX set */
-    snprintf(cmd, sizeof(cmd),
-             "cd %s && PREFIX=%s /bin/bash -c '%s' 2>&1",
-             pkg_dir, prefix, m->build_script);
+static int ram_mode = -1;               /* -1: BUILD_IN_RAM_ENV decides */
+static pthread_once_t ram_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t ram_lock = PTHREAD_MUTEX_INITIALIZER;
+static char ram_root[1024];             /* Empty if no tmpfs is usable */
+static long long ram_budget;
+static long long ram_reserved;
+static struct ram_tree *ram_trees;
+static int ram_count;
 
-    ret = system(cmd);
-    if (ret != 0) {
-        fprintf(stderr, "Error: Build failed\n");
-        return -1;
-    }
+void build_use_ram(int enable) {
+    ram_mode = enable;
+}
 
-    printf("✓ Build complete: %s/.cache/tinypkg/bin/%s\n", prefix, name);
-    return 0;
+static int is_tmpfs(const char *path) {
+    struct statfs st;
+    return statfs(path, &st) == 0 && st.f_type == TMPFS_SUPER_MAGIC;
 }
 
-/* ============================================================================
- * Phase 5: Execute Install
- * ============================================================================
- */
+static long long free_bytes(const char *path) {
+    struct statvfs st;
+    if (statvfs(path, &st) != 0) return -1;
+    return (long long)st.f_bavail * (long long)st.f_frsize;
+}
 
-int execute_install(const char *name) {
-    char *build_base = get_build_dir();
-    char *home = get_home_dir();
-    char *local_bin = get_local_bin();
-    char pkg_bin[1024];
-    char install_bin[1024];
-    char cmd[4096];
+static void ram_init(void) {
+    const char *dir = getenv(BUILD_RAM_DIR_ENV);
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    const char *budget = getenv(BUILD_RAM_BUDGET_ENV);
+    unsigned long long limit;
+    long long mem;
     struct stat st;
-
-    if (!build_base || !home || !local_bin) return -1;
-
-    snprintf(pkg_bin, sizeof(pkg_bin),
-             "%s/%s/PKG/bin/%s", build_base, name, name);
-    snprintf(install_bin, sizeof(install_bin), "%s/%s", local_bin, name);
-
-    /* Check if binary was built */
-    if (stat(pkg_bin, &st) != 0) {
-        fprintf(stderr, "Error: Package not built. Run 'tinypkg build %s' first\n", name);
-        return -1;
+    char path[1024];
+
+    if (dir && *dir) {
+        snprintf(path, sizeof(path), "%s", dir);
+    } else if (runtime && *runtime && is_tmpfs(runtime)) {
+        snprintf(path, sizeof(path), "%s/tinypkg-build", runtime);
+    } else if (is_tmpfs("/dev/shm")) {
+        snprintf(path, sizeof(path), "/dev/shm/tinypkg-build-%lu", (unsigned long)getuid());
+    } else {
+        fprintf(stderr, "Warning: No tmpfs to build in, building on disk\n");
+        return;
     }
 
-    /* Create ~/.local/bin if it doesn't exist */
-    if (mkdir_p(local_bin) != 0) {
-        fprintf(stderr, "Error: Failed to create local bin directory\n");
-        return -1;
+    /* /dev/shm is shared: the directory must be ours and private */
+    if (mkdir_p(path) != 0 || lstat(path, &st) != 0 || !S_ISDIR(st.st_mode) ||
+        st.st_uid != getuid() || chmod(path, 0700) != 0) {
+        fprintf(stderr, "Warning: Cannot build in %s, building on disk\n", path);
+        return;
     }
 
-    printf("Installing %s to %s...\n", name, install_bin);
-
-    /* Copy binary */
-    snprintf(cmd, sizeof(cmd), "cp %s %s", pkg_bin, install_bin);
-    if (system(cmd) != 0) {
-        fprintf(stderr, "Error: Failed to copy binary\n");
-        return -1;
+    ram_budget = free_bytes(path);
+    mem = sched_mem_available();
+    if (mem > 0 && mem / 100 * BUILD_RAM_SHARE_PCT < ram_budget) {
+        ram_budget = mem / 100 * BUILD_RAM_SHARE_PCT;
+    }
+    if (budget && *budget) {
+        if (gc_parse_size(budget, &limit) != 0) {
+            fprintf(stderr, "Warning: Ignoring invalid %s '%s'\n", BUILD_RAM_BUDGET_ENV, budget);
+        } else if ((long long)limit < ram_budget) {
+            ram_budget = (long long)limit;
+        }
     }
+    snprintf(ram_root, sizeof(ram_root), "%s", path);
+}
 
-    /* Make executable */
-    chmod(install_bin, 0755);
+/* RAM build root, NULL unless building in RAM and a tmpfs is usable */
+static const char *ram_dir(void) {
+    const char *env;
+    int on = ram_mode;
 
-    /* Track installation */
-    if (track_installation(name, "") != 0) {
-        fprintf(stderr, "Warning: Could not track installation\n");
+    if (on < 0) {
+        env = getenv(BUILD_IN_RAM_ENV);
+        on = env && strcmp(env, "1") == 0;
     }
+    if (!on) return NULL;
+    pthread_once(&ram_once, ram_init);
+    return ram_root[0] ? ram_root : NULL;
+}
 
-    printf("✓ Installed to %s\n", install_bin);
-    return 0;
+/* Call with ram_lock held */
+static struct ram_tree *ram_find(const char *name) {
+    for (int i = 0; i < ram_count; i++) {
+        if (strcmp(ram_trees[i].name, name) == 0) {
+            return &ram_trees[i];
+        }
+    }
+    return NULL;
 }
 
-/* ============================================================================
- * Phase 6: Track Installation
- * ============================================================================
- */
+/* Reserve room for the package's tree in RAM; 1 if it fits */
+static int ram_place(const char *name) {
+    long long expect = sched_tree_bytes(name);
+    struct ram_tree *grown;
+    int fits;
 
-int track_installation(const char *name, const char *version) {
-    char *tinypkg_dir = get_tinypkg_dir();
-    char db_path[1024];
-    FILE *f;
+    if (expect < 0) {
+        expect = (long long)gc_usage(GC_KIND_SOURCE, name) * BUILD_RAM_TREE_FACTOR;
+    }
 
-    if (!tinypkg_dir) return -1;
+    pthread_mutex_lock(&ram_lock);
+    fits = ram_reserved + expect <= ram_budget;
+    if (fits) {
+        grown = realloc(ram_trees, (ram_count + 1) * sizeof(*grown));
+        if (grown) {
+            ram_trees = grown;
+            snprintf(ram_trees[ram_count].name, sizeof(ram_trees[0].name), "%s", name);
+            ram_trees[ram_count++].bytes = expect;
+            ram_reserved += expect;
+        } else {
+            fits = 0;
+        }
+    }
+    pthread_mutex_unlock(&ram_lock);
 
-    /* Create ~/.tinypkg if needed */
-    if (mkdir_p(tinypkg_dir) != 0) {
-        fprintf(stderr, "Error: Failed to create tinypkg directory\n");
-        return -1;
+    if (!fits) {
+        printf("%s: %lld MiB expected, %lld MiB of RAM left; building on disk\n", name,
+               expect >> 20, (ram_budget - ram_reserved) >> 20);
     }
+    return fits;
+}
 
-    snprintf(db_path, sizeof(db_path), "%s/installed.db", tinypkg_dir);
+/* Remove the package's tree from RAM, if it is there, and its reservation */
+static void ram_remove(const char *name) {
+    char tree[2200];
+    struct ram_tree *t;
 
-    /* Append to installed.db */
-    f = fopen(db_path, "a");
-    if (!f) {
-        perror("fopen");
-        return -1;
+    pthread_mutex_lock(&ram_lock);
+    t = ram_find(name);
+    if (t) {
+        ram_reserved -= t->bytes;
+        *t = ram_trees[--ram_count];
     }
+    pthread_mutex_unlock(&ram_lock);
 
-    fprintf(f, "%s %s\n", name, version ? version : "unknown");
-    fclose(f);
+    snprintf(tree, sizeof(tree), "%s/%s", ram_root, name);
+    if (remove_tree(tree) != 0) {
+        fprintf(stderr, "Warning: Could not remove %s/%s\n", ram_root, name);
+    }
+}
 
-    return 0;
+/* Where the package's tree is; 1 if in RAM */
+static int tree_dir(const char *name, char *dir, size_t len) {
+    int in_ram;
+
+    pthread_mutex_lock(&ram_lock);
+    in_ram = ram_find(name) != NULL;
+    pthread_mutex_unlock(&ram_lock);
+
+    snprintf(dir, len, "%s/%s", in_ram ? ram_root : get_build_dir(), name);
+    return in_ram;
 }
 
-/* ============================================================================
- * Check if Package is Installed
- * ============================================================================
+/*
+ * Unpack build/<name>/source.tar.gz, without output: into RAM if allowed
+ * and it fits there, else in place. A failed RAM extraction (the tmpfs
+ * filled up) is retried on disk.
  */
+static int unpack_source(const char *name, int ram_ok) {
+    const char *ram = ram_ok ? ram_dir() : NULL;
+    char tarball[1200];
+    char dir[1100];
+    char tree[1100];
+
+    snprintf(dir, sizeof(dir), "%s/%s", get_build_dir(), name);
+    snprintf(tarball, sizeof(tarball), "%s/source.tar.gz", dir);
+
+    if (ram) {
+        ram_remove(name);
+        snprintf(tree, sizeof(tree), "%s/%s", ram, name);
+        if (ram_place(name)) {
+            char *argv[] = { "tar", "-xzf", tarball, "-C", tree, NULL };
+
+            if (mkdir_p(tree) == 0 && safe_execute(argv) == 0) {
+                return 0;
+            }
+            fprintf(stderr, "Warning: Could not extract %s in RAM, retrying on disk\n", name);
+            ram_remove(name);
+        }
+    }
 
-int is_installed(const char *name) {
-    char *tinypkg_dir = get_tinypkg_dir();
-    char db_path[1024];
-    FILE *f;
-    char line[256];
+    char *argv[] = { "tar", "-xzf", "source.tar.gz", NULL };
+    return safe_execute_in_dir(dir, argv) == 0 ? 0 : -1;
+}
 
-    if (!tinypkg_dir) return 0;
+static int untar_source(const char *name) {
+    return unpack_source(name, 1);
+}
 
-    snprintf(db_path, sizeof(db_path), "%s/installed.db", tinypkg_dir);
+int extract_tarball(const char *name) {
+    char tree[1100];
+    int ret;
 
-    f = fopen(db_path, "r");
-    if (!f) return 0;  /* Not installed */
+    if (!get_build_dir()) return -1;
 
-    while (fgets(line, sizeof(line), f)) {
-        char pkg[128] = {0};
-        sscanf(line, "%127s", pkg);
-        if (strcmp(pkg, name) == 0) {
-            fclose(f);
-            return 1;  /* Installed */
-        }
+    printf("Extracting source...\n");
+
+    ret = untar_source(name);
+    if (ret != 0) {
+        fprintf(stderr, "Error: Failed to extract tarball\n");
+        return -1;
     }
 
-    fclose(f);
+    tree_dir(name, tree, sizeof(tree));
+    printf("✓ Extracted to %s/\n", tree);
     return 0;
 }
 
 /* ============================================================================
- * Phase 7: Remove Package
+ * Phase 4: Execute Build
  * ============================================================================
  */
 
-int remove_package_impl(const char *name) {
-    char *local_bin = get_local_bin();
-    char *tinypkg_dir = get_tinypkg_dir();
-    char binary_path[1024];
-    char db_path[1024];
-    char tmp_path[1024];
-    FILE *in, *out;
-    char line[256];
-    int found = 0;
+extern char **environ;
 
-    if (!local_bin || !tinypkg_dir) return -1;
+/* "NAME=..." entries naming the same variable */
+static int same_var(const char *a, const char *b) {
+    size_t len = strcspn(a, "=");
+    return strncmp(a, b, len) == 0 && b[len] == '=';
+}
 
-    snprintf(binary_path, sizeof(binary_path), "%s/%s", local_bin, name);
-    snprintf(db_path, sizeof(db_path), "%s/installed.db", tinypkg_dir);
-    snprintf(tmp_path, sizeof(tmp_path), "%s/temp.db", tinypkg_dir);
+/* Where a build's output goes; see build.h */
+struct build_log {
+    char name[128];
+    char path[1100];
+    int compress;                       /* Piped through gzip */
+    char *tail;                         /* Ring of the last tail_cap bytes */
+    size_t tail_cap;
+    size_t tail_len;
+    size_t tail_head;                   /* Where the next byte goes */
+    unsigned long long lines;
+};
+
+static int verbose_mode = -1;           /* -1: BUILD_VERBOSE_ENV decides */
+static pthread_once_t verbose_once = PTHREAD_ONCE_INIT;
+
+/* Pipes are created and children forked under this, see run_script() */
+static pthread_mutex_t spawn_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void build_verbose(int enable) {
+    verbose_mode = enable;
+}
 
-    /* Remove binary */
-    if (unlink(binary_path) == 0) {
-        printf("✓ Removed %s\n", binary_path);
-    } else {
-        fprintf(stderr, "Warning: Could not remove %s\n", binary_path);
+static void verbose_init(void) {
+    const char *env = getenv(BUILD_VERBOSE_ENV);
+
+    if (verbose_mode < 0) {
+        verbose_mode = env && *env && strcmp(env, "0") != 0;
     }
+}
 
-    /* Update database (remove entry) */
-    in = fopen(db_path, "r");
-    out = fopen(tmp_path, "w");
+static int is_verbose(void) {
+    pthread_once(&verbose_once, verbose_init);
+    return verbose_mode;
+}
 
-    if (in && out) {
-        while (fgets(line, sizeof(line), in)) {
-            char pkg[128] = {0};
-            sscanf(line, "%127s", pkg);
-            if (strcmp(pkg, name) != 0) {
-                fputs(line, out);
-            } else {
-                found = 1;
-            }
-        }
-        fclose(in);
-        fclose(out);
+/* Start an empty log for a build of name; 0 or -1 */
+static int log_open(struct build_log *log, const char *name) {
+    const char *env = getenv(BUILD_LOG_TAIL_ENV);
+    unsigned long long cap = BUILD_LOG_TAIL_DEFAULT;
+    char other[1100];
 
-        if (found) {
-            rename(tmp_path, db_path);
-        } else {
-            unlink(tmp_path);
-        }
+    memset(log, 0, sizeof(*log));
+    snprintf(log->name, sizeof(log->name), "%s", name);
+    if (env && *env && gc_parse_size(env, &cap) != 0) {
+        cap = BUILD_LOG_TAIL_DEFAULT;
+    }
+    log->compress = in_path("gzip");
+    snprintf(log->path, sizeof(log->path), "%s/%s/%s%s", get_tinypkg_dir(), name,
+             BUILD_LOG_FILE, log->compress ? ".gz" : "");
+    snprintf(other, sizeof(other), "%s/%s/%s%s", get_tinypkg_dir(), name,
+             BUILD_LOG_FILE, log->compress ? "" : ".gz");
+    unlink(other);
+
+    if (truncate(log->path, 0) != 0 && errno != ENOENT) {
+        perror(log->path);
+        return -1;
+    }
+    if (cap > 0) {
+        log->tail = malloc((size_t)cap);
+        log->tail_cap = log->tail ? (size_t)cap : 0;
     }
-
-    printf("✓ %s uninstalled\n", name);
     return 0;
 }
 
-/* ============================================================================
- * Main Entry Points
- * ============================================================================
- */
+static void log_close(struct build_log *log) {
+    free(log->tail);
+    log->tail = NULL;
+}
 
-int build_package(const char *name) {
+/* Keep the newest bytes in the ring, count lines */
+static void log_keep(struct build_log *log, const char *data, size_t len) {
+    size_t cap = log->tail_cap, first;
+
+    for (const char *p = data; (p = memchr(p, '\n', len - (size_t)(p - data))); p++) {
+        log->lines++;
+    }
+    if (cap == 0) {
+        return;
+    }
+    if (len >= cap) {
+        memcpy(log->tail, data + len - cap, cap);
+        log->tail_head = 0;
+        log->tail_len = cap;
+        return;
+    }
+    first = cap - log->tail_head < len ? cap - log->tail_head : len;
+    memcpy(log->tail + log->tail_head, data, first);
+    memcpy(log->tail, data + first, len - first);
+    log->tail_head = (log->tail_head + len) % cap;
+    log->tail_len = log->tail_len + len < cap ? log->tail_len + len : cap;
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* After a failed script: where the log is and, unless it was shown, its end */
+static void log_print_tail(const struct build_log *log, const char *phase) {
+    size_t cap = log->tail_cap, len = log->tail_len, i = 0;
+    size_t start = len < cap ? 0 : log->tail_head;
+
+    flockfile(stderr);
+    fprintf(stderr, "Error: %s: %s failed, full output in %s\n", log->name, phase, log->path);
+    if (!is_verbose() && len > 0) {
+        /* The ring wrapped: begin at the first whole line */
+        if (len == cap) {
+            while (i < len && log->tail[(start + i) % cap] != '\n') i++;
+            i = i < len ? i + 1 : 0;
+        }
+        fprintf(stderr, "--- last %zu bytes of output ---\n", len - i);
+        for (; i < len; i++) {
+            fputc(log->tail[(start + i) % cap], stderr);
+        }
+        if (log->tail[(start + len - 1) % cap] != '\n') {
+            fputc('\n', stderr);
+        }
+        fprintf(stderr, "---\n");
+    }
+    funlockfile(stderr);
+}
+
+static int cloexec_pipe(int fds[2]) {
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+}
+
+/*
+ * Run a build script in dir with vars ("NAME=value", NULL-terminated) set
+ * over the environment, stdout and stderr captured into log as phase. The
+ * environment is prepared before fork() because builds run on several
+ * threads and only async-signal-safe calls are allowed in the child. For
+ * the same reason the pipes are made and the children forked under
+ * spawn_lock: a script started by another build must not inherit them, or
+ * this one would not see end of output until that one finished.
+ */
+static int run_script(const char *dir, const char *script, char *const vars[],
+                      const char *phase, struct build_log *log, struct rusage *usage) {
+    char **env;
+    size_t n = 0, nvars = 0, k = 0;
+    char buf[65536];
+    int out[2], gz[2] = { -1, -1 };
+    int file_fd, sink, status = 0, len, ok;
+    unsigned long long lines = 0;
+    double start = phase_clock();
+    pid_t pid, gz_pid = -1;
+    ssize_t got;
+
+    while (environ[n]) n++;
+    while (vars[nvars]) nvars++;
+    env = calloc(n + nvars + 1, sizeof(*env));
+    if (!env) return -1;
+
+    for (size_t v = 0; v < nvars; v++) {
+        env[k++] = vars[v];
+    }
+    for (size_t i = 0; i < n; i++) {
+        size_t v = 0;
+        while (v < nvars && !same_var(vars[v], environ[i])) v++;
+        if (v == nvars) {
+            env[k++] = environ[i];
+        }
+    }
+
+    /* One gzip member per script; concatenated they are one .gz file */
+    file_fd = open(log->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (file_fd < 0) {
+        perror(log->path);
+        free(env);
+        return -1;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+
+    pthread_mutex_lock(&spawn_lock);
+    if (cloexec_pipe(out) != 0) {
+        pthread_mutex_unlock(&spawn_lock);
+        perror("pipe");
+        close(file_fd);
+        free(env);
+        return -1;
+    }
+    if (log->compress && cloexec_pipe(gz) == 0) {
+        gz_pid = fork();
+        if (gz_pid == 0) {
+            if (dup2(gz[0], STDIN_FILENO) < 0 || dup2(file_fd, STDOUT_FILENO) < 0) {
+                _exit(127);
+            }
+            execlp("gzip", "gzip", "-c", (char *)NULL);
+            _exit(127);
+        }
+        close(gz[0]);
+        if (gz_pid < 0) {
+            close(gz[1]);
+            gz[1] = -1;
+        }
+    }
+    pid = fork();
+    if (pid == 0) {
+        if (chdir(dir) != 0 || dup2(out[1], STDOUT_FILENO) < 0 ||
+            dup2(out[1], STDERR_FILENO) < 0) {
+            _exit(127);
+        }
+        execle("/bin/bash", "bash", "-c", script, (char *)NULL, env);
+        _exit(127);
+    }
+    pthread_mutex_unlock(&spawn_lock);
+    close(out[1]);
+    free(env);
+
+    sink = log->compress ? gz[1] : file_fd;
+    if (pid < 0 || sink < 0) {
+        perror("fork");
+        close(out[0]);
+        pid = -1;
+    } else {
+        len = snprintf(buf, sizeof(buf), "==> %s in %s\n", phase, dir);
+        log_keep(log, buf, (size_t)len);
+        if (write_all(sink, buf, (size_t)len) != 0) {
+            sink = -1;
+        }
+        lines = log->lines;
+
+        while ((got = read(out[0], buf, sizeof(buf))) != 0) {
+            if (got < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            log_keep(log, buf, (size_t)got);
+            if (sink >= 0 && write_all(sink, buf, (size_t)got) != 0) {
+                fprintf(stderr, "Warning: %s: %s, output no longer logged\n",
+                        log->path, strerror(errno));
+                sink = -1;
+            }
+            if (is_verbose()) {
+                write_all(STDOUT_FILENO, buf, (size_t)got);
+            }
+        }
+        close(out[0]);
+    }
+
+    ok = pid > 0;
+    while (pid > 0 && wait4(pid, &status, 0, usage) < 0) {
+        if (errno != EINTR) {
+            ok = 0;
+            break;
+        }
+    }
+    ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+    if (gz[1] >= 0) {
+        close(gz[1]);
+    }
+    while (gz_pid > 0 && waitpid(gz_pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    close(file_fd);
+
+    if (!ok) {
+        if (pid > 0) {
+            log_print_tail(log, phase);
+        }
+        return -1;
+    }
+    if (!is_verbose()) {
+        printf("  %s: %s, %llu lines of output in %.1fs\n", log->name, phase, log->lines - lines,
+               (phase_clock() - start) / 1000.0);
+    }
+    return 0;
+}
+
+/* Add one run's CPU time to a total and keep the larger peak RSS */
+static void add_usage(struct rusage *total, const struct rusage *run) {
+    total->ru_utime.tv_sec += run->ru_utime.tv_sec;
+    total->ru_utime.tv_usec += run->ru_utime.tv_usec;
+    total->ru_stime.tv_sec += run->ru_stime.tv_sec;
+    total->ru_stime.tv_usec += run->ru_stime.tv_usec;
+    if (run->ru_maxrss > total->ru_maxrss) {
+        total->ru_maxrss = run->ru_maxrss;
+    }
+}
+
+/* Build script (then the training command, when instrumenting) at one stage */
+static int build_stage(const char *dir, const char *prefix, const struct manifest *m,
+                       const struct build_profile *p, int stage, const char *pgo_dir,
+                       struct build_log *log, struct rusage *total) {
+    char prefix_var[1100], cflags[2048], ldflags[2048];
+    char cflags_var[2100], cxxflags_var[2100], ldflags_var[2100], profile_var[64];
+    char *vars[] = { prefix_var, cflags_var, cxxflags_var, ldflags_var, profile_var, NULL };
+    struct rusage usage;
+
+    profile_flags(p, stage, pgo_dir, cflags, sizeof(cflags), ldflags, sizeof(ldflags));
+    snprintf(prefix_var, sizeof(prefix_var), "PREFIX=%s", prefix);
+    snprintf(cflags_var, sizeof(cflags_var), "CFLAGS=%s", cflags);
+    snprintf(cxxflags_var, sizeof(cxxflags_var), "CXXFLAGS=%s", cflags);
+    snprintf(ldflags_var, sizeof(ldflags_var), "LDFLAGS=%s", ldflags);
+    snprintf(profile_var, sizeof(profile_var), "TINYPKG_PROFILE=%s", p->name);
+
+    memset(&usage, 0, sizeof(usage));
+    if (run_script(dir, m->build_script, vars,
+                   stage == PROFILE_INSTRUMENT ? "build (instrumented)" :
+                   stage == PROFILE_OPTIMIZE ? "build (optimized)" : "build",
+                   log, &usage) != 0) {
+        return -1;
+    }
+    add_usage(total, &usage);
+
+    if (stage == PROFILE_INSTRUMENT) {
+        printf("Training %s...\n", m->name);
+        memset(&usage, 0, sizeof(usage));
+        if (run_script(dir, m->train_script, vars, "train", log, &usage) != 0) {
+            return -1;
+        }
+        add_usage(total, &usage);
+    }
+    return 0;
+}
+
+/* Unpack a fresh tree for the optimizing stage; the old one has its objects */
+static int refresh_tree(const char *name) {
+    char dir[1100];
+    struct dirent *de;
+    DIR *d;
+    int ret = 0;
+
+    snprintf(dir, sizeof(dir), "%s/%s", get_build_dir(), name);
+    d = opendir(dir);
+    if (!d) {
+        return -1;
+    }
+    while ((de = readdir(d)) != NULL) {
+        char child[2200];
+
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0 ||
+            strcmp(de->d_name, "source.tar.gz") == 0) {
+            continue;
+        }
+        snprintf(child, sizeof(child), "%s/%s", dir, de->d_name);
+        if (remove_tree(child) != 0) {
+            ret = -1;
+        }
+    }
+    closedir(d);
+
+    return ret == 0 ? unpack_source(name, 1) : -1;
+}
+
+int execute_build(const char *name, struct manifest *m) {
+    char *home = get_home_dir();
+    char pkg_dir[1100];
+    char prefix[1024];
+    char pgo_dir[1024];
+    const struct build_profile *p = profile_find(m->profile);
+    struct build_sample sample;
+    struct build_log log;
+    struct rusage usage;
+    double start;
+    int in_ram;
+
+    if (!get_build_dir() || !home) return -1;
+
+    /* The prefix is always persistent; only the tree may be in RAM */
+    in_ram = tree_dir(name, pkg_dir, sizeof(pkg_dir));
+    snprintf(prefix, sizeof(prefix), "%s/.cache/tinypkg/%s/PKG", home, name);
+    snprintf(pgo_dir, sizeof(pgo_dir), "%s/.cache/tinypkg/%s/%s", home, name, PROFILE_PGO_DIR);
+
+    if (!p) {
+        p = profile_find(PROFILE_DEFAULT);
+    }
+    if (p->trained && !m->train_script[0]) {
+        fprintf(stderr, "Warning: %s has no train: command, building with lto\n", name);
+        p = profile_find("lto");
+    }
+
+    /* Store mode: start from an empty prefix, never write into shared objects */
+    if (store_enabled() && store_release(name) != 0) {
+        fprintf(stderr, "Error: Failed to clear previous prefix\n");
+        return -1;
+    }
+
+    /* Create PKG (installation prefix) directory with parents */
+    if (mkdir_p(prefix) != 0) {
+        fprintf(stderr, "Error: Failed to create prefix directory\n");
+        return -1;
+    }
+
+    if (log_open(&log, name) != 0) {
+        return -1;
+    }
+
+    printf("Building %s (%s)%s...\n", name, p->name, in_ram ? " in RAM" : "");
+
+    /* Execute build script with PREFIX and the profile's flags set */
+    start = phase_clock();
+    memset(&usage, 0, sizeof(usage));
+    if (p->trained) {
+        /* Stage 1 writes profile data from the training run to pgo/ */
+        if (remove_tree(pgo_dir) != 0 || mkdir_p(pgo_dir) != 0 ||
+            build_stage(pkg_dir, prefix, m, p, PROFILE_INSTRUMENT, pgo_dir, &log, &usage) != 0) {
+            goto failed;
+        }
+
+        /* Stage 2 rebuilds from scratch into an empty prefix */
+        printf("Rebuilding %s with profile data...\n", name);
+        if (remove_tree(prefix) != 0 || mkdir_p(prefix) != 0 || refresh_tree(name) != 0) {
+            fprintf(stderr, "Error: Failed to reset the tree for the optimized build\n");
+            log_close(&log);
+            return -1;
+        }
+        in_ram = tree_dir(name, pkg_dir, sizeof(pkg_dir));
+        if (build_stage(pkg_dir, prefix, m, p, PROFILE_OPTIMIZE, pgo_dir, &log, &usage) != 0) {
+            goto failed;
+        }
+    } else if (build_stage(pkg_dir, prefix, m, p, PROFILE_SINGLE, NULL, &log, &usage) != 0) {
+        goto failed;
+    }
+
+    /* Wall and CPU time, peak RSS (kB) and tree size shape later runs */
+    memset(&sample, 0, sizeof(sample));
+    sample.wall_ms = phase_clock() - start;
+    sample.cpu_ms = usage.ru_utime.tv_sec * 1000.0 + usage.ru_utime.tv_usec / 1000.0 +
+                    usage.ru_stime.tv_sec * 1000.0 + usage.ru_stime.tv_usec / 1000.0;
+    sample.source_bytes = (long long)gc_usage(GC_KIND_SOURCE, name);
+    sample.peak_kb = usage.ru_maxrss;
+    sample.tree_bytes = in_ram ? (long long)gc_path_usage(pkg_dir)
+                               : (long long)gc_usage(GC_KIND_BUILD, name);
+    sched_record(name, m->version, &sample);
+
+    /* The profile is part of what identifies the artifact */
+    profile_record_built(name, m->version, p->name);
+
+    /* Nothing is kept in RAM past the build */
+    if (in_ram) {
+        ram_remove(name);
+    }
+
+    printf("✓ Build complete: %s/bin/%s (log: %s)\n", prefix, name, log.path);
+    log_close(&log);
+    return 0;
+
+failed:
+    log_close(&log);
+
+    /* Out of tmpfs space: the tree grew past its estimate, spill to disk */
+    if (in_ram && free_bytes(ram_root) < BUILD_RAM_FULL_BYTES) {
+        fprintf(stderr, "Warning: %s filled %s, rebuilding on disk\n", name, ram_root);
+        ram_remove(name);
+        if (unpack_source(name, 0) == 0) {
+            return execute_build(name, m);
+        }
+    }
+    fprintf(stderr, "Error: Build failed\n");
+    return -1;
+}
+
+/* ============================================================================
+ * Phase 5: Execute Install
+ * ============================================================================
+ */
+
+int execute_install(const char *name) {
+    char *tinypkg_dir = get_tinypkg_dir();
+    char *local_bin = get_local_bin();
+    char pkg_bin[1024];
+    char install_bin[1024];
+    char cmd[4096];
+    char version[64], profile[32];
+    struct stat st;
+
+    if (!tinypkg_dir || !local_bin) return -1;
+
+    /* Installed from the PKG prefix that execute_build populated */
+    snprintf(pkg_bin, sizeof(pkg_bin),
+             "%s/%s/PKG/bin/%s", tinypkg_dir, name, name);
+    snprintf(install_bin, sizeof(install_bin), "%s/%s", local_bin, name);
+
+    /* Check if binary was built */
+    if (stat(pkg_bin, &st) != 0) {
+        fprintf(stderr, "Error: Package not built. Run 'tinypkg build %s' first\n", name);
+        return -1;
+    }
+
+    /* Create ~/.local/bin if it doesn't exist */
+    if (mkdir_p(local_bin) != 0) {
+        fprintf(stderr, "Error: Failed to create local bin directory\n");
+        return -1;
+    }
+
+    printf("Installing %s to %s...\n", name, install_bin);
+
+    /* Store mode: share the object's blocks, never its inode */
+    if (store_enabled() && store_clone_file(pkg_bin, install_bin) == 0) {
+        chmod(install_bin, 0755);
+        printf("Cloned %s from store\n", name);
+    } else {
+        /* Copy binary */
+        snprintf(cmd, sizeof(cmd), "cp %s %s", pkg_bin, install_bin);
+        if (system(cmd) != 0) {
+            fprintf(stderr, "Error: Failed to copy binary\n");
+            return -1;
+        }
+
+        /* Make executable */
+        chmod(install_bin, 0755);
+    }
+
+    gc_touch(GC_KIND_ARTIFACT, name);
+
+    /* Track installation, with what the prefix was built as */
+    if (profile_built(name, version, sizeof(version), profile, sizeof(profile)) != 0) {
+        snprintf(version, sizeof(version), "unknown");
+        snprintf(profile, sizeof(profile), "%s", PROFILE_DEFAULT);
+    }
+    if (track_installation(name, version, profile) != 0) {
+        fprintf(stderr, "Warning: Could not track installation\n");
+    }
+
+    printf("✓ Installed to %s\n", install_bin);
+    return 0;
+}
+
+/* ============================================================================
+ * Phase 6: Track Installation
+ * ============================================================================
+ */
+
+/* Lines held back between track_begin() and track_commit() */
+static pthread_mutex_t track_lock = PTHREAD_MUTEX_INITIALIZER;
+static char **track_pending;
+static size_t track_count;
+static int track_deferred;
+
+void track_begin(void) {
+    pthread_mutex_lock(&track_lock);
+    track_deferred = 1;
+    pthread_mutex_unlock(&track_lock);
+}
+
+int track_commit(void) {
+    char *tinypkg_dir = get_tinypkg_dir();
+    char db_path[1024];
+    char tmp_path[1024];
+    char line[256];
+    FILE *in, *out;
+    int ret = 0;
+
+    pthread_mutex_lock(&track_lock);
+    track_deferred = 0;
+
+    if (track_count == 0) {
+        pthread_mutex_unlock(&track_lock);
+        return 0;
+    }
+
+    snprintf(db_path, sizeof(db_path), "%s/installed.db", tinypkg_dir);
+    snprintf(tmp_path, sizeof(tmp_path), "%s/temp.db", tinypkg_dir);
+
+    /* Every other package's entry as it was, then the whole batch */
+    out = fopen(tmp_path, "w");
+    if (!out) {
+        perror("fopen");
+        ret = -1;
+    } else {
+        in = fopen(db_path, "r");
+        while (in && fgets(line, sizeof(line), in)) {
+            char pkg[128] = {0};
+            int replaced = 0;
+
+            sscanf(line, "%127s", pkg);
+            for (size_t i = 0; i < track_count && !replaced; i++) {
+                size_t len = strcspn(track_pending[i], " ");
+                replaced = strlen(pkg) == len && strncmp(track_pending[i], pkg, len) == 0;
+            }
+            if (!replaced) {
+                fputs(line, out);
+            }
+        }
+        if (in) {
+            fclose(in);
+        }
+        for (size_t i = 0; i < track_count; i++) {
+            fputs(track_pending[i], out);
+        }
+        if (fclose(out) != 0 || rename(tmp_path, db_path) != 0) {
+            perror("installed.db");
+            unlink(tmp_path);
+            ret = -1;
+        }
+    }
+
+    for (size_t i = 0; i < track_count; i++) {
+        free(track_pending[i]);
+    }
+    free(track_pending);
+    track_pending = NULL;
+    track_count = 0;
+    pthread_mutex_unlock(&track_lock);
+    return ret;
+}
+
+int track_installation(const char *name, const char *version, const char *profile) {
+    char *tinypkg_dir = get_tinypkg_dir();
+    char db_path[1024];
+    char entry[256];
+    FILE *f;
+
+    if (!tinypkg_dir) return -1;
+
+    snprintf(entry, sizeof(entry), "%s %s %s\n", name, version ? version : "unknown",
+             profile ? profile : PROFILE_DEFAULT);
+
+    /* Batched: written by track_commit() */
+    pthread_mutex_lock(&track_lock);
+    if (track_deferred) {
+        char **grown = realloc(track_pending, (track_count + 1) * sizeof(*grown));
+        int ret = -1;
+
+        if (grown) {
+            track_pending = grown;
+            track_pending[track_count] = strdup(entry);
+            if (track_pending[track_count]) {
+                track_count++;
+                ret = 0;
+            }
+        }
+        pthread_mutex_unlock(&track_lock);
+        return ret;
+    }
+    pthread_mutex_unlock(&track_lock);
+
+    /* Create ~/.tinypkg if needed */
+    if (mkdir_p(tinypkg_dir) != 0) {
+        fprintf(stderr, "Error: Failed to create tinypkg directory\n");
+        return -1;
+    }
+
+    snprintf(db_path, sizeof(db_path), "%s/installed.db", tinypkg_dir);
+
+    /* Append to installed.db */
+    f = fopen(db_path, "a");
+    if (!f) {
+        perror("fopen");
+        return -1;
+    }
+
+    fputs(entry, f);
+    fclose(f);
+
+    return 0;
+}
+
+/* ============================================================================
+ * Check if Package is Installed
+ * ============================================================================
+ */
+
+int is_installed(const char *name) {
+    char *tinypkg_dir = get_tinypkg_dir();
+    char db_path[1024];
+    FILE *f;
+    char line[256];
+
+    if (!tinypkg_dir) return 0;
+
+    snprintf(db_path, sizeof(db_path), "%s/installed.db", tinypkg_dir);
+
+    f = fopen(db_path, "r");
+    if (!f) return 0;  /* Not installed */
+
+    while (fgets(line, sizeof(line), f)) {
+        char pkg[128] = {0};
+        sscanf(line, "%127s", pkg);
+        if (strcmp(pkg, name) == 0) {
+            fclose(f);
+            return 1;  /* Installed */
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
+
+/* ============================================================================
+ * Phase 7: Remove Package
+ * ============================================================================
+ */
+
+int remove_package_impl(const char *name) {
+    char *local_bin = get_local_bin();
+    char *tinypkg_dir = get_tinypkg_dir();
+    char binary_path[1024];
+    char db_path[1024];
+    char tmp_path[1024];
+    FILE *in, *out;
+    char line[256];
+    int found = 0;
+
+    if (!local_bin || !tinypkg_dir) return -1;
+
+    snprintf(binary_path, sizeof(binary_path), "%s/%s", local_bin, name);
+    snprintf(db_path, sizeof(db_path), "%s/installed.db", tinypkg_dir);
+    snprintf(tmp_path, sizeof(tmp_path), "%s/temp.db", tinypkg_dir);
+
+    /* Remove binary */
+    if (unlink(binary_path) == 0) {
+        printf("✓ Removed %s\n", binary_path);
+    } else {
+        fprintf(stderr, "Warning: Could not remove %s\n", binary_path);
+    }
+
+    /* Update database (remove entry) */
+    in = fopen(db_path, "r");
+    out = fopen(tmp_path, "w");
+
+    if (in && out) {
+        while (fgets(line, sizeof(line), in)) {
+            char pkg[128] = {0};
+            sscanf(line, "%127s", pkg);
+            if (strcmp(pkg, name) != 0) {
+                fputs(line, out);
+            } else {
+                found = 1;
+            }
+        }
+        fclose(in);
+        fclose(out);
+
+        if (found) {
+            rename(tmp_path, db_path);
+        } else {
+            unlink(tmp_path);
+        }
+    }
+
+    printf("✓ %s uninstalled\n", name);
+    return 0;
+}
+
+/* ============================================================================
+ * Phase Stamps
+ * ============================================================================
+ *
+ * <cache>/<name>/stamps records, for each phase that completed, a hash of
+ * what it was given: the URLs and checksum for the download, the
+ * tarball's sha256 for the extraction, and for the build that hash with
+ * the version, scripts, profile, strip and store settings and compiler
+ * variables. A rerun starts at the first phase whose inputs differ or
+ * whose output is gone, so a build that failed compiles again in the tree
+ * it left, and one whose inputs are unchanged is not redone at all.
+ */
+
+enum stamp_phase { STAMP_DOWNLOAD, STAMP_EXTRACT, STAMP_BUILD, STAMP_DONE };
+
+static const char *const stamp_names[] = { "download", "extract", "build" };
+
+/* Variables besides the profile that change what a build script produces */
+static const char *const stamp_env[] = {
+    "CC", "CXX", "CPPFLAGS", "CFLAGS", "CXXFLAGS", "LDFLAGS", "PKG_CONFIG_PATH", NULL
+};
+
+struct stamps {
+    char key[STAMP_DONE][SHA256_HEX_LEN];   /* Empty if the phase is not done */
+    int tree_on_disk;                       /* Not extracted into RAM */
+};
+
+static int force_mode;
+
+void build_force(int enable) {
+    force_mode = enable;
+}
+
+static void stamp_path(const char *name, char *path, size_t len) {
+    snprintf(path, len, "%s/%s/%s", get_tinypkg_dir(), name, BUILD_STAMP_FILE);
+}
+
+static void stamp_load(const char *name, struct stamps *st) {
+    char path[1100], line[256], phase[32], key[SHA256_HEX_LEN], where[16];
+    FILE *f;
+
+    memset(st, 0, sizeof(*st));
+    stamp_path(name, path, sizeof(path));
+    f = fopen(path, "r");
+    if (!f) return;
+
+    if (!fgets(line, sizeof(line), f) || strcmp(line, BUILD_STAMP_MAGIC "\n") != 0) {
+        fclose(f);
+        return;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        where[0] = '\0';
+        if (sscanf(line, "%31s %64s %15s", phase, key, where) < 2 ||
+            strlen(key) != SHA256_HEX_LEN - 1) {
+            continue;
+        }
+        for (int p = 0; p < STAMP_DONE; p++) {
+            if (strcmp(phase, stamp_names[p]) == 0) {
+                memcpy(st->key[p], key, SHA256_HEX_LEN);
+            }
+        }
+        if (strcmp(phase, stamp_names[STAMP_EXTRACT]) == 0) {
+            st->tree_on_disk = strcmp(where, "disk") == 0;
+        }
+    }
+    fclose(f);
+}
+
+static void stamp_save(const char *name, const struct stamps *st) {
+    char dir[1100], path[1100], tmp[1200];
+    FILE *f;
+
+    snprintf(dir, sizeof(dir), "%s/%s", get_tinypkg_dir(), name);
+    stamp_path(name, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if (mkdir_p(dir) != 0) return;
+
+    f = fopen(tmp, "w");
+    if (!f) {
+        perror(tmp);
+        return;
+    }
+    fprintf(f, "%s\n", BUILD_STAMP_MAGIC);
+    for (int p = 0; p < STAMP_DONE; p++) {
+        if (st->key[p][0]) {
+            fprintf(f, "%s %s%s\n", stamp_names[p], st->key[p],
+                    p == STAMP_EXTRACT ? (st->tree_on_disk ? " disk" : " ram") : "");
+        }
+    }
+    if (fclose(f) != 0 || rename(tmp, path) != 0) {
+        perror(path);
+        unlink(tmp);
+    }
+}
+
+/* Fields are hashed with their terminating NUL, so none can run into the next */
+static void stamp_field(struct sha256_ctx *ctx, const char *value) {
+    sha256_update(ctx, value, strlen(value) + 1);
+}
+
+static void stamp_final(struct sha256_ctx *ctx, char hex[SHA256_HEX_LEN]) {
+    uint8_t digest[SHA256_DIGEST_LEN];
+
+    sha256_final(ctx, digest);
+    sha256_to_hex(digest, hex);
+}
+
+static void stamp_download_key(const struct manifest *m, char hex[SHA256_HEX_LEN]) {
+    struct sha256_ctx ctx;
+
+    sha256_init(&ctx);
+    stamp_field(&ctx, m->source);
+    for (int i = 0; i < m->mirror_count; i++) {
+        stamp_field(&ctx, m->mirrors[i]);
+    }
+    stamp_field(&ctx, m->checksum);
+    stamp_final(&ctx, hex);
+}
+
+static void stamp_build_key(const struct manifest *m, const char *tarball,
+                            char hex[SHA256_HEX_LEN]) {
+    struct sha256_ctx ctx;
+    char setting[64];
+
+    sha256_init(&ctx);
+    stamp_field(&ctx, tarball);
+    stamp_field(&ctx, m->version);
+    stamp_field(&ctx, m->build_script);
+    stamp_field(&ctx, m->train_script);
+    stamp_field(&ctx, m->profile);
+    snprintf(setting, sizeof(setting), "strip=%d store=%d", strip_mode(), store_enabled());
+    stamp_field(&ctx, setting);
+    for (int i = 0; stamp_env[i]; i++) {
+        const char *value = getenv(stamp_env[i]);
+
+        stamp_field(&ctx, stamp_env[i]);
+        stamp_field(&ctx, value ? value : "");
+    }
+    stamp_final(&ctx, hex);
+}
+
+/* Whether build/<name>/ holds an extracted tree and not only the tarball */
+static int tree_extracted(const char *name) {
+    char dir[1100];
+    struct dirent *e;
+    DIR *d;
+    int found = 0;
+
+    snprintf(dir, sizeof(dir), "%s/%s", get_build_dir(), name);
+    d = opendir(dir);
+    if (!d) return 0;
+    while (!found && (e = readdir(d))) {
+        found = strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0 &&
+                strncmp(e->d_name, "source.tar.gz", 13) != 0;
+    }
+    closedir(d);
+    return found;
+}
+
+/* Whether the prefix is still there (the cache may have evicted it) */
+static int prefix_built(const char *name) {
+    char dir[1100], version[64], profile[32];
+    struct stat st;
+
+    snprintf(dir, sizeof(dir), "%s/%s/PKG", get_tinypkg_dir(), name);
+    return stat(dir, &st) == 0 && S_ISDIR(st.st_mode) &&
+           profile_built(name, version, sizeof(version), profile, sizeof(profile)) == 0;
+}
+
+/*
+ * The first phase to run, STAMP_DONE if none. Stamps from there on are
+ * dropped before it runs, so a run that fails keeps only what it finished.
+ */
+static int stamp_resume(const char *name, const struct manifest *m, struct stamps *st) {
+    char key[SHA256_HEX_LEN], hex[SHA256_HEX_LEN], tarball[1100];
+    int from, had = 0;
+
+    stamp_load(name, st);
+    stamp_download_key(m, key);
+    if (source_path(name, tarball, sizeof(tarball)) != 0) {
+        tarball[0] = '\0';
+    }
+
+    if (force_mode || strcmp(st->key[STAMP_DOWNLOAD], key) != 0 || !tarball[0]) {
+        from = STAMP_DOWNLOAD;
+    } else if (!st->key[STAMP_EXTRACT][0]) {
+        from = access(tarball, F_OK) == 0 ? STAMP_EXTRACT : STAMP_DOWNLOAD;
+    } else {
+        /* An unchanged prefix needs neither the tarball nor the tree */
+        stamp_build_key(m, st->key[STAMP_EXTRACT], key);
+        if (strcmp(st->key[STAMP_BUILD], key) == 0 && prefix_built(name)) {
+            from = STAMP_DONE;
+        } else if (access(tarball, F_OK) != 0) {
+            from = STAMP_DOWNLOAD;
+        } else if (sha256_file(tarball, hex) != 0 || strcmp(hex, st->key[STAMP_EXTRACT]) != 0 ||
+                   !st->tree_on_disk || !tree_extracted(name)) {
+            from = STAMP_EXTRACT;
+        } else {
+            from = STAMP_BUILD;
+        }
+    }
+
+    for (int p = from; p < STAMP_DONE; p++) {
+        had |= st->key[p][0] != '\0';
+        st->key[p][0] = '\0';
+    }
+    if (had) {
+        stamp_save(name, st);
+    }
+    return from;
+}
+
+/* Record that a phase completed with the current inputs */
+static void stamp_done(const char *name, const struct manifest *m, struct stamps *st,
+                       int phase) {
+    char path[1100];
+
+    switch (phase) {
+    case STAMP_DOWNLOAD:
+        stamp_download_key(m, st->key[STAMP_DOWNLOAD]);
+        break;
+    case STAMP_EXTRACT:
+        if (source_path(name, path, sizeof(path)) != 0 ||
+            sha256_file(path, st->key[STAMP_EXTRACT]) != 0) {
+            return;
+        }
+        st->tree_on_disk = !tree_dir(name, path, sizeof(path));
+        break;
+    default:
+        if (!st->key[STAMP_EXTRACT][0]) {
+            return;
+        }
+        stamp_build_key(m, st->key[STAMP_EXTRACT], st->key[STAMP_BUILD]);
+        break;
+    }
+    stamp_save(name, st);
+}
+
+static void stamp_print_current(const char *name, const struct manifest *m) {
+    printf("✓ %s %s is up to date (build --force rebuilds it)\n", name, m->version);
+}
+
+/* ============================================================================
+ * Main Entry Points
+ * ============================================================================
+ */
+
+/* Steps 4-5 for a package whose source is already extracted */
+static int build_extracted(const char *name, struct manifest *m, struct stamps *st) {
+    double t;
+
+    /* Step 4: Build */
+    t = phase_clock();
+    if (execute_build(name, m) != 0) {
+        gc_record(GC_KIND_BUILD, name);
+        return -1;
+    }
+    phase_record(name, "build", t);
+
+    /* Optionally strip the prefix, before the store shares its files */
+    if (strip_mode() != STRIP_OFF) {
+        struct strip_stats stats;
+
+        t = phase_clock();
+        strip_package(name, &stats);
+        strip_print_stats(name, &stats);
+        phase_record(name, "strip", t);
+    }
+
+    /* Step 5: Optionally deduplicate the prefix into the object store */
+    if (store_enabled()) {
+        t = phase_clock();
+        if (store_ingest(name) != 0) {
+            fprintf(stderr, "Warning: Store deduplication incomplete for %s\n", name);
+        }
+        phase_record(name, "store", t);
+    }
+
+    stamp_done(name, m, st, STAMP_BUILD);
+    return 0;
+}
+
+/* Steps 3-6 for a package whose source is already downloaded */
+static int build_downloaded(const char *name, struct manifest *m, double start,
+                            struct stamps *st, int from) {
+    double t;
+
+    /* Step 3: Extract, unless the tree left by the last run is still current */
+    if (from <= STAMP_EXTRACT) {
+        t = phase_clock();
+        if (extract_tarball(name) != 0) {
+            return -1;
+        }
+        phase_record(name, "extract", t);
+        stamp_done(name, m, st, STAMP_EXTRACT);
+    } else {
+        printf("✓ Continuing in %s/%s/\n", get_build_dir(), name);
+    }
+
+    /* Steps 4-5 */
+    if (build_extracted(name, m, st) != 0) {
+        return -1;
+    }
+
+    /* Step 6: Account for the new trees and enforce the cache budget */
+    t = phase_clock();
+    gc_record(GC_KIND_BUILD, name);
+    gc_record(GC_KIND_ARTIFACT, name);
+    gc_auto_except(&name, 1);
+    phase_record(name, "gc", t);
+    phase_record(name, "total", start);
+
+    return 0;
+}
+
+/* ============================================================================
+ * Prefetch Pipeline
+ * ============================================================================
+ *
+ * build_packages() runs up to 'jobs' builds at once while a worker
+ * downloads and extracts the packages next in line, so the network and the
+ * CPU are both busy and the total approaches max(download, build) rather
+ * than their sum. Packages are started in the order sched_plan() chose,
+ * each once the requested packages it depends on are built. The worker
+ * stays at most depth packages past the furthest one started and stops
+ * early while the trees it prepared take more than the disk budget.
+ *
+ * A build also waits while it would not fit in memory: its recorded peak
+ * RSS plus a margin must fit in what is available now and, together with
+ * the needs of the builds already running (which may not have peaked
+ * yet), in what was available when the run began. Nothing new starts
+ * while memory pressure (PSI) is high. One build always runs.
+ *
+ * Garbage is collected after a build only while no other build runs and
+ * the worker is idle, and nothing starts until it is done, so eviction
+ * never races an extraction or a tree in use. Otherwise the collection
+ * waits for a later package or the end of the run.
+ */
+
+enum prefetch_state { PREFETCH_PENDING, PREFETCH_READY, PREFETCH_FAILED };
+enum build_state { BUILD_WAITING, BUILD_RUNNING, BUILD_DONE, BUILD_FAILED };
+
+struct prefetch {
+    char *const *names;                 /* In build order */
+    struct manifest *m;
+    int count;
+    int depth;
+    unsigned long long disk_budget;
+    unsigned long long rate;            /* Bytes per second, 0 if unlimited */
+    int **deps;                         /* Positions that must be built first */
+    int *ndeps;
+    long long *need;                    /* sched_need() of each build */
+    long long mem_base;                 /* Available when the run began, -1 if unknown */
+    struct stamps *stamps;
+    int *from;                          /* First phase to run, see stamp_resume() */
+    double start;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int *state;
+    unsigned long long *bytes;          /* Disk used once ready */
+    int *build;                         /* enum build_state */
+    int building;                       /* Furthest position a builder took */
+    int running;                        /* Builds in progress */
+    long long reserved;                 /* Sum of their needs */
+    char *held;                         /* Already reported as held back */
+    int failed;
+    int busy;                           /* Worker is downloading or extracting */
+    int paused;                         /* Garbage collections in progress */
+    int deferred;                       /* A collection was skipped */
+    int stop;
+};
+
+static unsigned long long env_size(const char *name, unsigned long long fallback) {
+    const char *val = getenv(name);
+    unsigned long long size;
+
+    if (val && *val && gc_parse_size(val, &size) == 0) {
+        return size;
+    }
+    return fallback;
+}
+
+/* Disk held by packages prepared but not yet being built (lock held) */
+static unsigned long long prefetch_held(const struct prefetch *pf) {
+    unsigned long long held = 0;
+
+    for (int i = 0; i < pf->count; i++) {
+        if (pf->state[i] == PREFETCH_READY && pf->build[i] == BUILD_WAITING) {
+            held += pf->bytes[i];
+        }
+    }
+    return held;
+}
+
+static void prefetch_set(struct prefetch *pf, int i, int state, unsigned long long bytes) {
+    pthread_mutex_lock(&pf->lock);
+    pf->state[i] = state;
+    pf->bytes[i] = bytes;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+}
+
+/* Download packages [first, end) in one batch, then extract them in order */
+static void prefetch_batch(struct prefetch *pf, int first, int end) {
+    int n = end - first;
+    struct fetch_job jobs[n];
+    char dests[n][1100];
+    char *urls[n][MIRROR_MAX];
+    char cached[n];
+
+    memset(jobs, 0, sizeof(jobs));
+    memset(cached, 0, sizeof(cached));
+    for (int i = 0; i < n; i++) {
+        const char *name = pf->names[first + i];
+
+        if (source_path(name, dests[i], sizeof(dests[i])) != 0) {
+            continue;
+        }
+        pf->from[first + i] = stamp_resume(name, &pf->m[first + i], &pf->stamps[first + i]);
+        if (pf->from[first + i] == STAMP_EXTRACT) {
+            metrics_add(METRIC_CACHE_HITS, "source", 1);
+        }
+        if (pf->from[first + i] > STAMP_DOWNLOAD) {
+            jobs[i].dest = dests[i];
+            cached[i] = 1;
+            continue;
+        }
+        metrics_add(METRIC_CACHE_MISSES, "source", 1);
+        jobs[i].url = pf->m[first + i].source;
+        jobs[i].url_count = source_urls(name, &pf->m[first + i], urls[i]);
+        jobs[i].urls = urls[i];
+        jobs[i].dest = dests[i];
+        jobs[i].checksum = pf->m[first + i].checksum;
+        jobs[i].rate_limit = (long long)(pf->rate / (unsigned long long)n);
+    }
+
+    /* Jobs without a destination, or already here, are left out of the batch */
+    for (int i = 0, j = 0; i <= n; i++) {
+        if (i < n && jobs[i].dest && !cached[i]) {
+            continue;
+        }
+        if (i > j) {
+            fetch_files(&jobs[j], (size_t)(i - j));
+        }
+        j = i + 1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        const char *name = pf->names[first + i];
+        double t;
+
+        free_urls(urls[i], jobs[i].url_count);
+
+        if (!jobs[i].dest || jobs[i].status != 0) {
+            fprintf(stderr, "Error: Failed to download source for %s\n", name);
+            prefetch_set(pf, first + i, PREFETCH_FAILED, 0);
+            continue;
+        }
+        if (!cached[i]) {
+            phase_write(name, "download", jobs[i].stats.seconds * 1000.0);
+            fetch_print_stats(name, &jobs[i].stats);
+        }
+        if (pf->from[first + i] == STAMP_DOWNLOAD) {
+            stamp_done(name, &pf->m[first + i], &pf->stamps[first + i], STAMP_DOWNLOAD);
+        }
+
+        if (pf->from[first + i] <= STAMP_EXTRACT) {
+            t = phase_clock();
+            if (untar_source(name) != 0) {
+                fprintf(stderr, "Error: Failed to extract source for %s\n", name);
+                prefetch_set(pf, first + i, PREFETCH_FAILED, 0);
+                continue;
+            }
+            phase_record(name, "extract", t);
+            stamp_done(name, &pf->m[first + i], &pf->stamps[first + i], STAMP_EXTRACT);
+        }
+
+        prefetch_set(pf, first + i, PREFETCH_READY,
+                     gc_usage(GC_KIND_SOURCE, name) + gc_usage(GC_KIND_BUILD, name));
+    }
+}
+
+static void *prefetch_worker(void *arg) {
+    struct prefetch *pf = arg;
+    int next = 0;
+
+    pthread_mutex_lock(&pf->lock);
+    while (next < pf->count && !pf->stop) {
+        int end, limit;
+
+        /* The package being built is always fetched; later ones as allowed */
+        while (!pf->stop &&
+               (pf->paused || next > pf->building + pf->depth ||
+                (next > pf->building && prefetch_held(pf) >= pf->disk_budget))) {
+            pthread_cond_wait(&pf->cond, &pf->lock);
+        }
+        if (pf->stop) {
+            break;
+        }
+
+        /* Packages builders wait for go together; otherwise fill the window */
+        limit = next <= pf->building ? pf->building : pf->building + pf->depth;
+        end = next + 1;
+        while (end < pf->count && end <= limit && end - next < FETCH_MAX_PARALLEL) {
+            end++;
+        }
+
+        pf->busy = 1;
+        pthread_mutex_unlock(&pf->lock);
+
+        prefetch_batch(pf, next, end);
+
+        pthread_mutex_lock(&pf->lock);
+        pf->busy = 0;
+        next = end;
+        pthread_cond_broadcast(&pf->cond);
+    }
+    pthread_mutex_unlock(&pf->lock);
+    return NULL;
+}
+
+/* Step 6 inside the pipeline; skipped while anything else is in flight */
+static void prefetch_gc(struct prefetch *pf, int built) {
+    const char *name = pf->names[built];
+
+    gc_record(GC_KIND_BUILD, name);
+    gc_record(GC_KIND_ARTIFACT, name);
+
+    pthread_mutex_lock(&pf->lock);
+    if (pf->busy || pf->running > 0) {
+        pf->deferred = 1;
+        pthread_mutex_unlock(&pf->lock);
+        return;
+    }
+    pf->paused++;
+    pthread_mutex_unlock(&pf->lock);
+
+    /* Nothing starts until unpaused, so states are stable here */
+
+    /* Prepared trees count as just used, so they are evicted last */
+    for (int i = 0; i < pf->count; i++) {
+        if (pf->state[i] == PREFETCH_READY && pf->build[i] == BUILD_WAITING) {
+            gc_record(GC_KIND_SOURCE, pf->names[i]);
+            gc_record(GC_KIND_BUILD, pf->names[i]);
+        }
+    }
+    /* The batch is installed after it is built (restore): keep all of it */
+    gc_auto_except((const char *const *)pf->names, pf->count);
+
+    pthread_mutex_lock(&pf->lock);
+    pf->paused--;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+}
+
+/* Whether memory allows package i to start now (lock held) */
+static int builder_admit(struct prefetch *pf, int i) {
+    long long avail;
+    double psi;
+
+    if (pf->running == 0) {
+        return 1;
+    }
+
+    psi = sched_mem_pressure();
+    if (psi > ADMIT_PSI_LIMIT) {
+        if (!pf->held[i]) {
+            printf("Holding %s: memory pressure %.1f%%\n", pf->names[i], psi);
+            pf->held[i] = 1;
+        }
+        return 0;
+    }
+
+    avail = sched_mem_available();
+    if ((avail >= 0 && pf->need[i] > avail) ||
+        (pf->mem_base >= 0 && pf->reserved + pf->need[i] > pf->mem_base)) {
+        if (!pf->held[i]) {
+            printf("Holding %s: needs ~%lld MiB, %lld MiB available, %lld MiB reserved\n",
+                   pf->names[i], pf->need[i] >> 20, avail >> 20, pf->reserved >> 20);
+            pf->held[i] = 1;
+        }
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * First waiting package, in build order, whose dependencies are built and
+ * that fits in memory; packages needing a failed one fail too. *left
+ * counts those still waiting, *held whether memory kept one back. Lock
+ * held.
+ */
+static int builder_pick(struct prefetch *pf, int *left, int *held) {
+    int first = -1;
+
+    *left = 0;
+    *held = 0;
+    for (int i = 0; i < pf->count; i++) {
+        int ready = 1;
+
+        if (pf->build[i] != BUILD_WAITING) {
+            continue;
+        }
+        for (int k = 0; k < pf->ndeps[i] && ready == 1; k++) {
+            int d = pf->deps[i][k];
+
+            if (pf->build[d] == BUILD_FAILED) {
+                fprintf(stderr, "Error: %s not built, it needs %s\n",
+                        pf->names[i], pf->names[d]);
+                pf->build[i] = BUILD_FAILED;
+                pf->failed++;
+                ready = -1;
+            } else if (pf->build[d] != BUILD_DONE) {
+                ready = 0;
+            }
+        }
+        if (ready == 1 && builder_admit(pf, i)) {
+            return i;
+        }
+        if (ready == 1) {
+            *held = 1;
+        }
+        if (ready >= 0) {
+            (*left)++;
+            if (ready == 0 && first < 0) first = i;
+        }
+    }
+
+    /* Blocked with nothing running: only a dependency cycle does that */
+    return pf->running == 0 && !*held ? first : -1;
+}
+
+/* Wait for a state change, or until ms pass (lock held) */
+static void builder_wait(struct prefetch *pf, long ms) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&pf->cond, &pf->lock, &ts);
+}
+
+/* Steps 4-5 for a prepared package */
+static int build_prepared(struct prefetch *pf, int i) {
+    if (pf->from[i] == STAMP_DONE) {
+        stamp_print_current(pf->names[i], &pf->m[i]);
+        return 0;
+    }
+    printf("\n=== Building %s %s ===\n\n", pf->names[i], pf->m[i].version);
+    gc_record(GC_KIND_SOURCE, pf->names[i]);
+    if (pf->from[i] == STAMP_BUILD) {
+        printf("✓ Continuing in %s/%s/\n", get_build_dir(), pf->names[i]);
+    }
+    return build_extracted(pf->names[i], &pf->m[i], &pf->stamps[i]);
+}
+
+static void *builder(void *arg) {
+    struct prefetch *pf = arg;
+
+    pthread_mutex_lock(&pf->lock);
+    for (;;) {
+        const char *name;
+        double t;
+        int i, left, held, state, ret;
+
+        if (pf->paused) {
+            pthread_cond_wait(&pf->cond, &pf->lock);
+            continue;
+        }
+        i = builder_pick(pf, &left, &held);
+        if (i < 0 && left == 0) {
+            break;
+        }
+        if (i < 0) {
+            /* Memory is polled; everything else is signalled */
+            if (held) {
+                builder_wait(pf, ADMIT_RECHECK_MS);
+            } else {
+                pthread_cond_wait(&pf->cond, &pf->lock);
+            }
+            continue;
+        }
+
+        name = pf->names[i];
+        pf->build[i] = BUILD_RUNNING;
+        pf->running++;
+        pf->reserved += pf->need[i];
+        if (i > pf->building) {
+            pf->building = i;
+        }
+        pthread_cond_broadcast(&pf->cond);
+
+        t = phase_clock();
+        while (pf->state[i] == PREFETCH_PENDING) {
+            pthread_cond_wait(&pf->cond, &pf->lock);
+        }
+        state = pf->state[i];
+        pthread_mutex_unlock(&pf->lock);
+        phase_record(name, "wait", t);
+
+        ret = state == PREFETCH_READY ? build_prepared(pf, i) : -1;
+        if (ret != 0) {
+            fprintf(stderr, "Error: %s failed to build\n", name);
+        }
+
+        pthread_mutex_lock(&pf->lock);
+        pf->running--;
+        pf->reserved -= pf->need[i];
+        pf->build[i] = ret == 0 ? BUILD_DONE : BUILD_FAILED;
+        if (ret != 0) {
+            pf->failed++;
+        }
+        pthread_cond_broadcast(&pf->cond);
+        pthread_mutex_unlock(&pf->lock);
+
+        /* Step 6 */
+        if (ret == 0) {
+            t = phase_clock();
+            prefetch_gc(pf, i);
+            phase_record(name, "gc", t);
+            phase_record(name, "total", pf->start);
+        }
+
+        pthread_mutex_lock(&pf->lock);
+    }
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+    return NULL;
+}
+
+/* ============================================================================
+ * Build Order
+ * ============================================================================
+ */
+
+/* Source sizes for estimates: cached tarballs, else HEADs for new packages */
+static void plan_sources(char *const names[], const struct manifest *m,
+                         struct sched_job *plan, int count) {
+    const char **urls = calloc((size_t)count, sizeof(*urls));
+    long long *sizes = calloc((size_t)count, sizeof(*sizes));
+    int *which = calloc((size_t)count, sizeof(*which));
+    int n = 0;
+
+    for (int i = 0; i < count; i++) {
+        char path[1100];
+        struct stat st;
+
+        plan[i].source_bytes = -1;
+        if (source_path(names[i], path, sizeof(path)) == 0 && stat(path, &st) == 0) {
+            plan[i].source_bytes = (long long)st.st_size;
+        } else if (urls && !sched_known(names[i])) {
+            urls[n] = m[i].source;
+            which[n++] = i;
+        }
+    }
+
+    if (n > 0 && sizes && which && fetch_sizes(urls, sizes, (size_t)n) == 0) {
+        for (int k = 0; k < n; k++) {
+            plan[which[k]].source_bytes = sizes[k];
+        }
+    }
+
+    free(urls);
+    free(sizes);
+    free(which);
+}
+
+static void plan_print(const struct sched_job *plan, const int order[], int count,
+                       int jobs, double estimate_ms) {
+    static const char *basis[] = { "", "other version", "source size", "no history" };
+    char when[32];
+
+    sched_format(estimate_ms, when, sizeof(when));
+    printf("Estimated %s with %d at a time:\n", when, jobs);
+
+    for (int k = 0; k < count; k++) {
+        const struct sched_job *j = &plan[order[k]];
+
+        sched_format(j->estimate_ms, when, sizeof(when));
+        printf("  %-24s %-12s %8s  %4.1f cores", j->name, j->version, when, j->cores);
+        if (j->peak_kb > 0) {
+            printf("  %6lld MiB peak", j->peak_kb >> 10);
+        }
+        if (*basis[j->basis]) {
+            printf("  (%s)", basis[j->basis]);
+        }
+        printf("\n");
+    }
+    printf("\n");
+}
+
+int build_package(const char *name) {
     struct manifest m;
+    struct stamps st;
+    double start, t;
+    int from;
 
     if (!name) {
         fprintf(stderr, "Error: package name required\n");
@@ -482,27 +2129,37 @@ int build_package(const char *name) {
     }
 
     printf("=== Building %s ===\n\n", name);
+    start = t = phase_clock();
 
     /* Step 1: Parse manifest */
     if (parse_manifest(name, &m) != 0) {
         return -1;
     }
+    phase_record(name, "parse", t);
 
     printf("Version: %s\n", m.version);
     printf("Source: %s\n\n", m.source);
 
-    /* Step 2: Download source */
-    if (download_source(name, m.source) != 0) {
-        return -1;
+    from = stamp_resume(name, &m, &st);
+    if (from == STAMP_DONE) {
+        stamp_print_current(name, &m);
+        return 0;
     }
 
-    /* Step 3: Extract */
-    if (extract_tarball(name) != 0) {
-        return -1;
+    /* Step 2: Download source */
+    if (from == STAMP_DOWNLOAD) {
+        t = phase_clock();
+        if (download_source(name, &m) != 0) {
+            return -1;
+        }
+        phase_record(name, "download", t);
+        stamp_done(name, &m, &st, STAMP_DOWNLOAD);
+    } else if (from == STAMP_EXTRACT) {
+        metrics_add(METRIC_CACHE_HITS, "source", 1);
     }
 
-    /* Step 4: Build */
-    if (execute_build(name, &m) != 0) {
+    /* Steps 3-6 */
+    if (build_downloaded(name, &m, start, &st, from) != 0) {
         return -1;
     }
 
@@ -511,23 +2168,180 @@ int build_package(const char *name) {
     return 0;
 }
 
+int build_packages(char *const names[], int count, int jobs) {
+    struct prefetch pf;
+    struct manifest *parsed = NULL;
+    struct sched_job *plan = NULL;
+    pthread_t worker, *builders = NULL;
+    char **ordered = NULL;
+    int *order = NULL, *pos = NULL;
+    const char *depth = getenv(PREFETCH_ENV);
+    int started = 0, ret = -1;
+    double estimate_ms;
+    char took[32], estimated[32];
+
+    if (count == 1) {
+        return build_package(names[0]);
+    }
+    if (jobs < 1) jobs = 1;
+    if (jobs > count) jobs = count;
+
+    memset(&pf, 0, sizeof(pf));
+    pf.count = count;
+    pf.depth = (depth && *depth) ? atoi(depth) : PREFETCH_DEPTH;
+    pf.disk_budget = env_size(PREFETCH_DISK_ENV, PREFETCH_DISK_BUDGET);
+    pf.rate = env_size(PREFETCH_RATE_ENV, 0);
+    pf.building = jobs - 1;     /* The first builds start right away */
+    if (pf.depth < 0) pf.depth = 0;
+
+    parsed = calloc((size_t)count, sizeof(*parsed));
+    plan = calloc((size_t)count, sizeof(*plan));
+    order = calloc((size_t)count, sizeof(*order));
+    pos = calloc((size_t)count, sizeof(*pos));
+    ordered = calloc((size_t)count, sizeof(*ordered));
+    builders = calloc((size_t)jobs, sizeof(*builders));
+    pf.m = calloc((size_t)count, sizeof(*pf.m));
+    pf.state = calloc((size_t)count, sizeof(*pf.state));
+    pf.bytes = calloc((size_t)count, sizeof(*pf.bytes));
+    pf.build = calloc((size_t)count, sizeof(*pf.build));
+    pf.deps = calloc((size_t)count, sizeof(*pf.deps));
+    pf.ndeps = calloc((size_t)count, sizeof(*pf.ndeps));
+    pf.need = calloc((size_t)count, sizeof(*pf.need));
+    pf.held = calloc((size_t)count, sizeof(*pf.held));
+    pf.stamps = calloc((size_t)count, sizeof(*pf.stamps));
+    pf.from = calloc((size_t)count, sizeof(*pf.from));
+
+    if (!parsed || !plan || !order || !pos || !ordered || !builders || !pf.m ||
+        !pf.state || !pf.bytes || !pf.build || !pf.deps || !pf.ndeps || !pf.need ||
+        !pf.held || !pf.stamps || !pf.from || !get_build_dir()) {
+        fprintf(stderr, "Error: Out of memory\n");
+        goto out;
+    }
+
+    printf("=== Building %d packages ===\n\n", count);
+    pf.start = phase_clock();
+
+    /* Step 1 for all packages first: nothing starts on a bad manifest */
+    for (int i = 0; i < count; i++) {
+        double t = phase_clock();
+        if (parse_manifest(names[i], &parsed[i]) != 0) {
+            goto out;
+        }
+        phase_record(names[i], "parse", t);
+        plan[i].name = names[i];
+        plan[i].version = parsed[i].version;
+    }
+
+    /* Longest remaining chain first, from past build times */
+    plan_sources(names, parsed, plan, count);
+    pf.mem_base = sched_mem_available();
+    estimate_ms = sched_plan(plan, count, jobs, pf.mem_base, order);
+    plan_print(plan, order, count, jobs, estimate_ms);
+
+    for (int k = 0; k < count; k++) {
+        pos[order[k]] = k;
+    }
+    for (int k = 0; k < count; k++) {
+        struct sched_job *j = &plan[order[k]];
+
+        ordered[k] = names[order[k]];
+        pf.m[k] = parsed[order[k]];
+        for (int d = 0; d < j->ndeps; d++) {
+            j->deps[d] = pos[j->deps[d]];
+        }
+        pf.deps[k] = j->deps;
+        pf.ndeps[k] = j->ndeps;
+        pf.need[k] = sched_need(j);
+    }
+    pf.names = ordered;
+
+    /* Steps 2-3 run on the worker, ahead of the builds */
+    pthread_mutex_init(&pf.lock, NULL);
+    pthread_cond_init(&pf.cond, NULL);
+    if (pthread_create(&worker, NULL, prefetch_worker, &pf) != 0) {
+        fprintf(stderr, "Error: Failed to start prefetching\n");
+        goto out_sync;
+    }
+
+    /* Steps 4-6 on the builders */
+    for (; started < jobs; started++) {
+        if (pthread_create(&builders[started], NULL, builder, &pf) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        builder(&pf);
+    }
+    for (int k = 0; k < started; k++) {
+        pthread_join(builders[k], NULL);
+    }
+
+    pthread_mutex_lock(&pf.lock);
+    pf.stop = 1;
+    pthread_cond_broadcast(&pf.cond);
+    pthread_mutex_unlock(&pf.lock);
+    pthread_join(worker, NULL);
+
+    if (pf.deferred) {
+        gc_auto_except((const char *const *)pf.names, pf.count);
+    }
+
+    sched_format(phase_clock() - pf.start, took, sizeof(took));
+    sched_format(estimate_ms, estimated, sizeof(estimated));
+    if (pf.failed) {
+        fprintf(stderr, "\n%d of %d packages failed\n", pf.failed, count);
+    } else {
+        printf("\n✓ Built %d packages in %s (estimated %s)\n", count, took, estimated);
+        ret = 0;
+    }
+
+out_sync:
+    pthread_cond_destroy(&pf.cond);
+    pthread_mutex_destroy(&pf.lock);
+out:
+    if (plan) sched_free(plan, count);
+    free(parsed);
+    free(plan);
+    free(order);
+    free(pos);
+    free(ordered);
+    free(builders);
+    free(pf.m);
+    free(pf.state);
+    free(pf.bytes);
+    free(pf.build);
+    free(pf.deps);
+    free(pf.ndeps);
+    free(pf.need);
+    free(pf.held);
+    free(pf.stamps);
+    free(pf.from);
+    return ret;
+}
+
 int install_package(const char *name) {
+    double start;
+
     if (!name) {
         fprintf(stderr, "Error: package name required\n");
         return -1;
     }
 
     printf("=== Installing %s ===\n\n", name);
+    start = phase_clock();
 
     if (execute_install(name) != 0) {
         return -1;
     }
+    phase_record(name, "install", start);
 
     printf("\n✓ Installation complete!\n");
     return 0;
 }
 
-int remove_package(const char *name) {
+int remove_package(const char *name, int force) {
+    int dependents;
+
     if (!name) {
         fprintf(stderr, "Error: package name required\n");
         return -1;
@@ -535,6 +2349,16 @@ int remove_package(const char *name) {
 
     printf("=== Removing %s ===\n\n", name);
 
+    /* Refuse to break installed dependents (reverse index lookup) */
+    dependents = index_installed_dependents(name);
+    if (dependents < 0) {
+        fprintf(stderr, "Warning: No package index, skipping dependent check\n");
+    } else if (dependents > 0 && !force) {
+        fprintf(stderr, "Error: %d installed package(s) depend on %s "
+                "(use --force to remove anyway)\n", dependents, name);
+        return -1;
+    }
+
     if (remove_package_impl(name) != 0) {
         return -1;
     }
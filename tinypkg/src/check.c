@@ -0,0 +1,760 @@
+/*
+ * check.c - Manifest validation at sync time
+ *
+ * A manifest used to be read only when something built it, so a missing
+ * source, a malformed checksum or a dependency no manifest provides showed
+ * up halfway through an install. Sync now parses every manifest it
+ * indexes, one thread per CPU, and keeps what it found in
+ * ~/.cache/tinypkg/diagnostics; the same parse is what the derived index is
+ * compiled from. Later syncs recheck only the manifests git reports
+ * changed, carry the rest of the report forward, and redo the cross checks,
+ * which are cheap lookups in the index.
+ *
+ * Checksums are checked for form only: tarballs are not downloaded at sync
+ * time, and fetch verifies them when they are.
+ */
+
+#include "common.h"
+#include "check.h"
+#include "fetch.h"
+#include "sha256.h"
+#include "manifest.h"
+#include <pthread.h>
+#include <stdarg.h>
+
+#define CHECK_MAX_THREADS 16
+
+/* Manifests a worker takes per trip to the pool lock */
+#define CHECK_BATCH 64
+
+/* Problems a sync prints; 'tinypkg repo check' shows all of them */
+#define CHECK_SUMMARY_MAX 10
+
+/* Top-level manifest keys, in the order of enum manifest_key */
+static const char *const known_keys[] = {
+    "name", "version", "description", "author", "license", "homepage",
+    "architecture", "os", "source", "mirrors", "checksum", "depends",
+    "build", "train", "install", NULL
+};
+
+enum manifest_key {
+    KEY_NAME, KEY_VERSION, KEY_DESCRIPTION, KEY_AUTHOR, KEY_LICENSE,
+    KEY_HOMEPAGE, KEY_ARCHITECTURE, KEY_OS, KEY_SOURCE, KEY_MIRRORS,
+    KEY_CHECKSUM, KEY_DEPENDS, KEY_BUILD, KEY_TRAIN, KEY_INSTALL
+};
+
+/* ============================================================================
+ * Report
+ * ============================================================================
+ */
+
+static void issue_add(struct check_report *r, const char *package, int error,
+                      const char *check, const char *fmt, ...) {
+    struct check_issue *is;
+    va_list ap;
+
+    if (r->count == r->cap) {
+        size_t new_cap = r->cap ? r->cap * 2 : 16;
+        struct check_issue *p = realloc(r->issues, new_cap * sizeof(*p));
+        if (!p) {
+            return;     /* The report is one line short, nothing worse */
+        }
+        r->issues = p;
+        r->cap = new_cap;
+    }
+
+    is = &r->issues[r->count++];
+    snprintf(is->package, sizeof(is->package), "%s", package);
+    snprintf(is->check, sizeof(is->check), "%s", check);
+    is->error = error;
+    va_start(ap, fmt);
+    vsnprintf(is->message, sizeof(is->message), fmt, ap);
+    va_end(ap);
+
+    /* Messages quote manifest text; keep the report one line per issue */
+    for (char *p = is->message; *p; p++) {
+        if (*p == '\t' || *p == '\r') {
+            *p = ' ';
+        }
+    }
+}
+
+/* Checks made on one manifest alone; the others involve the rest of the repo */
+static int own_check(const char *check) {
+    return strcmp(check, "schema") == 0 || strcmp(check, "checksum") == 0;
+}
+
+static int issue_cmp(const void *a, const void *b) {
+    const struct check_issue *ia = a;
+    const struct check_issue *ib = b;
+    int c = strcmp(ia->package, ib->package);
+
+    if (c == 0) c = ib->error - ia->error;
+    if (c == 0) c = strcmp(ia->check, ib->check);
+    if (c == 0) c = strcmp(ia->message, ib->message);
+    return c;
+}
+
+/* Drop the issues drop() matches, keeping the order of the rest */
+static void report_filter(struct check_report *r, const void *ctx,
+                          int (*drop)(const struct check_issue *, const void *)) {
+    size_t out = 0;
+
+    for (size_t i = 0; i < r->count; i++) {
+        if (!drop(&r->issues[i], ctx)) {
+            r->issues[out++] = r->issues[i];
+        }
+    }
+    r->count = out;
+}
+
+/* The packages check_forget() was given */
+struct forget {
+    const struct index_entry *entries;
+    size_t count;
+};
+
+static int name_cmp(const void *key, const void *entry) {
+    return strcmp(key, ((const struct index_entry *)entry)->name);
+}
+
+static int drop_own(const struct check_issue *is, const void *ctx) {
+    const struct forget *f = ctx;
+
+    return own_check(is->check) &&
+           bsearch(is->package, f->entries, f->count, sizeof(*f->entries), name_cmp);
+}
+
+static int drop_cross(const struct check_issue *is, const void *ctx) {
+    (void)ctx;
+    return !own_check(is->check);
+}
+
+void check_forget(struct check_report *report, const struct index_entry *entries,
+                  size_t count) {
+    struct forget f = { entries, count };
+
+    if (count > 0) {
+        report_filter(report, &f, drop_own);
+    }
+}
+
+static void report_path(char *path, size_t len, const char *suffix) {
+    snprintf(path, len, "%s/%s%s", get_cache_path(), CHECK_REPORT_FILE, suffix);
+}
+
+int check_write(struct check_report *report) {
+    char path[PATH_MAX_LEN];
+    char tmp_path[PATH_MAX_LEN];
+    FILE *f;
+
+    if (report->count > 0) {
+        qsort(report->issues, report->count, sizeof(*report->issues), issue_cmp);
+    }
+
+    report_path(path, sizeof(path), "");
+    report_path(tmp_path, sizeof(tmp_path), ".tmp");
+    f = fopen(tmp_path, "w");
+    if (!f) {
+        log_error("check_write", strerror(errno));
+        return TINYPKG_ERR;
+    }
+
+    fprintf(f, "%s\n", CHECK_REPORT_MAGIC);
+    fprintf(f, "commit %s\n", report->commit[0] ? report->commit : "-");
+    for (size_t i = 0; i < report->count; i++) {
+        const struct check_issue *is = &report->issues[i];
+        fprintf(f, "%s\t%s\t%s\t%s\n", is->package, is->error ? "error" : "warning",
+                is->check, is->message);
+    }
+
+    if (fclose(f) != 0 || rename(tmp_path, path) != 0) {
+        log_error("check_write", strerror(errno));
+        unlink(tmp_path);
+        return TINYPKG_ERR;
+    }
+    return TINYPKG_OK;
+}
+
+int check_load(struct check_report *report) {
+    char path[PATH_MAX_LEN];
+    char *line = NULL;
+    size_t line_cap = 0;
+    int ret = TINYPKG_OK;
+    FILE *f;
+
+    memset(report, 0, sizeof(*report));
+    report_path(path, sizeof(path), "");
+    f = fopen(path, "r");
+    if (!f) {
+        return TINYPKG_NOT_FOUND;
+    }
+
+    if (getline(&line, &line_cap, f) < 0 ||
+        strncmp(line, CHECK_REPORT_MAGIC "\n", strlen(CHECK_REPORT_MAGIC) + 1) != 0 ||
+        getline(&line, &line_cap, f) < 0 ||
+        sscanf(line, "commit %63s", report->commit) != 1) {
+        ret = TINYPKG_ERR;
+    }
+
+    while (ret == TINYPKG_OK && getline(&line, &line_cap, f) > 0) {
+        char *fields[4] = {0};
+        char *p = line;
+        size_t before = report->count;
+
+        line[strcspn(line, "\n")] = '\0';
+        for (int i = 0; i < 4 && p; i++) {
+            fields[i] = p;
+            p = i < 3 ? strchr(p, '\t') : NULL;
+            if (p) {
+                *p++ = '\0';
+            }
+        }
+        if (!fields[3] || !fields[0][0] ||
+            (strcmp(fields[1], "error") != 0 && strcmp(fields[1], "warning") != 0)) {
+            ret = TINYPKG_ERR;
+            break;
+        }
+
+        issue_add(report, fields[0], strcmp(fields[1], "error") == 0, fields[2],
+                  "%s", fields[3]);
+        if (report->count == before) {
+            ret = TINYPKG_ERR;
+        }
+    }
+
+    free(line);
+    fclose(f);
+    if (ret != TINYPKG_OK) {
+        check_free(report);
+    }
+    return ret;
+}
+
+void check_free(struct check_report *report) {
+    free(report->issues);
+    report->issues = NULL;
+    report->count = 0;
+    report->cap = 0;
+}
+
+static void print_issue(const struct check_issue *is) {
+    printf("  %s: %s: %s [%s]\n", is->package, is->error ? "error" : "warning",
+           is->message, is->check);
+}
+
+void check_summary(const struct check_report *report, size_t packages) {
+    size_t errors = 0, affected = 0, shown = 0;
+
+    for (size_t i = 0; i < report->count; i++) {
+        errors += report->issues[i].error != 0;
+        if (i == 0 || strcmp(report->issues[i].package, report->issues[i - 1].package) != 0) {
+            affected++;
+        }
+    }
+
+    if (report->count == 0) {
+        printf("✓ Checked %zu manifests, no problems found\n", packages);
+        return;
+    }
+    printf("Checked %zu manifests: %zu errors, %zu warnings in %zu packages\n",
+           packages, errors, report->count - errors, affected);
+
+    /* Errors first: those are the builds that will fail */
+    for (int pass = 1; pass >= 0; pass--) {
+        for (size_t i = 0; i < report->count && shown < CHECK_SUMMARY_MAX; i++) {
+            if (report->issues[i].error == pass) {
+                print_issue(&report->issues[i]);
+                shown++;
+            }
+        }
+    }
+    if (shown < report->count) {
+        printf("  ... and %zu more, see 'tinypkg repo check'\n", report->count - shown);
+    }
+}
+
+int check_print(void) {
+    struct check_report report;
+    size_t errors = 0;
+    int ret = check_load(&report);
+
+    if (ret == TINYPKG_NOT_FOUND) {
+        log_error("check_print", "No diagnostics yet - run 'tinypkg repo sync' first");
+        return TINYPKG_ERR;
+    }
+    if (ret != TINYPKG_OK) {
+        log_error("check_print", "Diagnostics are corrupt - run 'tinypkg repo sync'");
+        return TINYPKG_ERR;
+    }
+
+    for (size_t i = 0; i < report.count; i++) {
+        errors += report.issues[i].error != 0;
+    }
+    printf("Diagnostics for %.12s: %zu errors, %zu warnings\n", report.commit,
+           errors, report.count - errors);
+    for (size_t i = 0; i < report.count; i++) {
+        print_issue(&report.issues[i]);
+    }
+
+    check_free(&report);
+    return errors > 0 ? 1 : TINYPKG_OK;
+}
+
+/* ============================================================================
+ * One manifest
+ * ============================================================================
+ */
+
+static int is_url(const char *s) {
+    return strncmp(s, "http://", 7) == 0 || strncmp(s, "https://", 8) == 0 ||
+           strncmp(s, "ftp://", 6) == 0 || strncmp(s, "file://", 7) == 0;
+}
+
+/* Whether word is in a space-separated list */
+static int word_listed(const char *list, const char *word) {
+    size_t len = strlen(word);
+
+    for (const char *p = list; p && *p; ) {
+        size_t n = strcspn(p, " ");
+        if (n == len && strncmp(p, word, len) == 0) {
+            return 1;
+        }
+        p += n + (p[n] == ' ');
+    }
+    return 0;
+}
+
+static void add_dependency(struct index_entry *e, const char *dep,
+                           struct check_report *r) {
+    size_t old_len = e->depends ? strlen(e->depends) : 0;
+    size_t len = strlen(dep);
+    char *p;
+
+    if (!is_valid_package_name(dep)) {
+        issue_add(r, e->name, 1, "schema", "dependency '%.64s' is not a package name", dep);
+        return;
+    }
+    if (strcmp(dep, e->name) == 0) {
+        issue_add(r, e->name, 1, "schema", "depends on itself");
+        return;
+    }
+    if (word_listed(e->depends, dep)) {
+        issue_add(r, e->name, 0, "schema", "dependency '%s' is listed twice", dep);
+        return;
+    }
+
+    p = realloc(e->depends, old_len + len + 2);
+    if (!p) {
+        return;
+    }
+    if (old_len > 0) {
+        p[old_len++] = ' ';
+    }
+    memcpy(p + old_len, dep, len + 1);
+    e->depends = p;
+}
+
+/* What check_one() has seen of a manifest so far */
+struct check_state {
+    struct index_entry *e;
+    struct check_report *r;
+    char name[128];
+    unsigned seen;
+    int key;                /* Top-level key the indented lines belong to */
+    int build_block;
+    int build_lines;
+    int has_source;
+};
+
+static int check_line(const struct manifest_line *l, void *ctx) {
+    struct check_state *c = ctx;
+    struct index_entry *e = c->e;
+    struct check_report *r = c->r;
+    const char *value = l->value;
+    int k;
+
+    if (l->event == MANIFEST_BAD) {
+        issue_add(r, e->name, 1, "schema", "line %d is not 'key: value'", l->lineno);
+        c->key = -1;
+        return 0;
+    }
+
+    /* Indented: a list item, or a line of a script block */
+    if (l->event == MANIFEST_TEXT) {
+        if (c->key == KEY_BUILD) {
+            c->build_lines++;
+        }
+        if (c->key != KEY_DEPENDS && c->key != KEY_MIRRORS) {
+            return 0;
+        }
+        if (!l->item) {
+            issue_add(r, e->name, 1, "schema", "line %d: expected '- <item>' under %s",
+                      l->lineno, known_keys[c->key]);
+        } else if (c->key == KEY_DEPENDS) {
+            add_dependency(e, l->item, r);
+        } else if (!is_url(l->item)) {
+            issue_add(r, e->name, 1, "schema",
+                      "mirror '%.160s' is not an http(s), ftp or file URL", l->item);
+        }
+        return 0;
+    }
+
+    for (k = 0; known_keys[k] && strcmp(known_keys[k], l->key) != 0; k++) {
+    }
+    c->key = known_keys[k] ? k : -1;
+    if (c->key < 0) {
+        issue_add(r, e->name, 0, "schema", "unknown key '%.32s'", l->key);
+        return 0;
+    }
+    if (c->seen & (1u << c->key)) {
+        issue_add(r, e->name, 0, "schema", "'%s' is given more than once", l->key);
+    }
+    c->seen |= 1u << c->key;
+
+    switch (c->key) {
+    case KEY_NAME:
+        sscanf(value, "%127s", c->name);
+        break;
+    case KEY_VERSION:
+        if (strlen(value) >= sizeof(e->version)) {
+            issue_add(r, e->name, 1, "schema", "version is longer than %zu characters",
+                      sizeof(e->version) - 1);
+        } else if (sscanf(value, "%63s", e->version) != 1) {
+            issue_add(r, e->name, 1, "schema", "version is empty");
+        }
+        break;
+    case KEY_SOURCE:
+        c->has_source = value[0] != '\0';
+        if (c->has_source && !is_url(value)) {
+            issue_add(r, e->name, 1, "schema",
+                      "source '%.160s' is not an http(s), ftp or file URL", value);
+        } else if (strlen(value) >= 512) {
+            issue_add(r, e->name, 1, "schema", "source URL is longer than 511 characters");
+        }
+        break;
+    case KEY_CHECKSUM:
+        if (!sha256_checksum_hex(value)) {
+            issue_add(r, e->name, 1, "checksum",
+                      "'%.80s' is not sha256:<64 hex digits>, so the download "
+                      "is refused unless " FETCH_UNVERIFIED_ENV " is set", value);
+        }
+        break;
+    case KEY_DEPENDS:
+    case KEY_MIRRORS:
+        if (value[0] && strcmp(value, "[]") != 0) {
+            issue_add(r, e->name, 1, "schema", "%s must be a list of '  - ' lines",
+                      known_keys[c->key]);
+        }
+        break;
+    case KEY_BUILD:
+    case KEY_TRAIN:
+    case KEY_INSTALL:
+        if (value[0] != '|') {
+            issue_add(r, e->name, 1, "schema", "%s must be a block ('%s: |' and "
+                      "indented lines)", known_keys[c->key], known_keys[c->key]);
+        } else if (c->key == KEY_BUILD) {
+            c->build_block = 1;
+        }
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+/*
+ * Read one manifest with the scanner parse_manifest() uses, noting
+ * whatever would make the build go wrong. Only the shape matters here;
+ * nothing is fetched or run.
+ */
+static int check_one(const char *path, struct index_entry *e, struct check_report *r) {
+    struct check_state c = { e, r, "", 0, -1, 0, 0, 0 };
+
+    if (manifest_scan(path, check_line, &c) != TINYPKG_OK) {
+        return TINYPKG_ERR;
+    }
+
+    if (!(c.seen & (1u << KEY_VERSION))) {
+        issue_add(r, e->name, 1, "schema", "no version");
+    }
+    if (!c.has_source) {
+        issue_add(r, e->name, 1, "schema", "no source URL");
+    }
+    if (!(c.seen & (1u << KEY_BUILD))) {
+        issue_add(r, e->name, 1, "schema", "no build script");
+    } else if (c.build_block && c.build_lines == 0) {
+        issue_add(r, e->name, 1, "schema", "build script is empty");
+    }
+    if (!(c.seen & (1u << KEY_INSTALL))) {
+        issue_add(r, e->name, 0, "schema", "no install script");
+    }
+    if (!c.name[0]) {
+        issue_add(r, e->name, 0, "schema", "no name");
+    } else if (strcmp(c.name, e->name) != 0) {
+        issue_add(r, e->name, 0, "schema",
+                  "name '%.64s' differs from its directory, it is built as '%s'",
+                  c.name, e->name);
+    }
+    return TINYPKG_OK;
+}
+
+/* ============================================================================
+ * Parallel parsing
+ * ============================================================================
+ */
+
+struct check_pool {
+    struct index_entry *entries;
+    char *found;
+    size_t count;
+    size_t next;
+    const char *cache;
+    pthread_mutex_t lock;
+};
+
+/* One per thread, so issues are recorded without locking */
+struct check_worker {
+    struct check_pool *pool;
+    struct check_report issues;
+};
+
+static void *manifest_worker(void *arg) {
+    struct check_worker *w = arg;
+    struct check_pool *pool = w->pool;
+
+    for (;;) {
+        size_t first, last;
+
+        pthread_mutex_lock(&pool->lock);
+        first = pool->next;
+        last = first + CHECK_BATCH < pool->count ? first + CHECK_BATCH : pool->count;
+        pool->next = last;
+        pthread_mutex_unlock(&pool->lock);
+        if (first >= last) {
+            break;
+        }
+
+        for (size_t i = first; i < last; i++) {
+            struct index_entry *e = &pool->entries[i];
+            char path[PATH_MAX_LEN * 2];
+
+            snprintf(path, sizeof(path), "%s/repo/packages/%s/manifest.yaml",
+                     pool->cache, e->name);
+            pool->found[i] = check_one(path, e, &w->issues) == TINYPKG_OK;
+        }
+    }
+    return NULL;
+}
+
+int check_manifests(struct index_entry *entries, size_t count, char *found,
+                    struct check_report *report) {
+    pthread_t threads[CHECK_MAX_THREADS];
+    struct check_worker workers[CHECK_MAX_THREADS];
+    struct check_pool pool;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = ncpu > 0 ? (int)ncpu : 1;
+    int started = 0;
+    int ret = TINYPKG_OK;
+
+    pool.entries = entries;
+    pool.found = found;
+    pool.count = count;
+    pool.next = 0;
+    pool.cache = get_cache_path();
+    if (!pool.cache) {
+        return TINYPKG_ERR;
+    }
+
+    if (nthreads > CHECK_MAX_THREADS) nthreads = CHECK_MAX_THREADS;
+    if ((size_t)nthreads > (count + CHECK_BATCH - 1) / CHECK_BATCH) {
+        nthreads = (int)((count + CHECK_BATCH - 1) / CHECK_BATCH);
+    }
+    if (nthreads < 1) nthreads = 1;
+
+    memset(workers, 0, sizeof(workers));
+    pthread_mutex_init(&pool.lock, NULL);
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].pool = &pool;
+    }
+
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, manifest_worker, &workers[i]) != 0) {
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        manifest_worker(&workers[0]);   /* No threads available: parse inline */
+        started = 1;
+    } else {
+        for (int i = 0; i < started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    pthread_mutex_destroy(&pool.lock);
+
+    for (int i = 0; i < started; i++) {
+        struct check_report *w = &workers[i].issues;
+
+        for (size_t j = 0; j < w->count; j++) {
+            size_t before = report->count;
+            issue_add(report, w->issues[j].package, w->issues[j].error,
+                      w->issues[j].check, "%s", w->issues[j].message);
+            if (report->count == before) {
+                ret = TINYPKG_ERR;
+            }
+        }
+        check_free(w);
+    }
+    return ret;
+}
+
+/* ============================================================================
+ * Cross checks
+ * ============================================================================
+ */
+
+/* A package as packages/index.yaml lists it */
+struct listed {
+    char name[128];
+    char version[64];
+};
+
+static int listed_cmp(const void *a, const void *b) {
+    const struct listed *la = a;
+    const struct listed *lb = b;
+    return strcmp(la->name, lb->name);
+}
+
+/* The packages: section of the repository's index.yaml, sorted by name */
+static int load_listed(struct listed **out, size_t *count) {
+    char path[PATH_MAX_LEN];
+    char line[LINE_MAX_LEN];
+    struct listed *list = NULL, *cur = NULL;
+    size_t cap = 0;
+    int in_packages = 0;
+    FILE *f;
+
+    *out = NULL;
+    *count = 0;
+    snprintf(path, sizeof(path), "%s/repo/packages/index.yaml", get_cache_path());
+    f = fopen(path, "r");
+    if (!f) {
+        return TINYPKG_NOT_FOUND;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        if (!in_packages) {
+            in_packages = strncmp(line, "packages:", 9) == 0;
+            continue;
+        }
+
+        /* Package entry: 2-space indent, name followed by colon */
+        if (line[0] == ' ' && line[1] == ' ' && line[2] != ' ' &&
+            line[2] != '\n' && line[2] != '\0') {
+            if (*count == cap) {
+                size_t new_cap = cap ? cap * 2 : 64;
+                struct listed *p = realloc(list, new_cap * sizeof(*p));
+                if (!p) {
+                    free(list);
+                    fclose(f);
+                    return TINYPKG_ERR;
+                }
+                list = p;
+                cap = new_cap;
+            }
+            cur = &list[*count];
+            memset(cur, 0, sizeof(*cur));
+            if (sscanf(line + 2, "%127[^:]:", cur->name) == 1) {
+                (*count)++;
+            } else {
+                cur = NULL;
+            }
+            continue;
+        }
+
+        if (cur && line[0] == ' ') {
+            char *p = line + strspn(line, " ");
+
+            if (strncmp(p, "version:", 8) == 0 || strncmp(p, "latest:", 7) == 0) {
+                sscanf(p, "%*[^:]:%*[ ]%63s", cur->version);
+            }
+        } else if (line[0] != '\n') {
+            cur = NULL;
+        }
+    }
+    fclose(f);
+
+    if (*count > 0) {
+        qsort(list, *count, sizeof(*list), listed_cmp);
+    }
+    *out = list;
+    return TINYPKG_OK;
+}
+
+int check_index(const struct pkg_index *idx, struct check_report *report) {
+    struct listed *listed;
+    size_t nlisted;
+    int ret;
+
+    report_filter(report, NULL, drop_cross);
+
+    for (size_t i = 0; i < idx->count; i++) {
+        const struct index_entry *e = &idx->entries[i];
+
+        for (const char *p = e->depends; p && *p; ) {
+            size_t n = strcspn(p, " ");
+            char dep[128];
+
+            if (n < sizeof(dep)) {
+                memcpy(dep, p, n);
+                dep[n] = '\0';
+                if (!index_find(idx, dep)) {
+                    issue_add(report, e->name, 1, "depends",
+                              "depends on '%s', which no manifest provides", dep);
+                }
+            }
+            p += n + (p[n] == ' ');
+        }
+    }
+
+    ret = load_listed(&listed, &nlisted);
+    if (ret == TINYPKG_NOT_FOUND) {
+        return TINYPKG_OK;  /* repo_parse_index() has said so already */
+    }
+    if (ret != TINYPKG_OK) {
+        return ret;
+    }
+
+    for (size_t i = 0; i < nlisted; i++) {
+        const struct listed *l = &listed[i];
+        const struct index_entry *e = index_find(idx, l->name);
+
+        if (i > 0 && strcmp(l->name, listed[i - 1].name) == 0) {
+            issue_add(report, l->name, 0, "index", "listed more than once in index.yaml");
+            continue;
+        }
+        if (!e) {
+            issue_add(report, l->name, 0, "index", "listed in index.yaml but has no manifest");
+        } else if (!l->version[0]) {
+            issue_add(report, l->name, 0, "index", "index.yaml gives no version");
+        } else if (e->version[0] && strcmp(l->version, e->version) != 0) {
+            issue_add(report, l->name, 1, "version",
+                      "index.yaml says %s but the manifest builds %s", l->version, e->version);
+        }
+    }
+
+    for (size_t i = 0; i < idx->count; i++) {
+        struct listed key;
+
+        memcpy(key.name, idx->entries[i].name, sizeof(key.name));
+        if (!bsearch(&key, listed, nlisted, sizeof(key), listed_cmp)) {
+            issue_add(report, key.name, 0, "index",
+                      "not listed in index.yaml, so search and list do not show it");
+        }
+    }
+
+    free(listed);
+    return TINYPKG_OK;
+}
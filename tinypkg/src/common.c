@@ -1,6 +1,8 @@
 #define _POSIX_C_SOURCE 200809L
 
 #include "common.h"
+#include "build.h"
+#include <dirent.h>
 
 static __thread char home_dir[PATH_MAX_LEN];
 static __thread char cache_path[PATH_MAX_LEN];
@@ -45,10 +47,21 @@ static void init_paths(void)
     home_dir[home_len] = '\0';
 
     build_path(cache_path,  PATH_MAX_LEN, home_dir, CACHE_DIR);
-    build_path(build_dir,   PATH_MAX_LEN, home_dir, BUILD_DIR);
     build_path(local_bin,   PATH_MAX_LEN, home_dir, LOCAL_BIN_DIR);
     build_path(tinypkg_dir, PATH_MAX_LEN, home_dir, TINYPKG_DIR);
 
+    /* Build trees may live elsewhere, e.g. off a slow network home */
+    const char *env_root = getenv(BUILD_ROOT_ENV);
+    if (env_root && *env_root) {
+        if (strnlen(env_root, PATH_MAX_LEN) >= PATH_MAX_LEN) {
+            log_error("init_paths", BUILD_ROOT_ENV " too long");
+            exit(1);
+        }
+        strcpy(build_dir, env_root);
+    } else {
+        build_path(build_dir, PATH_MAX_LEN, home_dir, BUILD_DIR);
+    }
+
     paths_initialized = 1;
 }
 
@@ -117,6 +130,48 @@ int mkdir_p(const char *path)
     return TINYPKG_OK;
 }
 
+/* rm -rf without spawning a process (does not follow symlinks) */
+int remove_tree(const char *path)
+{
+    struct stat st;
+    struct dirent *de;
+    DIR *d;
+    int ret = TINYPKG_OK;
+
+    if (lstat(path, &st) != 0)
+        return errno == ENOENT ? TINYPKG_OK : TINYPKG_ERR;
+
+    if (!S_ISDIR(st.st_mode))
+        return unlink(path) == 0 ? TINYPKG_OK : TINYPKG_ERR;
+
+    d = opendir(path);
+    if (!d)
+        return TINYPKG_ERR;
+
+    while ((de = readdir(d)) != NULL) {
+        char child[PATH_MAX_LEN];
+
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+
+        if (snprintf(child, sizeof(child), "%s/%s", path, de->d_name)
+            >= (int)sizeof(child)) {
+            ret = TINYPKG_ERR;
+            continue;
+        }
+
+        if (remove_tree(child) != TINYPKG_OK)
+            ret = TINYPKG_ERR;
+    }
+
+    closedir(d);
+
+    if (rmdir(path) != 0)
+        ret = TINYPKG_ERR;
+
+    return ret;
+}
+
 /* Package name validation */
 int is_valid_package_name(const char *name)
 {
@@ -192,18 +247,78 @@ int safe_execute_in_dir(const char *dir, char *const argv[])
            : TINYPKG_ERR;
 }
 
+/* 1 if an executable of that name is on PATH */
+int in_path(const char *prog)
+{
+    const char *path = getenv("PATH");
+    char dir[PATH_MAX_LEN], exe[PATH_MAX_LEN + 64];
+
+    while (path && *path) {
+        size_t len = strcspn(path, ":");
+        if (len > 0 && len < sizeof(dir)) {
+            memcpy(dir, path, len);
+            dir[len] = '\0';
+            snprintf(exe, sizeof(exe), "%s/%s", dir, prog);
+            if (access(exe, X_OK) == 0) {
+                return 1;
+            }
+        }
+        path += len + (path[len] == ':');
+    }
+    return 0;
+}
+
+/*
+ * A whole file in memory, NUL-terminated, with its length in *len. NULL if
+ * it is missing, unreadable or larger than max: callers get all of a file
+ * or none of it, never a silently truncated one.
+ */
+char *slurp(const char *path, size_t max, size_t *len)
+{
+    FILE *f = fopen(path, "rb");
+    struct stat st;
+    char *buf;
+
+    if (!f) {
+        return NULL;
+    }
+    if (fstat(fileno(f), &st) != 0 || (size_t)st.st_size > max ||
+        !(buf = malloc((size_t)st.st_size + 1))) {
+        fclose(f);
+        return NULL;
+    }
+    *len = fread(buf, 1, (size_t)st.st_size, f);
+    fclose(f);
+    if (*len != (size_t)st.st_size) {
+        free(buf);
+        return NULL;
+    }
+    buf[*len] = '\0';
+    return buf;
+}
+
 /* Logging */
+static FILE *log_out_stream;
+static FILE *log_err_stream;
+
+/* Send log output to other streams (NULL restores stdout/stderr) */
+void log_redirect(FILE *out, FILE *err)
+{
+    log_out_stream = out;
+    log_err_stream = err;
+}
+
 void log_error(const char *func, const char *msg)
 {
-    fprintf(stderr, "[ERROR] %s: %s\n", func, msg);
+    fprintf(log_err_stream ? log_err_stream : stderr, "[ERROR] %s: %s\n", func, msg);
 }
 
 void log_info(const char *msg)
 {
-    fprintf(stdout, "[INFO] %s\n", msg);
+    fprintf(log_out_stream ? log_out_stream : stdout, "[INFO] %s\n", msg);
 }
 
 void log_warn(const char *msg)
 {
-    fprintf(stdout, "[WARN] %s\n", msg);
+    fprintf(log_out_stream ? log_out_stream : stdout, "[WARN] %s\n", msg);
 }
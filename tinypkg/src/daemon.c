@@ -0,0 +1,493 @@
+/*
+ * daemon.c - Persistent query daemon and its Unix-socket client
+ *
+ * 'tinypkg daemon' keeps the parsed index and installed DB in memory and
+ * answers search/info/list/is-installed over ~/.cache/tinypkg/daemon.sock.
+ * The CLI tries the socket first and falls back to answering in-process.
+ *
+ * Connections are non-blocking and served from one poll() loop, so a
+ * client that is slow to send its request or read its answer holds up no
+ * one else; it is dropped after DAEMON_CLIENT_TIMEOUT_MS.
+ *
+ * Protocol (one request per connection):
+ *
+ *   request:  <cmd>\t<arg>\n
+ *   response: <status> <stdout-bytes> <stderr-bytes>\n<stdout><stderr>
+ *
+ * The cache directory is watched with inotify; when index.yaml or
+ * installed.db is replaced a fresh catalog is loaded and swapped in only
+ * once it parsed completely, so queries never see a half-loaded state.
+ */
+
+#include "common.h"
+#include "daemon.h"
+#include "util.h"
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+
+#define DAEMON_REQ_MAX 1024
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void on_signal(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+static int socket_path(struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    if (snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/%s",
+                 get_cache_path(), DAEMON_SOCKET_FILE)
+        >= (int)sizeof(addr->sun_path)) {
+        return TINYPKG_ERR;
+    }
+    return TINYPKG_OK;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return TINYPKG_ERR;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return TINYPKG_OK;
+}
+
+/* Read one '\n'-terminated line (terminator stripped) */
+static int read_line(int fd, char *buf, size_t len) {
+    size_t used = 0;
+
+    while (used + 1 < len) {
+        ssize_t n = read(fd, buf + used, 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            return TINYPKG_ERR;
+        }
+        if (buf[used] == '\n') {
+            buf[used] = '\0';
+            return TINYPKG_OK;
+        }
+        used++;
+    }
+    return TINYPKG_ERR;
+}
+
+/* ============================================================================
+ * Server
+ * ============================================================================
+ */
+
+/* Run one query against the resident catalog, capturing its output */
+static int dispatch(struct catalog *cat, int loaded, const char *cmd,
+                    const char *arg, FILE *out) {
+    if (strcmp(cmd, "ping") == 0) {
+        return TINYPKG_OK;
+    }
+    if (strcmp(cmd, "stop") == 0) {
+        stop_requested = 1;
+        return TINYPKG_OK;
+    }
+    if (strcmp(cmd, "info") == 0) {
+        return catalog_info(loaded ? cat : NULL, arg, out);
+    }
+
+    if (!loaded) {
+        log_error("daemon", "Repository not synced - run 'tinypkg repo sync' first");
+        return TINYPKG_ERR;
+    }
+
+    return catalog_dispatch(cat, cmd, arg, out);
+}
+
+/* A connection in progress: reading its request, then writing the answer */
+struct client {
+    int fd;
+    char req[DAEMON_REQ_MAX];
+    size_t req_len;
+    char *resp;             /* Header, stdout, stderr; NULL while reading */
+    size_t resp_len;
+    size_t sent;
+    long long deadline_ms;
+};
+
+static long long now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Answer a complete request line into c->resp */
+static void answer(struct client *c, struct catalog *cat, int loaded) {
+    char header[64];
+    char *out_buf = NULL, *err_buf = NULL;
+    size_t out_len = 0, err_len = 0, header_len;
+    FILE *out, *err;
+    char *arg;
+    int status;
+
+    arg = strchr(c->req, '\t');
+    if (arg) {
+        *arg++ = '\0';
+    } else {
+        arg = "";
+    }
+
+    out = open_memstream(&out_buf, &out_len);
+    err = open_memstream(&err_buf, &err_len);
+    if (!out || !err) {
+        if (out) fclose(out);
+        if (err) fclose(err);
+        free(out_buf);
+        free(err_buf);
+        return;
+    }
+
+    log_redirect(out, err);
+    status = dispatch(cat, loaded, c->req, arg, out);
+    log_redirect(NULL, NULL);
+
+    fclose(out);
+    fclose(err);
+
+    header_len = (size_t)snprintf(header, sizeof(header), "%d %zu %zu\n",
+                                  status, out_len, err_len);
+    c->resp = malloc(header_len + out_len + err_len + 1);
+    if (c->resp) {
+        memcpy(c->resp, header, header_len);
+        memcpy(c->resp + header_len, out_buf, out_len);
+        memcpy(c->resp + header_len + out_len, err_buf, err_len);
+        c->resp_len = header_len + out_len + err_len;
+        c->sent = 0;
+    }
+
+    free(out_buf);
+    free(err_buf);
+}
+
+/*
+ * Make progress on a ready client without blocking. Returns 0 when the
+ * connection is finished (answered, failed, or closed by the client).
+ */
+static int client_step(struct client *c, struct catalog *cat, int loaded) {
+    ssize_t n;
+
+    if (!c->resp) {
+        n = read(c->fd, c->req + c->req_len, sizeof(c->req) - 1 - c->req_len);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 1;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        c->req_len += (size_t)n;
+        c->req[c->req_len] = '\0';
+
+        char *nl = strchr(c->req, '\n');
+        if (!nl) {
+            return c->req_len + 1 < sizeof(c->req);    /* Too long: drop */
+        }
+        *nl = '\0';
+        answer(c, cat, loaded);
+        if (!c->resp) {
+            return 0;
+        }
+    }
+
+    while (c->sent < c->resp_len) {
+        n = write(c->fd, c->resp + c->sent, c->resp_len - c->sent);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 1;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        c->sent += (size_t)n;
+    }
+    return 0;
+}
+
+static void client_close(struct client *c) {
+    close(c->fd);
+    free(c->resp);
+}
+
+/* Drain inotify events; report whether a watched file was replaced */
+static int catalog_changed(int ino) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+    ssize_t n;
+
+    while ((n = read(ino, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+
+            if (ev->len > 0 &&
+                (strcmp(ev->name, "index.yaml") == 0 ||
+                 strcmp(ev->name, "installed.db") == 0)) {
+                changed = 1;
+            }
+            p += sizeof(*ev) + ev->len;
+        }
+    }
+
+    return changed;
+}
+
+int daemon_run(void) {
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    struct catalog cat;
+    struct pollfd fds[2 + DAEMON_MAX_CLIENTS];
+    struct client clients[DAEMON_MAX_CLIENTS];
+    int nclients = 0;
+    int status;
+    int loaded;
+    int listen_fd, ino;
+    mode_t old_mask;
+
+    if (socket_path(&addr) != TINYPKG_OK) {
+        log_error("daemon_run", "Socket path too long");
+        return TINYPKG_ERR;
+    }
+
+    if (daemon_query("ping", NULL, &status) == TINYPKG_OK) {
+        log_error("daemon_run", "A daemon is already running");
+        return TINYPKG_ERR;
+    }
+
+    if (mkdir_p(get_cache_path()) != TINYPKG_OK) {
+        return TINYPKG_ERR;
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        log_error("socket", strerror(errno));
+        return TINYPKG_ERR;
+    }
+
+    /* Stale socket from a previous run */
+    unlink(addr.sun_path);
+
+    old_mask = umask(077);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listen_fd, 64) != 0) {
+        umask(old_mask);
+        log_error("bind", strerror(errno));
+        close(listen_fd);
+        return TINYPKG_ERR;
+    }
+    umask(old_mask);
+
+    ino = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (ino < 0 || inotify_add_watch(ino, get_cache_path(),
+                                     IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE) < 0) {
+        log_warn("inotify unavailable, catalog will not reload automatically");
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+
+    loaded = catalog_load(&cat) == TINYPKG_OK;
+    if (!loaded) {
+        memset(&cat, 0, sizeof(cat));
+    }
+
+    printf("tinypkg daemon listening on %s (%zu packages)\n",
+           addr.sun_path, cat.count);
+    fflush(stdout);
+
+    while (!stop_requested) {
+        long long now = now_ms();
+        int timeout = -1;
+        int n;
+
+        /* Listener, inotify, then one slot per client */
+        fds[0].fd = nclients < DAEMON_MAX_CLIENTS ? listen_fd : -1;
+        fds[0].events = POLLIN;
+        fds[1].fd = ino;
+        fds[1].events = POLLIN;
+        for (int i = 0; i < nclients; i++) {
+            long long left = clients[i].deadline_ms - now;
+
+            fds[2 + i].fd = clients[i].fd;
+            fds[2 + i].events = clients[i].resp ? POLLOUT : POLLIN;
+            if (left < 0) {
+                left = 0;
+            }
+            if (timeout < 0 || left < timeout) {
+                timeout = (int)left;
+            }
+        }
+
+        n = poll(fds, (nfds_t)(2 + nclients), timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            log_error("poll", strerror(errno));
+            break;
+        }
+
+        if (ino >= 0 && (fds[1].revents & POLLIN) && catalog_changed(ino)) {
+            struct catalog fresh;
+
+            /* Swap only a fully parsed catalog; keep serving the old one */
+            if (catalog_load(&fresh) == TINYPKG_OK) {
+                catalog_free(&cat);
+                cat = fresh;
+                loaded = 1;
+                printf("Reloaded catalog (%zu packages)\n", cat.count);
+                fflush(stdout);
+            }
+        }
+
+        /* Serve whoever is ready; drop those past their deadline */
+        now = now_ms();
+        for (int i = 0; i < nclients; ) {
+            int keep = 1;
+
+            if (fds[2 + i].revents) {
+                keep = client_step(&clients[i], &cat, loaded);
+            }
+            if (keep && now >= clients[i].deadline_ms) {
+                keep = 0;
+            }
+            if (!keep) {
+                client_close(&clients[i]);
+                clients[i] = clients[--nclients];
+                fds[2 + i] = fds[2 + nclients];
+                continue;
+            }
+            i++;
+        }
+
+        if (fds[0].fd >= 0 && (fds[0].revents & POLLIN)) {
+            int client = accept(listen_fd, NULL, NULL);
+            if (client >= 0) {
+                struct client *c = &clients[nclients];
+
+                memset(c, 0, sizeof(*c));
+                c->fd = client;
+                c->deadline_ms = now_ms() + DAEMON_CLIENT_TIMEOUT_MS;
+                fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+                /* Most requests are already waiting: answer without a poll */
+                if (client_step(c, &cat, loaded)) {
+                    nclients++;
+                } else {
+                    client_close(c);
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < nclients; i++) {
+        client_close(&clients[i]);
+    }
+    catalog_free(&cat);
+    if (ino >= 0) {
+        close(ino);
+    }
+    close(listen_fd);
+    unlink(addr.sun_path);
+
+    printf("tinypkg daemon stopped\n");
+    return TINYPKG_OK;
+}
+
+int daemon_stop(void) {
+    int status;
+
+    if (daemon_query("stop", NULL, &status) != TINYPKG_OK) {
+        log_error("daemon_stop", "No daemon is running");
+        return TINYPKG_ERR;
+    }
+    return status;
+}
+
+/* ============================================================================
+ * Client
+ * ============================================================================
+ */
+
+/* Copy exactly len bytes from the socket to a stream */
+static int relay(int fd, size_t len, FILE *dst) {
+    char buf[8192];
+
+    while (len > 0) {
+        size_t want = len < sizeof(buf) ? len : sizeof(buf);
+        ssize_t n = read(fd, buf, want);
+
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            return TINYPKG_ERR;
+        }
+        fwrite(buf, 1, (size_t)n, dst);
+        len -= (size_t)n;
+    }
+    return TINYPKG_OK;
+}
+
+int daemon_query(const char *cmd, const char *arg, int *status) {
+    struct sockaddr_un addr;
+    struct timeval tv = { DAEMON_TIMEOUT_SEC, 0 };
+    struct stat st;
+    char req[DAEMON_REQ_MAX];
+    char header[64];
+    size_t out_len, err_len;
+    int fd;
+
+    if (getenv(DAEMON_DISABLE_ENV) || socket_path(&addr) != TINYPKG_OK) {
+        return TINYPKG_ERR;
+    }
+
+    /* Cheap check before creating a socket */
+    if (stat(addr.sun_path, &st) != 0 || !S_ISSOCK(st.st_mode)) {
+        return TINYPKG_ERR;
+    }
+
+    if (!arg) {
+        arg = "";
+    }
+    if (strpbrk(arg, "\t\n") ||
+        snprintf(req, sizeof(req), "%s\t%s\n", cmd, arg) >= (int)sizeof(req)) {
+        return TINYPKG_ERR;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return TINYPKG_ERR;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        write_all(fd, req, strlen(req)) != TINYPKG_OK ||
+        read_line(fd, header, sizeof(header)) != TINYPKG_OK ||
+        sscanf(header, "%d %zu %zu", status, &out_len, &err_len) != 3) {
+        close(fd);
+        return TINYPKG_ERR;   /* No usable daemon: answer locally */
+    }
+
+    /* The daemon has answered; from here on its result is final */
+    if (relay(fd, out_len, stdout) != TINYPKG_OK ||
+        relay(fd, err_len, stderr) != TINYPKG_OK) {
+        *status = TINYPKG_ERR;
+    }
+
+    close(fd);
+    return TINYPKG_OK;
+}
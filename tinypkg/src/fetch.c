@@ -0,0 +1,1396 @@
+/*
+ * fetch.c - Segmented, resumable downloads
+ *
+ * Transfers are delegated to the curl command line tool, so libcurl is not
+ * a build dependency. Per batch:
+ *
+ *   1. One curl process sends a HEAD for every URL to learn sizes and
+ *      whether byte ranges are accepted.
+ *   2. Files of at least 2 * FETCH_SEGMENT_MIN bytes from servers that
+ *      accept ranges are split into up to FETCH_MAX_SEGMENTS ranges, each
+ *      fetched by its own curl process and appended to <dest>.part<k>.
+ *   3. All other files go to a single curl process with --parallel, which
+ *      keeps one connection pool, so files from the same host reuse
+ *      connections. Each one is written to <dest>.part with --continue-at.
+ *
+ * A job may list several mirror URLs. The HEAD probe covers all of them,
+ * and they are ordered by mirror_score(): the probed latency plus the
+ * throughput and failure history in the host table. A transfer that fails
+ * resumes from the next mirror in the same attempt; only after every
+ * mirror has been tried does the job wait for a retry.
+ *
+ * <dest>.part.meta records the size and segment layout. A later attempt,
+ * mirror or run with the same layout continues every part from its current
+ * length. Failed rounds are retried with exponential backoff. If curl is
+ * missing, files are fetched one at a time with 'wget -c'.
+ */
+
+#include "common.h"
+#include "config.h"
+#include "fetch.h"
+#include "metrics.h"
+#include "mirror.h"
+#include "sha256.h"
+#include <poll.h>
+#include <stdarg.h>
+#include <strings.h>
+
+#define FETCH_META_MAGIC "tinypkg-fetch 1"
+#define FETCH_NO_CURL -3
+
+/* How often data is hashed while transfers are running */
+#define FETCH_HASH_TICK_MS 100
+
+/* Options shared by every transfer: quiet, give up on stalled connections */
+static const char *curl_common[] = {
+    "-s", "-L", "--fail", "--connect-timeout", "30",
+    "--speed-limit", "1024", "--speed-time", "30", NULL
+};
+
+struct segment {
+    long long start;
+    long long len;          /* -1: size unknown, read to EOF */
+    long long have;         /* Bytes already in the part file */
+    char part[PATH_MAX_LEN + 32];
+};
+
+/* What the HEAD probe learned about one mirror */
+struct candidate {
+    int ok;
+    double ttfb_ms;
+    long long size;
+    int ranges;
+    int dead;               /* Answered 4xx to a transfer */
+};
+
+struct plan {
+    long long size;         /* -1 if the server did not say */
+    int ranges;             /* Server advertised Accept-Ranges: bytes */
+    int nseg;
+    int done;               /* curl reported success (single stream) */
+    int failed;             /* Permanent failure (HTTP status, or 1) */
+    int complete;
+    int waiting;            /* Tried every mirror this attempt */
+    int http;               /* Status of the last failed transfer */
+    long long before;       /* Bytes on disk when the round started */
+    long long rate;         /* Bytes per second for the whole file, 0 if unlimited */
+
+    int verify;                         /* want[] holds the expected digest */
+    int rejected;                       /* Checksum unusable: not downloaded */
+    int mismatch;                       /* Some mirror sent bad data */
+    char want[SHA256_HEX_LEN];
+    struct sha256_ctx sha;              /* Over bytes [0, hashed) */
+    long long hashed;
+    double start;
+    struct segment seg[FETCH_MAX_SEGMENTS];
+
+    int nurls;
+    const char *urls[MIRROR_MAX];       /* Preference order */
+    struct candidate cand[MIRROR_MAX];
+    int order[MIRROR_MAX];              /* Candidate indices, best first */
+    int cur;                            /* Position in order */
+};
+
+/* Observations for the host table, saved once per batch */
+struct samples {
+    struct host_sample *items;
+    size_t count;
+};
+
+/* Growable NULL-terminated argv */
+struct args {
+    char **v;
+    size_t n;
+    size_t cap;
+};
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_ms(long ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+}
+
+static long long file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (long long)st.st_size : -1;
+}
+
+static int args_add(struct args *a, const char *s) {
+    if (a->n + 2 > a->cap) {
+        size_t cap = a->cap ? a->cap * 2 : 64;
+        char **v = realloc(a->v, cap * sizeof(*v));
+        if (!v) {
+            return TINYPKG_ERR;
+        }
+        a->v = v;
+        a->cap = cap;
+    }
+    a->v[a->n] = strdup(s);
+    if (!a->v[a->n]) {
+        return TINYPKG_ERR;
+    }
+    a->v[++a->n] = NULL;
+    return TINYPKG_OK;
+}
+
+static int args_addf(struct args *a, const char *fmt, ...) {
+    char buf[PATH_MAX_LEN * 2];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    if (n < 0 || n >= (int)sizeof(buf)) {
+        return TINYPKG_ERR;
+    }
+    return args_add(a, buf);
+}
+
+static int args_add_common(struct args *a) {
+    for (int i = 0; curl_common[i]; i++) {
+        if (args_add(a, curl_common[i]) != TINYPKG_OK) {
+            return TINYPKG_ERR;
+        }
+    }
+    return TINYPKG_OK;
+}
+
+static void args_free(struct args *a) {
+    for (size_t i = 0; i < a->n; i++) {
+        free(a->v[i]);
+    }
+    free(a->v);
+    memset(a, 0, sizeof(*a));
+}
+
+/* Run argv[0] from PATH with stdout on out_fd (if >= 0) */
+static pid_t spawn(char *const argv[], int out_fd) {
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        if (out_fd >= 0) {
+            dup2(out_fd, STDOUT_FILENO);
+            close(out_fd);
+        }
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+static int wait_exit(pid_t pid) {
+    int status;
+
+    if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+        return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static void hash_tick(struct plan *plans, size_t count);
+
+/* Run a curl batch and feed each line of its -w output to 'line' */
+static int run_batch(struct args *a, struct plan *plans, size_t count,
+                     void (*line)(struct plan *, size_t, int, char *)) {
+    char buf[PATH_MAX_LEN];
+    size_t used = 0;
+    int fds[2];
+    pid_t pid;
+    int code;
+
+    if (pipe(fds) != 0) {
+        log_error("fetch", strerror(errno));
+        return TINYPKG_ERR;
+    }
+
+    pid = spawn(a->v, fds[1]);
+    close(fds[1]);
+
+    for (;;) {
+        struct pollfd pfd = { fds[0], POLLIN, 0 };
+        char *nl;
+        ssize_t n;
+
+        /* Hash what has arrived while curl is busy */
+        if (poll(&pfd, 1, FETCH_HASH_TICK_MS) == 0) {
+            hash_tick(plans, count);
+            continue;
+        }
+
+        n = read(fds[0], buf + used, sizeof(buf) - 1 - used);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        used += (size_t)n;
+        buf[used] = '\0';
+
+        /* Lines are tagged "<job>|" or "<job>.<candidate>|" */
+        while ((nl = strchr(buf, '\n')) != NULL) {
+            char *end;
+            size_t idx;
+            long cand = -1;
+
+            *nl = '\0';
+            idx = strtoul(buf, &end, 10);
+            if (*end == '.') {
+                cand = strtol(end + 1, &end, 10);
+            }
+            if (*end == '|' && idx < count && cand < plans[idx].nurls) {
+                line(plans, idx, (int)cand, end + 1);
+            }
+
+            used -= (size_t)(nl + 1 - buf);
+            memmove(buf, nl + 1, used + 1);
+        }
+
+        /* A line longer than the buffer is not ours */
+        if (used == sizeof(buf) - 1) {
+            used = 0;
+        }
+    }
+    close(fds[0]);
+
+    code = wait_exit(pid);
+    return code == 127 ? FETCH_NO_CURL : TINYPKG_OK;
+}
+
+/* Wait for segment processes, hashing what arrives meanwhile */
+static int wait_segments(pid_t *pids, size_t npids, struct plan *plans, size_t count) {
+    size_t left = npids;
+    int no_curl = 0;
+
+    while (left > 0) {
+        for (size_t i = 0; i < npids; i++) {
+            int status;
+
+            if (pids[i] <= 0 || waitpid(pids[i], &status, WNOHANG) != pids[i]) {
+                continue;
+            }
+            if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+                no_curl = 1;
+            }
+            pids[i] = 0;
+            left--;
+        }
+        if (left > 0) {
+            hash_tick(plans, count);
+            sleep_ms(FETCH_HASH_TICK_MS);
+        }
+    }
+    return no_curl ? FETCH_NO_CURL : TINYPKG_OK;
+}
+
+/* ============================================================================
+ * Planning
+ * ============================================================================
+ */
+
+static const char *cur_url(const struct plan *p) {
+    return p->urls[p->order[p->cur]];
+}
+
+static void sample_add(struct samples *s, const char *url, double latency_ms,
+                       long long bytes, double seconds, int ok) {
+    struct host_sample *grown = realloc(s->items, (s->count + 1) * sizeof(*grown));
+
+    if (!grown) {
+        return;     /* Statistics are best effort */
+    }
+    s->items = grown;
+    mirror_host(url, grown[s->count].host, sizeof(grown[s->count].host));
+    grown[s->count].latency_ms = latency_ms;
+    grown[s->count].bytes = bytes;
+    grown[s->count].seconds = seconds;
+    grown[s->count].ok = ok;
+    s->count++;
+}
+
+/* "<exitcode>|<http_code>|<ttfb>|<content-length>|<accept-ranges>" */
+static void probe_line(struct plan *plans, size_t idx, int c, char *s) {
+    struct candidate *cand;
+    char *field[5];
+    int n = 0;
+
+    if (c < 0) {
+        return;
+    }
+    cand = &plans[idx].cand[c];
+
+    for (char *p = s; n < 5; p++) {
+        field[n++] = p;
+        p = strchr(p, '|');
+        if (!p) {
+            break;
+        }
+    }
+    if (n < 5) {
+        return;
+    }
+
+    /* http_code is 0 for file:// */
+    cand->ok = atoi(field[0]) == 0 && (atoi(field[1]) == 200 || atoi(field[1]) == 0);
+    cand->ttfb_ms = atof(field[2]) * 1000.0;
+    cand->size = atoll(field[3]);
+    if (cand->size <= 0) {
+        cand->size = -1;
+    }
+    cand->ranges = strncasecmp(field[4], "bytes", 5) == 0;
+}
+
+/* Learn sizes, range support and latency of every candidate at once */
+static int probe(struct plan *plans, size_t count) {
+    struct args a = { NULL, 0, 0 };
+    int ret = TINYPKG_ERR;
+    int first = 1;
+
+    if (args_add(&a, "curl") != TINYPKG_OK ||
+        args_add(&a, "-Z") != TINYPKG_OK ||
+        args_add(&a, "--no-progress-meter") != TINYPKG_OK ||
+        args_add(&a, "--parallel-immediate") != TINYPKG_OK ||
+        args_add(&a, "--parallel-max") != TINYPKG_OK ||
+        args_addf(&a, "%d", FETCH_MAX_PARALLEL) != TINYPKG_OK) {
+        goto out;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        for (int c = 0; c < plans[i].nurls; c++) {
+            if ((!first && args_add(&a, "--next") != TINYPKG_OK) ||
+                args_add_common(&a) != TINYPKG_OK ||
+                args_add(&a, "-I") != TINYPKG_OK ||
+                args_add(&a, "-o") != TINYPKG_OK ||
+                args_add(&a, "/dev/null") != TINYPKG_OK ||
+                args_add(&a, "-w") != TINYPKG_OK ||
+                args_addf(&a, "%zu.%d|%%{exitcode}|%%{http_code}|%%{time_starttransfer}|"
+                              "%%header{content-length}|%%header{accept-ranges}\\n",
+                          i, c) != TINYPKG_OK ||
+                args_add(&a, plans[i].urls[c]) != TINYPKG_OK) {
+                goto out;
+            }
+            first = 0;
+        }
+    }
+
+    ret = run_batch(&a, plans, count, probe_line);
+
+out:
+    args_free(&a);
+    return ret;
+}
+
+/* Order candidates: answering mirrors by score, then the rest as listed */
+static void rank(struct plan *p, struct samples *samples) {
+    double score[MIRROR_MAX];
+    int n = 0;
+
+    for (int c = 0; c < p->nurls; c++) {
+        const struct candidate *cand = &p->cand[c];
+
+        sample_add(samples, p->urls[c], cand->ok ? cand->ttfb_ms : 0, 0, 0, cand->ok);
+        if (cand->ok) {
+            score[c] = mirror_score(p->urls[c], cand->ttfb_ms, cand->size);
+            p->order[n++] = c;
+        }
+    }
+
+    /* Insertion sort keeps listed order among equal scores */
+    for (int i = 1; i < n; i++) {
+        int c = p->order[i];
+        int j = i - 1;
+        while (j >= 0 && score[p->order[j]] > score[c]) {
+            p->order[j + 1] = p->order[j];
+            j--;
+        }
+        p->order[j + 1] = c;
+    }
+
+    for (int c = 0; c < p->nurls; c++) {
+        if (!p->cand[c].ok) {
+            p->order[n++] = c;
+        }
+    }
+
+    p->cur = 0;
+    p->size = p->cand[p->order[0]].size;
+    p->ranges = p->cand[p->order[0]].ranges;
+}
+
+/* ============================================================================
+ * Verification
+ * ============================================================================
+ *
+ * The checksum is computed while the file downloads: every tick hashes the
+ * bytes that arrived since the last one, in file order, while they are
+ * still in the page cache. Segments beyond the first incomplete one wait
+ * until it is done. At the end only the last tick's worth is left.
+ */
+
+static void hash_reset(struct plan *p) {
+    sha256_init(&p->sha);
+    p->hashed = 0;
+}
+
+/* Hash whatever has arrived in order since the last call */
+static void hash_advance(struct plan *p) {
+    uint8_t buf[65536];
+
+    if (!p->verify) {
+        return;
+    }
+
+    for (int k = 0; k < p->nseg; k++) {
+        const struct segment *s = &p->seg[k];
+        long long have, end;
+        int fd;
+
+        if (s->len >= 0 && p->hashed >= s->start + s->len) {
+            continue;       /* Already hashed */
+        }
+
+        have = file_size(s->part);
+        end = s->start + (have > 0 ? have : 0);
+
+        /* The part was cut back: start over */
+        if (p->hashed > end) {
+            hash_reset(p);
+            return;
+        }
+
+        fd = open(s->part, O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        while (p->hashed < end) {
+            long long left = end - p->hashed;
+            ssize_t n = pread(fd, buf, left < (long long)sizeof(buf) ? (size_t)left : sizeof(buf),
+                              (off_t)(p->hashed - s->start));
+            if (n <= 0) {
+                break;
+            }
+            sha256_update(&p->sha, buf, (size_t)n);
+            p->hashed += n;
+        }
+        close(fd);
+
+        if (s->len < 0 || p->hashed < s->start + s->len) {
+            return;         /* Later segments wait for this one */
+        }
+    }
+}
+
+static void hash_tick(struct plan *plans, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (!plans[i].complete && !plans[i].failed) {
+            hash_advance(&plans[i]);
+        }
+    }
+}
+
+static void remove_parts(const char *dest);
+static int make_plan(const char *dest, struct plan *p, long long *resumed);
+
+/* Check a completed file; bad data rules out the mirror that sent it */
+static int verify(struct fetch_job *job, struct plan *p) {
+    uint8_t digest[SHA256_DIGEST_LEN];
+    char hex[SHA256_HEX_LEN];
+    char host[128], msg[PATH_MAX_LEN + 256];
+    long long ignored = 0;
+
+    if (!p->verify) {
+        return 1;
+    }
+
+    hash_advance(p);
+    sha256_final(&p->sha, digest);
+    sha256_to_hex(digest, hex);
+    if (strcmp(hex, p->want) == 0) {
+        job->stats.verified = 1;
+        return 1;
+    }
+
+    mirror_host(cur_url(p), host, sizeof(host));
+    snprintf(msg, sizeof(msg), "Checksum mismatch for %s from %s", job->dest, host);
+    log_warn(msg);
+
+    p->cand[p->order[p->cur]].dead = 1;
+    p->mismatch = 1;
+    p->complete = 0;
+    p->done = 0;
+    remove_parts(job->dest);
+    if (make_plan(job->dest, p, &ignored) != TINYPKG_OK) {
+        p->failed = 1;
+    }
+    return 0;
+}
+
+static void remove_parts(const char *dest) {
+    char path[PATH_MAX_LEN + 32];
+
+    snprintf(path, sizeof(path), "%s.part", dest);
+    unlink(path);
+    for (int k = 0; k < FETCH_MAX_SEGMENTS; k++) {
+        snprintf(path, sizeof(path), "%s.part%d", dest, k);
+        unlink(path);
+    }
+}
+
+/* Lay out segments, keeping partial data only if the layout is unchanged */
+static int make_plan(const char *dest, struct plan *p, long long *resumed) {
+    char meta[PATH_MAX_LEN + 32];
+    char line[LINE_MAX_LEN];
+    long long meta_size = 0;
+    int meta_nseg = 0;
+    FILE *f;
+
+    hash_reset(p);
+    p->nseg = 1;
+    if (p->ranges && p->size >= 2 * FETCH_SEGMENT_MIN) {
+        long long n = p->size / FETCH_SEGMENT_MIN;
+        p->nseg = n < FETCH_MAX_SEGMENTS ? (int)n : FETCH_MAX_SEGMENTS;
+    }
+
+    if (snprintf(meta, sizeof(meta), "%s.part.meta", dest) >= (int)sizeof(meta)) {
+        log_error("fetch", "Destination path too long");
+        return TINYPKG_ERR;
+    }
+
+    f = fopen(meta, "r");
+    if (f) {
+        if (!fgets(line, sizeof(line), f) ||
+            strncmp(line, FETCH_META_MAGIC, strlen(FETCH_META_MAGIC)) != 0 ||
+            !fgets(line, sizeof(line), f) ||
+            sscanf(line, "%lld %d", &meta_size, &meta_nseg) != 2) {
+            meta_nseg = 0;
+        }
+        fclose(f);
+    }
+
+    /* Unknown or different layout: partial data cannot be trusted */
+    if (meta_size != p->size || meta_nseg != p->nseg) {
+        remove_parts(dest);
+    }
+
+    for (int k = 0; k < p->nseg; k++) {
+        struct segment *s = &p->seg[k];
+
+        if (p->nseg == 1) {
+            snprintf(s->part, sizeof(s->part), "%s.part", dest);
+            s->start = 0;
+            s->len = p->size;
+        } else {
+            snprintf(s->part, sizeof(s->part), "%s.part%d", dest, k);
+            s->start = p->size / p->nseg * k;
+            s->len = (k == p->nseg - 1) ? p->size - s->start : p->size / p->nseg;
+        }
+
+        s->have = file_size(s->part);
+        if (s->have < 0 || (s->len >= 0 && s->have > s->len)) {
+            unlink(s->part);
+            s->have = 0;
+        }
+        *resumed += s->have;
+    }
+
+    f = fopen(meta, "w");
+    if (!f) {
+        log_error("fetch", strerror(errno));
+        return TINYPKG_ERR;
+    }
+    fprintf(f, "%s\n%lld %d\n", FETCH_META_MAGIC, p->size, p->nseg);
+    fclose(f);
+
+    return TINYPKG_OK;
+}
+
+/* ============================================================================
+ * Transfers
+ * ============================================================================
+ */
+
+/* "<exitcode>|<http_code>" for one single-stream transfer */
+static void transfer_line(struct plan *plans, size_t idx, int c, char *s) {
+    struct plan *p = &plans[idx];
+    int exitcode = atoi(s);
+    char *code = strchr(s, '|');
+    int http = code ? atoi(code + 1) : 0;
+
+    (void)c;
+
+    if (exitcode == 0) {
+        p->done = 1;
+        return;
+    }
+
+    p->http = http;
+    if (http >= 400 && http < 500 && http != 408 && http != 416 && http != 429) {
+        p->cand[p->order[p->cur]].dead = 1;
+    } else if (exitcode == 33) {
+        /* Server cannot resume: start this file over */
+        unlink(p->seg[0].part);
+    }
+}
+
+static int segment_complete(const struct segment *s) {
+    return s->len >= 0 && s->have == s->len;
+}
+
+/* Segments share the file's rate limit; curl wants at least 1 KiB/s */
+static long long segment_rate(const struct plan *p) {
+    long long rate = p->rate / p->nseg;
+    return rate < 1024 ? 1024 : rate;
+}
+
+/* One round: every incomplete file and segment, all at the same time */
+static int run_round(struct plan *plans, size_t count) {
+    struct args batch = { NULL, 0, 0 };
+    pid_t *pids;
+    size_t npids = 0, nbatch = 0;
+    int ret = TINYPKG_OK;
+
+    pids = calloc(count * FETCH_MAX_SEGMENTS, sizeof(*pids));
+    if (!pids ||
+        args_add(&batch, "curl") != TINYPKG_OK ||
+        args_add(&batch, "-Z") != TINYPKG_OK ||
+        args_add(&batch, "--no-progress-meter") != TINYPKG_OK ||
+        args_add(&batch, "--parallel-immediate") != TINYPKG_OK ||
+        args_add(&batch, "--parallel-max") != TINYPKG_OK ||
+        args_addf(&batch, "%d", FETCH_MAX_PARALLEL) != TINYPKG_OK) {
+        ret = TINYPKG_ERR;
+        goto out;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        struct plan *p = &plans[i];
+
+        if (p->complete || p->failed) {
+            continue;
+        }
+
+        if (p->nseg == 1) {
+            if ((nbatch++ > 0 && args_add(&batch, "--next") != TINYPKG_OK) ||
+                args_add_common(&batch) != TINYPKG_OK ||
+                (p->rate > 0 && (args_add(&batch, "--limit-rate") != TINYPKG_OK ||
+                                 args_addf(&batch, "%lld", p->rate) != TINYPKG_OK)) ||
+                args_add(&batch, "-C") != TINYPKG_OK ||
+                args_add(&batch, "-") != TINYPKG_OK ||
+                args_add(&batch, "-o") != TINYPKG_OK ||
+                args_add(&batch, p->seg[0].part) != TINYPKG_OK ||
+                args_add(&batch, "-w") != TINYPKG_OK ||
+                args_addf(&batch, "%zu|%%{exitcode}|%%{http_code}\\n", i) != TINYPKG_OK ||
+                args_add(&batch, cur_url(p)) != TINYPKG_OK) {
+                ret = TINYPKG_ERR;
+                goto out;
+            }
+            continue;
+        }
+
+        /* Segments append their remaining range to their own part file */
+        for (int k = 0; k < p->nseg; k++) {
+            struct segment *s = &p->seg[k];
+            struct args a = { NULL, 0, 0 };
+            int fd;
+
+            if (segment_complete(s)) {
+                continue;
+            }
+
+            fd = open(s->part, O_WRONLY | O_CREAT | O_APPEND, 0644);
+            if (fd < 0 ||
+                args_add(&a, "curl") != TINYPKG_OK ||
+                args_add_common(&a) != TINYPKG_OK ||
+                (p->rate > 0 && (args_add(&a, "--limit-rate") != TINYPKG_OK ||
+                                 args_addf(&a, "%lld", segment_rate(p)) != TINYPKG_OK)) ||
+                args_add(&a, "-r") != TINYPKG_OK ||
+                args_addf(&a, "%lld-%lld", s->start + s->have,
+                          s->start + s->len - 1) != TINYPKG_OK ||
+                args_add(&a, cur_url(p)) != TINYPKG_OK) {
+                if (fd >= 0) close(fd);
+                args_free(&a);
+                ret = TINYPKG_ERR;
+                goto out;
+            }
+
+            pids[npids++] = spawn(a.v, fd);
+            close(fd);
+            args_free(&a);
+        }
+    }
+
+    if (nbatch > 0) {
+        ret = run_batch(&batch, plans, count, transfer_line);
+    }
+
+    if (wait_segments(pids, npids, plans, count) == FETCH_NO_CURL) {
+        ret = FETCH_NO_CURL;
+    }
+
+out:
+    free(pids);
+    args_free(&batch);
+    return ret;
+}
+
+/* Re-measure parts after a round and decide which files are complete */
+static void refresh(struct fetch_job *jobs, struct plan *plans, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        struct plan *p = &plans[i];
+        int all = 1;
+
+        if (p->complete || p->failed) {
+            continue;
+        }
+
+        for (int k = 0; k < p->nseg; k++) {
+            struct segment *s = &p->seg[k];
+
+            s->have = file_size(s->part);
+            if (s->have < 0) {
+                s->have = 0;
+            }
+
+            /* Server ignored the range and sent the whole file */
+            if (p->nseg > 1 && s->have > s->len) {
+                long long ignored = 0;
+
+                log_warn("Server ignored byte range, falling back to one stream");
+                remove_parts(jobs[i].dest);
+                p->ranges = 0;
+                make_plan(jobs[i].dest, p, &ignored);
+                all = 0;
+                break;
+            }
+
+            if (!segment_complete(s)) {
+                all = 0;
+            }
+        }
+
+        if (p->nseg == 1) {
+            all = p->done || segment_complete(&p->seg[0]);
+        }
+
+        if (all) {
+            p->complete = 1;
+            jobs[i].stats.seconds = now_sec() - p->start;
+        }
+    }
+}
+
+static long long plan_bytes(const struct plan *p) {
+    long long n = 0;
+
+    for (int k = 0; k < p->nseg; k++) {
+        n += p->seg[k].have;
+    }
+    return n;
+}
+
+/* Continue from the mirror at position pos, keeping parts if they fit */
+static void switch_mirror(struct fetch_job *job, struct plan *p, int pos) {
+    const struct candidate *c = &p->cand[p->order[pos]];
+
+    p->cur = pos;
+    p->done = 0;
+    if (c->size != p->size || (p->nseg > 1 && !c->ranges)) {
+        long long ignored = 0;
+
+        p->size = c->size;
+        p->ranges = c->ranges;
+        if (make_plan(job->dest, p, &ignored) != TINYPKG_OK) {
+            p->failed = 1;
+        }
+        job->stats.segments = p->nseg;
+    }
+}
+
+/*
+ * After a round that left the file incomplete: resume from the next usable
+ * mirror right away. Returns 1 to go on, 0 to wait for the next attempt
+ * once every mirror had its turn and -1 when no mirror is left.
+ */
+static int next_mirror(struct fetch_job *job, struct plan *p) {
+    char from[128], to[128], msg[320];
+
+    for (int pos = p->cur + 1; pos < p->nurls; pos++) {
+        if (p->cand[p->order[pos]].dead) {
+            continue;
+        }
+        mirror_host(cur_url(p), from, sizeof(from));
+        switch_mirror(job, p, pos);
+        mirror_host(cur_url(p), to, sizeof(to));
+        snprintf(msg, sizeof(msg), "%s failed for %s, trying %s", from,
+                 job->dest, to);
+        log_warn(msg);
+        job->stats.failovers++;
+        return p->failed ? -1 : 1;
+    }
+
+    /* Every mirror had its turn: start over from the best live one */
+    for (int pos = 0; pos < p->nurls; pos++) {
+        if (!p->cand[p->order[pos]].dead) {
+            if (pos != p->cur) {
+                switch_mirror(job, p, pos);
+            }
+            return p->failed ? -1 : 0;
+        }
+    }
+
+    p->failed = p->http ? p->http : 1;
+    return -1;
+}
+
+/* Join the parts into dest; a single part is just renamed */
+static int finalize(struct fetch_job *job, struct plan *p) {
+    char meta[PATH_MAX_LEN + 32], tmp[PATH_MAX_LEN + 32];
+    char buf[65536];
+    FILE *out;
+
+    snprintf(meta, sizeof(meta), "%s.part.meta", job->dest);
+
+    if (p->nseg == 1) {
+        if (rename(p->seg[0].part, job->dest) != 0) {
+            log_error("fetch", strerror(errno));
+            return TINYPKG_ERR;
+        }
+    } else {
+        snprintf(tmp, sizeof(tmp), "%s.part.tmp", job->dest);
+        out = fopen(tmp, "w");
+        if (!out) {
+            log_error("fetch", strerror(errno));
+            return TINYPKG_ERR;
+        }
+
+        for (int k = 0; k < p->nseg; k++) {
+            FILE *in = fopen(p->seg[k].part, "r");
+            size_t n;
+
+            if (!in) {
+                fclose(out);
+                unlink(tmp);
+                log_error("fetch", strerror(errno));
+                return TINYPKG_ERR;
+            }
+            while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+                fwrite(buf, 1, n, out);
+            }
+            fclose(in);
+        }
+
+        if (fclose(out) != 0 || rename(tmp, job->dest) != 0) {
+            unlink(tmp);
+            log_error("fetch", strerror(errno));
+            return TINYPKG_ERR;
+        }
+        remove_parts(job->dest);
+    }
+
+    unlink(meta);
+    job->stats.size = file_size(job->dest);
+    return TINYPKG_OK;
+}
+
+/* No curl: one resumable wget per file */
+static int fetch_with_wget(struct fetch_job *jobs, struct plan *plans, size_t count) {
+    int ret = TINYPKG_OK;
+
+    for (size_t i = 0; i < count; i++) {
+        char *argv[] = { "wget", "-q", "-c", "-O", plans[i].seg[0].part,
+                         (char *)cur_url(&plans[i]), NULL };
+
+        if (plans[i].complete || plans[i].failed) {
+            continue;
+        }
+
+        /* Parts of a segmented layout mean nothing to wget */
+        if (plans[i].nseg > 1) {
+            remove_parts(jobs[i].dest);
+            snprintf(plans[i].seg[0].part, sizeof(plans[i].seg[0].part),
+                     "%s.part", jobs[i].dest);
+            plans[i].nseg = 1;
+        }
+
+        if (wait_exit(spawn(argv, -1)) != 0) {
+            log_error("fetch", "wget failed");
+            jobs[i].status = TINYPKG_ERR;
+            ret = TINYPKG_ERR;
+            continue;
+        }
+
+        plans[i].complete = 1;
+        if (!verify(&jobs[i], &plans[i])) {
+            jobs[i].status = TINYPKG_ERR;
+            ret = TINYPKG_ERR;
+            continue;
+        }
+        jobs[i].stats.seconds = now_sec() - plans[i].start;
+    }
+
+    return ret;
+}
+
+/* ============================================================================
+ * Public API
+ * ============================================================================
+ */
+
+/*
+ * Accept "sha256:<hex>" or bare hex. Anything else fails the job, since a
+ * download that cannot be checked must not pass for a verified one, unless
+ * FETCH_UNVERIFIED_ENV allows it.
+ */
+static int set_checksum(struct plan *p, const char *checksum) {
+    const char *hex = sha256_checksum_hex(checksum);
+    const char *allow = getenv(FETCH_UNVERIFIED_ENV);
+    char msg[256];
+
+    if (!checksum || !*checksum) {
+        return TINYPKG_OK;
+    }
+    if (!hex) {
+        if (allow && *allow && strcmp(allow, "0") != 0) {
+            snprintf(msg, sizeof(msg), "Unsupported checksum '%.64s', not verified (%s)",
+                     checksum, FETCH_UNVERIFIED_ENV);
+            log_warn(msg);
+            return TINYPKG_OK;
+        }
+        snprintf(msg, sizeof(msg), "Unsupported checksum '%.64s': refusing an unverifiable "
+                 "download (set %s=1 to allow)", checksum, FETCH_UNVERIFIED_ENV);
+        log_error("fetch", msg);
+        return TINYPKG_ERR;
+    }
+
+    for (int i = 0; i < SHA256_HEX_LEN - 1; i++) {
+        p->want[i] = (char)tolower((unsigned char)hex[i]);
+    }
+    p->want[SHA256_HEX_LEN - 1] = '\0';
+    p->verify = 1;
+    return TINYPKG_OK;
+}
+
+int fetch_files(struct fetch_job *jobs, size_t count) {
+    struct samples samples = { NULL, 0 };
+    struct plan *plans;
+    int ret = TINYPKG_OK;
+    int no_curl = 0;
+    int attempt = 0;
+
+    if (count == 0) {
+        return TINYPKG_OK;
+    }
+
+    plans = calloc(count, sizeof(*plans));
+    if (!plans) {
+        log_error("fetch_files", "Out of memory");
+        return TINYPKG_ERR;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        struct plan *p = &plans[i];
+
+        memset(&jobs[i].stats, 0, sizeof(jobs[i].stats));
+        jobs[i].status = TINYPKG_ERR;
+        p->size = -1;
+        p->rate = jobs[i].rate_limit;
+        p->start = now_sec();
+        p->rejected = set_checksum(p, jobs[i].checksum) != TINYPKG_OK;
+
+        if (jobs[i].urls && jobs[i].url_count > 0) {
+            while (p->nurls < jobs[i].url_count && p->nurls < MIRROR_MAX) {
+                p->urls[p->nurls] = jobs[i].urls[p->nurls];
+                p->nurls++;
+            }
+        } else {
+            p->urls[p->nurls++] = jobs[i].url;
+        }
+    }
+
+    if (probe(plans, count) == FETCH_NO_CURL) {
+        no_curl = 1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        rank(&plans[i], &samples);
+        if (plans[i].rejected ||
+            make_plan(jobs[i].dest, &plans[i], &jobs[i].stats.resumed) != TINYPKG_OK) {
+            plans[i].failed = 1;
+        }
+        jobs[i].stats.segments = plans[i].nseg;
+    }
+
+    while (!no_curl) {
+        char msg[128];
+        int pending = 0, waiting = 0;
+        double round_start = now_sec();
+        int round;
+
+        for (size_t i = 0; i < count; i++) {
+            struct plan *p = &plans[i];
+
+            p->before = p->complete || p->failed ? -1 : plan_bytes(p);
+            p->http = 0;
+            p->waiting = 0;
+        }
+
+        round = run_round(plans, count);
+        if (round == FETCH_NO_CURL) {
+            no_curl = 1;
+            break;
+        }
+        if (round != TINYPKG_OK) {
+            ret = TINYPKG_ERR;
+            break;
+        }
+
+        refresh(jobs, plans, count);
+
+        for (size_t i = 0; i < count; i++) {
+            struct plan *p = &plans[i];
+            int next;
+
+            if (p->before < 0) {
+                continue;   /* Was not part of this round */
+            }
+            if (p->complete) {
+                verify(&jobs[i], p);
+            }
+
+            /* Throughput of this round, for the host table */
+            sample_add(&samples, cur_url(p), 0, plan_bytes(p) - p->before,
+                       now_sec() - round_start, p->complete);
+            if (p->complete) {
+                continue;
+            }
+
+            next = next_mirror(&jobs[i], p);
+            p->waiting = next == 0;
+            pending += next >= 0;
+            waiting += next == 0;
+        }
+
+        if (pending == 0 || (waiting > 0 && attempt == FETCH_RETRIES)) {
+            break;
+        }
+        if (waiting == 0) {
+            continue;   /* Only failovers: the next mirrors start right away */
+        }
+
+        /* Retry what is left, from wherever each part stopped */
+        snprintf(msg, sizeof(msg), "%d download(s) incomplete, retrying (%d/%d)",
+                 pending, attempt + 1, FETCH_RETRIES);
+        log_warn(msg);
+        for (size_t i = 0; i < count; i++) {
+            if (!plans[i].waiting) {
+                continue;
+            }
+            jobs[i].stats.retries++;
+            for (int k = 0; k < plans[i].nseg; k++) {
+                if (!segment_complete(&plans[i].seg[k])) {
+                    jobs[i].stats.resumed += plans[i].seg[k].have;
+                }
+            }
+        }
+
+        sleep_ms(FETCH_BACKOFF_MS << (attempt < 6 ? attempt : 6));
+        attempt++;
+    }
+
+    if (no_curl && fetch_with_wget(jobs, plans, count) != TINYPKG_OK) {
+        ret = TINYPKG_ERR;
+    }
+
+    mirror_record(samples.items, samples.count);
+    free(samples.items);
+
+    for (size_t i = 0; i < count; i++) {
+        if (plans[i].mismatch && !plans[i].complete) {
+            char msg[PATH_MAX_LEN + 64];
+            snprintf(msg, sizeof(msg), "No mirror served %s with the expected checksum",
+                     jobs[i].dest);
+            log_error("fetch", msg);
+        } else if (plans[i].failed > 1) {
+            char msg[PATH_MAX_LEN + 64];
+            snprintf(msg, sizeof(msg), "HTTP %d for %s", plans[i].failed,
+                     cur_url(&plans[i]));
+            log_error("fetch", msg);
+        }
+        if (plans[i].failed) {
+            char meta[PATH_MAX_LEN + 32];
+
+            /* Nothing worth resuming */
+            remove_parts(jobs[i].dest);
+            snprintf(meta, sizeof(meta), "%s.part.meta", jobs[i].dest);
+            unlink(meta);
+        }
+
+        if (!plans[i].complete || finalize(&jobs[i], &plans[i]) != TINYPKG_OK) {
+            ret = TINYPKG_ERR;
+            continue;
+        }
+        jobs[i].stats.segments = plans[i].nseg;
+        mirror_host(cur_url(&plans[i]), jobs[i].stats.host, sizeof(jobs[i].stats.host));
+        jobs[i].status = TINYPKG_OK;
+
+        /* Only the bytes that came over the wire this time */
+        {
+            const struct fetch_stats *st = &jobs[i].stats;
+            double bytes = (double)(st->size - st->resumed);
+
+            metrics_add(METRIC_DOWNLOAD_BYTES, st->host, bytes > 0 ? bytes : 0);
+            metrics_add(METRIC_DOWNLOAD_SECONDS, st->host, st->seconds);
+            if (st->seconds > 0 && bytes > 0) {
+                metrics_observe(METRIC_DOWNLOAD_THROUGHPUT, st->host, bytes / st->seconds);
+            }
+        }
+    }
+
+    free(plans);
+    return ret;
+}
+
+/* A header's value in a curl -D dump; after redirects, the last response's */
+static void dump_header(const char *path, const char *name, char *out, size_t len) {
+    FILE *f = fopen(path, "r");
+    char line[1024];
+    size_t n = strlen(name);
+
+    out[0] = '\0';
+    if (!f) {
+        return;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "HTTP/", 5) == 0) {
+            out[0] = '\0';
+        } else if (strncasecmp(line, name, n) == 0 && line[n] == ':') {
+            char *v = line + n + 1;
+            v += strspn(v, " \t");
+            v[strcspn(v, "\r\n")] = '\0';
+            snprintf(out, len, "%s", v);
+        }
+    }
+    fclose(f);
+}
+
+/* fetch_if_changed() for file://: size and mtime stand in for an ETag */
+static int file_if_changed(const char *path, const char *dest, struct fetch_cond *cond) {
+    char tag[sizeof(cond->etag)];
+    char tmp[PATH_MAX_LEN + 8];
+    char buf[65536];
+    struct stat st;
+    int in, out, ret = TINYPKG_OK;
+    ssize_t n;
+
+    if (stat(path, &st) != 0) {
+        log_error("fetch", strerror(errno));
+        return TINYPKG_ERR;
+    }
+    snprintf(tag, sizeof(tag), "\"%lld-%lld.%09ld\"", (long long)st.st_size,
+             (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+    if (strcmp(tag, cond->etag) == 0) {
+        return FETCH_NOT_MODIFIED;
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.part", dest);
+    in = open(path, O_RDONLY);
+    out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (in < 0 || out < 0) {
+        ret = TINYPKG_ERR;
+    }
+    while (ret == TINYPKG_OK && (n = read(in, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            ret = errno == EINTR ? TINYPKG_OK : TINYPKG_ERR;
+            continue;
+        }
+        for (ssize_t off = 0; off < n; ) {
+            ssize_t w = write(out, buf + off, (size_t)(n - off));
+            if (w < 0 && errno == EINTR) {
+                continue;
+            }
+            if (w <= 0) {
+                ret = TINYPKG_ERR;
+                break;
+            }
+            off += w;
+        }
+    }
+    if (in >= 0) close(in);
+    if (out >= 0 && close(out) != 0) ret = TINYPKG_ERR;
+
+    if (ret != TINYPKG_OK || rename(tmp, dest) != 0) {
+        log_error("fetch", strerror(errno));
+        unlink(tmp);
+        return TINYPKG_ERR;
+    }
+    memcpy(cond->etag, tag, sizeof(tag));
+    cond->modified[0] = '\0';
+    return TINYPKG_OK;
+}
+
+int fetch_if_changed(const char *url, const char *dest, struct fetch_cond *cond) {
+    struct args a = { NULL, 0, 0 };
+    char tmp[PATH_MAX_LEN + 8], dump[PATH_MAX_LEN + 16];
+    char status[32] = "";
+    char msg[PATH_MAX_LEN];
+    size_t used = 0;
+    int fds[2], code, http, ret = TINYPKG_ERR;
+    ssize_t n;
+    pid_t pid;
+
+    if (strncmp(url, "file://", 7) == 0) {
+        return file_if_changed(url + 7, dest, cond);
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.part", dest);
+    snprintf(dump, sizeof(dump), "%s.headers", dest);
+    if (args_add(&a, "curl") != TINYPKG_OK ||
+        args_add_common(&a) != TINYPKG_OK ||
+        args_add(&a, "-o") != TINYPKG_OK || args_add(&a, tmp) != TINYPKG_OK ||
+        args_add(&a, "-D") != TINYPKG_OK || args_add(&a, dump) != TINYPKG_OK ||
+        args_add(&a, "-w") != TINYPKG_OK || args_add(&a, "%{http_code}") != TINYPKG_OK ||
+        (cond->etag[0] && (args_add(&a, "-H") != TINYPKG_OK ||
+                           args_addf(&a, "If-None-Match: %s", cond->etag) != TINYPKG_OK)) ||
+        (cond->modified[0] && (args_add(&a, "-H") != TINYPKG_OK ||
+                               args_addf(&a, "If-Modified-Since: %s", cond->modified)
+                                   != TINYPKG_OK)) ||
+        args_add(&a, url) != TINYPKG_OK || pipe(fds) != 0) {
+        log_error("fetch", strerror(errno));
+        args_free(&a);
+        return TINYPKG_ERR;
+    }
+
+    pid = spawn(a.v, fds[1]);
+    close(fds[1]);
+    while ((n = read(fds[0], status + used, sizeof(status) - 1 - used)) != 0) {
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) break;
+        used += (size_t)n;
+    }
+    status[used] = '\0';
+    close(fds[0]);
+    code = wait_exit(pid);
+    http = atoi(status);
+
+    if (code == 127) {
+        log_error("fetch", "curl is required for http(s) downloads");
+    } else if (code == 0 && http == 304) {
+        ret = FETCH_NOT_MODIFIED;
+    } else if (code == 0 && http == 200) {
+        dump_header(dump, "ETag", cond->etag, sizeof(cond->etag));
+        dump_header(dump, "Last-Modified", cond->modified, sizeof(cond->modified));
+        ret = rename(tmp, dest) == 0 ? TINYPKG_OK : TINYPKG_ERR;
+    } else {
+        snprintf(msg, sizeof(msg), "%s: %s %d", url, http ? "HTTP" : "curl exit", http ? http : code);
+        log_error("fetch", msg);
+    }
+
+    unlink(tmp);
+    unlink(dump);
+    args_free(&a);
+    return ret;
+}
+
+int fetch_sizes(const char *const urls[], long long sizes[], size_t count) {
+    struct plan *plans;
+    int ret;
+
+    if (count == 0) {
+        return TINYPKG_OK;
+    }
+
+    plans = calloc(count, sizeof(*plans));
+    if (!plans) {
+        log_error("fetch_sizes", "Out of memory");
+        return TINYPKG_ERR;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        plans[i].urls[0] = urls[i];
+        plans[i].nurls = 1;
+    }
+
+    ret = probe(plans, count);
+    for (size_t i = 0; i < count; i++) {
+        sizes[i] = plans[i].cand[0].ok ? plans[i].cand[0].size : -1;
+    }
+
+    free(plans);
+    return ret == TINYPKG_OK ? TINYPKG_OK : TINYPKG_ERR;
+}
+
+int fetch_exists(const char *const urls[], int found[], size_t count) {
+    struct plan *plans;
+    int ret;
+
+    if (count == 0) {
+        return TINYPKG_OK;
+    }
+
+    plans = calloc(count, sizeof(*plans));
+    if (!plans) {
+        log_error("fetch_exists", "Out of memory");
+        return TINYPKG_ERR;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        plans[i].urls[0] = urls[i];
+        plans[i].nurls = 1;
+    }
+
+    ret = probe(plans, count);
+    for (size_t i = 0; i < count; i++) {
+        found[i] = plans[i].cand[0].ok;
+    }
+
+    free(plans);
+    return ret == TINYPKG_OK ? TINYPKG_OK : TINYPKG_ERR;
+}
+
+int fetch_file(const char *url, const char *dest, struct fetch_stats *stats) {
+    struct fetch_job job;
+    int ret;
+
+    memset(&job, 0, sizeof(job));
+    job.url = url;
+    job.dest = dest;
+
+    ret = fetch_files(&job, 1);
+    if (stats) {
+        *stats = job.stats;
+    }
+    return ret;
+}
+
+void fetch_print_stats(const char *label, const struct fetch_stats *st) {
+    double mib = st->size / 1048576.0;
+
+    printf("%s: %.1f MiB in %.2fs (%.1f MiB/s)", label, mib, st->seconds,
+           st->seconds > 0 ? mib / st->seconds : 0.0);
+    if (st->host[0]) {
+        printf(" from %s", st->host);
+    }
+    if (st->segments > 1) {
+        printf(", %d segments", st->segments);
+    }
+    if (st->retries > 0) {
+        printf(", %d retr%s", st->retries, st->retries == 1 ? "y" : "ies");
+    }
+    if (st->verified) {
+        printf(", sha256 verified");
+    }
+    if (st->failovers > 0) {
+        printf(", %d failover%s", st->failovers, st->failovers == 1 ? "" : "s");
+    }
+    if (st->resumed > 0) {
+        printf(", %.1f MiB kept by resuming", st->resumed / 1048576.0);
+    }
+    printf("\n");
+}
@@ -0,0 +1,610 @@
+/*
+ * gc.c - Size-budgeted LRU garbage collection of build trees and caches
+ *
+ * The build pipeline records the size and last-use time of every cache
+ * entry it produces or reads in ~/.cache/tinypkg/gc.ledger:
+ *
+ *   tinypkg-gc 1
+ *   <kind> <name> <bytes> <last_use>
+ *
+ * Only the entry that just changed is measured, so keeping the ledger
+ * current never needs a walk of the whole cache. Eviction removes the
+ * least recently used entries until the total fits the byte budget.
+ */
+
+#include "common.h"
+#include "config.h"
+#include "gc.h"
+#include "metrics.h"
+#include "store.h"
+#include "strip.h"
+#include <dirent.h>
+#include <pthread.h>
+
+struct gc_entry {
+    char kind[16];
+    char name[128];
+    unsigned long long bytes;
+    long long last_use;
+};
+
+struct gc_ledger {
+    struct gc_entry *entries;
+    size_t count;
+    size_t cap;
+};
+
+static const char *gc_kinds[] = {
+    GC_KIND_BUILD, GC_KIND_SOURCE, GC_KIND_ARTIFACT, GC_KIND_DEBUG, NULL
+};
+
+/* ============================================================================
+ * Filesystem helpers
+ * ============================================================================
+ */
+
+/* Disk usage of a file or directory tree (does not follow symlinks) */
+static unsigned long long path_usage(const char *path) {
+    struct stat st;
+    unsigned long long total;
+    struct dirent *de;
+    DIR *d;
+
+    if (lstat(path, &st) != 0) {
+        return 0;
+    }
+
+    total = (unsigned long long)st.st_blocks * 512ULL;
+    if (!S_ISDIR(st.st_mode)) {
+        return total;
+    }
+
+    d = opendir(path);
+    if (!d) {
+        return total;
+    }
+
+    while ((de = readdir(d)) != NULL) {
+        char child[PATH_MAX_LEN];
+
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        if (snprintf(child, sizeof(child), "%s/%s", path, de->d_name)
+            >= (int)sizeof(child)) {
+            continue;
+        }
+        total += path_usage(child);
+    }
+
+    closedir(d);
+    return total;
+}
+
+/* Map a ledger entry to the path it accounts for */
+static void entry_path(char *dst, size_t len, const char *kind, const char *name) {
+    if (strcmp(kind, GC_KIND_SOURCE) == 0) {
+        snprintf(dst, len, "%s/%s/source.tar.gz", get_build_dir(), name);
+    } else if (strcmp(kind, GC_KIND_ARTIFACT) == 0) {
+        snprintf(dst, len, "%s/%s/PKG", get_cache_path(), name);
+    } else if (strcmp(kind, GC_KIND_DEBUG) == 0) {
+        snprintf(dst, len, "%s/%s/%s", get_cache_path(), STRIP_DEBUG_DIR, name);
+    } else {
+        snprintf(dst, len, "%s/%s", get_build_dir(), name);
+    }
+}
+
+/* Measure an entry; a build tree excludes the tarball kept beside it */
+static unsigned long long entry_usage(const char *kind, const char *name) {
+    char path[PATH_MAX_LEN];
+    unsigned long long bytes;
+
+    entry_path(path, sizeof(path), kind, name);
+    bytes = path_usage(path);
+
+    if (strcmp(kind, GC_KIND_BUILD) == 0) {
+        char tarball[PATH_MAX_LEN];
+        unsigned long long tar_bytes;
+
+        entry_path(tarball, sizeof(tarball), GC_KIND_SOURCE, name);
+        tar_bytes = path_usage(tarball);
+        bytes = bytes > tar_bytes ? bytes - tar_bytes : 0;
+
+        /* An empty build directory is only the directory inode itself */
+        if (bytes <= 4096) {
+            bytes = 0;
+        }
+    }
+
+    return bytes;
+}
+
+/* Evict one entry from disk */
+static int entry_remove(const char *kind, const char *name) {
+    char path[PATH_MAX_LEN];
+    struct dirent *de;
+    DIR *d;
+    int ret = TINYPKG_OK;
+
+    entry_path(path, sizeof(path), kind, name);
+
+    if (strcmp(kind, GC_KIND_BUILD) != 0) {
+        return remove_tree(path);
+    }
+
+    /* Build tree: drop everything except the cached tarball */
+    d = opendir(path);
+    if (!d) {
+        return errno == ENOENT ? TINYPKG_OK : TINYPKG_ERR;
+    }
+
+    while ((de = readdir(d)) != NULL) {
+        char child[PATH_MAX_LEN];
+
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0 ||
+            strcmp(de->d_name, "source.tar.gz") == 0) {
+            continue;
+        }
+        if (snprintf(child, sizeof(child), "%s/%s", path, de->d_name)
+            >= (int)sizeof(child)) {
+            continue;
+        }
+        if (remove_tree(child) != TINYPKG_OK) {
+            ret = TINYPKG_ERR;
+        }
+    }
+
+    closedir(d);
+    rmdir(path);    /* Succeeds only when no tarball remains */
+    return ret;
+}
+
+/* ============================================================================
+ * Ledger I/O
+ * ============================================================================
+ */
+
+/* fcntl locks only exclude other processes; parallel builds are threads */
+static pthread_mutex_t ledger_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Serialize ledger updates between concurrent tinypkg processes */
+static int ledger_lock(void) {
+    char lock_path[PATH_MAX_LEN];
+    struct flock fl;
+    struct timespec t0;
+    int fd;
+
+    snprintf(lock_path, sizeof(lock_path), "%s/%s.lock",
+             get_cache_path(), GC_LEDGER_FILE);
+
+    if (mkdir_p(get_cache_path()) != TINYPKG_OK) {
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_mutex_lock(&ledger_mutex);
+    fd = open(lock_path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        log_error("ledger_lock", strerror(errno));
+        pthread_mutex_unlock(&ledger_mutex);
+        return -1;
+    }
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    if (fcntl(fd, F_SETLKW, &fl) != 0) {
+        log_error("ledger_lock", strerror(errno));
+        close(fd);
+        pthread_mutex_unlock(&ledger_mutex);
+        return -1;
+    }
+
+    metrics_observe(METRIC_LOCK_WAIT_SECONDS, "gc", metrics_since(&t0));
+    return fd;
+}
+
+static void ledger_unlock(int fd) {
+    if (fd >= 0) {
+        close(fd);  /* Releases the fcntl lock */
+        pthread_mutex_unlock(&ledger_mutex);
+    }
+}
+
+static void ledger_free(struct gc_ledger *l) {
+    free(l->entries);
+    memset(l, 0, sizeof(*l));
+}
+
+static struct gc_entry *ledger_find(struct gc_ledger *l,
+                                    const char *kind, const char *name) {
+    for (size_t i = 0; i < l->count; i++) {
+        if (strcmp(l->entries[i].kind, kind) == 0 &&
+            strcmp(l->entries[i].name, name) == 0) {
+            return &l->entries[i];
+        }
+    }
+    return NULL;
+}
+
+static struct gc_entry *ledger_add(struct gc_ledger *l,
+                                   const char *kind, const char *name) {
+    struct gc_entry *e;
+
+    if (l->count == l->cap) {
+        size_t new_cap = l->cap ? l->cap * 2 : 32;
+        struct gc_entry *p = realloc(l->entries, new_cap * sizeof(*p));
+        if (!p) {
+            log_error("ledger_add", strerror(errno));
+            return NULL;
+        }
+        l->entries = p;
+        l->cap = new_cap;
+    }
+
+    e = &l->entries[l->count++];
+    memset(e, 0, sizeof(*e));
+    strncpy(e->kind, kind, sizeof(e->kind) - 1);
+    strncpy(e->name, name, sizeof(e->name) - 1);
+    return e;
+}
+
+static int ledger_load(struct gc_ledger *l) {
+    char path[PATH_MAX_LEN];
+    char line[LINE_MAX_LEN];
+    FILE *f;
+
+    memset(l, 0, sizeof(*l));
+    snprintf(path, sizeof(path), "%s/%s", get_cache_path(), GC_LEDGER_FILE);
+
+    f = fopen(path, "r");
+    if (!f) {
+        return TINYPKG_OK;  /* Empty ledger */
+    }
+
+    if (!fgets(line, sizeof(line), f) ||
+        strncmp(line, GC_LEDGER_MAGIC, strlen(GC_LEDGER_MAGIC)) != 0) {
+        log_warn("Cache ledger has an unknown format, ignoring it");
+        fclose(f);
+        return TINYPKG_OK;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        char kind[16], name[128];
+        unsigned long long bytes;
+        long long last_use;
+        struct gc_entry *e;
+
+        if (sscanf(line, "%15s %127s %llu %lld",
+                   kind, name, &bytes, &last_use) != 4) {
+            continue;
+        }
+
+        e = ledger_add(l, kind, name);
+        if (!e) {
+            fclose(f);
+            ledger_free(l);
+            return TINYPKG_ERR;
+        }
+        e->bytes = bytes;
+        e->last_use = last_use;
+    }
+
+    fclose(f);
+    return TINYPKG_OK;
+}
+
+static int ledger_save(const struct gc_ledger *l) {
+    char path[PATH_MAX_LEN];
+    char tmp_path[PATH_MAX_LEN];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/%s", get_cache_path(), GC_LEDGER_FILE);
+    snprintf(tmp_path, sizeof(tmp_path), "%s/%s.tmp",
+             get_cache_path(), GC_LEDGER_FILE);
+
+    f = fopen(tmp_path, "w");
+    if (!f) {
+        log_error("ledger_save", strerror(errno));
+        return TINYPKG_ERR;
+    }
+
+    fprintf(f, "%s\n", GC_LEDGER_MAGIC);
+    for (size_t i = 0; i < l->count; i++) {
+        const struct gc_entry *e = &l->entries[i];
+        if (e->bytes == 0) {
+            continue;   /* Entry no longer exists on disk */
+        }
+        fprintf(f, "%s %s %llu %lld\n", e->kind, e->name, e->bytes, e->last_use);
+    }
+
+    if (fclose(f) != 0 || rename(tmp_path, path) != 0) {
+        log_error("ledger_save", strerror(errno));
+        unlink(tmp_path);
+        return TINYPKG_ERR;
+    }
+
+    return TINYPKG_OK;
+}
+
+/* Update one entry: re-measure it if measure is set, always stamp last use */
+static int ledger_update(const char *kind, const char *name, int measure) {
+    struct gc_ledger l;
+    struct gc_entry *e;
+    int fd, ret;
+
+    if (!kind || !name) {
+        return TINYPKG_ERR;
+    }
+
+    fd = ledger_lock();
+    if (fd < 0) {
+        return TINYPKG_ERR;
+    }
+
+    if (ledger_load(&l) != TINYPKG_OK) {
+        ledger_unlock(fd);
+        return TINYPKG_ERR;
+    }
+
+    e = ledger_find(&l, kind, name);
+    if (!e) {
+        e = ledger_add(&l, kind, name);
+        measure = 1;
+    }
+
+    if (e) {
+        if (measure) {
+            e->bytes = entry_usage(kind, name);
+        }
+        e->last_use = (long long)time(NULL);
+    }
+
+    ret = e ? ledger_save(&l) : TINYPKG_ERR;
+    ledger_free(&l);
+    ledger_unlock(fd);
+    return ret;
+}
+
+/* ============================================================================
+ * Public API
+ * ============================================================================
+ */
+
+/* Measure an entry that was just produced and mark it as used */
+int gc_record(const char *kind, const char *name) {
+    return ledger_update(kind, name, 1);
+}
+
+/* Mark an existing entry as used without re-measuring it */
+int gc_touch(const char *kind, const char *name) {
+    return ledger_update(kind, name, 0);
+}
+
+static int entry_lru_cmp(const void *a, const void *b) {
+    const struct gc_entry *ea = a;
+    const struct gc_entry *eb = b;
+
+    if (ea->last_use != eb->last_use) {
+        return ea->last_use < eb->last_use ? -1 : 1;
+    }
+    return (ea->bytes > eb->bytes) ? -1 : (ea->bytes < eb->bytes);
+}
+
+static int is_kept(const char *name, const char *const *keep, int nkeep) {
+    for (int i = 0; i < nkeep; i++) {
+        if (strcmp(keep[i], name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Evict least recently used entries until the ledger total fits budget,
+ * never touching the entries of the packages in keep. Store objects the
+ * evicted prefixes were the last users of go too (always with sweep).
+ */
+static int collect(unsigned long long budget, int dry_run,
+                   const char *const *keep, int nkeep, int sweep) {
+    struct gc_ledger l;
+    unsigned long long total = 0, freed = 0;
+    int evicted = 0;
+    int fd, ret = TINYPKG_OK;
+
+    fd = ledger_lock();
+    if (fd < 0) {
+        return TINYPKG_ERR;
+    }
+
+    if (ledger_load(&l) != TINYPKG_OK) {
+        ledger_unlock(fd);
+        return TINYPKG_ERR;
+    }
+
+    for (size_t i = 0; i < l.count; i++) {
+        total += l.entries[i].bytes;
+    }
+
+    if (l.count > 0) {
+        qsort(l.entries, l.count, sizeof(*l.entries), entry_lru_cmp);
+    }
+
+    for (size_t i = 0; i < l.count && total > budget; i++) {
+        struct gc_entry *e = &l.entries[i];
+
+        if (e->bytes == 0 || is_kept(e->name, keep, nkeep)) {
+            continue;
+        }
+
+        printf("%s %s %s (%llu KB)\n", dry_run ? "Would evict" : "Evicting",
+               e->kind, e->name, e->bytes / 1024);
+
+        if (!dry_run && entry_remove(e->kind, e->name) != TINYPKG_OK) {
+            fprintf(stderr, "Warning: Could not fully remove %s %s\n",
+                    e->kind, e->name);
+            ret = TINYPKG_ERR;
+        }
+
+        total -= e->bytes;
+        freed += e->bytes;
+        evicted++;
+        if (!dry_run) {
+            e->bytes = 0;
+        }
+    }
+
+    if (!dry_run && evicted > 0) {
+        if (ledger_save(&l) != TINYPKG_OK) {
+            ret = TINYPKG_ERR;
+        }
+    }
+    if (!dry_run && (evicted > 0 || sweep)) {
+        unsigned long long swept;
+        if (store_sweep(&swept) != TINYPKG_OK) {
+            ret = TINYPKG_ERR;
+        }
+    }
+
+    printf("Cache: %llu MB used, budget %llu MB, %s %llu MB in %d entr%s\n",
+           (total + freed) / (1024 * 1024), budget / (1024 * 1024),
+           dry_run ? "would free" : "freed", freed / (1024 * 1024),
+           evicted, evicted == 1 ? "y" : "ies");
+
+    ledger_free(&l);
+    ledger_unlock(fd);
+    return ret;
+}
+
+/* Post-build hook: enforce the configured budget */
+unsigned long long gc_usage(const char *kind, const char *name) {
+    return entry_usage(kind, name);
+}
+
+unsigned long long gc_path_usage(const char *path) {
+    return path_usage(path);
+}
+
+int gc_collect(unsigned long long budget, int dry_run) {
+    return collect(budget, dry_run, NULL, 0, 1);
+}
+
+int gc_auto(void) {
+    return collect(gc_budget(), 0, NULL, 0, 0);
+}
+
+int gc_auto_except(const char *const *keep, int nkeep) {
+    return collect(gc_budget(), 0, keep, nkeep, 0);
+}
+
+/* Rebuild the ledger from disk (bootstrap or after manual cleanup) */
+int gc_rescan(void) {
+    struct gc_ledger l;
+    struct dirent *de;
+    DIR *d;
+    int fd, ret;
+    long long now = (long long)time(NULL);
+
+    fd = ledger_lock();
+    if (fd < 0) {
+        return TINYPKG_ERR;
+    }
+
+    if (ledger_load(&l) != TINYPKG_OK) {
+        ledger_unlock(fd);
+        return TINYPKG_ERR;
+    }
+
+    /* Existing entries keep their last-use stamps, sizes are refreshed */
+    for (size_t i = 0; i < l.count; i++) {
+        l.entries[i].bytes = entry_usage(l.entries[i].kind, l.entries[i].name);
+    }
+
+    /* Pick up build directories the ledger has never seen */
+    d = opendir(get_build_dir());
+    while (d && (de = readdir(d)) != NULL) {
+        if (!is_valid_package_name(de->d_name)) {
+            continue;
+        }
+        for (int k = 0; gc_kinds[k]; k++) {
+            struct gc_entry *e;
+            unsigned long long bytes;
+
+            if (ledger_find(&l, gc_kinds[k], de->d_name)) {
+                continue;
+            }
+            bytes = entry_usage(gc_kinds[k], de->d_name);
+            if (bytes == 0) {
+                continue;
+            }
+            e = ledger_add(&l, gc_kinds[k], de->d_name);
+            if (e) {
+                e->bytes = bytes;
+                e->last_use = now;
+            }
+        }
+    }
+    if (d) {
+        closedir(d);
+    }
+
+    ret = ledger_save(&l);
+    ledger_free(&l);
+    ledger_unlock(fd);
+    return ret;
+}
+
+/* Parse "123", "512K", "300M", "2G" into bytes */
+int gc_parse_size(const char *str, unsigned long long *out) {
+    char *end;
+    unsigned long long val;
+
+    if (!str || !*str || !out) {
+        return TINYPKG_ERR;
+    }
+
+    errno = 0;
+    val = strtoull(str, &end, 10);
+    if (errno != 0 || end == str) {
+        return TINYPKG_ERR;
+    }
+
+    switch (toupper((unsigned char)*end)) {
+    case '\0':
+        break;
+    case 'K':
+        val <<= 10;
+        end++;
+        break;
+    case 'M':
+        val <<= 20;
+        end++;
+        break;
+    case 'G':
+        val <<= 30;
+        end++;
+        break;
+    default:
+        return TINYPKG_ERR;
+    }
+
+    if (*end && !(toupper((unsigned char)end[0]) == 'B' && end[1] == '\0')) {
+        return TINYPKG_ERR;
+    }
+
+    *out = val;
+    return TINYPKG_OK;
+}
+
+unsigned long long gc_budget(void) {
+    const char *env = getenv(GC_BUDGET_ENV);
+    unsigned long long budget;
+
+    if (env && gc_parse_size(env, &budget) == TINYPKG_OK) {
+        return budget;
+    }
+    if (env) {
+        log_warn("Invalid " GC_BUDGET_ENV ", using default budget");
+    }
+    return GC_DEFAULT_BUDGET;
+}
@@ -0,0 +1,1047 @@
+/*
+ * index.c - Derived package index (compiled from manifests at sync time)
+ *
+ * The first 'repo sync' reads every packages/<name>/manifest.yaml once and
+ * compiles them into ~/.cache/tinypkg/pkgindex.db, a sorted, tab-separated
+ * file:
+ *
+ *   tinypkg-index 2
+ *   commit <sha of the repository HEAD indexed>
+ *   <name>\t<version>\t<depends...>\t<rdepends...>
+ *
+ * The reverse-dependency column is the precomputed adjacency list, so
+ * 'remove' and 'rdeps' answer from the index without reparsing manifests.
+ * Later syncs ask git (or, for a snapshot tree, the snapshot's change
+ * journal) which manifests changed since that commit and patch only those
+ * entries and the edges they add or drop. Manifests are parsed
+ * by check.c, which validates them at the same time.
+ */
+
+#include "common.h"
+#include "index.h"
+#include "build.h"
+#include "check.h"
+#include "snapshot.h"
+#include <dirent.h>
+#include <sys/mman.h>
+
+/* Append word to a space-separated, heap-allocated list */
+static int list_append(char **list, const char *word) {
+    size_t old_len = *list ? strlen(*list) : 0;
+    size_t word_len = strlen(word);
+    char *p = realloc(*list, old_len + word_len + 2);
+
+    if (!p) {
+        log_error("list_append", strerror(errno));
+        return TINYPKG_ERR;
+    }
+
+    if (old_len > 0) {
+        p[old_len++] = ' ';
+    }
+    memcpy(p + old_len, word, word_len + 1);
+    *list = p;
+    return TINYPKG_OK;
+}
+
+/* Whether word is in a space-separated list */
+static int list_has(const char *list, const char *word) {
+    size_t len = strlen(word);
+
+    for (const char *p = list; p && *p; ) {
+        size_t n = strcspn(p, " ");
+        if (n == len && strncmp(p, word, len) == 0) {
+            return 1;
+        }
+        p += n + (p[n] == ' ');
+    }
+    return 0;
+}
+
+/* Drop word from a space-separated list, if there */
+static void list_remove(char *list, const char *word) {
+    size_t len = strlen(word);
+
+    for (char *p = list; p && *p; ) {
+        size_t n = strcspn(p, " ");
+        if (n == len && strncmp(p, word, len) == 0) {
+            if (p[n] == ' ') {
+                memmove(p, p + n + 1, strlen(p + n + 1) + 1);
+            } else {
+                *(p > list ? p - 1 : p) = '\0';
+            }
+            return;
+        }
+        p += n + (p[n] == ' ');
+    }
+}
+
+/* Add word to a sorted space-separated list, keeping it sorted and unique */
+static int list_insert(char **list, const char *word) {
+    size_t len = strlen(word), old_len = *list ? strlen(*list) : 0, at = 0;
+    char *p;
+
+    if (list_has(*list, word)) {
+        return TINYPKG_OK;
+    }
+    while (at < old_len) {
+        size_t n = strcspn(*list + at, " ");
+        int cmp = strncmp(*list + at, word, n < len ? n : len);
+        if (cmp > 0 || (cmp == 0 && n > len)) {
+            break;
+        }
+        at += n + ((*list)[at + n] == ' ');
+    }
+
+    p = realloc(*list, old_len + len + 2);
+    if (!p) {
+        log_error("list_insert", strerror(errno));
+        return TINYPKG_ERR;
+    }
+    if (at >= old_len) {
+        p[old_len] = '\0';
+        *list = p;
+        return list_append(list, word);
+    }
+    memmove(p + at + len + 1, p + at, old_len - at + 1);
+    memcpy(p + at, word, len);
+    p[at + len] = ' ';
+    *list = p;
+    return TINYPKG_OK;
+}
+
+static int entry_cmp(const void *a, const void *b) {
+    const struct index_entry *ea = a;
+    const struct index_entry *eb = b;
+    return strcmp(ea->name, eb->name);
+}
+
+/* Write the index atomically (temp file + rename) */
+static int index_write(const struct pkg_index *idx) {
+    char *cache = get_cache_path();
+    char db_path[PATH_MAX_LEN];
+    char tmp_path[PATH_MAX_LEN];
+    FILE *f;
+
+    snprintf(db_path, PATH_MAX_LEN, "%s/%s", cache, INDEX_DB_FILE);
+    snprintf(tmp_path, PATH_MAX_LEN, "%s/%s.tmp", cache, INDEX_DB_FILE);
+
+    f = fopen(tmp_path, "w");
+    if (!f) {
+        log_error("index_write", strerror(errno));
+        return TINYPKG_ERR;
+    }
+
+    fprintf(f, "%s\n", INDEX_DB_MAGIC);
+    fprintf(f, "commit %s\n", idx->commit[0] ? idx->commit : "-");
+    for (size_t i = 0; i < idx->count; i++) {
+        const struct index_entry *e = &idx->entries[i];
+        fprintf(f, "%s\t%s\t%s\t%s\n", e->name,
+                e->version[0] ? e->version : "unknown",
+                e->depends ? e->depends : "",
+                e->rdepends ? e->rdepends : "");
+    }
+
+    if (fclose(f) != 0 || rename(tmp_path, db_path) != 0) {
+        log_error("index_write", strerror(errno));
+        unlink(tmp_path);
+        return TINYPKG_ERR;
+    }
+
+    return TINYPKG_OK;
+}
+
+/* Run git in the cached repository; its stdout, reaped by git_close() */
+static FILE *git_open(char *const args[], pid_t *pid) {
+    char repo[PATH_MAX_LEN];
+    char *argv[16] = { "git", "-C", repo };
+    int fds[2], n = 3;
+    FILE *f;
+
+    snprintf(repo, sizeof(repo), "%s/repo", get_cache_path());
+    for (int i = 0; args[i] && n < 15; i++) {
+        argv[n++] = args[i];
+    }
+    argv[n] = NULL;
+
+    if (pipe(fds) != 0) {
+        log_error("index_sync", strerror(errno));
+        return NULL;
+    }
+    *pid = fork();
+    if (*pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+
+        /* Our caller explains a failure; git's own message would only confuse */
+        if (dup2(fds[1], STDOUT_FILENO) < 0 || (null >= 0 && dup2(null, STDERR_FILENO) < 0)) {
+            _exit(127);
+        }
+        close(fds[0]);
+        close(fds[1]);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    close(fds[1]);
+    if (*pid < 0 || !(f = fdopen(fds[0], "r"))) {
+        log_error("index_sync", strerror(errno));
+        close(fds[0]);
+        return NULL;
+    }
+    return f;
+}
+
+static int git_close(FILE *f, pid_t pid) {
+    int status;
+
+    fclose(f);
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return TINYPKG_ERR;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? TINYPKG_OK : TINYPKG_ERR;
+}
+
+void index_head(char commit[64]) {
+    char *args[] = { "rev-parse", "HEAD", NULL };
+    pid_t pid;
+    FILE *f;
+
+    if (snapshot_id(commit) == TINYPKG_OK) {
+        return;
+    }
+    snprintf(commit, 64, "-");
+    f = git_open(args, &pid);
+    if (!f) {
+        return;
+    }
+    if (!fgets(commit, 64, f)) {
+        snprintf(commit, 64, "-");
+    }
+    commit[strcspn(commit, "\n")] = '\0';
+    if (git_close(f, pid) != TINYPKG_OK || !commit[0]) {
+        snprintf(commit, 64, "-");
+    }
+}
+
+/* Add name to the reverse lists of the packages it depends on */
+static int link_deps(struct pkg_index *idx, const struct index_entry *e, size_t *edges) {
+    char *deps, *tok, *save = NULL;
+    char name[sizeof(e->name)];
+
+    if (!e->depends || !e->depends[0]) {
+        return TINYPKG_OK;
+    }
+    deps = strdup(e->depends);
+    if (!deps) {
+        return TINYPKG_ERR;
+    }
+    memcpy(name, e->name, sizeof(name));
+
+    for (tok = strtok_r(deps, " ", &save); tok; tok = strtok_r(NULL, " ", &save)) {
+        struct index_entry *dep = index_find(idx, tok);
+        if (!dep) {
+            continue;   /* Not provided by this repository */
+        }
+        if (list_insert(&dep->rdepends, name) != TINYPKG_OK) {
+            free(deps);
+            return TINYPKG_ERR;
+        }
+        if (edges) (*edges)++;
+    }
+    free(deps);
+    return TINYPKG_OK;
+}
+
+/* Take name off the reverse lists of the packages e depends on */
+static void unlink_deps(struct pkg_index *idx, const struct index_entry *e) {
+    char *deps, *tok, *save = NULL;
+
+    if (!e->depends || !(deps = strdup(e->depends))) {
+        return;
+    }
+    for (tok = strtok_r(deps, " ", &save); tok; tok = strtok_r(NULL, " ", &save)) {
+        struct index_entry *dep = index_find(idx, tok);
+        if (dep && dep->rdepends) {
+            list_remove(dep->rdepends, e->name);
+        }
+    }
+    free(deps);
+}
+
+/*
+ * Fill in every reverse list at once. Entries are visited in name order, so
+ * each list comes out sorted without link_deps()'s insert per edge, which
+ * is quadratic in a popular dependency's fan-in; sizes are counted first so
+ * each list is allocated exactly once.
+ */
+static int link_all(struct pkg_index *idx, size_t *edges) {
+    size_t *len = calloc(idx->count ? idx->count : 1, sizeof(*len));
+
+    if (!len) {
+        log_error("index_build", strerror(errno));
+        return TINYPKG_ERR;
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < idx->count; i++) {
+            const char *name = idx->entries[i].name;
+            size_t name_len = strlen(name);
+
+            for (const char *p = idx->entries[i].depends; p && *p; ) {
+                size_t n = strcspn(p, " ");
+                struct index_entry *dep;
+                char word[128];
+
+                if (n < sizeof(word)) {
+                    memcpy(word, p, n);
+                    word[n] = '\0';
+                    dep = index_find(idx, word);
+                } else {
+                    dep = NULL;
+                }
+                p += n + (p[n] == ' ');
+                if (!dep) {
+                    continue;   /* Not provided by this repository */
+                }
+
+                size_t *at = &len[dep - idx->entries];
+                if (pass == 0) {
+                    *at += name_len + 1;
+                    (*edges)++;
+                    continue;
+                }
+                if (*at > 0) {
+                    dep->rdepends[(*at)++] = ' ';
+                }
+                memcpy(dep->rdepends + *at, name, name_len + 1);
+                *at += name_len;
+            }
+        }
+
+        if (pass == 0) {
+            for (size_t i = 0; i < idx->count; i++) {
+                if (len[i] > 0 && !(idx->entries[i].rdepends = malloc(len[i]))) {
+                    log_error("index_build", strerror(errno));
+                    free(len);
+                    return TINYPKG_ERR;
+                }
+                len[i] = 0;
+            }
+        }
+    }
+
+    free(len);
+    return TINYPKG_OK;
+}
+
+static int index_read(struct pkg_index *idx, int quiet);
+
+/* Compile all manifests into the derived index, checking each on the way */
+int index_build(void) {
+    char *cache = get_cache_path();
+    char pkgs_dir[PATH_MAX_LEN];
+    struct pkg_index idx = {0};
+    struct check_report report = {0};
+    char *found;
+    size_t cap = 0;
+    size_t scanned;
+    size_t edges = 0;
+    struct dirent *de;
+    DIR *d;
+    int ret;
+
+    if (!cache) {
+        log_error("index_build", "Failed to get cache path");
+        return TINYPKG_ERR;
+    }
+
+    snprintf(pkgs_dir, PATH_MAX_LEN, "%s/repo/packages", cache);
+    index_head(idx.commit);
+
+    d = opendir(pkgs_dir);
+    if (!d) {
+        log_error("index_build", "Could not open packages directory");
+        return TINYPKG_ERR;
+    }
+
+    printf("Compiling package index...\n");
+
+    while ((de = readdir(d)) != NULL) {
+        if (!is_valid_package_name(de->d_name)) {
+            continue;
+        }
+
+        if (idx.count == cap) {
+            size_t new_cap = cap ? cap * 2 : 64;
+            struct index_entry *p = realloc(idx.entries, new_cap * sizeof(*p));
+            if (!p) {
+                log_error("index_build", strerror(errno));
+                closedir(d);
+                index_free(&idx);
+                return TINYPKG_ERR;
+            }
+            idx.entries = p;
+            cap = new_cap;
+        }
+
+        memset(&idx.entries[idx.count], 0, sizeof(*idx.entries));
+        strncpy(idx.entries[idx.count].name, de->d_name, sizeof(idx.entries->name) - 1);
+        idx.count++;
+    }
+    closedir(d);
+
+    /* Parse and check every manifest, all CPUs at once */
+    scanned = idx.count;
+    found = calloc(scanned ? scanned : 1, 1);
+    if (!found || check_manifests(idx.entries, scanned, found, &report) != TINYPKG_OK) {
+        log_error("index_build", "Out of memory checking manifests");
+        free(found);
+        check_free(&report);
+        index_free(&idx);
+        return TINYPKG_ERR;
+    }
+
+    /* A directory without a manifest is not a package */
+    idx.count = 0;
+    for (size_t i = 0; i < scanned; i++) {
+        if (found[i]) {
+            idx.entries[idx.count++] = idx.entries[i];
+        } else {
+            free(idx.entries[i].depends);
+        }
+    }
+    free(found);
+
+    if (idx.count > 0) {
+        qsort(idx.entries, idx.count, sizeof(*idx.entries), entry_cmp);
+    }
+
+    /* Invert the dependency edges into the reverse adjacency list */
+    if (link_all(&idx, &edges) != TINYPKG_OK || check_index(&idx, &report) != TINYPKG_OK) {
+        check_free(&report);
+        index_free(&idx);
+        return TINYPKG_ERR;
+    }
+
+    ret = index_write(&idx);
+    if (ret == TINYPKG_OK) {
+        printf("✓ Indexed %zu packages (%zu dependency edges)\n",
+               idx.count, edges);
+        memcpy(report.commit, idx.commit, sizeof(report.commit));
+        if (check_write(&report) == TINYPKG_OK) {
+            check_summary(&report, idx.count);
+        }
+    }
+
+    check_free(&report);
+    index_free(&idx);
+    return ret;
+}
+
+/*
+ * Put a freshly parsed entry into idx, or drop the package's entry if its
+ * manifest is gone (!found); *what is 'A'dded, 'M'odified, 'D'eleted or 0.
+ * fresh->depends now belongs to idx.
+ */
+static int index_patch(struct pkg_index *idx, struct index_entry *fresh, int found,
+                       char *what) {
+    struct index_entry *e = index_find(idx, fresh->name);
+    const char *name = fresh->name;
+    size_t at;
+
+    *what = 0;
+    if (!found) {
+        free(fresh->depends);
+        fresh->depends = NULL;
+    }
+
+    /* Its old edges go; packages depending on it keep pointing at it */
+    if (e) {
+        unlink_deps(idx, e);
+        free(e->depends);
+        e->depends = NULL;
+    }
+
+    if (!found) {
+        if (e) {
+            at = (size_t)(e - idx->entries);
+            free(e->rdepends);
+            memmove(e, e + 1, (idx->count - at - 1) * sizeof(*e));
+            idx->count--;
+            *what = 'D';
+        }
+        return TINYPKG_OK;
+    }
+
+    if (e) {
+        memcpy(e->version, fresh->version, sizeof(e->version));
+        e->depends = fresh->depends;
+        *what = 'M';
+    } else {
+        struct index_entry *p = realloc(idx->entries, (idx->count + 1) * sizeof(*p));
+
+        if (!p) {
+            free(fresh->depends);
+            return TINYPKG_ERR;
+        }
+        idx->entries = p;
+        for (at = 0; at < idx->count && strcmp(idx->entries[at].name, name) < 0; at++) {
+        }
+        memmove(&p[at + 1], &p[at], (idx->count - at) * sizeof(*p));
+        p[at] = *fresh;
+        idx->count++;
+        e = &p[at];
+
+        /* Packages already naming it as a dependency, in name order */
+        for (size_t i = 0; i < idx->count; i++) {
+            if (i != at && list_has(p[i].depends, name) &&
+                list_append(&e->rdepends, p[i].name) != TINYPKG_OK) {
+                return TINYPKG_ERR;
+            }
+        }
+        *what = 'A';
+    }
+    return link_deps(idx, e, NULL);
+}
+
+/* The packages whose manifests changed, as the callers of changed_add() find them */
+struct changed_list {
+    struct index_entry *v;
+    size_t count;
+    size_t cap;
+};
+
+/* Note the package of path if it is packages/<name>/manifest.yaml */
+static int changed_add(const char *path, void *ctx) {
+    struct changed_list *list = ctx;
+    struct index_entry *e;
+    size_t len;
+
+    if (strncmp(path, "packages/", 9) != 0) {
+        return TINYPKG_OK;
+    }
+    len = strcspn(path + 9, "/");
+    if (len == 0 || len >= sizeof(e->name) || strcmp(path + 9 + len, "/manifest.yaml") != 0) {
+        return TINYPKG_OK;
+    }
+
+    if (list->count == list->cap) {
+        size_t new_cap = list->cap ? list->cap * 2 : 64;
+        struct index_entry *p = realloc(list->v, new_cap * sizeof(*p));
+        if (!p) {
+            log_error("index_sync", strerror(errno));
+            return TINYPKG_ERR;
+        }
+        list->v = p;
+        list->cap = new_cap;
+    }
+    e = &list->v[list->count];
+    memset(e, 0, sizeof(*e));
+    memcpy(e->name, path + 9, len);
+    if (is_valid_package_name(e->name)) {
+        list->count++;
+    }
+    return TINYPKG_OK;
+}
+
+int index_sync(void) {
+    struct pkg_index idx;
+    struct check_report report = {0};
+    struct changed_list list = { NULL, 0, 0 };
+    struct index_entry *changed;
+    size_t nchanged = 0;
+    char *found = NULL;
+    char head[64];
+    char line[PATH_MAX_LEN];
+    char *diff[] = { "diff", "--name-only", "--no-renames", NULL, "HEAD", "--", "packages", NULL };
+    size_t changes[3] = { 0, 0, 0 };
+    pid_t pid;
+    FILE *f;
+    int ret;
+
+    if (!get_cache_path()) {
+        log_error("index_sync", "Failed to get cache path");
+        return TINYPKG_ERR;
+    }
+
+    index_head(head);
+    if (strcmp(head, "-") == 0 || index_read(&idx, 1) != TINYPKG_OK) {
+        return index_build();
+    }
+
+    /* The diagnostics of unchanged manifests carry over only from this commit */
+    if (strcmp(idx.commit, "-") == 0 || check_load(&report) != TINYPKG_OK ||
+        strcmp(report.commit, idx.commit) != 0) {
+        check_free(&report);
+        index_free(&idx);
+        return index_build();
+    }
+    if (strcmp(idx.commit, head) == 0) {
+        printf("✓ Package index up to date (%zu packages at %.12s)\n", idx.count, head);
+        check_summary(&report, idx.count);
+        check_free(&report);
+        index_free(&idx);
+        return TINYPKG_OK;
+    }
+
+    /* Only packages/<name>/manifest.yaml matters to the index */
+    if (snapshot_id(line) == TINYPKG_OK) {
+        ret = snapshot_changes(idx.commit, head, changed_add, &list);
+    } else {
+        diff[3] = idx.commit;
+        diff[4] = head;
+        f = git_open(diff, &pid);
+        ret = f ? TINYPKG_OK : TINYPKG_ERR;
+        while (ret == TINYPKG_OK && fgets(line, sizeof(line), f)) {
+            line[strcspn(line, "\n")] = '\0';
+            ret = changed_add(line, &list);
+        }
+        if (f && git_close(f, pid) != TINYPKG_OK) {
+            ret = TINYPKG_ERR;
+        }
+    }
+    changed = list.v;
+    nchanged = list.count;
+
+    /* History rewritten (or the indexed commit is gone): start over */
+    if (ret != TINYPKG_OK) {
+        log_warn("Could not diff against the indexed commit, rebuilding the index");
+        free(changed);
+        check_free(&report);
+        index_free(&idx);
+        return index_build();
+    }
+
+    /* Recheck the changed manifests in parallel, then patch them in */
+    if (nchanged > 0) {
+        size_t n = 1;
+
+        /* Snapshot steps can name a manifest more than once */
+        qsort(changed, nchanged, sizeof(*changed), entry_cmp);
+        for (size_t i = 1; i < nchanged; i++) {
+            if (strcmp(changed[i].name, changed[n - 1].name) != 0) {
+                changed[n++] = changed[i];
+            }
+        }
+        nchanged = n;
+        check_forget(&report, changed, nchanged);
+        found = calloc(nchanged, 1);
+        if (!found || check_manifests(changed, nchanged, found, &report) != TINYPKG_OK) {
+            log_error("index_sync", "Out of memory checking manifests");
+            ret = TINYPKG_ERR;
+        }
+    }
+    for (size_t i = 0; ret == TINYPKG_OK && i < nchanged; i++) {
+        char what;
+
+        ret = index_patch(&idx, &changed[i], found[i], &what);
+        changed[i].depends = NULL;
+        if (what) {
+            changes[what == 'A' ? 0 : what == 'M' ? 1 : 2]++;
+        }
+    }
+    for (size_t i = 0; i < nchanged; i++) {
+        free(changed[i].depends);
+    }
+    free(changed);
+    free(found);
+
+    snprintf(idx.commit, sizeof(idx.commit), "%s", head);
+    if (ret == TINYPKG_OK) {
+        ret = check_index(&idx, &report);
+    }
+    if (ret == TINYPKG_OK) {
+        ret = index_write(&idx);
+    }
+    if (ret == TINYPKG_OK) {
+        printf("✓ Package index updated to %.12s: %zu added, %zu changed, %zu removed "
+               "(%zu packages)\n", head, changes[0], changes[1], changes[2], idx.count);
+        memcpy(report.commit, head, sizeof(report.commit));
+        if (check_write(&report) == TINYPKG_OK) {
+            check_summary(&report, idx.count);
+        }
+    }
+    check_free(&report);
+    index_free(&idx);
+    return ret;
+}
+
+/*
+ * Load the derived index into memory. An older format, or a file that is
+ * not a sorted list of complete entries, is an error; quiet leaves the
+ * reporting to the caller.
+ */
+static int index_read(struct pkg_index *idx, int quiet) {
+    char *cache = get_cache_path();
+    char db_path[PATH_MAX_LEN];
+    char *line = NULL;
+    size_t line_cap = 0;
+    size_t cap = 0;
+    const char *bad = NULL;
+    FILE *f;
+
+    if (!idx || !cache) {
+        return TINYPKG_ERR;
+    }
+
+    memset(idx, 0, sizeof(*idx));
+    snprintf(db_path, PATH_MAX_LEN, "%s/%s", cache, INDEX_DB_FILE);
+
+    f = fopen(db_path, "r");
+    if (!f) {
+        return TINYPKG_NOT_FOUND;
+    }
+
+    if (getline(&line, &line_cap, f) < 0 ||
+        strncmp(line, INDEX_DB_MAGIC "\n", strlen(INDEX_DB_MAGIC) + 1) != 0) {
+        bad = "Index format mismatch - run 'tinypkg repo sync'";
+    } else if (getline(&line, &line_cap, f) < 0 ||
+               sscanf(line, "commit %63s", idx->commit) != 1) {
+        bad = "Index is corrupt - run 'tinypkg repo sync'";
+    }
+
+    while (!bad && getline(&line, &line_cap, f) > 0) {
+        char *fields[4] = {0};
+        char *p = line;
+        struct index_entry *e;
+
+        line[strcspn(line, "\n")] = '\0';
+        for (int i = 0; i < 4 && p; i++) {
+            fields[i] = p;
+            p = strchr(p, '\t');
+            if (p) {
+                *p++ = '\0';
+            }
+        }
+        if (!fields[3] || p || !fields[0][0] ||
+            (idx->count > 0 && strcmp(idx->entries[idx->count - 1].name, fields[0]) >= 0)) {
+            bad = "Index is corrupt - run 'tinypkg repo sync'";
+            break;
+        }
+
+        if (idx->count == cap) {
+            size_t new_cap = cap ? cap * 2 : 64;
+            struct index_entry *n = realloc(idx->entries, new_cap * sizeof(*n));
+            if (!n) {
+                bad = strerror(errno);
+                break;
+            }
+            idx->entries = n;
+            cap = new_cap;
+        }
+
+        e = &idx->entries[idx->count++];
+        memset(e, 0, sizeof(*e));
+        strncpy(e->name, fields[0], sizeof(e->name) - 1);
+        strncpy(e->version, fields[1], sizeof(e->version) - 1);
+        e->depends = strdup(fields[2]);
+        e->rdepends = strdup(fields[3]);
+    }
+
+    free(line);
+    fclose(f);
+    if (bad) {
+        if (!quiet) {
+            log_error("index_load", bad);
+        }
+        index_free(idx);
+        return TINYPKG_ERR;
+    }
+    return TINYPKG_OK;
+}
+
+int index_load(struct pkg_index *idx) {
+    return index_read(idx, 0);
+}
+
+void index_free(struct pkg_index *idx) {
+    if (!idx) {
+        return;
+    }
+    for (size_t i = 0; i < idx->count; i++) {
+        free(idx->entries[i].depends);
+        free(idx->entries[i].rdepends);
+    }
+    free(idx->entries);
+    idx->entries = NULL;
+    idx->count = 0;
+}
+
+/* Binary search; entries are kept sorted by name */
+struct index_entry *index_find(const struct pkg_index *idx, const char *name) {
+    struct index_entry key;
+
+    if (!idx || !idx->entries || !name) {
+        return NULL;
+    }
+
+    memset(&key, 0, sizeof(key));
+    strncpy(key.name, name, sizeof(key.name) - 1);
+    return bsearch(&key, idx->entries, idx->count, sizeof(key), entry_cmp);
+}
+
+/*
+ * Count installed packages that depend directly on name, printing each.
+ * Returns TINYPKG_NOT_FOUND if no index is available.
+ */
+static int name_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Names in installed.db, sorted */
+static int installed_names(char ***names, size_t *count) {
+    char *tinypkg_dir = get_tinypkg_dir();
+    char db_path[PATH_MAX_LEN];
+    char line[256];
+    size_t cap = 0;
+    FILE *f;
+
+    *names = NULL;
+    *count = 0;
+    if (!tinypkg_dir) {
+        return TINYPKG_ERR;
+    }
+    snprintf(db_path, sizeof(db_path), "%s/installed.db", tinypkg_dir);
+    f = fopen(db_path, "r");
+    if (!f) {
+        return TINYPKG_OK;  /* Nothing installed */
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        char pkg[128] = {0};
+
+        if (sscanf(line, "%127s", pkg) != 1) {
+            continue;
+        }
+        if (*count == cap) {
+            size_t new_cap = cap ? cap * 2 : 32;
+            char **p = realloc(*names, new_cap * sizeof(*p));
+            if (!p) {
+                break;
+            }
+            *names = p;
+            cap = new_cap;
+        }
+        if (!((*names)[*count] = strdup(pkg))) {
+            break;
+        }
+        (*count)++;
+    }
+    fclose(f);
+
+    if (*count > 1) {
+        qsort(*names, *count, sizeof(**names), name_cmp);
+    }
+    return TINYPKG_OK;
+}
+
+/*
+ * The rdepends column of name, found by bisecting the mapped index: its
+ * entries are sorted lines, so only O(log n) of them are read. *rdeps is
+ * NULL when the index has no such package.
+ */
+static int index_lookup_rdepends(const char *name, char **rdeps) {
+    char *cache = get_cache_path();
+    char db_path[PATH_MAX_LEN];
+    size_t name_len = strlen(name);
+    size_t magic_len = strlen(INDEX_DB_MAGIC) + 1;
+    size_t lo, hi, size;
+    struct stat st;
+    char *buf;
+    int fd, ret = TINYPKG_OK;
+
+    *rdeps = NULL;
+    if (!cache) {
+        return TINYPKG_ERR;
+    }
+    snprintf(db_path, PATH_MAX_LEN, "%s/%s", cache, INDEX_DB_FILE);
+    fd = open(db_path, O_RDONLY);
+    if (fd < 0) {
+        return TINYPKG_NOT_FOUND;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return TINYPKG_ERR;
+    }
+    size = (size_t)st.st_size;
+    buf = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED) {
+        return TINYPKG_ERR;
+    }
+
+    /* Entries start after the magic and commit lines */
+    if (size < magic_len || memcmp(buf, INDEX_DB_MAGIC "\n", magic_len) != 0 ||
+        !memchr(buf + magic_len, '\n', size - magic_len)) {
+        log_error("index_load", "Index format mismatch - run 'tinypkg repo sync'");
+        munmap(buf, size);
+        return TINYPKG_ERR;
+    }
+    lo = (size_t)((char *)memchr(buf + magic_len, '\n', size - magic_len) - buf) + 1;
+    hi = size;
+
+    while (lo < hi) {
+        size_t line = lo + (hi - lo) / 2;
+        char *eol, *tab;
+        int cmp;
+
+        while (line > lo && buf[line - 1] != '\n') {
+            line--;
+        }
+        eol = memchr(buf + line, '\n', size - line);
+        tab = memchr(buf + line, '\t', (eol ? (size_t)(eol - buf) : size) - line);
+        if (!eol || !tab) {
+            log_error("index_load", "Index is corrupt - run 'tinypkg repo sync'");
+            ret = TINYPKG_ERR;
+            break;
+        }
+
+        cmp = strncmp(buf + line, name, name_len);
+        if (cmp == 0 && (size_t)(tab - (buf + line)) != name_len) {
+            cmp = 1;    /* name is a prefix of this entry's */
+        }
+        if (cmp < 0) {
+            lo = (size_t)(eol - buf) + 1;
+        } else if (cmp > 0) {
+            hi = line;
+        } else {
+            /* name, version, depends, rdepends */
+            char *field = tab + 1;
+            for (int i = 0; i < 2 && field; i++) {
+                field = memchr(field, '\t', (size_t)(eol - field));
+                field = field ? field + 1 : NULL;
+            }
+            if (!field) {
+                log_error("index_load", "Index is corrupt - run 'tinypkg repo sync'");
+                ret = TINYPKG_ERR;
+            } else if (!(*rdeps = strndup(field, (size_t)(eol - field)))) {
+                ret = TINYPKG_ERR;
+            }
+            break;
+        }
+    }
+
+    munmap(buf, size);
+    return ret;
+}
+
+/*
+ * Installed packages among name's dependents. Costs one index lookup and
+ * one read of installed.db, however large the repository is.
+ */
+int index_installed_dependents(const char *name) {
+    char *rdeps, *tok, *save = NULL;
+    char **installed = NULL;
+    size_t ninstalled = 0;
+    int count = 0;
+    int ret;
+
+    ret = index_lookup_rdepends(name, &rdeps);
+    if (ret != TINYPKG_OK || !rdeps || !rdeps[0]) {
+        free(rdeps);
+        return ret == TINYPKG_OK ? 0 : ret;
+    }
+
+    if (installed_names(&installed, &ninstalled) != TINYPKG_OK) {
+        free(rdeps);
+        return TINYPKG_ERR;
+    }
+
+    for (tok = strtok_r(rdeps, " ", &save); tok;
+         tok = strtok_r(NULL, " ", &save)) {
+        if (ninstalled > 0 &&
+            bsearch(&tok, installed, ninstalled, sizeof(*installed), name_cmp)) {
+            printf("  %s (installed) depends on %s\n", tok, name);
+            count++;
+        }
+    }
+
+    for (size_t i = 0; i < ninstalled; i++) {
+        free(installed[i]);
+    }
+    free(installed);
+    free(rdeps);
+    return count;
+}
+
+/* Print direct or transitive reverse dependencies (breadth-first) */
+int index_print_rdeps(const char *name, int transitive) {
+    struct pkg_index idx;
+    struct index_entry *root;
+    size_t *queue = NULL;
+    char *seen = NULL;
+    size_t head = 0, tail = 0;
+    int found = 0;
+    int ret;
+
+    ret = index_load(&idx);
+    if (ret == TINYPKG_NOT_FOUND) {
+        log_error("index_print_rdeps", "No package index - run 'tinypkg repo sync' first");
+        return TINYPKG_ERR;
+    }
+    if (ret != TINYPKG_OK) {
+        return ret;
+    }
+
+    root = index_find(&idx, name);
+    if (!root) {
+        log_error("index_print_rdeps", "Package not found");
+        index_free(&idx);
+        return TINYPKG_NOT_FOUND;
+    }
+
+    queue = malloc(idx.count * sizeof(*queue));
+    seen = calloc(idx.count, 1);
+    if (!queue || !seen) {
+        free(queue);
+        free(seen);
+        index_free(&idx);
+        return TINYPKG_ERR;
+    }
+
+    queue[tail++] = (size_t)(root - idx.entries);
+    seen[root - idx.entries] = 1;
+
+    while (head < tail) {
+        struct index_entry *e = &idx.entries[queue[head++]];
+        char *rdeps, *tok, *save = NULL;
+
+        if (!e->rdepends || !e->rdepends[0]) {
+            continue;
+        }
+
+        rdeps = strdup(e->rdepends);
+        if (!rdeps) {
+            break;
+        }
+
+        for (tok = strtok_r(rdeps, " ", &save); tok;
+             tok = strtok_r(NULL, " ", &save)) {
+            struct index_entry *r = index_find(&idx, tok);
+            size_t ri;
+
+            if (!r) {
+                continue;
+            }
+            ri = (size_t)(r - idx.entries);
+            if (seen[ri]) {
+                continue;
+            }
+            seen[ri] = 1;
+            printf("%s\n", r->name);
+            found++;
+            if (transitive) {
+                queue[tail++] = ri;
+            }
+        }
+        free(rdeps);
+    }
+
+    if (found == 0) {
+        fprintf(stderr, "No packages depend on %s\n", name);
+    }
+
+    free(queue);
+    free(seen);
+    index_free(&idx);
+    return TINYPKG_OK;
+}
@@ -0,0 +1,575 @@
+/*
+ * lock.c - Lockfiles: export the installed set, restore it elsewhere
+ *
+ * Setting a host up used to mean one 'tinypkg install' after another, each
+ * building from source. A lockfile pins the whole set instead: versions,
+ * profiles, source checksums and the digest of each built prefix.
+ * Restoring it does the cheap thing first for every package at once:
+ *
+ *   1. reuse prefixes already in the cache whose digest matches
+ *   2. fetch the rest as .tpk artifacts from the repo mirrors, all
+ *      downloads together, and unpack them in parallel
+ *   3. build from source only what no mirror had, through the scheduler
+ *   4. install everything in parallel, recording it in installed.db in
+ *      a single rewrite
+ *
+ * With a warm cache that is a few seconds of hashing and copying however
+ * long the set would take to compile.
+ */
+
+#include "common.h"
+#include "lock.h"
+#include "build.h"
+#include "fetch.h"
+#include "metrics.h"
+#include "mirror.h"
+#include "profile.h"
+#include "sched.h"
+#include "store.h"
+#include "tpk.h"
+#include <pthread.h>
+
+#define LOCK_MAX_THREADS 16
+
+enum item_state {
+    ITEM_PENDING,       /* Nothing usable yet */
+    ITEM_LOCAL,         /* Prefix already here */
+    ITEM_ARTIFACT,      /* Unpacked from a mirror's artifact */
+    ITEM_BUILT,         /* Built from source */
+    ITEM_FAILED
+};
+
+struct restore_item {
+    struct lock_entry e;
+    int state;
+    int fetched;                        /* Artifact downloaded to path */
+    char path[PATH_MAX_LEN + 288];
+    int installed;
+};
+
+/* Runs one function over every item, several threads at a time */
+struct item_pool {
+    struct restore_item *items;
+    size_t count;
+    size_t next;
+    void (*run)(struct restore_item *);
+    pthread_mutex_t lock;
+};
+
+static void *pool_worker(void *arg) {
+    struct item_pool *pool = arg;
+
+    for (;;) {
+        struct restore_item *it;
+
+        pthread_mutex_lock(&pool->lock);
+        if (pool->next >= pool->count) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        it = &pool->items[pool->next++];
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->run(it);
+    }
+    return NULL;
+}
+
+static void pool_run(struct restore_item *items, size_t count,
+                     void (*run)(struct restore_item *)) {
+    pthread_t threads[LOCK_MAX_THREADS];
+    struct item_pool pool;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = ncpu > 0 ? (int)ncpu : 1;
+    int started = 0;
+
+    if (nthreads > LOCK_MAX_THREADS) nthreads = LOCK_MAX_THREADS;
+    if ((size_t)nthreads > count) nthreads = (int)count;
+
+    pool.items = items;
+    pool.count = count;
+    pool.next = 0;
+    pool.run = run;
+    pthread_mutex_init(&pool.lock, NULL);
+
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, pool_worker, &pool) != 0) {
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        pool_worker(&pool);     /* No threads available: run inline */
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool.lock);
+}
+
+static int entry_cmp(const void *a, const void *b) {
+    return strcmp(((const struct restore_item *)a)->e.name,
+                  ((const struct restore_item *)b)->e.name);
+}
+
+/* Prefix built as this version and profile, with this digest ("-": any) */
+static int prefix_matches(const struct lock_entry *e) {
+    char version[64], profile[32], digest[SHA256_HEX_LEN];
+
+    if (profile_built(e->name, version, sizeof(version), profile, sizeof(profile))
+        != TINYPKG_OK ||
+        strcmp(version, e->version) != 0 || strcmp(profile, e->profile) != 0) {
+        return 0;
+    }
+    if (strcmp(e->digest, "-") == 0) {
+        return 1;
+    }
+    return tpk_digest(e->name, digest) == TINYPKG_OK && strcmp(digest, e->digest) == 0;
+}
+
+/* ============================================================================
+ * Lock
+ * ============================================================================
+ */
+
+/* One item per package in installed.db; its last line wins */
+static struct restore_item *read_installed(size_t *count) {
+    char path[PATH_MAX_LEN];
+    char line[LINE_MAX_LEN];
+    struct restore_item *items = NULL;
+    size_t n = 0;
+    FILE *f;
+
+    *count = 0;
+    snprintf(path, sizeof(path), "%s/installed.db", get_tinypkg_dir());
+    f = fopen(path, "r");
+    if (!f) {
+        return NULL;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        char name[128], version[64], profile[32] = PROFILE_DEFAULT;
+        struct restore_item *it = NULL, *grown;
+
+        if (sscanf(line, "%127s %63s %31s", name, version, profile) < 2 ||
+            !is_valid_package_name(name)) {
+            continue;
+        }
+        for (size_t i = 0; i < n && !it; i++) {
+            if (strcmp(items[i].e.name, name) == 0) it = &items[i];
+        }
+        if (!it) {
+            grown = realloc(items, (n + 1) * sizeof(*items));
+            if (!grown) break;
+            items = grown;
+            it = &items[n++];
+            memset(it, 0, sizeof(*it));
+            snprintf(it->e.name, sizeof(it->e.name), "%s", name);
+        }
+        snprintf(it->e.version, sizeof(it->e.version), "%s", version);
+        snprintf(it->e.profile, sizeof(it->e.profile), "%s", profile);
+    }
+    fclose(f);
+
+    *count = n;
+    return items;
+}
+
+/* Digest of the prefix, if it is still what installed.db says */
+static void lock_digest(struct restore_item *it) {
+    struct lock_entry *e = &it->e;
+
+    snprintf(e->digest, sizeof(e->digest), "-");
+    if (!prefix_matches(e) || tpk_digest(e->name, e->digest) != TINYPKG_OK) {
+        snprintf(e->digest, sizeof(e->digest), "-");
+    }
+}
+
+int lock_write(const char *path) {
+    char tmp_path[PATH_MAX_LEN + 8];
+    struct restore_item *items;
+    size_t count, unpinned = 0;
+    FILE *f;
+
+    items = read_installed(&count);
+    if (count == 0) {
+        fprintf(stderr, "Error: Nothing is installed\n");
+        free(items);
+        return TINYPKG_NOT_FOUND;
+    }
+    qsort(items, count, sizeof(*items), entry_cmp);
+
+    /* Checksums from the manifests the versions came from */
+    for (size_t i = 0; i < count; i++) {
+        struct lock_entry *e = &items[i].e;
+        char manifest_path[PATH_MAX_LEN];
+        struct manifest m;
+
+        snprintf(e->checksum, sizeof(e->checksum), "-");
+        snprintf(manifest_path, sizeof(manifest_path), "%s/repo/packages/%s/manifest.yaml",
+                 get_cache_path(), e->name);
+        if (access(manifest_path, R_OK) == 0 && parse_manifest(e->name, &m) == 0 &&
+            strcmp(m.version, e->version) == 0 && m.checksum[0]) {
+            snprintf(e->checksum, sizeof(e->checksum), "%s", m.checksum);
+        }
+    }
+
+    /* Hashing every prefix is the slow part */
+    pool_run(items, count, lock_digest);
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    f = fopen(tmp_path, "w");
+    if (!f) {
+        log_error("lock_write", strerror(errno));
+        free(items);
+        return TINYPKG_ERR;
+    }
+
+    fprintf(f, "%s\n", LOCK_MAGIC);
+    for (size_t i = 0; i < count; i++) {
+        const struct lock_entry *e = &items[i].e;
+
+        fprintf(f, "%s %s %s %s %s\n", e->name, e->version, e->profile, e->checksum,
+                e->digest);
+        if (strcmp(e->digest, "-") == 0) {
+            fprintf(stderr, "Warning: %s: prefix no longer matches the installed version; "
+                    "locked without a digest\n", e->name);
+            unpinned++;
+        }
+    }
+
+    if (fclose(f) != 0 || rename(tmp_path, path) != 0) {
+        log_error("lock_write", strerror(errno));
+        unlink(tmp_path);
+        free(items);
+        return TINYPKG_ERR;
+    }
+
+    printf("✓ Locked %zu packages in %s", count, path);
+    if (unpinned > 0) {
+        printf(" (%zu without a digest)", unpinned);
+    }
+    printf("\n");
+    free(items);
+    return TINYPKG_OK;
+}
+
+/* ============================================================================
+ * Restore
+ * ============================================================================
+ */
+
+static struct restore_item *read_lock(const char *path, size_t *count) {
+    char line[LINE_MAX_LEN];
+    struct restore_item *items = NULL;
+    size_t n = 0;
+    int lineno = 1;
+    FILE *f;
+
+    *count = 0;
+    f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (!fgets(line, sizeof(line), f) || strncmp(line, LOCK_MAGIC, strlen(LOCK_MAGIC)) != 0) {
+        fprintf(stderr, "Error: %s is not a tinypkg lockfile\n", path);
+        fclose(f);
+        return NULL;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        struct restore_item *grown;
+        struct lock_entry e;
+
+        lineno++;
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0') {
+            continue;
+        }
+        if (sscanf(line, "%127s %63s %31s %127s %64s", e.name, e.version, e.profile,
+                   e.checksum, e.digest) != 5 ||
+            !is_valid_package_name(e.name) || !profile_find(e.profile) ||
+            (strcmp(e.digest, "-") != 0 && strlen(e.digest) != SHA256_HEX_LEN - 1)) {
+            fprintf(stderr, "Error: %s:%d: malformed entry\n", path, lineno);
+            free(items);
+            fclose(f);
+            return NULL;
+        }
+
+        grown = realloc(items, (n + 1) * sizeof(*items));
+        if (!grown) {
+            break;
+        }
+        items = grown;
+        memset(&items[n], 0, sizeof(items[n]));
+        items[n++].e = e;
+    }
+    fclose(f);
+
+    *count = n;
+    return items;
+}
+
+static void check_local(struct restore_item *it) {
+    if (prefix_matches(&it->e)) {
+        it->state = ITEM_LOCAL;
+    }
+}
+
+static void unpack_artifact(struct restore_item *it) {
+    struct tpk_info info;
+
+    if (!it->fetched) {
+        return;
+    }
+    if (tpk_unpack(it->path, &info) == TINYPKG_OK) {
+        if (strcmp(info.name, it->e.name) != 0 || strcmp(info.version, it->e.version) != 0 ||
+            strcmp(info.profile, it->e.profile) != 0) {
+            fprintf(stderr, "Warning: %s: artifact is not the locked build\n", it->e.name);
+        } else if (strcmp(it->e.digest, "-") != 0 && strcmp(info.digest, it->e.digest) != 0) {
+            fprintf(stderr, "Warning: %s: artifact digest differs from the lockfile\n",
+                    it->e.name);
+        } else {
+            it->state = ITEM_ARTIFACT;
+        }
+    }
+    unlink(it->path);
+}
+
+static void install_item(struct restore_item *it) {
+    if (it->state != ITEM_FAILED) {
+        it->installed = execute_install(it->e.name) == 0;
+    }
+}
+
+/*
+ * Download every missing package's artifact in one batch. One round of
+ * probes first, so a package no mirror has costs nothing more: the
+ * downloads themselves retry, which is right for a flaky mirror but slow
+ * for a file that is not there.
+ */
+static void fetch_artifacts(struct restore_item *items, size_t count) {
+    struct fetch_job *jobs;
+    struct restore_item **owner;
+    char **urls, **found;
+    int *present;
+    size_t njobs = 0, nurls = 0, nfound = 0, kept = 0;
+    char dir[PATH_MAX_LEN];
+
+    snprintf(dir, sizeof(dir), "%s/%s", get_cache_path(), LOCK_ARTIFACT_DIR);
+    jobs = calloc(count, sizeof(*jobs));
+    owner = calloc(count, sizeof(*owner));
+    urls = calloc(count * MIRROR_MAX, sizeof(*urls));
+    found = calloc(count * MIRROR_MAX, sizeof(*found));
+    present = calloc(count * MIRROR_MAX, sizeof(*present));
+    if (!jobs || !owner || !urls || !found || !present || mkdir_p(dir) != TINYPKG_OK) {
+        free(jobs);
+        free(owner);
+        free(urls);
+        free(found);
+        free(present);
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        struct restore_item *it = &items[i];
+        char key[128], file[272];
+        int n;
+
+        if (it->state != ITEM_PENDING) {
+            continue;
+        }
+        profile_key(it->e.version, it->e.profile, key, sizeof(key));
+        snprintf(file, sizeof(file), "%s-%s%s", it->e.name, key, TPK_EXT);
+        n = mirror_artifact_candidates(it->e.name, file, urls + nurls, MIRROR_MAX);
+        if (n == 0) {
+            continue;
+        }
+
+        snprintf(it->path, sizeof(it->path), "%s/%s", dir, file);
+        jobs[njobs].urls = urls + nurls;
+        jobs[njobs].url_count = n;
+        jobs[njobs].dest = it->path;
+        owner[njobs++] = it;
+        nurls += (size_t)n;
+    }
+
+    /* Only the mirrors that have the file stay candidates */
+    if (nurls > 0) {
+        fetch_exists((const char *const *)urls, present, nurls);
+    }
+    for (size_t j = 0; j < njobs; j++) {
+        char *const *cand = jobs[j].urls;
+        int n = jobs[j].url_count;
+
+        jobs[j].urls = found + nfound;
+        jobs[j].url_count = 0;
+        for (int k = 0; k < n; k++) {
+            if (present[cand - urls + k]) {
+                found[nfound++] = cand[k];
+                jobs[j].url_count++;
+            }
+        }
+        if (jobs[j].url_count > 0) {
+            jobs[kept] = jobs[j];
+            owner[kept++] = owner[j];
+        }
+    }
+
+    if (kept > 0) {
+        printf("Fetching %zu artifacts...\n", kept);
+        fetch_files(jobs, kept);
+        for (size_t j = 0; j < kept; j++) {
+            owner[j]->fetched = jobs[j].status == TINYPKG_OK;
+        }
+    }
+
+    for (size_t i = 0; i < nurls; i++) {
+        free(urls[i]);
+    }
+    free(urls);
+    free(found);
+    free(present);
+    free(owner);
+    free(jobs);
+}
+
+/* What is still missing can be built if the repo has that exact source */
+static int build_missing(struct restore_item *items, size_t count, int jobs) {
+    char **names = calloc(count, sizeof(*names));
+    int n = 0, ret = TINYPKG_OK;
+
+    if (!names) {
+        return TINYPKG_ERR;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        struct restore_item *it = &items[i];
+        char manifest_path[PATH_MAX_LEN];
+        struct manifest m;
+
+        if (it->state != ITEM_PENDING) {
+            continue;
+        }
+
+        snprintf(manifest_path, sizeof(manifest_path), "%s/repo/packages/%s/manifest.yaml",
+                 get_cache_path(), it->e.name);
+        if (access(manifest_path, R_OK) != 0 || parse_manifest(it->e.name, &m) != 0 ||
+            strcmp(m.version, it->e.version) != 0) {
+            fprintf(stderr, "Error: %s %s: no artifact, and the repo does not have that "
+                    "version\n", it->e.name, it->e.version);
+            it->state = ITEM_FAILED;
+            continue;
+        }
+        if (strcmp(it->e.checksum, "-") != 0 && strcmp(m.checksum, it->e.checksum) != 0) {
+            fprintf(stderr, "Error: %s %s: the repo's source checksum differs from the "
+                    "lockfile\n", it->e.name, it->e.version);
+            it->state = ITEM_FAILED;
+            continue;
+        }
+        if (profile_pin(it->e.name, it->e.profile) != TINYPKG_OK) {
+            it->state = ITEM_FAILED;
+            continue;
+        }
+        names[n++] = it->e.name;
+    }
+
+    if (n > 0) {
+        printf("Building %d packages from source...\n", n);
+        if (build_packages(names, n, jobs) != 0) {
+            ret = TINYPKG_ERR;
+        }
+
+        /* Built or not, the prefix says */
+        for (size_t i = 0; i < count; i++) {
+            struct restore_item *it = &items[i];
+            char version[64], profile[32];
+
+            if (it->state != ITEM_PENDING) {
+                continue;
+            }
+            if (profile_built(it->e.name, version, sizeof(version), profile, sizeof(profile))
+                != TINYPKG_OK || strcmp(version, it->e.version) != 0 ||
+                strcmp(profile, it->e.profile) != 0) {
+                it->state = ITEM_FAILED;
+                continue;
+            }
+            it->state = ITEM_BUILT;
+            if (strcmp(it->e.digest, "-") != 0 && !prefix_matches(&it->e)) {
+                fprintf(stderr, "Warning: %s: rebuilt from the locked source, but not "
+                        "bit-identical to the locked build\n", it->e.name);
+            }
+        }
+    }
+
+    free(names);
+    return ret;
+}
+
+int lock_restore(const char *path, int jobs) {
+    struct restore_item *items;
+    struct timespec t0, t1;
+    size_t count, local = 0, artifacts = 0, built = 0, failed = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    items = read_lock(path, &count);
+    if (!items) {
+        return TINYPKG_ERR;
+    }
+    if (count == 0) {
+        printf("Nothing to restore\n");
+        free(items);
+        return TINYPKG_OK;
+    }
+
+    pool_run(items, count, check_local);
+    fetch_artifacts(items, count);
+    pool_run(items, count, unpack_artifact);
+
+    /* Unpacked prefixes join the store like built ones (which did already) */
+    for (size_t i = 0; i < count; i++) {
+        if (items[i].state == ITEM_ARTIFACT && store_enabled() &&
+            store_ingest(items[i].e.name) != TINYPKG_OK) {
+            log_warn("Store deduplication incomplete");
+        }
+    }
+
+    build_missing(items, count, jobs);
+
+    /* One installed.db rewrite for the whole set */
+    track_begin();
+    pool_run(items, count, install_item);
+    if (track_commit() != 0) {
+        fprintf(stderr, "Error: Could not record the installations\n");
+        free(items);
+        return TINYPKG_ERR;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const struct restore_item *it = &items[i];
+
+        if (!it->installed) {
+            fprintf(stderr, "Error: %s %s was not restored\n", it->e.name, it->e.version);
+            failed++;
+        } else if (it->state == ITEM_LOCAL) {
+            local++;
+        } else if (it->state == ITEM_ARTIFACT) {
+            artifacts++;
+        } else {
+            built++;
+        }
+    }
+
+    metrics_add(METRIC_CACHE_HITS, "artifact", (double)(local + artifacts));
+    metrics_add(METRIC_CACHE_MISSES, "artifact", (double)built);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("\n%s Restored %zu of %zu packages in %.2fs: %zu cached, %zu from artifacts, "
+           "%zu built\n", failed ? "✗" : "✓", count - failed, count,
+           (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9,
+           local, artifacts, built);
+
+    free(items);
+    return failed ? TINYPKG_ERR : TINYPKG_OK;
+}
@@ -10,7 +10,19 @@
 #include "common.h"
 #include "repo.h"
 #include "build.h"
+#include "sched.h"
 #include "util.h"
+#include "index.h"
+#include "gc.h"
+#include "store.h"
+#include "daemon.h"
+#include "mirror.h"
+#include "profile.h"
+#include "strip.h"
+#include "tpk.h"
+#include "lock.h"
+#include "metrics.h"
+#include "check.h"
 
 void print_usage(const char *prog) {
     printf("Usage: %s [command] [args...]\n\n", prog);
@@ -18,12 +30,35 @@ void print_usage(const char *prog) {
     printf("  repo sync                 Synchronize package repository\n");
     printf("  repo add <url>            Add repository source\n");
     printf("  repo remove <name>        Remove repository source\n");
+    printf("  repo check                Show problems the last sync found in manifests\n");
+    printf("  repo mirror [add|remove] <url>\n");
+    printf("                            Manage source mirrors, or list them\n");
     printf("  search <term>             Search for packages\n");
     printf("  info <package>            Show detailed package info\n");
     printf("  list                      List all available packages\n");
-    printf("  build <package>           Download and build a package\n");
-    printf("  install <package>         Install a built package\n");
-    printf("  remove <package>          Remove an installed package\n");
+    printf("  is-installed <package>    Check whether a package is installed\n");
+    printf("  build [-j N] [--profile P] [--strip[=compress]] [--build-in-ram]\n");
+    printf("        [--verbose] [--force] <package>...\n");
+    printf("                            Build packages N at a time, redoing only what changed\n");
+    printf("  profile [set <package> <profile>|unset <package>]\n");
+    printf("                            List build profiles, or pick one per package\n");
+    printf("  install <package|file.tpk>\n");
+    printf("                            Install a built package, or a package file\n");
+    printf("  pack <package> [-o file]  Write a built package to a .tpk file\n");
+    printf("  lock [file]               Write the installed set to a lockfile\n");
+    printf("  restore [-j N] [file]     Install exactly what a lockfile lists\n");
+    printf("  remove <package> [--force]\n");
+    printf("                            Remove an installed package\n");
+    printf("  rdeps <package> [--transitive]\n");
+    printf("                            List packages that depend on a package\n");
+    printf("  gc [--budget SIZE] [--dry-run] [--rescan]\n");
+    printf("                            Evict least recently used caches\n");
+    printf("  store [package]           Deduplicate a prefix, or report savings\n");
+    printf("  mirror <dir> [--artifacts]\n");
+    printf("                            Copy repo and sources into a servable mirror\n");
+    printf("  daemon [stop]             Serve queries from memory over a socket\n");
+    printf("  batch                     Answer queries read from stdin, one per line\n");
+    printf("  metrics [--textfile PATH] Print totals in Prometheus format, or write them\n");
     printf("  help                      Show this help message\n");
     printf("\n");
     printf("Examples:\n");
@@ -42,11 +77,15 @@ int main(int argc, char *argv[]) {
     
     const char *cmd = argv[1];
     int ret = 0;
+    struct timespec t0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    metrics_at_exit();
     
     /* Repository commands */
     if (strcmp(cmd, "repo") == 0) {
         if (argc < 3) {
-            printf("Usage: %s repo [sync|add|remove]\n", argv[0]);
+            printf("Usage: %s repo [sync|add|remove|check|mirror]\n", argv[0]);
             return 1;
         }
         
@@ -66,6 +105,19 @@ int main(int argc, char *argv[]) {
                 return 1;
             }
             ret = repo_remove(argv[3]);
+        } else if (strcmp(subcmd, "check") == 0) {
+            ret = check_print();
+        } else if (strcmp(subcmd, "mirror") == 0) {
+            if (argc == 3 || (argc == 4 && strcmp(argv[3], "list") == 0)) {
+                ret = mirror_list();
+            } else if (argc == 5 && strcmp(argv[3], "add") == 0) {
+                ret = mirror_add(argv[4]);
+            } else if (argc == 5 && strcmp(argv[3], "remove") == 0) {
+                ret = mirror_remove(argv[4]);
+            } else {
+                printf("Usage: %s repo mirror [list|add <url>|remove <url>]\n", argv[0]);
+                return 1;
+            }
         } else {
             printf("Unknown repo command: %s\n", subcmd);
             return 1;
@@ -77,7 +129,9 @@ int main(int argc, char *argv[]) {
             printf("Usage: %s search <term>\n", argv[0]);
             return 1;
         }
-        ret = util_search(argv[2]);
+        if (daemon_query("search", argv[2], &ret) != TINYPKG_OK) {
+            ret = util_search(argv[2]);
+        }
     }
     else if (strcmp(cmd, "info") == 0) {
         if (argc < 3) {
@@ -90,15 +144,18 @@ int main(int argc, char *argv[]) {
             return 1;
         }
         
-        ret = util_info(argv[2]);
+        if (daemon_query("info", argv[2], &ret) != TINYPKG_OK) {
+            ret = util_info(argv[2]);
+        }
     }
     else if (strcmp(cmd, "list") == 0) {
-        ret = util_list();
+        if (daemon_query("list", NULL, &ret) != TINYPKG_OK) {
+            ret = util_list();
+        }
     }
-    /* Build/install commands */
-    else if (strcmp(cmd, "build") == 0) {
+    else if (strcmp(cmd, "is-installed") == 0) {
         if (argc < 3) {
-            printf("Usage: %s build <package>\n", argv[0]);
+            printf("Usage: %s is-installed <package>\n", argv[0]);
             return 1;
         }
         
@@ -107,13 +164,83 @@ int main(int argc, char *argv[]) {
             return 1;
         }
         
-        ret = build_package(argv[2]);
+        if (daemon_query("is-installed", argv[2], &ret) != TINYPKG_OK) {
+            ret = util_is_installed(argv[2]);
+        }
+    }
+    /* Build/install commands */
+    else if (strcmp(cmd, "build") == 0) {
+        const char *env_jobs = getenv(SCHED_JOBS_ENV);
+        int jobs = (env_jobs && *env_jobs) ? atoi(env_jobs) : 1;
+        int count = 0;
+
+        /* Package names are compacted in place over the options */
+        for (int i = 2; i < argc; i++) {
+            if ((strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jobs") == 0) && i + 1 < argc) {
+                jobs = atoi(argv[++i]);
+                continue;
+            }
+            if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+                if (profile_use(argv[++i]) != TINYPKG_OK) {
+                    return 1;
+                }
+                continue;
+            }
+            if (strcmp(argv[i], "--strip") == 0 || strcmp(argv[i], "--strip=compress") == 0) {
+                strip_use(argv[i][7] ? STRIP_COMPRESS : STRIP_SPLIT);
+                continue;
+            }
+            if (strcmp(argv[i], "--build-in-ram") == 0) {
+                build_use_ram(1);
+                continue;
+            }
+            if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0) {
+                build_verbose(1);
+                continue;
+            }
+            if (strcmp(argv[i], "--force") == 0) {
+                build_force(1);
+                continue;
+            }
+            if (!is_valid_package_name(argv[i])) {
+                log_error("main", "Invalid package name");
+                return 1;
+            }
+            argv[2 + count++] = argv[i];
+        }
+
+        if (count == 0 || jobs < 1) {
+            printf("Usage: %s build [-j N] [--profile P] [--strip[=compress]] [--build-in-ram] "
+                   "[--verbose] [--force] <package>...\n", argv[0]);
+            return 1;
+        }
+
+        ret = build_packages(argv + 2, count, jobs);
+    }
+    else if (strcmp(cmd, "profile") == 0) {
+        if (argc == 2 || (argc == 3 && strcmp(argv[2], "list") == 0)) {
+            ret = profile_list();
+        } else if (argc == 5 && strcmp(argv[2], "set") == 0 &&
+                   is_valid_package_name(argv[3])) {
+            ret = profile_set(argv[3], argv[4]);
+        } else if (argc == 4 && strcmp(argv[2], "unset") == 0 &&
+                   is_valid_package_name(argv[3])) {
+            ret = profile_set(argv[3], NULL);
+        } else {
+            printf("Usage: %s profile [list|set <package> <profile>|unset <package>]\n",
+                   argv[0]);
+            return 1;
+        }
     }
     else if (strcmp(cmd, "install") == 0) {
         if (argc < 3) {
-            printf("Usage: %s install <package>\n", argv[0]);
+            printf("Usage: %s install <package|file.tpk>\n", argv[0]);
             return 1;
         }
+
+        if (tpk_is_file(argv[2])) {
+            return tpk_install(argv[2]) == TINYPKG_OK ? 0 : 1;
+        }
         
         if (!is_valid_package_name(argv[2])) {
             log_error("main", "Invalid package name");
@@ -122,6 +249,38 @@ int main(int argc, char *argv[]) {
         
         ret = install_package(argv[2]);
     }
+    else if (strcmp(cmd, "lock") == 0) {
+        if (argc > 3) {
+            printf("Usage: %s lock [file]\n", argv[0]);
+            return 1;
+        }
+        ret = lock_write(argc == 3 ? argv[2] : LOCK_FILE);
+    }
+    else if (strcmp(cmd, "restore") == 0) {
+        const char *env_jobs = getenv(SCHED_JOBS_ENV);
+        const char *file = NULL;
+        int jobs = (env_jobs && *env_jobs) ? atoi(env_jobs) : 1;
+
+        for (int i = 2; i < argc; i++) {
+            if ((strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jobs") == 0) && i + 1 < argc) {
+                jobs = atoi(argv[++i]);
+            } else if (argv[i][0] != '-' && !file) {
+                file = argv[i];
+            } else {
+                printf("Usage: %s restore [-j N] [file]\n", argv[0]);
+                return 1;
+            }
+        }
+        ret = lock_restore(file ? file : LOCK_FILE, jobs);
+    }
+    else if (strcmp(cmd, "pack") == 0) {
+        if ((argc != 3 && !(argc == 5 && strcmp(argv[3], "-o") == 0)) ||
+            !is_valid_package_name(argv[2])) {
+            printf("Usage: %s pack <package> [-o file]\n", argv[0]);
+            return 1;
+        }
+        ret = tpk_pack(argv[2], argc == 5 ? argv[4] : NULL);
+    }
     else if (strcmp(cmd, "remove") == 0) {
         if (argc < 3) {
             printf("Usage: %s remove <package>\n", argv[0]);
@@ -133,7 +292,86 @@ int main(int argc, char *argv[]) {
             return 1;
         }
         
-        ret = remove_package(argv[2]);
+        ret = remove_package(argv[2],
+                             argc > 3 && strcmp(argv[3], "--force") == 0);
+    }
+    else if (strcmp(cmd, "rdeps") == 0) {
+        if (argc < 3) {
+            printf("Usage: %s rdeps <package> [--transitive]\n", argv[0]);
+            return 1;
+        }
+        
+        if (!is_valid_package_name(argv[2])) {
+            log_error("main", "Invalid package name");
+            return 1;
+        }
+        
+        ret = index_print_rdeps(argv[2],
+                                argc > 3 && strcmp(argv[3], "--transitive") == 0);
+    }
+    /* Cache maintenance */
+    else if (strcmp(cmd, "gc") == 0) {
+        unsigned long long budget = gc_budget();
+        int dry_run = 0;
+        
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "--dry-run") == 0) {
+                dry_run = 1;
+            } else if (strcmp(argv[i], "--rescan") == 0) {
+                if (gc_rescan() != TINYPKG_OK) {
+                    return 1;
+                }
+            } else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc) {
+                if (gc_parse_size(argv[++i], &budget) != TINYPKG_OK) {
+                    log_error("main", "Invalid budget (use e.g. 500M or 2G)");
+                    return 1;
+                }
+            } else {
+                printf("Usage: %s gc [--budget SIZE] [--dry-run] [--rescan]\n", argv[0]);
+                return 1;
+            }
+        }
+        
+        ret = gc_collect(budget, dry_run);
+    }
+    else if (strcmp(cmd, "store") == 0) {
+        if (argc < 3) {
+            ret = store_report();
+        } else if (!is_valid_package_name(argv[2])) {
+            log_error("main", "Invalid package name");
+            return 1;
+        } else {
+            ret = store_ingest(argv[2]);
+        }
+    }
+    else if (strcmp(cmd, "mirror") == 0) {
+        int artifacts = argc > 3 && strcmp(argv[3], "--artifacts") == 0;
+
+        if (argc < 3 || argv[2][0] == '-' || (argc > 3 && !artifacts)) {
+            printf("Usage: %s mirror <dir> [--artifacts]\n", argv[0]);
+            return 1;
+        }
+        ret = mirror_create(argv[2], artifacts);
+    }
+    else if (strcmp(cmd, "batch") == 0) {
+        ret = util_batch(stdin, stdout);
+    }
+    else if (strcmp(cmd, "metrics") == 0) {
+        if (argc == 2) {
+            ret = metrics_print(stdout);
+        } else if (argc == 4 && strcmp(argv[2], "--textfile") == 0) {
+            ret = metrics_write_textfile(argv[3]);
+        } else {
+            printf("Usage: %s metrics [--textfile PATH]\n", argv[0]);
+            return 1;
+        }
+    }
+    else if (strcmp(cmd, "daemon") == 0) {
+        if (argc > 2 && strcmp(argv[2], "stop") == 0) {
+            ret = daemon_stop();
+        } else {
+            ret = daemon_run();
+        }
     }
     /* Help command */
     else if (strcmp(cmd, "help") == 0 || strcmp(cmd, "--help") == 0 ||
@@ -152,6 +390,13 @@ int main(int argc, char *argv[]) {
         print_usage(argv[0]);
         return 1;
     }
+
+    /* Only commands that ran; each query is timed end to end, daemon or not */
+    metrics_add(METRIC_RUNS, cmd, 1);
+    if (strcmp(cmd, "search") == 0 || strcmp(cmd, "info") == 0 ||
+        strcmp(cmd, "list") == 0 || strcmp(cmd, "is-installed") == 0) {
+        metrics_observe(METRIC_QUERY_SECONDS, cmd, metrics_since(&t0));
+    }
     
     return ret == TINYPKG_OK ? 0 : 1;
 }
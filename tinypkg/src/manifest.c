@@ -0,0 +1,77 @@
+/*
+ * manifest.c - The one reader of packages/<name>/manifest.yaml
+ *
+ * Manifests are a small subset of YAML: top-level "key: value" lines,
+ * lists of "  - item" lines and "key: |" blocks of indented script lines.
+ * This only splits a manifest into those lines; build.c fills a struct
+ * manifest from them and check.c reports what is wrong with them.
+ */
+
+#include "common.h"
+#include "manifest.h"
+
+/* Trailing blanks are not part of a YAML scalar */
+static void trim(char *s) {
+    size_t n = strlen(s);
+
+    while (n > 0 && (s[n - 1] == ' ' || s[n - 1] == '\t')) {
+        s[--n] = '\0';
+    }
+}
+
+int manifest_scan(const char *path, int (*fn)(const struct manifest_line *line, void *ctx),
+                  void *ctx) {
+    FILE *f = fopen(path, "r");
+    char *line = NULL;
+    size_t line_cap = 0;
+    char key[64] = "";
+    char item[LINE_MAX_LEN];
+    int lineno = 0, ret = TINYPKG_OK;
+
+    if (!f) {
+        return TINYPKG_ERR;
+    }
+
+    while (ret == TINYPKG_OK && getline(&line, &line_cap, f) >= 0) {
+        struct manifest_line l = { MANIFEST_TEXT, ++lineno, key, line, NULL };
+        char *colon;
+
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '#' || line[strspn(line, " \t")] == '\0') {
+            continue;
+        }
+
+        /* Indented: a list item, or a line of a script block */
+        if (line[0] == ' ' || line[0] == '\t') {
+            const char *p = line + strspn(line, " \t");
+
+            if (p[0] == '-' && (p[1] == '\0' || p[1] == ' ' || p[1] == '\t')) {
+                snprintf(item, sizeof(item), "%s", p + 1 + strspn(p + 1, " \t"));
+                trim(item);
+                l.item = item;
+            }
+            ret = fn(&l, ctx);
+            continue;
+        }
+
+        colon = strchr(line, ':');
+        if (!colon) {
+            key[0] = '\0';
+            l.event = MANIFEST_BAD;
+            ret = fn(&l, ctx);
+            continue;
+        }
+
+        *colon++ = '\0';
+        snprintf(key, sizeof(key), "%s", line);
+        colon += strspn(colon, " \t");
+        trim(colon);
+        l.event = MANIFEST_KEY;
+        l.value = colon;
+        ret = fn(&l, ctx);
+    }
+
+    free(line);
+    fclose(f);
+    return ret;
+}
@@ -0,0 +1,557 @@
+/*
+ * metrics.c - Cumulative counters and histograms in Prometheus format
+ *
+ * Instrumented code only adds to an in-memory table of this run's changes,
+ * under a mutex: no I/O on the hot path. At exit the changes are appended
+ * to ~/.cache/tinypkg/metrics.log in a single O_APPEND write, so a query
+ * that takes a millisecond doesn't pay for a locked rewrite of the totals.
+ * The log is folded into ~/.cache/tinypkg/metrics.db:
+ *
+ *   tinypkg-metrics 1
+ *   <metric> <label> <value>                          counters
+ *   <metric> <label> <count> <sum> <bucket counts>    histograms
+ *
+ * once it passes METRICS_LOG_MAX, and before the totals are read. Log
+ * records have the same form as the lines of metrics.db. Appenders hold a
+ * shared fcntl lock and the fold an exclusive one, so no record lands in
+ * the log between being read and the log being emptied. metrics.db is
+ * written to a temporary, fsync'd and renamed, so a crash leaves either
+ * the old totals or the new ones.
+ */
+
+#include "common.h"
+#include "metrics.h"
+#include <math.h>
+#include <pthread.h>
+
+#define METRICS_MAX_BUCKETS 12
+#define METRICS_LABEL_LEN 64
+
+/* This run's changes, appended at exit; folded into METRICS_FILE past this */
+#define METRICS_LOG "metrics.log"
+#define METRICS_LOG_MAX (64 * 1024)
+
+enum { KIND_COUNTER, KIND_HISTOGRAM };
+
+struct metric_def {
+    const char *name;
+    const char *help;
+    int kind;
+    const char *label;          /* Label name */
+    const double *buckets;      /* Upper bounds, ascending; histograms only */
+    int nbuckets;
+};
+
+static const double seconds_long[] = { 0.1, 0.5, 1, 5, 15, 60, 300, 900, 3600, 14400 };
+static const double seconds_short[] = { 0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1,
+                                        0.5, 1, 5 };
+static const double seconds_wait[] = { 0.001, 0.01, 0.1, 1, 10, 60, 600 };
+static const double bytes_rate[] = { 1e4, 1e5, 1e6, 1e7, 1e8, 1e9 };
+
+#define BUCKETS(b) b, (int)(sizeof(b) / sizeof(b[0]))
+
+static const struct metric_def defs[METRIC_COUNT] = {
+    [METRIC_RUNS] = { "tinypkg_runs_total", "tinypkg invocations",
+                      KIND_COUNTER, "command", NULL, 0 },
+    [METRIC_PHASE_SECONDS] = { "tinypkg_phase_duration_seconds",
+                               "Time spent in each package pipeline phase",
+                               KIND_HISTOGRAM, "phase", BUCKETS(seconds_long) },
+    [METRIC_DOWNLOAD_BYTES] = { "tinypkg_download_bytes_total", "Bytes downloaded",
+                                KIND_COUNTER, "host", NULL, 0 },
+    [METRIC_DOWNLOAD_SECONDS] = { "tinypkg_download_seconds_total",
+                                  "Wall time of completed downloads",
+                                  KIND_COUNTER, "host", NULL, 0 },
+    [METRIC_DOWNLOAD_THROUGHPUT] = { "tinypkg_download_throughput_bytes_per_second",
+                                     "Throughput of each completed download",
+                                     KIND_HISTOGRAM, "host", BUCKETS(bytes_rate) },
+    [METRIC_CACHE_HITS] = { "tinypkg_cache_hits_total",
+                            "Lookups answered from the local cache or an artifact",
+                            KIND_COUNTER, "cache", NULL, 0 },
+    [METRIC_CACHE_MISSES] = { "tinypkg_cache_misses_total",
+                              "Lookups that had to download or build",
+                              KIND_COUNTER, "cache", NULL, 0 },
+    [METRIC_QUERY_SECONDS] = { "tinypkg_query_duration_seconds",
+                               "Latency of search, info, list and is-installed",
+                               KIND_HISTOGRAM, "command", BUCKETS(seconds_short) },
+    [METRIC_LOCK_WAIT_SECONDS] = { "tinypkg_lock_wait_seconds",
+                                   "Time spent waiting for file locks",
+                                   KIND_HISTOGRAM, "lock", BUCKETS(seconds_wait) },
+};
+
+struct series {
+    int metric;
+    char label[METRICS_LABEL_LEN];
+    double value;               /* Counter value, or histogram sum */
+    unsigned long long count;   /* Observations */
+    unsigned long long buckets[METRICS_MAX_BUCKETS];   /* Not cumulative */
+};
+
+struct series_table {
+    struct series *s;
+    size_t count;
+};
+
+static pthread_mutex_t delta_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct series_table delta;
+static pid_t exit_owner;
+
+static int enabled(void) {
+    const char *env = getenv(METRICS_ENV);
+    return !(env && strcmp(env, "0") == 0);
+}
+
+/* Label values are single tokens in metrics.db */
+static void clean_label(const char *in, char *out) {
+    size_t i;
+
+    for (i = 0; in && in[i] && i < METRICS_LABEL_LEN - 1; i++) {
+        out[i] = isspace((unsigned char)in[i]) || in[i] == '"' || in[i] == '\\'
+                 ? '_' : in[i];
+    }
+    if (i == 0) {
+        out[i++] = '-';
+    }
+    out[i] = '\0';
+}
+
+static struct series *table_get(struct series_table *t, int metric, const char *label) {
+    struct series *grown;
+
+    for (size_t i = 0; i < t->count; i++) {
+        if (t->s[i].metric == metric && strcmp(t->s[i].label, label) == 0) {
+            return &t->s[i];
+        }
+    }
+
+    grown = realloc(t->s, (t->count + 1) * sizeof(*grown));
+    if (!grown) {
+        return NULL;
+    }
+    t->s = grown;
+    memset(&t->s[t->count], 0, sizeof(t->s[t->count]));
+    t->s[t->count].metric = metric;
+    snprintf(t->s[t->count].label, sizeof(t->s[t->count].label), "%s", label);
+    return &t->s[t->count++];
+}
+
+void metrics_add(int metric, const char *label, double value) {
+    char clean[METRICS_LABEL_LEN];
+    struct series *s;
+
+    if (metric < 0 || metric >= METRIC_COUNT || !enabled()) {
+        return;
+    }
+    clean_label(label, clean);
+
+    pthread_mutex_lock(&delta_lock);
+    s = table_get(&delta, metric, clean);
+    if (s) {
+        s->value += value;
+    }
+    pthread_mutex_unlock(&delta_lock);
+}
+
+void metrics_observe(int metric, const char *label, double value) {
+    char clean[METRICS_LABEL_LEN];
+    const struct metric_def *d;
+    struct series *s;
+
+    if (metric < 0 || metric >= METRIC_COUNT || !enabled() || isnan(value)) {
+        return;
+    }
+    d = &defs[metric];
+    clean_label(label, clean);
+
+    pthread_mutex_lock(&delta_lock);
+    s = table_get(&delta, metric, clean);
+    if (s) {
+        int b = 0;
+
+        while (b < d->nbuckets && value > d->buckets[b]) b++;
+        if (b < d->nbuckets) {
+            s->buckets[b]++;
+        }
+        s->value += value;
+        s->count++;
+    }
+    pthread_mutex_unlock(&delta_lock);
+}
+
+double metrics_since(const struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* ============================================================================
+ * Persistence
+ * ============================================================================
+ */
+
+static int metric_by_name(const char *name) {
+    for (int i = 0; i < METRIC_COUNT; i++) {
+        if (strcmp(defs[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Add the lines of path to t; magic, when given, must be the first line.
+ * Unknown metrics (from a newer tinypkg) are dropped, not fatal, and so
+ * is a last line without its newline, left by a run that crashed mid-write.
+ */
+static void table_read(struct series_table *t, const char *path, const char *magic) {
+    char line[LINE_MAX_LEN];
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (!f) {
+        return;
+    }
+    if (magic && (!fgets(line, sizeof(line), f) || strncmp(line, magic, strlen(magic)))) {
+        fclose(f);
+        return;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        char name[128], label[METRICS_LABEL_LEN];
+        struct series *s;
+        char *p = line;
+        int metric, used;
+
+        if (!strchr(line, '\n') ||
+            sscanf(p, "%127s %63s%n", name, label, &used) != 2 ||
+            (metric = metric_by_name(name)) < 0 || !(s = table_get(t, metric, label))) {
+            continue;
+        }
+        p += used;
+
+        if (defs[metric].kind == KIND_COUNTER) {
+            s->value += strtod(p, NULL);
+            continue;
+        }
+        s->count += strtoull(p, &p, 10);
+        s->value += strtod(p, &p);
+        for (int b = 0; b < defs[metric].nbuckets; b++) {
+            s->buckets[b] += strtoull(p, &p, 10);
+        }
+    }
+    fclose(f);
+}
+
+static void table_write(const struct series_table *t, FILE *f) {
+    for (size_t i = 0; i < t->count; i++) {
+        const struct series *s = &t->s[i];
+        const struct metric_def *d = &defs[s->metric];
+
+        fprintf(f, "%s %s", d->name, s->label);
+        if (d->kind == KIND_COUNTER) {
+            fprintf(f, " %.17g\n", s->value);
+            continue;
+        }
+        fprintf(f, " %llu %.17g", s->count, s->value);
+        for (int b = 0; b < d->nbuckets; b++) {
+            fprintf(f, " %llu", s->buckets[b]);
+        }
+        fprintf(f, "\n");
+    }
+}
+
+static int table_save(const struct series_table *t) {
+    char path[PATH_MAX_LEN], tmp_path[PATH_MAX_LEN + 8];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/%s", get_cache_path(), METRICS_FILE);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    f = fopen(tmp_path, "w");
+    if (!f) {
+        return TINYPKG_ERR;
+    }
+
+    fprintf(f, "%s\n", METRICS_MAGIC);
+    table_write(t, f);
+
+    /* Data on disk before the rename makes it visible */
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0) {
+        fclose(f);
+        unlink(tmp_path);
+        return TINYPKG_ERR;
+    }
+    if (fclose(f) != 0 || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return TINYPKG_ERR;
+    }
+    return TINYPKG_OK;
+}
+
+/* F_RDLCK to append to the log, F_WRLCK to fold it */
+static int file_lock(short type) {
+    char lock_path[PATH_MAX_LEN];
+    struct flock fl;
+    int fd;
+
+    snprintf(lock_path, sizeof(lock_path), "%s/%s.lock", get_cache_path(), METRICS_FILE);
+    if (mkdir_p(get_cache_path()) != TINYPKG_OK) {
+        return -1;
+    }
+
+    fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    if (fcntl(fd, F_SETLKW, &fl) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * One write, so concurrent runs never interleave their records. Sets
+ * *size to the log's length afterwards.
+ */
+static int log_append(const struct series_table *t, off_t *size) {
+    char path[PATH_MAX_LEN];
+    char *buf = NULL;
+    size_t len = 0;
+    struct stat st;
+    FILE *mem;
+    int lock_fd, fd, ret = TINYPKG_ERR;
+
+    mem = open_memstream(&buf, &len);
+    if (!mem) {
+        return TINYPKG_ERR;
+    }
+    table_write(t, mem);
+    if (fclose(mem) != 0) {
+        free(buf);
+        return TINYPKG_ERR;
+    }
+
+    lock_fd = file_lock(F_RDLCK);
+    if (lock_fd < 0) {
+        free(buf);
+        return TINYPKG_ERR;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", get_cache_path(), METRICS_LOG);
+    fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        if (write(fd, buf, len) == (ssize_t)len && fstat(fd, &st) == 0) {
+            *size = st.st_size;
+            ret = TINYPKG_OK;
+        }
+        close(fd);
+    }
+
+    close(lock_fd);
+    free(buf);
+    return ret;
+}
+
+static int write_textfile(const struct series_table *t, const char *path);
+
+/*
+ * Fold metrics.log and this run's changes into METRICS_FILE, leave the
+ * result in total and, if textfile is set, write it there too, still under
+ * the lock so the textfile always matches metrics.db. Caller holds
+ * delta_lock. A crash between the rename and the unlink counts the log
+ * twice; metrics are not worth a journal.
+ */
+static int fold(struct series_table *total, const char *textfile) {
+    char db_path[PATH_MAX_LEN], log_path[PATH_MAX_LEN];
+    int fd, ret;
+
+    fd = file_lock(F_WRLCK);
+    if (fd < 0) {
+        return TINYPKG_ERR;
+    }
+
+    snprintf(db_path, sizeof(db_path), "%s/%s", get_cache_path(), METRICS_FILE);
+    snprintf(log_path, sizeof(log_path), "%s/%s", get_cache_path(), METRICS_LOG);
+    table_read(total, db_path, METRICS_MAGIC);
+    table_read(total, log_path, NULL);
+    for (size_t i = 0; i < delta.count; i++) {
+        const struct series *d = &delta.s[i];
+        struct series *s = table_get(total, d->metric, d->label);
+
+        if (!s) {
+            continue;
+        }
+        s->value += d->value;
+        s->count += d->count;
+        for (int b = 0; b < METRICS_MAX_BUCKETS; b++) {
+            s->buckets[b] += d->buckets[b];
+        }
+    }
+
+    if (table_save(total) != TINYPKG_OK) {
+        close(fd);
+        return TINYPKG_ERR;
+    }
+    unlink(log_path);
+    free(delta.s);
+    delta.s = NULL;
+    delta.count = 0;
+
+    ret = textfile && *textfile ? write_textfile(total, textfile) : TINYPKG_OK;
+    close(fd);
+    return ret;
+}
+
+/* ============================================================================
+ * Exposition
+ * ============================================================================
+ */
+
+static int series_cmp(const void *a, const void *b) {
+    const struct series *x = a, *y = b;
+
+    if (x->metric != y->metric) {
+        return x->metric - y->metric;
+    }
+    return strcmp(x->label, y->label);
+}
+
+/* Prometheus floats: shortest that round-trips a bucket bound, +Inf spelled out */
+static void print_number(FILE *out, double v) {
+    if (isinf(v)) {
+        fputs(v > 0 ? "+Inf" : "-Inf", out);
+    } else {
+        fprintf(out, "%.15g", v);
+    }
+}
+
+static void render(const struct series_table *t, FILE *out) {
+    int last = -1;
+
+    qsort(t->s, t->count, sizeof(*t->s), series_cmp);
+
+    for (size_t i = 0; i < t->count; i++) {
+        const struct series *s = &t->s[i];
+        const struct metric_def *d = &defs[s->metric];
+        unsigned long long cumulative = 0;
+
+        if (s->metric != last) {
+            fprintf(out, "# HELP %s %s\n", d->name, d->help);
+            fprintf(out, "# TYPE %s %s\n", d->name,
+                    d->kind == KIND_COUNTER ? "counter" : "histogram");
+            last = s->metric;
+        }
+
+        if (d->kind == KIND_COUNTER) {
+            fprintf(out, "%s{%s=\"%s\"} ", d->name, d->label, s->label);
+            print_number(out, s->value);
+            fputc('\n', out);
+            continue;
+        }
+
+        for (int b = 0; b < d->nbuckets; b++) {
+            cumulative += s->buckets[b];
+            fprintf(out, "%s_bucket{%s=\"%s\",le=\"", d->name, d->label, s->label);
+            print_number(out, d->buckets[b]);
+            fprintf(out, "\"} %llu\n", cumulative);
+        }
+        fprintf(out, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %llu\n", d->name, d->label,
+                s->label, s->count);
+        fprintf(out, "%s_sum{%s=\"%s\"} ", d->name, d->label, s->label);
+        print_number(out, s->value);
+        fprintf(out, "\n%s_count{%s=\"%s\"} %llu\n", d->name, d->label, s->label, s->count);
+    }
+}
+
+static int write_textfile(const struct series_table *t, const char *path) {
+    char tmp_path[PATH_MAX_LEN + 32];
+    FILE *f;
+
+    /* Same directory, so the rename is atomic and the collector never
+     * reads a half-written file; the pid keeps concurrent runs apart */
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", path, (long)getpid());
+    f = fopen(tmp_path, "w");
+    if (!f) {
+        log_error("metrics_write_textfile", strerror(errno));
+        return TINYPKG_ERR;
+    }
+
+    render(t, f);
+    if (fclose(f) != 0 || rename(tmp_path, path) != 0) {
+        log_error("metrics_write_textfile", strerror(errno));
+        unlink(tmp_path);
+        return TINYPKG_ERR;
+    }
+    return TINYPKG_OK;
+}
+
+int metrics_flush(void) {
+    struct series_table total = { NULL, 0 };
+    const char *textfile = getenv(METRICS_TEXTFILE_ENV);
+    off_t size = 0;
+    int ret = TINYPKG_OK;
+
+    pthread_mutex_lock(&delta_lock);
+    if (delta.count == 0) {
+        pthread_mutex_unlock(&delta_lock);
+        return TINYPKG_OK;
+    }
+
+    /* The textfile needs the totals, so only then is every run a fold */
+    if (textfile && *textfile) {
+        ret = fold(&total, textfile);
+    } else if ((ret = log_append(&delta, &size)) == TINYPKG_OK) {
+        free(delta.s);
+        delta.s = NULL;
+        delta.count = 0;
+        if (size > METRICS_LOG_MAX) {
+            ret = fold(&total, NULL);
+        }
+    }
+
+    pthread_mutex_unlock(&delta_lock);
+    free(total.s);
+    return ret;
+}
+
+static void flush_at_exit(void) {
+    if (getpid() == exit_owner) {
+        metrics_flush();
+    }
+}
+
+void metrics_at_exit(void) {
+    exit_owner = getpid();
+    atexit(flush_at_exit);
+}
+
+int metrics_print(FILE *out) {
+    struct series_table total = { NULL, 0 };
+    int ret;
+
+    /* This run's own changes count too */
+    pthread_mutex_lock(&delta_lock);
+    ret = fold(&total, NULL);
+    pthread_mutex_unlock(&delta_lock);
+
+    render(&total, out);
+    free(total.s);
+    return ret;
+}
+
+int metrics_write_textfile(const char *path) {
+    struct series_table total = { NULL, 0 };
+    int ret;
+
+    pthread_mutex_lock(&delta_lock);
+    ret = fold(&total, path);
+    pthread_mutex_unlock(&delta_lock);
+
+    free(total.s);
+    return ret;
+}
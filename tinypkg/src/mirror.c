@@ -0,0 +1,801 @@
+/*
+ * mirror.c - Source mirrors and per-host download statistics
+ *
+ * Every download has an ordered list of candidate URLs (repo-level
+ * mirrors, manifest mirrors, the manifest source). fetch.c probes them all
+ * at once and tries them in mirror_score() order, which combines the
+ * probe's time to first byte with what is remembered about the host in
+ * ~/.cache/tinypkg/hosts.db:
+ *
+ *   tinypkg-hosts 1
+ *   <host> <latency_ms> <bytes_per_sec> <ok> <fail> <updated>
+ *
+ * Latency and throughput are exponentially weighted moving averages, so a
+ * host that slows down loses its place after a few downloads.
+ *
+ * mirror_create() builds the other end: a static tree any web server (or a
+ * file:// path) can serve to a fleet, so upstream is only paid once. It
+ * holds the repository both as repo.git and as snapshots (snapshot.c).
+ */
+
+#include "common.h"
+#include "mirror.h"
+#include "metrics.h"
+#include "build.h"
+#include "fetch.h"
+#include "sha256.h"
+#include "profile.h"
+#include "tpk.h"
+#include "snapshot.h"
+#include <dirent.h>
+#include <strings.h>
+
+#define EWMA_WEIGHT 0.3
+#define DEFAULT_LATENCY_MS 200.0
+#define DEFAULT_BPS (2.0 * 1024 * 1024)
+#define MIN_THROUGHPUT_SAMPLE (64 * 1024)   /* Smaller transfers say little */
+
+struct host_entry {
+    char host[128];
+    double latency_ms;
+    double bps;
+    unsigned long ok;
+    unsigned long fail;
+    long long updated;
+};
+
+struct host_table {
+    struct host_entry *entries;
+    size_t count;
+};
+
+/* Snapshot used for scoring, loaded once per process */
+static struct host_table cached;
+static int cached_loaded;
+
+/* ============================================================================
+ * Candidates
+ * ============================================================================
+ */
+
+static int add_candidate(char *out[], int count, int max, const char *url) {
+    if (count >= max || !url || !*url) {
+        return count;
+    }
+
+    /* Same URL from two places: keep the earlier, preferred one */
+    for (int i = 0; i < count; i++) {
+        if (strcmp(out[i], url) == 0) {
+            return count;
+        }
+    }
+
+    out[count] = strdup(url);
+    return out[count] ? count + 1 : count;
+}
+
+static int add_base(char *out[], int count, int max, const char *base,
+                    const char *kind, const char *name, const char *file) {
+    char url[PATH_MAX_LEN];
+    size_t len = strlen(base);
+
+    while (len > 0 && base[len - 1] == '/') {
+        len--;
+    }
+
+    if (snprintf(url, sizeof(url), "%.*s/%s/%s/%s", (int)len, base, kind, name, file)
+        >= (int)sizeof(url)) {
+        return count;
+    }
+    return add_candidate(out, count, max, url);
+}
+
+/* <base>/<kind>/<name>/<file> for each repo-level mirror */
+static int add_repo_bases(char *out[], int count, int max, const char *kind,
+                          const char *name, const char *file) {
+    char path[PATH_MAX_LEN];
+    char line[LINE_MAX_LEN];
+    const char *env = getenv(MIRROR_ENV);
+    FILE *f;
+
+    /* Environment first, otherwise mirrors.conf */
+    if (*file && env && *env) {
+        char *copy = strdup(env);
+        char *save = NULL;
+
+        for (char *tok = copy ? strtok_r(copy, " \t,", &save) : NULL; tok;
+             tok = strtok_r(NULL, " \t,", &save)) {
+            count = add_base(out, count, max, tok, kind, name, file);
+        }
+        free(copy);
+    } else if (*file) {
+        snprintf(path, sizeof(path), "%s/%s", get_cache_path(), MIRROR_CONF_FILE);
+        f = fopen(path, "r");
+        if (f) {
+            while (fgets(line, sizeof(line), f)) {
+                char base[LINE_MAX_LEN];
+                if (sscanf(line, "%511s", base) == 1 && base[0] != '#') {
+                    count = add_base(out, count, max, base, kind, name, file);
+                }
+            }
+            fclose(f);
+        }
+    }
+    return count;
+}
+
+int mirror_candidates(const char *name, const char *source,
+                      char *const manifest_mirrors[], int nmirrors,
+                      char *out[], int max) {
+    const char *file = strrchr(source, '/');
+    int count;
+
+    file = file ? file + 1 : source;
+    count = add_repo_bases(out, 0, max, "sources", name, file);
+
+    for (int i = 0; i < nmirrors; i++) {
+        count = add_candidate(out, count, max, manifest_mirrors[i]);
+    }
+
+    /* The source always stays a candidate, even with max mirrors listed */
+    if (count == max) {
+        for (int i = 0; i < count; i++) {
+            if (strcmp(out[i], source) == 0) {
+                return count;
+            }
+        }
+        free(out[--count]);
+    }
+    return add_candidate(out, count, max, source);
+}
+
+int mirror_artifact_candidates(const char *name, const char *file, char *out[], int max) {
+    return add_repo_bases(out, 0, max, "artifacts", name, file);
+}
+
+void mirror_host(const char *url, char *host, size_t len) {
+    const char *p = strstr(url, "://");
+    size_t n;
+
+    if (strncmp(url, "file://", 7) == 0 || !p) {
+        snprintf(host, len, "file");
+        return;
+    }
+
+    p += 3;
+    n = strcspn(p, "/?#");
+    snprintf(host, len, "%.*s", (int)n, p);
+}
+
+/* ============================================================================
+ * Host table
+ * ============================================================================
+ */
+
+static void table_free(struct host_table *t) {
+    free(t->entries);
+    memset(t, 0, sizeof(*t));
+}
+
+static int table_load(struct host_table *t) {
+    char path[PATH_MAX_LEN];
+    char line[LINE_MAX_LEN];
+    FILE *f;
+
+    memset(t, 0, sizeof(*t));
+    snprintf(path, sizeof(path), "%s/%s", get_cache_path(), MIRROR_HOSTS_FILE);
+
+    f = fopen(path, "r");
+    if (!f) {
+        return TINYPKG_OK;    /* No history yet */
+    }
+
+    if (!fgets(line, sizeof(line), f) ||
+        strncmp(line, MIRROR_HOSTS_MAGIC, strlen(MIRROR_HOSTS_MAGIC)) != 0) {
+        fclose(f);
+        return TINYPKG_OK;    /* Unknown format: start over */
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        struct host_entry e;
+        struct host_entry *grown;
+
+        if (sscanf(line, "%127s %lf %lf %lu %lu %lld", e.host, &e.latency_ms,
+                   &e.bps, &e.ok, &e.fail, &e.updated) != 6) {
+            continue;
+        }
+
+        grown = realloc(t->entries, (t->count + 1) * sizeof(*grown));
+        if (!grown) {
+            fclose(f);
+            table_free(t);
+            return TINYPKG_ERR;
+        }
+        t->entries = grown;
+        t->entries[t->count++] = e;
+    }
+
+    fclose(f);
+    return TINYPKG_OK;
+}
+
+static int table_save(const struct host_table *t) {
+    char path[PATH_MAX_LEN];
+    char tmp_path[PATH_MAX_LEN];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/%s", get_cache_path(), MIRROR_HOSTS_FILE);
+    snprintf(tmp_path, sizeof(tmp_path), "%s/%s.tmp", get_cache_path(), MIRROR_HOSTS_FILE);
+
+    f = fopen(tmp_path, "w");
+    if (!f) {
+        log_error("mirror_record", strerror(errno));
+        return TINYPKG_ERR;
+    }
+
+    fprintf(f, "%s\n", MIRROR_HOSTS_MAGIC);
+    for (size_t i = 0; i < t->count; i++) {
+        const struct host_entry *e = &t->entries[i];
+        fprintf(f, "%s %.1f %.0f %lu %lu %lld\n", e->host, e->latency_ms,
+                e->bps, e->ok, e->fail, e->updated);
+    }
+
+    if (fclose(f) != 0 || rename(tmp_path, path) != 0) {
+        log_error("mirror_record", strerror(errno));
+        unlink(tmp_path);
+        return TINYPKG_ERR;
+    }
+    return TINYPKG_OK;
+}
+
+static struct host_entry *table_find(const struct host_table *t, const char *host) {
+    for (size_t i = 0; i < t->count; i++) {
+        if (strcmp(t->entries[i].host, host) == 0) {
+            return &t->entries[i];
+        }
+    }
+    return NULL;
+}
+
+/* Serialize read-modify-write of the table between processes */
+static int table_lock(void) {
+    char lock_path[PATH_MAX_LEN];
+    struct flock fl;
+    struct timespec t0;
+    int fd;
+
+    if (mkdir_p(get_cache_path()) != TINYPKG_OK) {
+        return -1;
+    }
+
+    snprintf(lock_path, sizeof(lock_path), "%s/%s.lock",
+             get_cache_path(), MIRROR_HOSTS_FILE);
+
+    fd = open(lock_path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        log_error("mirror_record", strerror(errno));
+        return -1;
+    }
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (fcntl(fd, F_SETLKW, &fl) != 0) {
+        log_error("mirror_record", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    metrics_observe(METRIC_LOCK_WAIT_SECONDS, "hosts", metrics_since(&t0));
+    return fd;
+}
+
+static double ewma(double old, double sample) {
+    return old > 0 ? old + EWMA_WEIGHT * (sample - old) : sample;
+}
+
+int mirror_record(const struct host_sample *samples, size_t count) {
+    struct host_table t;
+    int fd, ret;
+
+    if (count == 0) {
+        return TINYPKG_OK;
+    }
+
+    fd = table_lock();
+    if (fd < 0) {
+        return TINYPKG_ERR;
+    }
+
+    if (table_load(&t) != TINYPKG_OK) {
+        close(fd);
+        return TINYPKG_ERR;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const struct host_sample *s = &samples[i];
+        struct host_entry *e = table_find(&t, s->host);
+
+        if (!e) {
+            struct host_entry *grown = realloc(t.entries, (t.count + 1) * sizeof(*grown));
+            if (!grown) {
+                break;
+            }
+            t.entries = grown;
+            e = &t.entries[t.count++];
+            memset(e, 0, sizeof(*e));
+            snprintf(e->host, sizeof(e->host), "%s", s->host);
+        }
+
+        if (s->ok) {
+            e->ok++;
+        } else {
+            e->fail++;
+        }
+        if (s->latency_ms > 0) {
+            e->latency_ms = ewma(e->latency_ms, s->latency_ms);
+        }
+        if (s->ok && s->bytes >= MIN_THROUGHPUT_SAMPLE && s->seconds > 0) {
+            e->bps = ewma(e->bps, s->bytes / s->seconds);
+        }
+        e->updated = (long long)time(NULL);
+    }
+
+    ret = table_save(&t);
+    table_free(&t);
+    close(fd);
+
+    /* Rescore from fresh data next time */
+    if (cached_loaded) {
+        table_free(&cached);
+        cached_loaded = 0;
+    }
+    return ret;
+}
+
+double mirror_score(const char *url, double probe_ms, long long size) {
+    char host[128];
+    const struct host_entry *e;
+    double latency, bps, score;
+
+    if (!cached_loaded) {
+        table_load(&cached);
+        cached_loaded = 1;
+    }
+
+    mirror_host(url, host, sizeof(host));
+    e = table_find(&cached, host);
+
+    latency = probe_ms > 0 ? probe_ms : (e && e->latency_ms > 0 ? e->latency_ms : DEFAULT_LATENCY_MS);
+    bps = (e && e->bps > 0) ? e->bps : DEFAULT_BPS;
+    score = latency / 1000.0 + (size > 0 ? (double)size : 1048576.0) / bps;
+
+    /* A host that often fails costs a retry on top */
+    if (e) {
+        score *= 1.0 + 2.0 * (double)e->fail / (double)(e->ok + e->fail + 1);
+    }
+    return score;
+}
+
+/* ============================================================================
+ * Repo-level configuration
+ * ============================================================================
+ */
+
+static int valid_base(const char *base) {
+    return strncmp(base, "http://", 7) == 0 || strncmp(base, "https://", 8) == 0 ||
+           strncmp(base, "file://", 7) == 0;
+}
+
+/* Rewrite mirrors.conf without 'drop' and, if given, with 'add' appended */
+static int conf_update(const char *drop, const char *add, int *found) {
+    char path[PATH_MAX_LEN], tmp_path[PATH_MAX_LEN];
+    char line[LINE_MAX_LEN];
+    FILE *in, *out;
+
+    *found = 0;
+    if (mkdir_p(get_cache_path()) != TINYPKG_OK) {
+        return TINYPKG_ERR;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", get_cache_path(), MIRROR_CONF_FILE);
+    snprintf(tmp_path, sizeof(tmp_path), "%s/%s.tmp", get_cache_path(), MIRROR_CONF_FILE);
+
+    out = fopen(tmp_path, "w");
+    if (!out) {
+        log_error("mirror", strerror(errno));
+        return TINYPKG_ERR;
+    }
+
+    in = fopen(path, "r");
+    if (in) {
+        while (fgets(line, sizeof(line), in)) {
+            char base[LINE_MAX_LEN];
+            if (sscanf(line, "%511s", base) == 1 && base[0] != '#' &&
+                strcmp(base, drop) == 0) {
+                *found = 1;
+                continue;
+            }
+            fputs(line, out);
+        }
+        fclose(in);
+    } else {
+        fprintf(out, "# Source mirrors, most preferred first: <base>/sources/<pkg>/<file>\n");
+    }
+
+    if (add) {
+        fprintf(out, "%s\n", add);
+    }
+
+    if (fclose(out) != 0 || rename(tmp_path, path) != 0) {
+        log_error("mirror", strerror(errno));
+        unlink(tmp_path);
+        return TINYPKG_ERR;
+    }
+    return TINYPKG_OK;
+}
+
+int mirror_add(const char *base) {
+    int found;
+
+    if (!valid_base(base)) {
+        log_error("mirror_add", "Mirror must start with http://, https:// or file://");
+        return TINYPKG_ERR;
+    }
+
+    /* Re-adding moves a mirror to the end of the list */
+    if (conf_update(base, base, &found) != TINYPKG_OK) {
+        return TINYPKG_ERR;
+    }
+
+    printf("✓ Mirror %s %s\n", base, found ? "moved to the end" : "added");
+    return TINYPKG_OK;
+}
+
+int mirror_remove(const char *base) {
+    int found;
+
+    if (conf_update(base, NULL, &found) != TINYPKG_OK) {
+        return TINYPKG_ERR;
+    }
+    if (!found) {
+        log_error("mirror_remove", "No such mirror");
+        return TINYPKG_NOT_FOUND;
+    }
+
+    printf("✓ Mirror %s removed\n", base);
+    return TINYPKG_OK;
+}
+
+int mirror_list(void) {
+    char path[PATH_MAX_LEN];
+    char line[LINE_MAX_LEN];
+    const char *env = getenv(MIRROR_ENV);
+    struct host_table t;
+    FILE *f;
+
+    printf("Mirrors (tried before manifest sources):\n");
+    if (env && *env) {
+        printf("  %s (from %s)\n", env, MIRROR_ENV);
+    } else {
+        int any = 0;
+
+        snprintf(path, sizeof(path), "%s/%s", get_cache_path(), MIRROR_CONF_FILE);
+        f = fopen(path, "r");
+        while (f && fgets(line, sizeof(line), f)) {
+            char base[LINE_MAX_LEN];
+            if (sscanf(line, "%511s", base) == 1 && base[0] != '#') {
+                printf("  %s\n", base);
+                any = 1;
+            }
+        }
+        if (f) {
+            fclose(f);
+        }
+        if (!any) {
+            printf("  (none)\n");
+        }
+    }
+
+    if (table_load(&t) != TINYPKG_OK || t.count == 0) {
+        printf("\nNo host statistics yet\n");
+        table_free(&t);
+        return TINYPKG_OK;
+    }
+
+    printf("\n%-32s %10s %12s %6s %6s\n", "Host", "Latency", "Throughput", "OK", "Fail");
+    for (size_t i = 0; i < t.count; i++) {
+        const struct host_entry *e = &t.entries[i];
+        printf("%-32s %8.0fms %8.1fMB/s %6lu %6lu\n", e->host, e->latency_ms,
+               e->bps / 1048576.0, e->ok, e->fail);
+    }
+
+    table_free(&t);
+    return TINYPKG_OK;
+}
+
+/* ============================================================================
+ * Creating a mirror
+ * ============================================================================
+ */
+
+/* Packages per fetch batch; each may run several curl processes */
+#define MIRROR_FETCH_BATCH 16
+
+struct mirror_item {
+    struct manifest m;
+    char dest[PATH_MAX_LEN];
+};
+
+/* 1 if path matches "sha256:<hex>", 0 if not, -1 if it cannot be checked */
+static int checksum_ok(const char *path, const char *checksum) {
+    char hex[SHA256_HEX_LEN];
+    const char *want = sha256_checksum_hex(checksum);
+
+    if (!want) {
+        return -1;
+    }
+
+    if (sha256_file(path, hex) != TINYPKG_OK) {
+        return 0;
+    }
+    return strcasecmp(hex, want) == 0;
+}
+
+/* An existing, verified copy need not be fetched again */
+static int have_source(const struct mirror_item *it) {
+    struct stat st;
+
+    if (stat(it->dest, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+    return !it->m.checksum[0] || checksum_ok(it->dest, it->m.checksum) != 0;
+}
+
+static int mirror_repo(const char *dir) {
+    char src[PATH_MAX_LEN], dst[PATH_MAX_LEN], id[64];
+    struct stat st;
+    int ret;
+
+    snprintf(src, sizeof(src), "%s/repo", get_cache_path());
+    snprintf(dst, sizeof(dst), "%s/repo.git", dir);
+
+    if (stat(src, &st) != 0) {
+        log_error("mirror_create", "No synced repository; run 'tinypkg repo sync' first");
+        return TINYPKG_ERR;
+    }
+
+    /* A tree synced from snapshots has no history; republish the snapshot only */
+    if (snapshot_id(id) == TINYPKG_OK) {
+        printf("Repository synced from snapshot %.12s: no history for repo.git\n", id);
+        return TINYPKG_OK;
+    }
+
+    printf("Mirroring repository to %s...\n", dst);
+    if (stat(dst, &st) == 0) {
+        char *argv[] = { "git", "-C", dst, "fetch", "--quiet", "--prune", "origin", NULL };
+        ret = safe_execute(argv);
+    } else {
+        char *argv[] = { "git", "clone", "--quiet", "--mirror", src, dst, NULL };
+        ret = safe_execute(argv);
+    }
+
+    /* Lets plain HTTP servers serve the repository */
+    if (ret == TINYPKG_OK) {
+        char *argv[] = { "git", "-C", dst, "update-server-info", NULL };
+        ret = safe_execute(argv);
+    }
+    if (ret != TINYPKG_OK) {
+        log_error("mirror_create", "git failed");
+    }
+    return ret;
+}
+
+/* Read every manifest; items whose source is missing or stale go first */
+static struct mirror_item *mirror_scan(const char *dir, size_t *count, size_t *missing) {
+    char pkgs_dir[PATH_MAX_LEN];
+    struct mirror_item *items = NULL;
+    struct dirent *de;
+    size_t cap = 0;
+    DIR *d;
+
+    *count = 0;
+    *missing = 0;
+    snprintf(pkgs_dir, sizeof(pkgs_dir), "%s/repo/packages", get_cache_path());
+
+    d = opendir(pkgs_dir);
+    if (!d) {
+        log_error("mirror_create", "Could not open packages directory");
+        return NULL;
+    }
+
+    while ((de = readdir(d)) != NULL) {
+        struct mirror_item *it;
+        const char *file;
+        char pkg_dir[PATH_MAX_LEN];
+
+        if (!is_valid_package_name(de->d_name)) {
+            continue;
+        }
+
+        if (*count == cap) {
+            size_t new_cap = cap ? cap * 2 : 64;
+            struct mirror_item *grown = realloc(items, new_cap * sizeof(*grown));
+            if (!grown) {
+                log_error("mirror_create", strerror(errno));
+                free(items);
+                closedir(d);
+                return NULL;
+            }
+            items = grown;
+            cap = new_cap;
+        }
+
+        it = &items[*count];
+        if (parse_manifest(de->d_name, &it->m) != 0) {
+            continue;
+        }
+
+        file = strrchr(it->m.source, '/');
+        file = file ? file + 1 : it->m.source;
+        snprintf(pkg_dir, sizeof(pkg_dir), "%s/sources/%s", dir, de->d_name);
+        if (!*file || mkdir_p(pkg_dir) != TINYPKG_OK ||
+            snprintf(it->dest, sizeof(it->dest), "%s/%s", pkg_dir, file)
+                >= (int)sizeof(it->dest)) {
+            log_warn("Skipping package with unusable source URL");
+            continue;
+        }
+        (*count)++;
+    }
+    closedir(d);
+
+    /* Partition: missing sources to the front */
+    for (size_t i = 0; i < *count; i++) {
+        if (!have_source(&items[i])) {
+            struct mirror_item tmp = items[*missing];
+            items[*missing] = items[i];
+            items[i] = tmp;
+            (*missing)++;
+        }
+    }
+    return items;
+}
+
+/* Fetch items in batches, verified as they arrive; returns the number that failed */
+static size_t mirror_sources(struct mirror_item *items, size_t count,
+                             long long *bytes) {
+    size_t failed = 0;
+
+    for (size_t base = 0; base < count; base += MIRROR_FETCH_BATCH) {
+        size_t n = count - base < MIRROR_FETCH_BATCH ? count - base : MIRROR_FETCH_BATCH;
+        struct fetch_job jobs[MIRROR_FETCH_BATCH];
+        char *urls[MIRROR_FETCH_BATCH][MIRROR_MAX];
+
+        memset(jobs, 0, sizeof(jobs));
+        for (size_t i = 0; i < n; i++) {
+            struct manifest *m = &items[base + i].m;
+            char *mirrors[4];
+
+            for (int k = 0; k < m->mirror_count; k++) {
+                mirrors[k] = m->mirrors[k];
+            }
+            jobs[i].url = m->source;
+            jobs[i].url_count = mirror_candidates(m->name, m->source, mirrors,
+                                                  m->mirror_count, urls[i], MIRROR_MAX);
+            jobs[i].urls = urls[i];
+            jobs[i].dest = items[base + i].dest;
+            jobs[i].checksum = m->checksum;
+        }
+
+        fetch_files(jobs, n);
+
+        for (size_t i = 0; i < n; i++) {
+            struct mirror_item *it = &items[base + i];
+            char msg[PATH_MAX_LEN + 64];
+
+            for (int k = 0; k < jobs[i].url_count; k++) {
+                free(urls[i][k]);
+            }
+
+            if (jobs[i].status != TINYPKG_OK) {
+                snprintf(msg, sizeof(msg), "%s: download failed", it->m.name);
+                log_error("mirror_create", msg);
+                failed++;
+                continue;
+            }
+
+            *bytes += jobs[i].stats.size;
+            fetch_print_stats(it->m.name, &jobs[i].stats);
+        }
+    }
+    return failed;
+}
+
+/* Pack each built PKG prefix; returns the number written */
+static size_t mirror_artifacts(const char *dir, const struct mirror_item *items,
+                               size_t count) {
+    size_t written = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        const struct manifest *m = &items[i].m;
+        char prefix[PATH_MAX_LEN], out_dir[PATH_MAX_LEN];
+        char out[PATH_MAX_LEN + 384];
+        char version[64], profile[32], key[128];
+        struct stat st;
+
+        snprintf(prefix, sizeof(prefix), "%s/%s/PKG", get_tinypkg_dir(), m->name);
+        if (stat(prefix, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            continue;       /* Never built here */
+        }
+
+        snprintf(out_dir, sizeof(out_dir), "%s/artifacts/%s", dir, m->name);
+        /* Keyed by what the prefix was built as, not what the index has now */
+        if (profile_built(m->name, version, sizeof(version), profile, sizeof(profile))
+            != TINYPKG_OK) {
+            continue;       /* Built before build records; rebuild to publish */
+        }
+        profile_key(version, profile, key, sizeof(key));
+        snprintf(out, sizeof(out), "%s/%s-%s%s", out_dir, m->name, key, TPK_EXT);
+
+        if (mkdir_p(out_dir) != TINYPKG_OK) {
+            continue;
+        }
+        if (tpk_pack(m->name, out) != TINYPKG_OK) {
+            log_warn("Could not pack an artifact");
+            continue;
+        }
+        written++;
+    }
+    return written;
+}
+
+int mirror_create(const char *dir, int artifacts) {
+    struct mirror_item *items;
+    size_t count, missing, failed;
+    long long bytes = 0;
+    char snap[PATH_MAX_LEN];
+
+    if (!dir || !*dir) {
+        log_error("mirror_create", "Directory required");
+        return TINYPKG_ERR;
+    }
+    if (mkdir_p(dir) != TINYPKG_OK) {
+        log_error("mirror_create", "Could not create mirror directory");
+        return TINYPKG_ERR;
+    }
+
+    printf("=== Creating mirror in %s ===\n\n", dir);
+
+    if (mirror_repo(dir) != TINYPKG_OK) {
+        return TINYPKG_ERR;
+    }
+    snprintf(snap, sizeof(snap), "%s/snapshot", dir);
+    if (snapshot_publish(snap) != TINYPKG_OK) {
+        return TINYPKG_ERR;
+    }
+
+    items = mirror_scan(dir, &count, &missing);
+    if (!items) {
+        return TINYPKG_ERR;
+    }
+
+    printf("Sources: %zu packages, %zu to fetch\n", count, missing);
+    failed = mirror_sources(items, missing, &bytes);
+
+    if (artifacts) {
+        size_t n = mirror_artifacts(dir, items, count);
+        printf("Artifacts: %zu built package%s packed\n", n, n == 1 ? "" : "s");
+    }
+
+    free(items);
+
+    printf("\n%zu source%s fetched (%.1f MiB), %zu already present, %zu failed\n",
+           missing - failed, missing - failed == 1 ? "" : "s", bytes / 1048576.0,
+           count - missing, failed);
+    printf("Serve %s over HTTP or use it as file://%s:\n", dir, dir);
+    printf("  tinypkg repo mirror add <base>\n");
+    printf("  TINYPKG_REPO_URL=<base>/repo.git tinypkg repo sync\n");
+    printf("  TINYPKG_REPO_SNAPSHOT=<base>/snapshot tinypkg repo sync   (no git needed)\n");
+
+    return failed ? TINYPKG_ERR : TINYPKG_OK;
+}
@@ -0,0 +1,310 @@
+/*
+ * profile.c - Named optimization profiles for package builds
+ *
+ * Packages are built from source so they can be tuned for the machine
+ * they run on. A profile is a named set of compiler flags exported to
+ * the build script as CFLAGS, CXXFLAGS and LDFLAGS:
+ *
+ *   generic  -O2, runs on any CPU of the architecture
+ *   native   -O2 -march=native
+ *   lto      native plus link-time optimization
+ *   pgo      lto plus profile-guided optimization: the package is built
+ *            instrumented, its manifest's train: command is run against
+ *            the result, and it is rebuilt from a fresh tree using the
+ *            profile data that run wrote
+ *
+ * The profile is recorded beside the PKG prefix it produced and in
+ * installed.db, and is part of the name artifacts are published under,
+ * so tuned and generic builds of one version never stand in for each
+ * other and can be benchmarked side by side.
+ */
+
+#include "common.h"
+#include "profile.h"
+
+#define LTO_FLAGS "-O2 -march=native -flto=auto"
+
+static const struct build_profile profiles[] = {
+    { "generic", "-O2", "", 0, "portable -O2" },
+    { "native", "-O2 -march=native", "", 0, "tuned for this CPU" },
+    { "lto", LTO_FLAGS, LTO_FLAGS, 0, "native plus link-time optimization" },
+    { "pgo", LTO_FLAGS, LTO_FLAGS, 1, "lto plus profile-guided optimization (needs train:)" },
+};
+
+#define PROFILE_COUNT (sizeof(profiles) / sizeof(profiles[0]))
+
+/* Set before any build thread starts */
+static const struct build_profile *run_profile;
+
+struct profile_pin {
+    char package[128];
+    const struct build_profile *profile;
+};
+
+static struct profile_pin *pins;
+static size_t pin_count;
+
+const struct build_profile *profile_find(const char *name) {
+    for (size_t i = 0; name && i < PROFILE_COUNT; i++) {
+        if (strcmp(profiles[i].name, name) == 0) {
+            return &profiles[i];
+        }
+    }
+    return NULL;
+}
+
+int profile_use(const char *name) {
+    const struct build_profile *p = profile_find(name);
+
+    if (!p) {
+        log_error("profile_use", "Unknown profile (generic, native, lto, pgo)");
+        return TINYPKG_ERR;
+    }
+    run_profile = p;
+    return TINYPKG_OK;
+}
+
+int profile_pin(const char *package, const char *name) {
+    const struct build_profile *p = profile_find(name);
+    struct profile_pin *grown;
+
+    if (!p) {
+        log_error("profile_pin", "Unknown profile (generic, native, lto, pgo)");
+        return TINYPKG_ERR;
+    }
+    grown = realloc(pins, (pin_count + 1) * sizeof(*grown));
+    if (!grown) {
+        return TINYPKG_ERR;
+    }
+    pins = grown;
+    snprintf(pins[pin_count].package, sizeof(pins[pin_count].package), "%s", package);
+    pins[pin_count++].profile = p;
+    return TINYPKG_OK;
+}
+
+/* The package's line in profiles.conf; TINYPKG_NOT_FOUND if none */
+static int conf_lookup(const char *package, char *profile, size_t len) {
+    char path[PATH_MAX_LEN];
+    char line[LINE_MAX_LEN];
+    int ret = TINYPKG_NOT_FOUND;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/%s", get_cache_path(), PROFILE_CONF_FILE);
+    f = fopen(path, "r");
+    if (!f) {
+        return TINYPKG_NOT_FOUND;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        char pkg[128], name[32];
+        if (sscanf(line, "%127s %31s", pkg, name) == 2 && pkg[0] != '#' &&
+            strcmp(pkg, package) == 0) {
+            snprintf(profile, len, "%s", name);
+            ret = TINYPKG_OK;   /* The last line wins */
+        }
+    }
+
+    fclose(f);
+    return ret;
+}
+
+const struct build_profile *profile_for(const char *package) {
+    const struct build_profile *p;
+    const char *env = getenv(PROFILE_ENV);
+    char name[32];
+
+    for (size_t i = 0; i < pin_count; i++) {
+        if (strcmp(pins[i].package, package) == 0) {
+            return pins[i].profile;
+        }
+    }
+
+    if (conf_lookup(package, name, sizeof(name)) == TINYPKG_OK) {
+        p = profile_find(name);
+        if (p) {
+            return p;
+        }
+        log_warn("profiles.conf names an unknown profile; ignored");
+    }
+
+    if (run_profile) {
+        return run_profile;
+    }
+
+    if (env && *env) {
+        p = profile_find(env);
+        if (p) {
+            return p;
+        }
+        log_warn("Unknown " PROFILE_ENV "; building generic");
+    }
+
+    return profile_find(PROFILE_DEFAULT);
+}
+
+void profile_flags(const struct build_profile *p, int stage, const char *pgo_dir,
+                   char *cflags, size_t cflags_len, char *ldflags, size_t ldflags_len) {
+    const char *user_cflags = getenv("CFLAGS");
+    const char *user_ldflags = getenv("LDFLAGS");
+    char pgo[PATH_MAX_LEN + 96] = "";
+
+    /* Atomic counters: training runs may be multithreaded */
+    if (stage == PROFILE_INSTRUMENT) {
+        snprintf(pgo, sizeof(pgo), " -fprofile-generate=%s -fprofile-update=atomic", pgo_dir);
+    } else if (stage == PROFILE_OPTIMIZE) {
+        snprintf(pgo, sizeof(pgo), " -fprofile-use=%s -fprofile-correction -Wno-missing-profile",
+                 pgo_dir);
+    }
+
+    snprintf(cflags, cflags_len, "%s%s%s%s", p->cflags, pgo,
+             user_cflags && *user_cflags ? " " : "", user_cflags ? user_cflags : "");
+
+    /* Instrumented objects need the profiling runtime at link time */
+    snprintf(ldflags, ldflags_len, "%s%s%s%s", p->ldflags, pgo,
+             user_ldflags && *user_ldflags ? " " : "", user_ldflags ? user_ldflags : "");
+    if (ldflags[0] == ' ') {
+        memmove(ldflags, ldflags + 1, strlen(ldflags));
+    }
+}
+
+int profile_record_built(const char *package, const char *version, const char *profile) {
+    char path[PATH_MAX_LEN], tmp_path[PATH_MAX_LEN + 8];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/%s/%s", get_tinypkg_dir(), package, PROFILE_BUILT_FILE);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    f = fopen(tmp_path, "w");
+    if (!f) {
+        log_error("profile_record_built", strerror(errno));
+        return TINYPKG_ERR;
+    }
+    fprintf(f, "%s %s\n", version[0] ? version : "0", profile);
+    if (fclose(f) != 0 || rename(tmp_path, path) != 0) {
+        log_error("profile_record_built", strerror(errno));
+        unlink(tmp_path);
+        return TINYPKG_ERR;
+    }
+    return TINYPKG_OK;
+}
+
+int profile_built(const char *package, char *version, size_t version_len,
+                  char *profile, size_t profile_len) {
+    char path[PATH_MAX_LEN];
+    char line[LINE_MAX_LEN];
+    char v[64], p[32];
+    FILE *f;
+    int n = 0;
+
+    snprintf(path, sizeof(path), "%s/%s/%s", get_tinypkg_dir(), package, PROFILE_BUILT_FILE);
+    f = fopen(path, "r");
+    if (!f) {
+        return TINYPKG_NOT_FOUND;   /* Not built, or built before profiles */
+    }
+    if (fgets(line, sizeof(line), f)) {
+        n = sscanf(line, "%63s %31s", v, p);
+    }
+    fclose(f);
+
+    if (n != 2) {
+        return TINYPKG_NOT_FOUND;
+    }
+    snprintf(version, version_len, "%s", v);
+    snprintf(profile, profile_len, "%s", p);
+    return TINYPKG_OK;
+}
+
+void profile_key(const char *version, const char *profile, char *key, size_t len) {
+    snprintf(key, len, "%s-%s", version && *version ? version : "0",
+             profile && *profile ? profile : PROFILE_DEFAULT);
+}
+
+int profile_list(void) {
+    char path[PATH_MAX_LEN];
+    char line[LINE_MAX_LEN];
+    const char *env = getenv(PROFILE_ENV);
+    int any = 0;
+    FILE *f;
+
+    printf("Profiles:\n");
+    for (size_t i = 0; i < PROFILE_COUNT; i++) {
+        printf("  %-8s %s\n", profiles[i].name, profiles[i].summary);
+    }
+
+    printf("\nDefault: %s%s\n", env && *env ? env : PROFILE_DEFAULT,
+           env && *env ? " (from " PROFILE_ENV ")" : "");
+
+    printf("Packages:\n");
+    snprintf(path, sizeof(path), "%s/%s", get_cache_path(), PROFILE_CONF_FILE);
+    f = fopen(path, "r");
+    while (f && fgets(line, sizeof(line), f)) {
+        char pkg[128], name[32];
+        if (sscanf(line, "%127s %31s", pkg, name) == 2 && pkg[0] != '#') {
+            printf("  %-24s %s\n", pkg, name);
+            any = 1;
+        }
+    }
+    if (f) {
+        fclose(f);
+    }
+    if (!any) {
+        printf("  (none)\n");
+    }
+    return TINYPKG_OK;
+}
+
+/* Replace the package's line in profiles.conf, or drop it (profile NULL) */
+int profile_set(const char *package, const char *profile) {
+    char path[PATH_MAX_LEN], tmp_path[PATH_MAX_LEN];
+    char line[LINE_MAX_LEN];
+    FILE *in, *out;
+
+    if (profile && !profile_find(profile)) {
+        log_error("profile_set", "Unknown profile (generic, native, lto, pgo)");
+        return TINYPKG_ERR;
+    }
+    if (mkdir_p(get_cache_path()) != TINYPKG_OK) {
+        return TINYPKG_ERR;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", get_cache_path(), PROFILE_CONF_FILE);
+    snprintf(tmp_path, sizeof(tmp_path), "%s/%s.tmp", get_cache_path(), PROFILE_CONF_FILE);
+
+    out = fopen(tmp_path, "w");
+    if (!out) {
+        log_error("profile_set", strerror(errno));
+        return TINYPKG_ERR;
+    }
+
+    in = fopen(path, "r");
+    if (in) {
+        while (fgets(line, sizeof(line), in)) {
+            char pkg[128];
+            if (sscanf(line, "%127s", pkg) == 1 && pkg[0] != '#' &&
+                strcmp(pkg, package) == 0) {
+                continue;
+            }
+            fputs(line, out);
+        }
+        fclose(in);
+    } else {
+        fprintf(out, "# Build profile per package: <package> <profile>\n");
+    }
+
+    if (profile) {
+        fprintf(out, "%s %s\n", package, profile);
+    }
+
+    if (fclose(out) != 0 || rename(tmp_path, path) != 0) {
+        log_error("profile_set", strerror(errno));
+        unlink(tmp_path);
+        return TINYPKG_ERR;
+    }
+
+    if (profile) {
+        printf("✓ %s builds with profile %s\n", package, profile);
+    } else {
+        printf("✓ %s builds with the default profile\n", package);
+    }
+    return TINYPKG_OK;
+}
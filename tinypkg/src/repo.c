@@ -12,6 +12,8 @@
 
 #include "common.h"
 #include "repo.h"
+#include "index.h"
+#include "snapshot.h"
 #include <yaml.h>
 
 /* Create directory if it doesn't exist */
@@ -29,10 +31,18 @@ static int ensure_dir(const char *path) {
     return mkdir_p(path);
 }
 
+/* Repository to clone: REPO_URL unless overridden from the environment */
+static char *repo_url(void) {
+    char *url = getenv(REPO_URL_ENV);
+    return (url && *url) ? url : REPO_URL;
+}
+
 /* Clone or update the git repository using safe_execute */
 int repo_clone_or_pull(void) {
     char *cache = get_cache_path();
     char repo_path[PATH_MAX_LEN];
+    char git_path[PATH_MAX_LEN + 8];
+    char *url = repo_url();
     struct stat st;
     
     if (!cache) {
@@ -44,6 +54,17 @@ int repo_clone_or_pull(void) {
     
     printf("Repository cache: %s\n", repo_path);
     
+    /* A tree synced from snapshots has no history to pull: clone afresh */
+    snprintf(git_path, sizeof(git_path), "%s/.git", repo_path);
+    if (stat(repo_path, &st) == 0 && stat(git_path, &st) != 0) {
+        printf("Replacing the snapshot tree with a git clone...\n");
+        if (remove_tree(repo_path) != TINYPKG_OK) {
+            log_error("repo_clone_or_pull", "Failed to remove the snapshot tree");
+            return TINYPKG_ERR;
+        }
+        snapshot_forget();
+    }
+    
     /* Check if repo already exists */
     if (stat(repo_path, &st) == 0 && S_ISDIR(st.st_mode)) {
         /* Repository exists, update it */
@@ -57,14 +78,14 @@ int repo_clone_or_pull(void) {
         }
     } else {
         /* Repository doesn't exist, clone it */
-        printf("Cloning repository from %s...\n", REPO_URL);
+        printf("Cloning repository from %s...\n", url);
         
         if (ensure_dir(cache) != TINYPKG_OK) {
             log_error("repo_clone_or_pull", "Failed to create cache directory");
             return TINYPKG_ERR;
         }
         
-        char *argv[] = { "git", "clone", REPO_URL, repo_path, NULL };
+        char *argv[] = { "git", "clone", url, repo_path, NULL };
         int ret = safe_execute(argv);
         if (ret != TINYPKG_OK) {
             log_error("repo_clone_or_pull", "git clone failed");
@@ -100,7 +121,8 @@ int repo_parse_index(void) {
     printf("\nAvailable packages:\n");
     printf("-------------------\n");
     
-    while (fgets(line, sizeof(line), f)) {
+    int more = fgets(line, sizeof(line), f) != NULL;
+    while (more) {
         char *p = line;
         
         /* Skip leading whitespace */
@@ -111,6 +133,7 @@ int repo_parse_index(void) {
             if (strncmp(p, "packages:", 9) == 0) {
                 in_packages = 1;
             }
+            more = fgets(line, sizeof(line), f) != NULL;
             continue;
         }
         
@@ -120,32 +143,37 @@ int repo_parse_index(void) {
             char version[64] = {0};
             char desc[256] = {0};
             
-            /* Extract package name */
-            if (sscanf(line + 2, "%127[^:]:", name) == 1) {
-                /* Try to find version and description on following lines */
-                char next_line[LINE_MAX_LEN];
+            sscanf(line + 2, "%127[^:]:", name);
+            
+            /*
+             * Its fields are indented deeper than the entry. The line that
+             * ends them (the next entry, or a top-level key) is parsed next
+             */
+            while ((more = fgets(line, sizeof(line), f) != NULL)) {
+                if (line[0] != ' ' || line[1] != ' ' || line[2] != ' ') {
+                    break;
+                }
                 
-                while (fgets(next_line, sizeof(next_line), f)) {
-                    if (next_line[0] != ' ' || next_line[1] != ' ' || next_line[2] == ' ') {
-                        break; /* End of this package entry */
-                    }
-                    
-                    if (strstr(next_line, "version:")) {
-                        sscanf(next_line, "%*[^:]:%*[ ]%63s", version);
-                    }
-                    
-                    if (strstr(next_line, "description:")) {
-                        sscanf(next_line, "%*[^:]:%*[ ]%255[^\n]", desc);
-                    }
+                if (strstr(line, "version:") || strstr(line, "latest:")) {
+                    sscanf(line, "%*[^:]:%*[ ]%63s", version);
                 }
                 
-                /* Print package info */
+                if (strstr(line, "description:")) {
+                    sscanf(line, "%*[^:]:%*[ ]%255[^\n]", desc);
+                }
+            }
+            
+            /* Print package info */
+            if (name[0]) {
                 printf(" %s (%s)\n", name, version[0] ? version : "unknown");
                 if (desc[0]) {
                     printf(" %s\n", desc);
                 }
             }
+            continue;
         }
+        
+        more = fgets(line, sizeof(line), f) != NULL;
     }
     
     fclose(f);
@@ -168,12 +196,18 @@ int repo_cache_packages(void) {
     
     printf("Caching package data...\n");
     
-    /* Copy index.yaml to cache root */
-    char *argv[] = { "cp", "index.yaml", cache, NULL };
+    /* Copy index.yaml to cache root; rename so readers never see a partial file */
+    char tmp[PATH_MAX_LEN];
+    char dst[PATH_MAX_LEN];
+    snprintf(tmp, PATH_MAX_LEN, "%s/index.yaml.tmp", cache);
+    snprintf(dst, PATH_MAX_LEN, "%s/index.yaml", cache);
+    
+    char *argv[] = { "cp", "index.yaml", tmp, NULL };
     int ret = safe_execute_in_dir(src, argv);
     
-    if (ret != TINYPKG_OK) {
+    if (ret != TINYPKG_OK || rename(tmp, dst) != 0) {
         log_warn("Could not cache index.yaml");
+        unlink(tmp);
     }
     
     printf("Package data cached at %s/\n", cache);
@@ -184,8 +218,9 @@ int repo_cache_packages(void) {
 int repo_sync(void) {
     printf("=== Synchronizing tinypkg repository ===\n\n");
     
-    /* Step 1: Clone or pull repository */
-    if (repo_clone_or_pull() != TINYPKG_OK) {
+    /* Step 1: Clone or pull repository, or apply its latest snapshot */
+    const char *base = snapshot_base();
+    if ((base ? snapshot_sync(base) : repo_clone_or_pull()) != TINYPKG_OK) {
         return TINYPKG_ERR;
     }
     
@@ -201,6 +236,11 @@ int repo_sync(void) {
         return TINYPKG_ERR;
     }
     
+    /* Step 4: Update derived index (versions, reverse dependencies) */
+    if (index_sync() != TINYPKG_OK) {
+        return TINYPKG_ERR;
+    }
+    
     printf("\n✓ Repository sync complete!\n");
     return TINYPKG_OK;
 }
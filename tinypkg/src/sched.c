@@ -0,0 +1,701 @@
+/*
+ * sched.c - Build duration history and critical-path build ordering
+ *
+ * Every successful build step is remembered in ~/.cache/tinypkg/builds.db,
+ * keyed by package and version:
+ *
+ *   tinypkg-builds 3
+ *   <name> <version> <wall_ms> <cpu_ms> <source_bytes> <builds> <updated>
+ *       <peak_kb> <tree_bytes>
+ *
+ * Times are exponentially weighted moving averages over rebuilds of the
+ * same version. A version never built before borrows the times of the
+ * most recently built version of the package; a package never built at
+ * all is scaled from its source size at the rate the history shows
+ * overall (SCHED_DEFAULT_MS_PER_MIB without any history).
+ *
+ * With several builders the order matters: a long build started last
+ * leaves the others idle at the end. sched_plan() gives each job the
+ * length of the longest dependency chain it heads and list-schedules by
+ * it, which for independent jobs is longest-processing-time first, and
+ * reports the makespan of that schedule as the estimate for the run.
+ *
+ * peak_kb is the largest peak RSS of the build, as wait4() reports it:
+ * the biggest single process (a linker, usually), not the sum of parallel
+ * compilers, which is why admission adds a margin. Memory available to
+ * us is the smaller of MemAvailable and what the cgroup limit leaves.
+ */
+
+#include "common.h"
+#include "config.h"
+#include "index.h"
+#include "sched.h"
+#include "metrics.h"
+#include <pthread.h>
+
+#define EWMA_WEIGHT 0.5
+
+struct build_entry {
+    char name[128];
+    char version[64];
+    double wall_ms;
+    double cpu_ms;
+    long long source_bytes;
+    unsigned long builds;
+    long long updated;
+    long long peak_kb;
+    long long tree_bytes;
+};
+
+struct build_table {
+    struct build_entry *entries;
+    size_t count;
+};
+
+/* fcntl locks only exclude other processes; builders are threads */
+static pthread_mutex_t table_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* ============================================================================
+ * History
+ * ============================================================================
+ */
+
+static void table_free(struct build_table *t) {
+    free(t->entries);
+    memset(t, 0, sizeof(*t));
+}
+
+static int table_load(struct build_table *t) {
+    char path[PATH_MAX_LEN];
+    char line[LINE_MAX_LEN];
+    int version;
+    FILE *f;
+
+    memset(t, 0, sizeof(*t));
+    snprintf(path, sizeof(path), "%s/%s", get_cache_path(), SCHED_DB_FILE);
+
+    f = fopen(path, "r");
+    if (!f) {
+        return TINYPKG_OK;    /* No history yet */
+    }
+
+    /* Older versions lack the trailing columns; those read as 0 */
+    if (!fgets(line, sizeof(line), f) ||
+        sscanf(line, "tinypkg-builds %d", &version) != 1 ||
+        version < 1 || version > SCHED_DB_VERSION) {
+        fclose(f);
+        return TINYPKG_OK;    /* Unknown format: start over */
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        struct build_entry e;
+        struct build_entry *grown;
+
+        e.peak_kb = 0;
+        e.tree_bytes = 0;
+        if (sscanf(line, "%127s %63s %lf %lf %lld %lu %lld %lld %lld", e.name, e.version,
+                   &e.wall_ms, &e.cpu_ms, &e.source_bytes, &e.builds, &e.updated,
+                   &e.peak_kb, &e.tree_bytes) < 6 + version) {
+            continue;
+        }
+
+        grown = realloc(t->entries, (t->count + 1) * sizeof(*grown));
+        if (!grown) {
+            fclose(f);
+            table_free(t);
+            return TINYPKG_ERR;
+        }
+        t->entries = grown;
+        t->entries[t->count++] = e;
+    }
+
+    fclose(f);
+    return TINYPKG_OK;
+}
+
+static int table_save(const struct build_table *t) {
+    char path[PATH_MAX_LEN];
+    char tmp_path[PATH_MAX_LEN];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/%s", get_cache_path(), SCHED_DB_FILE);
+    snprintf(tmp_path, sizeof(tmp_path), "%s/%s.tmp", get_cache_path(), SCHED_DB_FILE);
+
+    f = fopen(tmp_path, "w");
+    if (!f) {
+        log_error("sched_record", strerror(errno));
+        return TINYPKG_ERR;
+    }
+
+    fprintf(f, "%s\n", SCHED_DB_MAGIC);
+    for (size_t i = 0; i < t->count; i++) {
+        const struct build_entry *e = &t->entries[i];
+        fprintf(f, "%s %s %.0f %.0f %lld %lu %lld %lld %lld\n", e->name, e->version,
+                e->wall_ms, e->cpu_ms, e->source_bytes, e->builds, e->updated,
+                e->peak_kb, e->tree_bytes);
+    }
+
+    if (fclose(f) != 0 || rename(tmp_path, path) != 0) {
+        log_error("sched_record", strerror(errno));
+        unlink(tmp_path);
+        return TINYPKG_ERR;
+    }
+    return TINYPKG_OK;
+}
+
+/* Serialize read-modify-write of the table between processes */
+static int table_lock(void) {
+    char lock_path[PATH_MAX_LEN];
+    struct flock fl;
+    struct timespec t0;
+    int fd;
+
+    if (mkdir_p(get_cache_path()) != TINYPKG_OK) {
+        return -1;
+    }
+
+    snprintf(lock_path, sizeof(lock_path), "%s/%s.lock",
+             get_cache_path(), SCHED_DB_FILE);
+
+    fd = open(lock_path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        log_error("sched_record", strerror(errno));
+        return -1;
+    }
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (fcntl(fd, F_SETLKW, &fl) != 0) {
+        log_error("sched_record", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    metrics_observe(METRIC_LOCK_WAIT_SECONDS, "builds", metrics_since(&t0));
+    return fd;
+}
+
+static double ewma(double old, double sample) {
+    return old > 0 ? old + EWMA_WEIGHT * (sample - old) : sample;
+}
+
+int sched_record(const char *name, const char *version, const struct build_sample *s) {
+    struct build_table t;
+    struct build_entry *e = NULL;
+    int fd, ret = TINYPKG_ERR;
+
+    if (!name || !version || !*version) {
+        return TINYPKG_ERR;
+    }
+
+    pthread_mutex_lock(&table_mutex);
+    fd = table_lock();
+    if (fd < 0) {
+        pthread_mutex_unlock(&table_mutex);
+        return TINYPKG_ERR;
+    }
+
+    if (table_load(&t) != TINYPKG_OK) {
+        goto out;
+    }
+
+    for (size_t i = 0; i < t.count; i++) {
+        if (strcmp(t.entries[i].name, name) == 0 &&
+            strcmp(t.entries[i].version, version) == 0) {
+            e = &t.entries[i];
+            break;
+        }
+    }
+
+    if (!e) {
+        struct build_entry *grown = realloc(t.entries, (t.count + 1) * sizeof(*grown));
+        if (!grown) {
+            table_free(&t);
+            goto out;
+        }
+        t.entries = grown;
+        e = &t.entries[t.count++];
+        memset(e, 0, sizeof(*e));
+        snprintf(e->name, sizeof(e->name), "%s", name);
+        snprintf(e->version, sizeof(e->version), "%s", version);
+    }
+
+    e->wall_ms = ewma(e->wall_ms, s->wall_ms);
+    e->cpu_ms = ewma(e->cpu_ms, s->cpu_ms);
+    if (s->source_bytes > 0) {
+        e->source_bytes = s->source_bytes;
+    }
+    e->peak_kb = s->peak_kb;    /* Sizes: the latest is the one to plan for */
+    if (s->tree_bytes > 0) {
+        e->tree_bytes = s->tree_bytes;
+    }
+    e->builds++;
+    e->updated = (long long)time(NULL);
+
+    ret = table_save(&t);
+    table_free(&t);
+
+out:
+    close(fd);
+    pthread_mutex_unlock(&table_mutex);
+    return ret;
+}
+
+long long sched_tree_bytes(const char *name) {
+    struct build_table t;
+    const struct build_entry *best = NULL;
+    long long bytes;
+
+    if (table_load(&t) != TINYPKG_OK) {
+        return -1;
+    }
+    for (size_t i = 0; i < t.count; i++) {
+        const struct build_entry *e = &t.entries[i];
+        if (strcmp(e->name, name) == 0 && e->tree_bytes > 0 &&
+            (!best || e->updated > best->updated)) {
+            best = e;
+        }
+    }
+    bytes = best ? best->tree_bytes : -1;
+    table_free(&t);
+    return bytes;
+}
+
+int sched_known(const char *name) {
+    struct build_table t;
+    int found = 0;
+
+    if (table_load(&t) != TINYPKG_OK) {
+        return 0;
+    }
+    for (size_t i = 0; i < t.count && !found; i++) {
+        found = strcmp(t.entries[i].name, name) == 0;
+    }
+    table_free(&t);
+    return found;
+}
+
+/* ============================================================================
+ * Estimates
+ * ============================================================================
+ */
+
+static void estimate(struct sched_job *job, const struct build_table *t) {
+    const struct build_entry *best = NULL;
+    double wall = 0, cpu = 0;
+    long long bytes = 0;
+
+    job->peak_kb = 0;
+
+    for (size_t i = 0; i < t->count; i++) {
+        const struct build_entry *e = &t->entries[i];
+
+        if (e->source_bytes > 0) {
+            wall += e->wall_ms;
+            cpu += e->cpu_ms;
+            bytes += e->source_bytes;
+        }
+        if (strcmp(e->name, job->name) != 0) {
+            continue;
+        }
+        if (job->version && strcmp(e->version, job->version) == 0) {
+            best = e;
+            break;
+        }
+        if (!best || e->updated > best->updated) {
+            best = e;
+        }
+    }
+
+    if (best) {
+        job->basis = job->version && strcmp(best->version, job->version) == 0
+                         ? SCHED_EXACT : SCHED_OTHER_VERSION;
+        job->estimate_ms = best->wall_ms;
+        job->cores = best->wall_ms > 0 ? best->cpu_ms / best->wall_ms : 1.0;
+        job->peak_kb = best->peak_kb;
+    } else if (job->source_bytes > 0) {
+        double mib = job->source_bytes / (1024.0 * 1024.0);
+
+        job->basis = SCHED_SIZE;
+        if (bytes > 0) {
+            job->estimate_ms = wall * ((double)job->source_bytes / (double)bytes);
+            job->cores = wall > 0 ? cpu / wall : 1.0;
+        } else {
+            job->estimate_ms = mib * SCHED_DEFAULT_MS_PER_MIB;
+            job->cores = 1.0;
+        }
+    } else {
+        job->basis = SCHED_DEFAULT;
+        job->estimate_ms = SCHED_DEFAULT_BUILD_MS;
+        job->cores = 1.0;
+    }
+
+    if (job->estimate_ms < 1) {
+        job->estimate_ms = 1;
+    }
+    if (job->cores < 0.1) {
+        job->cores = 0.1;
+    }
+}
+
+/* Dependencies of each job on other requested jobs, from the index */
+static void link_deps(struct sched_job *jobs, int count) {
+    struct pkg_index idx;
+
+    if (index_load(&idx) != TINYPKG_OK) {
+        return;     /* No index: treat the jobs as independent */
+    }
+
+    for (int i = 0; i < count; i++) {
+        const struct index_entry *e = index_find(&idx, jobs[i].name);
+        char *list, *tok, *save = NULL;
+
+        if (!e || !e->depends || !*e->depends || !(list = strdup(e->depends))) {
+            continue;
+        }
+        for (tok = strtok_r(list, " ", &save); tok; tok = strtok_r(NULL, " ", &save)) {
+            for (int j = 0; j < count; j++) {
+                int *grown;
+
+                if (j == i || strcmp(jobs[j].name, tok) != 0) {
+                    continue;
+                }
+                grown = realloc(jobs[i].deps, (size_t)(jobs[i].ndeps + 1) * sizeof(*grown));
+                if (grown) {
+                    jobs[i].deps = grown;
+                    jobs[i].deps[jobs[i].ndeps++] = j;
+                }
+                break;
+            }
+        }
+        free(list);
+    }
+
+    index_free(&idx);
+}
+
+/* Longest chain of builds starting at job i (visiting guards cycles) */
+static double chain(struct sched_job *jobs, int count, int i, char *mark) {
+    double longest = 0;
+
+    if (mark[i] == 2) {
+        return jobs[i].path_ms;
+    }
+    if (mark[i] == 1) {
+        return 0;       /* Cycle: the index should not have one */
+    }
+    mark[i] = 1;
+
+    /* Everything that needs this job comes after it */
+    for (int j = 0; j < count; j++) {
+        for (int k = 0; k < jobs[j].ndeps; k++) {
+            if (jobs[j].deps[k] == i) {
+                double c = chain(jobs, count, j, mark);
+                if (c > longest) {
+                    longest = c;
+                }
+                break;
+            }
+        }
+    }
+
+    mark[i] = 2;
+    jobs[i].path_ms = jobs[i].estimate_ms + longest;
+    return jobs[i].path_ms;
+}
+
+/* ============================================================================
+ * Memory
+ * ============================================================================
+ */
+
+/* First number in a small file, -1 if unreadable ("max" reads as -1) */
+static long long read_number(const char *path) {
+    char buf[64];
+    long long v;
+    FILE *f = fopen(path, "r");
+
+    if (!f) {
+        return -1;
+    }
+    if (!fgets(buf, sizeof(buf), f) || sscanf(buf, "%lld", &v) != 1) {
+        v = -1;
+    }
+    fclose(f);
+    return v;
+}
+
+/* Our memory cgroup (v2 unified, else v1) directory for a file in it */
+static int cgroup_file(const char *v2_name, const char *v1_name, char *out, size_t len) {
+    char line[LINE_MAX_LEN];
+    char v2[PATH_MAX_LEN] = "", v1[PATH_MAX_LEN] = "";
+    FILE *f = fopen("/proc/self/cgroup", "r");
+
+    if (!f) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (strncmp(line, "0::", 3) == 0) {
+            snprintf(v2, sizeof(v2), "%s", line + 3);
+        } else if (strstr(line, ":memory:")) {
+            snprintf(v1, sizeof(v1), "%s", strstr(line, ":memory:") + 8);
+        }
+    }
+    fclose(f);
+
+    /* Inside a cgroup namespace the listed path may not exist under the mount */
+    if (v1_name && *v1) {
+        snprintf(out, len, "/sys/fs/cgroup/memory%s/%s", v1, v1_name);
+        if (access(out, R_OK) == 0) return 1;
+        snprintf(out, len, "/sys/fs/cgroup/memory/%s", v1_name);
+        if (access(out, R_OK) == 0) return 1;
+    }
+    if (v2_name) {
+        snprintf(out, len, "/sys/fs/cgroup%s/%s", v2, v2_name);
+        if (access(out, R_OK) == 0) return 1;
+        snprintf(out, len, "/sys/fs/cgroup/%s", v2_name);
+        if (access(out, R_OK) == 0) return 1;
+    }
+    return 0;
+}
+
+long long sched_mem_available(void) {
+    char line[LINE_MAX_LEN], path[PATH_MAX_LEN];
+    long long avail = -1, limit, usage;
+    FILE *f = fopen("/proc/meminfo", "r");
+
+    if (f) {
+        while (fgets(line, sizeof(line), f)) {
+            long long kb;
+            if (sscanf(line, "MemAvailable: %lld kB", &kb) == 1) {
+                avail = kb * 1024;
+                break;
+            }
+        }
+        fclose(f);
+    }
+
+    /* A container limit is often well below what the host has free */
+    limit = cgroup_file("memory.max", NULL, path, sizeof(path)) ? read_number(path) : -1;
+    usage = cgroup_file("memory.current", NULL, path, sizeof(path)) ? read_number(path) : -1;
+    if (limit < 0) {
+        limit = cgroup_file(NULL, "memory.limit_in_bytes", path, sizeof(path)) ? read_number(path) : -1;
+        usage = cgroup_file(NULL, "memory.usage_in_bytes", path, sizeof(path)) ? read_number(path) : -1;
+    }
+    if (limit > 0 && limit < (1LL << 60) && usage >= 0) {
+        long long left = limit > usage ? limit - usage : 0;
+        if (avail < 0 || left < avail) {
+            avail = left;
+        }
+    }
+    return avail;
+}
+
+double sched_mem_pressure(void) {
+    char path[PATH_MAX_LEN], line[LINE_MAX_LEN];
+    double avg10 = -1;
+    FILE *f = NULL;
+
+    if (cgroup_file("memory.pressure", NULL, path, sizeof(path))) {
+        f = fopen(path, "r");
+    }
+    if (!f) {
+        f = fopen("/proc/pressure/memory", "r");
+    }
+    if (!f) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "some avg10=%lf", &avg10) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return avg10;
+}
+
+/* ============================================================================
+ * Planning
+ * ============================================================================
+ */
+
+long long sched_need(const struct sched_job *job) {
+    if (job->peak_kb <= 0) {
+        return ADMIT_MIN_BYTES;
+    }
+    return job->peak_kb * 1024 * (100 + ADMIT_MARGIN_PCT) / 100;
+}
+
+double sched_plan(struct sched_job *jobs, int count, int slots, long long mem_bytes,
+                  int order[]) {
+    struct build_table t;
+    double *finish, *slot_free, *ready_at, *start_at;
+    char *mark, *started;
+    double makespan = 0, cpu = 0;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (slots < 1) {
+        slots = 1;
+    }
+    if (ncpu < 1) {
+        ncpu = 1;
+    }
+
+    if (table_load(&t) != TINYPKG_OK) {
+        memset(&t, 0, sizeof(t));
+    }
+    for (int i = 0; i < count; i++) {
+        jobs[i].deps = NULL;
+        jobs[i].ndeps = 0;
+        estimate(&jobs[i], &t);
+        cpu += jobs[i].estimate_ms * jobs[i].cores;
+    }
+    table_free(&t);
+    link_deps(jobs, count);
+
+    finish = calloc((size_t)count, sizeof(*finish));
+    slot_free = calloc((size_t)slots, sizeof(*slot_free));
+    ready_at = calloc((size_t)count, sizeof(*ready_at));
+    start_at = calloc((size_t)count, sizeof(*start_at));
+    mark = calloc((size_t)count, 1);
+    started = calloc((size_t)count, 1);
+    if (!finish || !slot_free || !ready_at || !start_at || !mark || !started) {
+        for (int i = 0; i < count; i++) {
+            order[i] = i;
+        }
+        free(finish);
+        free(slot_free);
+        free(ready_at);
+        free(start_at);
+        free(mark);
+        free(started);
+        return 0;
+    }
+
+    for (int i = 0; i < count; i++) {
+        chain(jobs, count, i, mark);
+    }
+
+    /*
+     * List scheduling: the earliest free builder takes the ready job with
+     * the longest chain that fits in memory beside the running ones, where
+     * a job is ready once its dependencies are done; if none is ready, it
+     * waits for the first one that will be.
+     */
+    for (int n = 0; n < count; n++) {
+        double now, soonest = -1;
+        int s = 0, pick = -1;
+
+        for (int k = 1; k < slots; k++) {
+            if (slot_free[k] < slot_free[s]) {
+                s = k;
+            }
+        }
+        now = slot_free[s];
+
+        for (int i = 0; i < count; i++) {
+            double ready = 0;
+            int blocked = 0;
+
+            if (started[i]) {
+                continue;
+            }
+            for (int k = 0; k < jobs[i].ndeps && !blocked; k++) {
+                int d = jobs[i].deps[k];
+                blocked = !started[d];
+                if (finish[d] > ready) {
+                    ready = finish[d];
+                }
+            }
+            ready_at[i] = blocked ? -1 : ready;
+            if (!blocked && (soonest < 0 || ready < soonest)) {
+                soonest = ready;
+            }
+        }
+
+        /* Only a dependency cycle leaves nothing schedulable */
+        if (soonest < 0) {
+            for (int i = 0; i < count; i++) {
+                if (!started[i]) {
+                    ready_at[i] = 0;
+                }
+            }
+            soonest = 0;
+        }
+        if (soonest > now) {
+            now = soonest;
+        }
+
+        /* A job that does not fit in memory waits for running ones to end */
+        for (;;) {
+            long long used = 0;
+            double next_end = -1;
+
+            for (int i = 0; i < count; i++) {
+                if (started[i] && start_at[i] <= now && finish[i] > now) {
+                    used += sched_need(&jobs[i]);
+                    if (next_end < 0 || finish[i] < next_end) {
+                        next_end = finish[i];
+                    }
+                }
+            }
+            for (int i = 0; i < count; i++) {
+                if (!started[i] && ready_at[i] >= 0 && ready_at[i] <= now &&
+                    (mem_bytes < 0 || used == 0 || used + sched_need(&jobs[i]) <= mem_bytes) &&
+                    (pick < 0 || jobs[i].path_ms > jobs[pick].path_ms)) {
+                    pick = i;
+                }
+            }
+            if (pick >= 0 || next_end < 0) {
+                break;
+            }
+            now = next_end;
+        }
+
+        started[pick] = 1;
+        start_at[pick] = now;
+        finish[pick] = now + jobs[pick].estimate_ms;
+        slot_free[s] = finish[pick];
+        if (finish[pick] > makespan) {
+            makespan = finish[pick];
+        }
+        order[n] = pick;
+    }
+
+    free(finish);
+    free(slot_free);
+    free(ready_at);
+    free(start_at);
+    free(mark);
+    free(started);
+
+    /* Builds that use many cores cannot all overlap fully */
+    if (cpu / (double)ncpu > makespan) {
+        makespan = cpu / (double)ncpu;
+    }
+    return makespan;
+}
+
+void sched_free(struct sched_job *jobs, int count) {
+    for (int i = 0; i < count; i++) {
+        free(jobs[i].deps);
+        jobs[i].deps = NULL;
+        jobs[i].ndeps = 0;
+    }
+}
+
+void sched_format(double ms, char *buf, size_t len) {
+    long long s = (long long)(ms / 1000.0 + 0.5);
+
+    if (s >= 3600) {
+        snprintf(buf, len, "%lldh %02lldm", s / 3600, (s % 3600) / 60);
+    } else if (s >= 60) {
+        snprintf(buf, len, "%lldm %02llds", s / 60, s % 60);
+    } else if (ms >= 500) {
+        snprintf(buf, len, "%llds", s);
+    } else {
+        snprintf(buf, len, "<1s");
+    }
+}
@@ -0,0 +1,394 @@
+/*
+ * sha256.c - Streaming SHA-256 (FIPS 180-4)
+ *
+ * Used for content addressing and source verification. Data can be fed in
+ * arbitrary chunks, so callers hash while reading instead of making a
+ * second pass over the file.
+ *
+ * The block function is picked once per process: SHA-NI on x86, the ARMv8
+ * crypto extensions on aarch64, portable C otherwise. TINYPKG_SHA256=<name>
+ * forces a backend, e.g. to compare them.
+ */
+
+#include "common.h"
+#include "sha256.h"
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA256_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define SHA256_ARM 1
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#endif
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+typedef void (*blocks_fn)(uint32_t state[8], const uint8_t *p, size_t blocks);
+
+/* Process whole 64-byte blocks */
+static void blocks_portable(uint32_t state[8], const uint8_t *p, size_t blocks) {
+    while (blocks--) {
+        uint32_t w[64];
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+        for (int i = 0; i < 16; i++) {
+            w[i] = ((uint32_t)p[i * 4] << 24) | ((uint32_t)p[i * 4 + 1] << 16) |
+                   ((uint32_t)p[i * 4 + 2] << 8) | (uint32_t)p[i * 4 + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        for (int i = 0; i < 64; i++) {
+            uint32_t s1 = ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25);
+            uint32_t ch = (e & f) ^ (~e & g);
+            uint32_t t1 = h + s1 + ch + K[i] + w[i];
+            uint32_t s0 = ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22);
+            uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t t2 = s0 + maj;
+
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+        p += 64;
+    }
+}
+
+#ifdef SHA256_X86
+/*
+ * SHA-NI keeps the state as ABEF/CDGH pairs. Each step runs four rounds
+ * while sha256msg1/msg2 extend the schedule four words at a time.
+ */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void blocks_shani(uint32_t state[8], const uint8_t *p, size_t blocks) {
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+    __m128i st1 = _mm_loadu_si128((const __m128i *)&state[4]);
+    __m128i st0;
+
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);         /* CDAB */
+    st1 = _mm_shuffle_epi32(st1, 0x1B);         /* EFGH */
+    st0 = _mm_alignr_epi8(tmp, st1, 8);         /* ABEF */
+    st1 = _mm_blend_epi16(st1, tmp, 0xF0);      /* CDGH */
+
+    while (blocks--) {
+        __m128i abef = st0, cdgh = st1;
+        __m128i msg[4];
+
+        for (int i = 0; i < 4; i++) {
+            msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + i * 16)), bswap);
+        }
+
+        for (int i = 0; i < 16; i++) {
+            __m128i wk = _mm_add_epi32(msg[i & 3], _mm_loadu_si128((const __m128i *)&K[i * 4]));
+
+            st1 = _mm_sha256rnds2_epu32(st1, st0, wk);
+            if (i < 12) {
+                __m128i w = _mm_sha256msg1_epu32(msg[i & 3], msg[(i + 1) & 3]);
+                w = _mm_add_epi32(w, _mm_alignr_epi8(msg[(i + 3) & 3], msg[(i + 2) & 3], 4));
+                msg[i & 3] = _mm_sha256msg2_epu32(w, msg[(i + 3) & 3]);
+            }
+            st0 = _mm_sha256rnds2_epu32(st0, st1, _mm_shuffle_epi32(wk, 0x0E));
+        }
+
+        st0 = _mm_add_epi32(st0, abef);
+        st1 = _mm_add_epi32(st1, cdgh);
+        p += 64;
+    }
+
+    tmp = _mm_shuffle_epi32(st0, 0x1B);         /* FEBA */
+    st1 = _mm_shuffle_epi32(st1, 0xB1);         /* DCHG */
+    st0 = _mm_blend_epi16(tmp, st1, 0xF0);      /* DCBA */
+    st1 = _mm_alignr_epi8(st1, tmp, 8);         /* HGFE */
+
+    _mm_storeu_si128((__m128i *)&state[0], st0);
+    _mm_storeu_si128((__m128i *)&state[4], st1);
+}
+
+static int have_shani(void) {
+    unsigned int a, b, c, d;
+
+    if (!__get_cpuid(1, &a, &b, &c, &d) ||
+        !(c & (1u << 19)) || !(c & (1u << 9))) {    /* SSE4.1, SSSE3 */
+        return 0;
+    }
+    return __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & (1u << 29));
+}
+#endif
+
+#ifdef SHA256_ARM
+/* ARMv8 crypto extensions: four rounds per vsha256h/h2 pair */
+__attribute__((target("arch=armv8-a+crypto")))
+static void blocks_armv8(uint32_t state[8], const uint8_t *p, size_t blocks) {
+    uint32x4_t abcd = vld1q_u32(&state[0]);
+    uint32x4_t efgh = vld1q_u32(&state[4]);
+
+    while (blocks--) {
+        uint32x4_t abcd0 = abcd, efgh0 = efgh;
+        uint32x4_t msg[4];
+
+        for (int i = 0; i < 4; i++) {
+            msg[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(p + i * 16)));
+        }
+
+        for (int i = 0; i < 16; i++) {
+            uint32x4_t wk = vaddq_u32(msg[i & 3], vld1q_u32(&K[i * 4]));
+            uint32x4_t prev = abcd;
+
+            if (i < 12) {
+                msg[i & 3] = vsha256su1q_u32(vsha256su0q_u32(msg[i & 3], msg[(i + 1) & 3]),
+                                             msg[(i + 2) & 3], msg[(i + 3) & 3]);
+            }
+            abcd = vsha256hq_u32(abcd, efgh, wk);
+            efgh = vsha256h2q_u32(efgh, prev, wk);
+        }
+
+        abcd = vaddq_u32(abcd, abcd0);
+        efgh = vaddq_u32(efgh, efgh0);
+        p += 64;
+    }
+
+    vst1q_u32(&state[0], abcd);
+    vst1q_u32(&state[4], efgh);
+}
+
+static int have_armv8(void) {
+#ifdef HWCAP_SHA2
+    return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+#else
+    return 0;
+#endif
+}
+#endif
+
+static int have_portable(void) {
+    return 1;
+}
+
+/* Fastest first; the first supported one is the default */
+static const struct {
+    const char *name;
+    blocks_fn fn;
+    int (*supported)(void);
+} backends[] = {
+#ifdef SHA256_X86
+    { "sha-ni", blocks_shani, have_shani },
+#endif
+#ifdef SHA256_ARM
+    { "armv8-ce", blocks_armv8, have_armv8 },
+#endif
+    { "portable", blocks_portable, have_portable },
+};
+
+#define NBACKENDS ((int)(sizeof(backends) / sizeof(backends[0])))
+
+static blocks_fn sha256_blocks = blocks_portable;
+static const char *backend_name = "portable";
+static pthread_once_t backend_once = PTHREAD_ONCE_INIT;
+
+static int backend_set(const char *name) {
+    for (int i = 0; i < NBACKENDS; i++) {
+        if (strcmp(backends[i].name, name) == 0 && backends[i].supported()) {
+            sha256_blocks = backends[i].fn;
+            backend_name = backends[i].name;
+            return TINYPKG_OK;
+        }
+    }
+    return TINYPKG_NOT_FOUND;
+}
+
+static void backend_pick(void) {
+    const char *forced = getenv(SHA256_BACKEND_ENV);
+
+    if (forced && *forced && backend_set(forced) == TINYPKG_OK) {
+        return;
+    }
+    for (int i = 0; i < NBACKENDS; i++) {
+        if (backends[i].supported()) {
+            sha256_blocks = backends[i].fn;
+            backend_name = backends[i].name;
+            return;
+        }
+    }
+}
+
+int sha256_backends(const char *names[], int max) {
+    int n = 0;
+
+    for (int i = 0; i < NBACKENDS && n < max; i++) {
+        if (backends[i].supported()) {
+            names[n++] = backends[i].name;
+        }
+    }
+    return n;
+}
+
+int sha256_use_backend(const char *name) {
+    pthread_once(&backend_once, backend_pick);
+    return backend_set(name);
+}
+
+const char *sha256_backend(void) {
+    pthread_once(&backend_once, backend_pick);
+    return backend_name;
+}
+
+void sha256_init(struct sha256_ctx *ctx) {
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    pthread_once(&backend_once, backend_pick);
+
+    memcpy(ctx->state, iv, sizeof(iv));
+    ctx->total = 0;
+    ctx->buf_len = 0;
+}
+
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len) {
+    const uint8_t *p = data;
+
+    ctx->total += len;
+
+    /* Top up a partially filled block first */
+    if (ctx->buf_len > 0) {
+        size_t take = 64 - ctx->buf_len;
+        if (take > len) {
+            take = len;
+        }
+        memcpy(ctx->buf + ctx->buf_len, p, take);
+        ctx->buf_len += take;
+        p += take;
+        len -= take;
+
+        if (ctx->buf_len < 64) {
+            return;
+        }
+        sha256_blocks(ctx->state, ctx->buf, 1);
+        ctx->buf_len = 0;
+    }
+
+    /* Hash full blocks straight from the caller's buffer */
+    if (len >= 64) {
+        sha256_blocks(ctx->state, p, len / 64);
+        p += len & ~(size_t)63;
+        len &= 63;
+    }
+
+    if (len > 0) {
+        memcpy(ctx->buf, p, len);
+        ctx->buf_len = len;
+    }
+}
+
+void sha256_final(struct sha256_ctx *ctx, uint8_t digest[SHA256_DIGEST_LEN]) {
+    uint64_t bits = ctx->total * 8;
+    uint8_t pad[72];
+    size_t pad_len = (ctx->buf_len < 56) ? 56 - ctx->buf_len : 120 - ctx->buf_len;
+
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for (int i = 0; i < 8; i++) {
+        pad[pad_len + i] = (uint8_t)(bits >> (56 - i * 8));
+    }
+
+    /* Padding must not count towards the message length */
+    sha256_update(ctx, pad, pad_len + 8);
+
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4]     = (uint8_t)(ctx->state[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t)(ctx->state[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t)(ctx->state[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t)ctx->state[i];
+    }
+}
+
+void sha256_to_hex(const uint8_t digest[SHA256_DIGEST_LEN], char hex[SHA256_HEX_LEN]) {
+    static const char digits[] = "0123456789abcdef";
+
+    for (int i = 0; i < SHA256_DIGEST_LEN; i++) {
+        hex[i * 2]     = digits[digest[i] >> 4];
+        hex[i * 2 + 1] = digits[digest[i] & 0x0f];
+    }
+    hex[SHA256_HEX_LEN - 1] = '\0';
+}
+
+/* Hash a whole file in one streaming pass */
+int sha256_file(const char *path, char hex[SHA256_HEX_LEN]) {
+    struct sha256_ctx ctx;
+    uint8_t digest[SHA256_DIGEST_LEN];
+    uint8_t buf[65536];
+    ssize_t n;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return TINYPKG_ERR;
+    }
+
+    sha256_init(&ctx);
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        sha256_update(&ctx, buf, (size_t)n);
+    }
+    close(fd);
+
+    if (n < 0) {
+        return TINYPKG_ERR;
+    }
+
+    sha256_final(&ctx, digest);
+    sha256_to_hex(digest, hex);
+    return TINYPKG_OK;
+}
+
+const char *sha256_checksum_hex(const char *checksum) {
+    const char *hex = checksum;
+
+    if (!hex) {
+        return NULL;
+    }
+    if (strncmp(hex, "sha256:", 7) == 0) {
+        hex += 7;
+    }
+    if (strlen(hex) != SHA256_HEX_LEN - 1 ||
+        strspn(hex, "0123456789abcdefABCDEF") != SHA256_HEX_LEN - 1) {
+        return NULL;
+    }
+    return hex;
+}
@@ -0,0 +1,1148 @@
+/*
+ * snapshot.c - Repository snapshots: package metadata without git
+ *
+ * 'repo sync' normally clones the repository with git, which a minimal
+ * container may not have, and which is the slowest part of a cold start.
+ * All the package manager reads from that clone is packages/, so 'tinypkg
+ * mirror' also publishes it as one gzip'd, checksummed snapshot, plus a
+ * small delta for each new commit it publishes. A client that sets
+ * TINYPKG_REPO_SNAPSHOT:
+ *
+ *   1. fetches the head file conditionally: unchanged, that is one 304
+ *   2. fetches the deltas from its snapshot to the current one when they
+ *      are on offer and smaller than a full snapshot, else the snapshot
+ *   3. checks each against the head file's sha256 as it downloads, then
+ *      writes only the files whose content changed
+ *
+ * Which paths each step changed is recorded, so index_sync() patches the
+ * derived index from the changed manifests as it does after a git pull.
+ * An "applying" marker outlives an interrupted apply, so the retry records
+ * the files that one already wrote.
+ */
+
+#include "common.h"
+#include "snapshot.h"
+#include "fetch.h"
+#include "index.h"
+#include "sha256.h"
+#include <dirent.h>
+#include <signal.h>
+
+#define SNAPSHOT_FILE_MAX (16 << 20)    /* Largest file a snapshot may hold */
+#define SNAPSHOT_STEPS_KEPT 64          /* Steps in the change journal */
+
+/* A sorted list of packages/ paths */
+struct paths {
+    char **v;
+    size_t count;
+    size_t cap;
+};
+
+struct head_delta {
+    char from[64];
+    char to[64];
+    char sha[SHA256_HEX_LEN];
+    long long size;
+};
+
+/* A parsed head file */
+struct head {
+    char id[64];
+    char sha[SHA256_HEX_LEN];
+    long long size;
+    struct head_delta deltas[SNAPSHOT_DELTAS];
+    int ndeltas;
+};
+
+/* Client state: the snapshot <cache>/repo is at */
+struct state {
+    char id[64];
+    struct fetch_cond cond;
+};
+
+const char *snapshot_base(void) {
+    const char *base = getenv(SNAPSHOT_ENV);
+    return base && *base ? base : NULL;
+}
+
+/* ============================================================================
+ * Helpers
+ * ============================================================================
+ */
+
+static int paths_add(struct paths *p, const char *path) {
+    if (p->count == p->cap) {
+        size_t new_cap = p->cap ? p->cap * 2 : 256;
+        char **v = realloc(p->v, new_cap * sizeof(*v));
+        if (!v) {
+            return TINYPKG_ERR;
+        }
+        p->v = v;
+        p->cap = new_cap;
+    }
+    if (!(p->v[p->count] = strdup(path))) {
+        return TINYPKG_ERR;
+    }
+    p->count++;
+    return TINYPKG_OK;
+}
+
+static int str_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void paths_sort(struct paths *p) {
+    if (p->count > 1) {
+        qsort(p->v, p->count, sizeof(*p->v), str_cmp);
+    }
+}
+
+static int paths_has(const struct paths *p, const char *path) {
+    return p->count > 0 && bsearch(&path, p->v, p->count, sizeof(*p->v), str_cmp) != NULL;
+}
+
+static void paths_free(struct paths *p) {
+    for (size_t i = 0; i < p->count; i++) {
+        free(p->v[i]);
+    }
+    free(p->v);
+    memset(p, 0, sizeof(*p));
+}
+
+/* Ids name files on the server and here: commit hashes and the like only */
+static int id_ok(const char *id) {
+    size_t n = strlen(id);
+    return n > 0 && n < 64 && strspn(id, "0123456789abcdefABCDEF") == n;
+}
+
+/* A relative path under packages/ with no way out of it */
+static int path_ok(const char *path) {
+    if (strncmp(path, "packages/", 9) != 0 || strlen(path) >= PATH_MAX_LEN - 256) {
+        return 0;
+    }
+    for (const char *p = path; *p; ) {
+        size_t n = strcspn(p, "/");
+        if (n == 0 || (n == 1 && p[0] == '.') || (n == 2 && p[0] == '.' && p[1] == '.')) {
+            return 0;
+        }
+        p += n + (p[n] == '/');
+    }
+    return path[strlen(path) - 1] != '/' && !strpbrk(path, "\n\r");
+}
+
+static void repo_path(char *path, size_t len, const char *rel) {
+    snprintf(path, len, "%s/repo%s%s", get_cache_path(), rel ? "/" : "", rel ? rel : "");
+}
+
+static void state_path(char *path, size_t len, const char *name) {
+    snprintf(path, len, "%s/%s/%s", get_cache_path(), SNAPSHOT_DIR, name);
+}
+
+/* Regular files below packages/, as relative paths */
+static int collect(const char *rel, struct paths *out) {
+    char dir[PATH_MAX_LEN];
+    struct dirent *de;
+    DIR *d;
+    int ret = TINYPKG_OK;
+
+    repo_path(dir, sizeof(dir), rel);
+    d = opendir(dir);
+    if (!d) {
+        return errno == ENOENT ? TINYPKG_OK : TINYPKG_ERR;
+    }
+
+    while (ret == TINYPKG_OK && (de = readdir(d)) != NULL) {
+        char child[PATH_MAX_LEN], full[PATH_MAX_LEN];
+        struct stat st;
+
+        if (de->d_name[0] == '.') {
+            continue;
+        }
+        if (snprintf(child, sizeof(child), "%s/%s", rel, de->d_name) >= (int)sizeof(child)) {
+            continue;
+        }
+        repo_path(full, sizeof(full), child);
+        if (lstat(full, &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            ret = collect(child, out);
+        } else if (S_ISREG(st.st_mode) && path_ok(child)) {
+            ret = paths_add(out, child);
+        }
+    }
+    closedir(d);
+    return ret;
+}
+
+/* ============================================================================
+ * Compressed record streams
+ * ============================================================================
+ */
+
+/* gzip between us and path: writing compresses into it, reading expands it */
+static FILE *gz_open(const char *path, int writing, pid_t *pid) {
+    int fds[2], fd;
+    FILE *f;
+
+    fd = writing ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : open(path, O_RDONLY);
+    if (fd < 0 || pipe(fds) != 0) {
+        log_error("snapshot", strerror(errno));
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+
+    /* Our end must not leak into a second filter, which would hold it open */
+    fcntl(writing ? fds[1] : fds[0], F_SETFD, FD_CLOEXEC);
+
+    *pid = fork();
+    if (*pid == 0) {
+        if (dup2(writing ? fds[0] : fd, STDIN_FILENO) < 0 ||
+            dup2(writing ? fd : fds[1], STDOUT_FILENO) < 0) {
+            _exit(127);
+        }
+        close(fds[0]);
+        close(fds[1]);
+        close(fd);
+        if (writing) {
+            execlp("gzip", "gzip", "-c", (char *)NULL);
+        } else {
+            execlp("gzip", "gzip", "-d", "-c", (char *)NULL);
+        }
+        _exit(127);
+    }
+
+    close(fd);
+    close(writing ? fds[0] : fds[1]);
+    if (*pid < 0 || !(f = fdopen(writing ? fds[1] : fds[0], writing ? "wb" : "rb"))) {
+        log_error("snapshot", strerror(errno));
+        close(writing ? fds[1] : fds[0]);
+        return NULL;
+    }
+    return f;
+}
+
+static int gz_close(FILE *f, pid_t pid, int ok) {
+    int status;
+
+    /* Stop a decompressor we no longer read from */
+    if (!ok) {
+        kill(pid, SIGTERM);
+    }
+    if (fclose(f) != 0) {
+        ok = 0;
+    }
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return TINYPKG_ERR;
+    }
+    return ok && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? TINYPKG_OK : TINYPKG_ERR;
+}
+
+static int put_file(FILE *out, const char *rel, const char *data, size_t len) {
+    return fprintf(out, "file %zu %s\n", len, rel) > 0 &&
+           fwrite(data, 1, len, out) == len ? TINYPKG_OK : TINYPKG_ERR;
+}
+
+/*
+ * Next record of a stream: 'f'ile (*data, *len filled in, to be freed),
+ * 'd'elete, 'e'nd, or 0 if the stream is malformed
+ */
+static int next_record(FILE *in, char **line, size_t *cap, char **path,
+                       char **data, size_t *len) {
+    ssize_t n = getline(line, cap, in);
+    char *end;
+
+    *data = NULL;
+    if (n <= 0 || (*line)[n - 1] != '\n') {
+        return 0;
+    }
+    (*line)[n - 1] = '\0';
+
+    if (strcmp(*line, "end") == 0) {
+        return 'e';
+    }
+    if (strncmp(*line, "delete ", 7) == 0) {
+        *path = *line + 7;
+        return path_ok(*path) ? 'd' : 0;
+    }
+    if (strncmp(*line, "file ", 5) != 0) {
+        return 0;
+    }
+
+    *len = strtoul(*line + 5, &end, 10);
+    *path = end + 1;
+    if (*end != ' ' || *len > SNAPSHOT_FILE_MAX || !path_ok(*path) ||
+        !(*data = malloc(*len + 1))) {
+        return 0;
+    }
+    if (fread(*data, 1, *len, in) != *len) {
+        free(*data);
+        *data = NULL;
+        return 0;
+    }
+    return 'f';
+}
+
+/* "<magic>", ["from <id>"], "id <id>": checks them against what is expected */
+static int stream_header(FILE *in, const char *magic, const char *from, const char *id) {
+    char line[128], want[128];
+
+    snprintf(want, sizeof(want), "%s\n", magic);
+    if (!fgets(line, sizeof(line), in) || strcmp(line, want) != 0) {
+        return TINYPKG_ERR;
+    }
+    if (from) {
+        snprintf(want, sizeof(want), "from %s\n", from);
+        if (!fgets(line, sizeof(line), in) || strcmp(line, want) != 0) {
+            return TINYPKG_ERR;
+        }
+    }
+    snprintf(want, sizeof(want), "id %s\n", id);
+    return fgets(line, sizeof(line), in) && strcmp(line, want) == 0 ? TINYPKG_OK : TINYPKG_ERR;
+}
+
+/* ============================================================================
+ * Head file
+ * ============================================================================
+ */
+
+static int head_load(const char *path, struct head *h) {
+    FILE *f = fopen(path, "r");
+    char line[512];
+    int ok;
+
+    memset(h, 0, sizeof(*h));
+    if (!f) {
+        return TINYPKG_NOT_FOUND;
+    }
+
+    ok = fgets(line, sizeof(line), f) && strcmp(line, SNAPSHOT_HEAD_MAGIC "\n") == 0 &&
+         fgets(line, sizeof(line), f) &&
+         sscanf(line, "snapshot %63s %64s %lld", h->id, h->sha, &h->size) == 3 &&
+         id_ok(h->id) && strlen(h->sha) == SHA256_HEX_LEN - 1 && h->size > 0;
+
+    while (ok && fgets(line, sizeof(line), f) && h->ndeltas < SNAPSHOT_DELTAS) {
+        struct head_delta *d = &h->deltas[h->ndeltas];
+
+        ok = sscanf(line, "delta %63s %63s %64s %lld", d->from, d->to, d->sha, &d->size) == 4 &&
+             id_ok(d->from) && id_ok(d->to) && strlen(d->sha) == SHA256_HEX_LEN - 1 &&
+             d->size > 0;
+        h->ndeltas += ok;
+    }
+    fclose(f);
+    return ok ? TINYPKG_OK : TINYPKG_ERR;
+}
+
+static int head_write(const char *path, const struct head *h) {
+    char tmp[PATH_MAX_LEN + 8];
+    FILE *f;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    f = fopen(tmp, "w");
+    if (!f) {
+        log_error("snapshot_publish", strerror(errno));
+        return TINYPKG_ERR;
+    }
+    fprintf(f, "%s\nsnapshot %s %s %lld\n", SNAPSHOT_HEAD_MAGIC, h->id, h->sha, h->size);
+    for (int i = 0; i < h->ndeltas; i++) {
+        const struct head_delta *d = &h->deltas[i];
+        fprintf(f, "delta %s %s %s %lld\n", d->from, d->to, d->sha, d->size);
+    }
+    if (fclose(f) != 0 || rename(tmp, path) != 0) {
+        log_error("snapshot_publish", strerror(errno));
+        unlink(tmp);
+        return TINYPKG_ERR;
+    }
+    return TINYPKG_OK;
+}
+
+/* ============================================================================
+ * Publishing
+ * ============================================================================
+ */
+
+/* Path and content hash of every file in a published snapshot */
+struct old_file {
+    char *path;
+    char hash[SHA256_HEX_LEN];
+};
+
+static int old_cmp(const void *a, const void *b) {
+    return strcmp(((const struct old_file *)a)->path, ((const struct old_file *)b)->path);
+}
+
+static void hash_data(const char *data, size_t len, char hex[SHA256_HEX_LEN]) {
+    struct sha256_ctx ctx;
+    uint8_t digest[SHA256_DIGEST_LEN];
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, digest);
+    sha256_to_hex(digest, hex);
+}
+
+static struct old_file *read_old(const char *snap, const char *id, size_t *count) {
+    struct old_file *files = NULL;
+    size_t cap = 0;
+    char *line = NULL, *path, *data;
+    size_t line_cap = 0, len;
+    int kind = 0;
+    pid_t pid;
+    FILE *in = gz_open(snap, 0, &pid);
+
+    *count = 0;
+    if (!in) {
+        return NULL;
+    }
+    if (stream_header(in, SNAPSHOT_MAGIC, NULL, id) == TINYPKG_OK) {
+        while ((kind = next_record(in, &line, &line_cap, &path, &data, &len)) == 'f') {
+            if (*count == cap) {
+                size_t new_cap = cap ? cap * 2 : 256;
+                struct old_file *p = realloc(files, new_cap * sizeof(*p));
+                if (!p) {
+                    free(data);
+                    kind = 0;
+                    break;
+                }
+                files = p;
+                cap = new_cap;
+            }
+            hash_data(data, len, files[*count].hash);
+            free(data);
+            if (!(files[*count].path = strdup(path))) {
+                kind = 0;
+                break;
+            }
+            (*count)++;
+        }
+    }
+    free(line);
+
+    if (gz_close(in, pid, kind == 'e') != TINYPKG_OK) {
+        for (size_t i = 0; i < *count; i++) {
+            free(files[i].path);
+        }
+        free(files);
+        *count = 0;
+        return NULL;
+    }
+    if (*count > 1) {
+        qsort(files, *count, sizeof(*files), old_cmp);
+    }
+    return files;
+}
+
+/*
+ * Write <dir>/<id>.snap, and <dir>/<id>.delta against old (the files of
+ * the snapshot before it) when there is one. Fills in sizes and hashes.
+ */
+static int write_streams(const char *dir, const char *id, const struct paths *files,
+                         const char *prev, const struct old_file *old, size_t nold,
+                         struct head *h, size_t *changed, size_t *removed) {
+    char snap[PATH_MAX_LEN], delta[PATH_MAX_LEN], tmp[PATH_MAX_LEN + 8], dtmp[PATH_MAX_LEN + 8];
+    char *seen = old ? calloc(nold ? nold : 1, 1) : NULL;
+    FILE *out, *dout = NULL;
+    pid_t pid, dpid = -1;
+    int ok = 1;
+
+    snprintf(snap, sizeof(snap), "%s/%s.snap", dir, id);
+    snprintf(delta, sizeof(delta), "%s/%s.delta", dir, id);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", snap);
+    snprintf(dtmp, sizeof(dtmp), "%s.tmp", delta);
+
+    if ((old && !seen) || !(out = gz_open(tmp, 1, &pid))) {
+        free(seen);
+        return TINYPKG_ERR;
+    }
+    if (old && !(dout = gz_open(dtmp, 1, &dpid))) {
+        gz_close(out, pid, 0);
+        unlink(tmp);
+        free(seen);
+        return TINYPKG_ERR;
+    }
+
+    fprintf(out, "%s\nid %s\n", SNAPSHOT_MAGIC, id);
+    if (dout) {
+        fprintf(dout, "%s\nfrom %s\nid %s\n", SNAPSHOT_DELTA_MAGIC, prev, id);
+    }
+
+    for (size_t i = 0; ok && i < files->count; i++) {
+        char full[PATH_MAX_LEN];
+        size_t len;
+        char *data;
+
+        repo_path(full, sizeof(full), files->v[i]);
+        data = slurp(full, SNAPSHOT_FILE_MAX, &len);
+        if (!data) {
+            fprintf(stderr, "Error: Cannot read %s (missing, or over %d MiB)\n", full,
+                    SNAPSHOT_FILE_MAX >> 20);
+            ok = 0;
+            break;
+        }
+        ok = put_file(out, files->v[i], data, len) == TINYPKG_OK;
+
+        if (ok && dout) {
+            struct old_file key = { files->v[i], "" };
+            struct old_file *o = nold ? bsearch(&key, old, nold, sizeof(*old), old_cmp) : NULL;
+            char hex[SHA256_HEX_LEN];
+
+            hash_data(data, len, hex);
+            if (o) {
+                seen[o - old] = 1;
+            }
+            if (!o || strcmp(o->hash, hex) != 0) {
+                ok = put_file(dout, files->v[i], data, len) == TINYPKG_OK;
+                (*changed)++;
+            }
+        }
+        free(data);
+    }
+
+    for (size_t i = 0; ok && dout && i < nold; i++) {
+        if (!seen[i]) {
+            ok = fprintf(dout, "delete %s\n", old[i].path) > 0;
+            (*removed)++;
+        }
+    }
+    free(seen);
+
+    ok = ok && fprintf(out, "end\n") > 0 && (!dout || fprintf(dout, "end\n") > 0);
+    ok = gz_close(out, pid, ok) == TINYPKG_OK && ok;
+    if (dout) {
+        ok = gz_close(dout, dpid, ok) == TINYPKG_OK && ok;
+    }
+
+    if (ok && (sha256_file(tmp, h->sha) != TINYPKG_OK || rename(tmp, snap) != 0)) {
+        ok = 0;
+    }
+    if (ok && dout) {
+        struct head_delta *d = &h->deltas[0];
+        struct stat st;
+
+        ok = sha256_file(dtmp, d->sha) == TINYPKG_OK && stat(dtmp, &st) == 0 &&
+             rename(dtmp, delta) == 0;
+        d->size = ok ? (long long)st.st_size : 0;
+    }
+    if (ok) {
+        struct stat st;
+        ok = stat(snap, &st) == 0;
+        h->size = ok ? (long long)st.st_size : 0;
+    }
+
+    if (!ok) {
+        log_error("snapshot_publish", "Could not write the snapshot");
+        unlink(tmp);
+        unlink(dtmp);
+        return TINYPKG_ERR;
+    }
+    return TINYPKG_OK;
+}
+
+/* Drop snapshots and deltas the head no longer names */
+static void prune(const char *dir, const struct head *h) {
+    struct dirent *de;
+    DIR *d = opendir(dir);
+
+    if (!d) {
+        return;
+    }
+    while ((de = readdir(d)) != NULL) {
+        char id[64], path[PATH_MAX_LEN];
+        const char *dot = strrchr(de->d_name, '.');
+        int keep = 0;
+
+        if (!dot || (size_t)(dot - de->d_name) >= sizeof(id) ||
+            (strcmp(dot, ".snap") != 0 && strcmp(dot, ".delta") != 0)) {
+            continue;
+        }
+        memcpy(id, de->d_name, (size_t)(dot - de->d_name));
+        id[dot - de->d_name] = '\0';
+
+        if (strcmp(dot, ".snap") == 0) {
+            keep = strcmp(id, h->id) == 0;
+        }
+        for (int i = 0; !keep && strcmp(dot, ".delta") == 0 && i < h->ndeltas; i++) {
+            keep = strcmp(id, h->deltas[i].to) == 0;
+        }
+        if (!keep && snprintf(path, sizeof(path), "%s/%s", dir, de->d_name) < (int)sizeof(path)) {
+            unlink(path);
+        }
+    }
+    closedir(d);
+}
+
+int snapshot_publish(const char *dir) {
+    char head_file[PATH_MAX_LEN], prev_snap[PATH_MAX_LEN];
+    struct head prev, next;
+    struct paths files = { NULL, 0, 0 };
+    struct old_file *old = NULL;
+    size_t nold = 0, changed = 0, removed = 0;
+    char id[64];
+    int ret;
+
+    index_head(id);
+    if (!id_ok(id)) {
+        log_error("snapshot_publish", "Cannot tell which commit the repository is at");
+        return TINYPKG_ERR;
+    }
+    if (mkdir_p(dir) != TINYPKG_OK) {
+        return TINYPKG_ERR;
+    }
+
+    snprintf(head_file, sizeof(head_file), "%s/%s", dir, SNAPSHOT_HEAD);
+    if (head_load(head_file, &prev) != TINYPKG_OK) {
+        memset(&prev, 0, sizeof(prev));
+    }
+    if (strcmp(prev.id, id) == 0) {
+        printf("✓ Snapshot %.12s already published\n", id);
+        return TINYPKG_OK;
+    }
+
+    printf("Publishing snapshot %.12s to %s...\n", id, dir);
+    if (collect("packages", &files) != TINYPKG_OK) {
+        log_error("snapshot_publish", "Could not read the packages directory");
+        paths_free(&files);
+        return TINYPKG_ERR;
+    }
+    paths_sort(&files);
+
+    /* The previous snapshot is what the delta is taken against */
+    if (prev.id[0]) {
+        snprintf(prev_snap, sizeof(prev_snap), "%s/%s.snap", dir, prev.id);
+        old = read_old(prev_snap, prev.id, &nold);
+        if (!old && nold == 0 && access(prev_snap, F_OK) == 0) {
+            log_warn("Previous snapshot unreadable, publishing without a delta");
+        }
+    }
+
+    memset(&next, 0, sizeof(next));
+    snprintf(next.id, sizeof(next.id), "%s", id);
+    if (old) {
+        snprintf(next.deltas[0].from, sizeof(next.deltas[0].from), "%s", prev.id);
+        snprintf(next.deltas[0].to, sizeof(next.deltas[0].to), "%s", id);
+        next.ndeltas = 1;
+        for (int i = 0; i < prev.ndeltas && next.ndeltas < SNAPSHOT_DELTAS; i++) {
+            next.deltas[next.ndeltas++] = prev.deltas[i];
+        }
+    }
+
+    ret = write_streams(dir, id, &files, prev.id, old, nold, &next, &changed, &removed);
+    if (ret == TINYPKG_OK) {
+        ret = head_write(head_file, &next);
+    }
+    if (ret == TINYPKG_OK) {
+        prune(dir, &next);
+        printf("✓ Snapshot %.12s: %zu files, %.1f KiB\n", id, files.count, next.size / 1024.0);
+        if (old) {
+            printf("✓ Delta from %.12s: %zu changed, %zu removed, %.1f KiB\n", prev.id,
+                   changed, removed, next.deltas[0].size / 1024.0);
+        }
+    }
+
+    for (size_t i = 0; i < nold; i++) {
+        free(old[i].path);
+    }
+    free(old);
+    paths_free(&files);
+    return ret;
+}
+
+/* ============================================================================
+ * Client state
+ * ============================================================================
+ */
+
+static int state_load(struct state *st) {
+    char path[PATH_MAX_LEN], line[512];
+    FILE *f;
+    int ok;
+
+    memset(st, 0, sizeof(*st));
+    state_path(path, sizeof(path), "state");
+    f = fopen(path, "r");
+    if (!f) {
+        return TINYPKG_NOT_FOUND;
+    }
+    ok = fgets(line, sizeof(line), f) && strcmp(line, SNAPSHOT_STATE_MAGIC "\n") == 0 &&
+         fgets(line, sizeof(line), f) && sscanf(line, "id %63s", st->id) == 1 && id_ok(st->id);
+    while (ok && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (strncmp(line, "etag ", 5) == 0) {
+            snprintf(st->cond.etag, sizeof(st->cond.etag), "%s", line + 5);
+        } else if (strncmp(line, "modified ", 9) == 0) {
+            snprintf(st->cond.modified, sizeof(st->cond.modified), "%s", line + 9);
+        }
+    }
+    fclose(f);
+    if (!ok) {
+        memset(st, 0, sizeof(*st));
+    }
+    return ok ? TINYPKG_OK : TINYPKG_ERR;
+}
+
+static int state_save(const struct state *st) {
+    char path[PATH_MAX_LEN], tmp[PATH_MAX_LEN + 8];
+    FILE *f;
+
+    state_path(path, sizeof(path), "state");
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    f = fopen(tmp, "w");
+    if (!f) {
+        log_error("snapshot_sync", strerror(errno));
+        return TINYPKG_ERR;
+    }
+    fprintf(f, "%s\nid %s\n", SNAPSHOT_STATE_MAGIC, st->id);
+    if (st->cond.etag[0]) fprintf(f, "etag %s\n", st->cond.etag);
+    if (st->cond.modified[0]) fprintf(f, "modified %s\n", st->cond.modified);
+    if (fclose(f) != 0 || rename(tmp, path) != 0) {
+        log_error("snapshot_sync", strerror(errno));
+        unlink(tmp);
+        return TINYPKG_ERR;
+    }
+    return TINYPKG_OK;
+}
+
+int snapshot_id(char id[64]) {
+    char git[PATH_MAX_LEN];
+    struct state st;
+
+    repo_path(git, sizeof(git), ".git");
+    if (access(git, F_OK) == 0 || state_load(&st) != TINYPKG_OK) {
+        return TINYPKG_NOT_FOUND;
+    }
+    memcpy(id, st.id, 64);
+    return TINYPKG_OK;
+}
+
+void snapshot_forget(void) {
+    char path[PATH_MAX_LEN];
+
+    state_path(path, sizeof(path), "");
+    remove_tree(path);
+}
+
+/*
+ * The change journal: "<from> <to> <path>" per changed path, "<from> <to> -"
+ * for a step that changed nothing, oldest step first
+ */
+static char *journal_load(size_t *len) {
+    char path[PATH_MAX_LEN];
+    char *text;
+
+    state_path(path, sizeof(path), "changes");
+    text = slurp(path, 64 << 20, len);
+    if (text && strncmp(text, SNAPSHOT_CHANGES_MAGIC "\n", strlen(SNAPSHOT_CHANGES_MAGIC) + 1) != 0) {
+        free(text);
+        text = NULL;
+    }
+    return text;
+}
+
+/* Record one step, keeping only the last SNAPSHOT_STEPS_KEPT */
+static int journal_add(const char *from, const char *to, const struct paths *changed) {
+    char path[PATH_MAX_LEN], tmp[PATH_MAX_LEN + 8];
+    size_t len = 0, steps = 0;
+    char *text = journal_load(&len);
+    const char *keep = "";
+    FILE *f;
+
+    /* Count steps from the end; keep the newest ones */
+    if (text) {
+        char *body = text + strlen(SNAPSHOT_CHANGES_MAGIC) + 1;
+        char *line = body + strlen(body);
+        char last[130] = "";
+
+        keep = body;
+        while (line > body) {
+            char *start = line - 1;
+            char step[130];
+            size_t n;
+
+            while (start > body && start[-1] != '\n') start--;
+            n = strcspn(start, " ");
+            n += 1 + strcspn(start + n + 1, " ");
+            snprintf(step, sizeof(step), "%.*s", (int)(n < sizeof(step) - 1 ? n : sizeof(step) - 1), start);
+            if (strcmp(step, last) != 0) {
+                if (++steps >= SNAPSHOT_STEPS_KEPT) {
+                    break;
+                }
+                memcpy(last, step, sizeof(last));
+            }
+            keep = start;
+            line = start;
+        }
+    }
+
+    state_path(path, sizeof(path), "changes");
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    f = fopen(tmp, "w");
+    if (!f) {
+        free(text);
+        return TINYPKG_ERR;
+    }
+    fprintf(f, "%s\n%s", SNAPSHOT_CHANGES_MAGIC, keep);
+    for (size_t i = 0; i < changed->count; i++) {
+        fprintf(f, "%s %s %s\n", from, to, changed->v[i]);
+    }
+    if (changed->count == 0) {
+        fprintf(f, "%s %s -\n", from, to);
+    }
+    free(text);
+    if (fclose(f) != 0 || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return TINYPKG_ERR;
+    }
+    return TINYPKG_OK;
+}
+
+int snapshot_changes(const char *from, const char *to,
+                     int (*fn)(const char *path, void *ctx), void *ctx) {
+    size_t len = 0;
+    char *text = journal_load(&len);
+    char cur[64];
+    int steps = 0, ret = TINYPKG_OK;
+
+    if (!text) {
+        return TINYPKG_ERR;
+    }
+    snprintf(cur, sizeof(cur), "%s", from);
+
+    while (ret == TINYPKG_OK && strcmp(cur, to) != 0) {
+        char next[64] = "";
+        size_t n = strlen(cur);
+
+        if (++steps > SNAPSHOT_STEPS_KEPT) {
+            ret = TINYPKG_ERR;
+            break;
+        }
+        /* Every line of the first step out of cur */
+        for (char *line = strchr(text, '\n') + 1; *line; line += strcspn(line, "\n") + 1) {
+            char *to_id = line + n + 1, *rel;
+            size_t tn;
+
+            if (strncmp(line, cur, n) != 0 || line[n] != ' ') {
+                continue;
+            }
+            tn = strcspn(to_id, " \n");
+            if (next[0] && (strncmp(to_id, next, tn) != 0 || next[tn] != '\0')) {
+                continue;
+            }
+            if (!next[0]) {
+                snprintf(next, sizeof(next), "%.*s", (int)(tn < 63 ? tn : 63), to_id);
+            }
+            rel = to_id + tn + 1;
+            if (to_id[tn] == ' ' && strncmp(rel, "-\n", 2) != 0) {
+                char p[PATH_MAX_LEN];
+                snprintf(p, sizeof(p), "%.*s", (int)strcspn(rel, "\n"), rel);
+                if (fn(p, ctx) != TINYPKG_OK) {
+                    ret = TINYPKG_ERR;
+                    break;
+                }
+            }
+        }
+        if (!next[0]) {
+            ret = TINYPKG_ERR;
+        }
+        snprintf(cur, sizeof(cur), "%s", next);
+    }
+
+    free(text);
+    return ret;
+}
+
+/* ============================================================================
+ * Applying
+ * ============================================================================
+ */
+
+/* Write rel unless it already holds data; 1 if it changed, -1 on error */
+static int put_if_changed(const char *rel, const char *data, size_t len) {
+    char full[PATH_MAX_LEN], tmp[PATH_MAX_LEN + 8];
+    size_t have_len = 0;
+    char *have;
+    FILE *f;
+
+    repo_path(full, sizeof(full), rel);
+    have = slurp(full, SNAPSHOT_FILE_MAX, &have_len);
+    if (have && have_len == len && memcmp(have, data, len) == 0) {
+        free(have);
+        return 0;
+    }
+    free(have);
+
+    snprintf(tmp, sizeof(tmp), "%s", full);
+    *strrchr(tmp, '/') = '\0';
+    if (mkdir_p(tmp) != TINYPKG_OK) {
+        return -1;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", full);
+    f = fopen(tmp, "wb");
+    if (!f || fwrite(data, 1, len, f) != len || fclose(f) != 0 || rename(tmp, full) != 0) {
+        if (f) unlink(tmp);
+        return -1;
+    }
+    return 1;
+}
+
+/* Remove rel and the package directory if that leaves it empty */
+static int drop(const char *rel) {
+    char full[PATH_MAX_LEN];
+
+    repo_path(full, sizeof(full), rel);
+    if (unlink(full) != 0) {
+        return 0;
+    }
+    *strrchr(full, '/') = '\0';
+    rmdir(full);
+    return 1;
+}
+
+/*
+ * Apply a downloaded snapshot (from NULL) or delta to <cache>/repo and add
+ * the paths the step changed to changed. Records are idempotent, so a
+ * stream interrupted halfway is repaired by the next, but the files it
+ * already wrote then look unchanged. A delta names only what changed since
+ * from, so all of its paths are added; a snapshot adds the paths whose
+ * content differed, or with all set, every path it holds.
+ */
+static int apply(const char *file, const char *from, const char *id, int all,
+                 struct paths *changed) {
+    struct paths seen = { NULL, 0, 0 };
+    char *line = NULL, *path, *data;
+    size_t line_cap = 0, len;
+    int kind = 0, ret;
+    pid_t pid;
+    FILE *in = gz_open(file, 0, &pid);
+
+    if (!in) {
+        return TINYPKG_ERR;
+    }
+
+    if (stream_header(in, from ? SNAPSHOT_DELTA_MAGIC : SNAPSHOT_MAGIC, from, id)
+        == TINYPKG_OK) {
+        for (;;) {
+            int r = 0;
+
+            kind = next_record(in, &line, &line_cap, &path, &data, &len);
+            if (kind == 'f') {
+                r = put_if_changed(path, data, len);
+                free(data);
+                if (r < 0 || (!from && paths_add(&seen, path) != TINYPKG_OK)) {
+                    kind = 0;
+                }
+            } else if (kind == 'd') {
+                r = drop(path);
+            }
+            if (kind != 'f' && kind != 'd') {
+                break;
+            }
+            if ((r > 0 || from || all) && paths_add(changed, path) != TINYPKG_OK) {
+                kind = 0;
+                break;
+            }
+        }
+    }
+    free(line);
+    ret = gz_close(in, pid, kind == 'e');
+
+    /* A full snapshot also says what is gone: everything it did not list */
+    if (ret == TINYPKG_OK && !from) {
+        struct paths have = { NULL, 0, 0 };
+
+        paths_sort(&seen);
+        ret = collect("packages", &have);
+        for (size_t i = 0; ret == TINYPKG_OK && i < have.count; i++) {
+            if (!paths_has(&seen, have.v[i]) && drop(have.v[i])) {
+                ret = paths_add(changed, have.v[i]);
+            }
+        }
+        paths_free(&have);
+    }
+    paths_free(&seen);
+
+    if (ret != TINYPKG_OK) {
+        fprintf(stderr, "Error: %s is not a valid %s\n", file, from ? "delta" : "snapshot");
+    }
+    return ret;
+}
+
+/* ============================================================================
+ * Syncing
+ * ============================================================================
+ */
+
+/* Download the files of a step plan at once, each checked against the head */
+static int download(const char *base, const struct head_delta *steps, int nsteps,
+                    const struct head *h, char dests[][PATH_MAX_LEN]) {
+    struct fetch_job jobs[SNAPSHOT_DELTAS];
+    char urls[SNAPSHOT_DELTAS][PATH_MAX_LEN];
+    char sums[SNAPSHOT_DELTAS][SHA256_HEX_LEN + 8];
+    int n = nsteps ? nsteps : 1;
+    int ret;
+
+    memset(jobs, 0, sizeof(jobs));
+    for (int i = 0; i < n; i++) {
+        const char *id = nsteps ? steps[i].to : h->id;
+        const char *ext = nsteps ? "delta" : "snap";
+
+        snprintf(urls[i], sizeof(urls[i]), "%s/%s.%s", base, id, ext);
+        state_path(dests[i], PATH_MAX_LEN, id);
+        strncat(dests[i], nsteps ? ".delta" : ".snap", PATH_MAX_LEN - strlen(dests[i]) - 1);
+        snprintf(sums[i], sizeof(sums[i]), "sha256:%s", nsteps ? steps[i].sha : h->sha);
+        jobs[i].url = urls[i];
+        jobs[i].dest = dests[i];
+        jobs[i].checksum = sums[i];
+    }
+
+    ret = fetch_files(jobs, (size_t)n);
+    for (int i = 0; i < n; i++) {
+        if (jobs[i].status != TINYPKG_OK) {
+            fprintf(stderr, "Error: Could not download %s\n", urls[i]);
+            ret = TINYPKG_ERR;
+        }
+    }
+    return ret;
+}
+
+int snapshot_sync(const char *base) {
+    char head_url[PATH_MAX_LEN], head_file[PATH_MAX_LEN], dir[PATH_MAX_LEN], git[PATH_MAX_LEN];
+    char marker[PATH_MAX_LEN];
+    char dests[SNAPSHOT_DELTAS][PATH_MAX_LEN];
+    struct head_delta steps[SNAPSHOT_DELTAS];
+    struct paths changed = { NULL, 0, 0 };
+    struct state st;
+    struct head h;
+    long long bytes = 0;
+    int nsteps = 0, redo, ret;
+    FILE *f;
+
+    if (!get_cache_path()) {
+        log_error("snapshot_sync", "Failed to get cache path");
+        return TINYPKG_ERR;
+    }
+
+    printf("Repository snapshot: %s\n", base);
+
+    /* A git checkout is replaced wholesale; its history means nothing here */
+    repo_path(git, sizeof(git), ".git");
+    if (access(git, F_OK) == 0) {
+        char repo[PATH_MAX_LEN];
+
+        printf("Replacing the git checkout with the snapshot...\n");
+        repo_path(repo, sizeof(repo), NULL);
+        snapshot_forget();
+        if (remove_tree(repo) != TINYPKG_OK) {
+            log_error("snapshot_sync", "Could not remove the git checkout");
+            return TINYPKG_ERR;
+        }
+    }
+    if (state_load(&st) != TINYPKG_OK) {
+        memset(&st, 0, sizeof(st));
+    }
+
+    state_path(dir, sizeof(dir), "");
+    if (mkdir_p(dir) != TINYPKG_OK) {
+        return TINYPKG_ERR;
+    }
+    snprintf(head_url, sizeof(head_url), "%s/%s", base, SNAPSHOT_HEAD);
+    state_path(head_file, sizeof(head_file), SNAPSHOT_HEAD);
+
+    ret = fetch_if_changed(head_url, head_file, &st.cond);
+    if (ret == FETCH_NOT_MODIFIED && st.id[0]) {
+        printf("✓ Snapshot unchanged (%.12s)\n", st.id);
+        return TINYPKG_OK;
+    }
+    if (ret == FETCH_NOT_MODIFIED) {
+        /* Validators without a tree: ask again unconditionally */
+        memset(&st.cond, 0, sizeof(st.cond));
+        ret = fetch_if_changed(head_url, head_file, &st.cond);
+    }
+    if (ret != TINYPKG_OK) {
+        log_error("snapshot_sync", "Could not fetch the snapshot head");
+        return TINYPKG_ERR;
+    }
+    if (head_load(head_file, &h) != TINYPKG_OK) {
+        log_error("snapshot_sync", "Snapshot head is not valid");
+        return TINYPKG_ERR;
+    }
+    if (strcmp(h.id, st.id) == 0) {
+        printf("✓ Snapshot unchanged (%.12s)\n", st.id);
+        return state_save(&st);
+    }
+
+    /* Deltas chain newest first; walk them from where we are */
+    if (st.id[0]) {
+        char cur[64];
+        long long sum = 0;
+
+        snprintf(cur, sizeof(cur), "%s", st.id);
+        while (strcmp(cur, h.id) != 0 && nsteps < h.ndeltas) {
+            int i;
+            for (i = 0; i < h.ndeltas && strcmp(h.deltas[i].from, cur) != 0; i++) {
+            }
+            if (i == h.ndeltas) {
+                break;
+            }
+            steps[nsteps++] = h.deltas[i];
+            sum += h.deltas[i].size;
+            snprintf(cur, sizeof(cur), "%s", h.deltas[i].to);
+        }
+        if (strcmp(cur, h.id) != 0 || sum >= h.size) {
+            nsteps = 0;
+        }
+    }
+
+    /* Left behind by an apply that never finished; see apply() */
+    state_path(marker, sizeof(marker), "applying");
+    redo = access(marker, F_OK) == 0;
+
+    if (nsteps > 0) {
+        printf("Fetching %d delta%s %.12s..%.12s...\n", nsteps, nsteps == 1 ? "" : "s",
+               st.id, h.id);
+    } else {
+        printf("Fetching snapshot %.12s (%.1f KiB)...\n", h.id, h.size / 1024.0);
+    }
+    ret = download(base, steps, nsteps, &h, dests);
+    if (ret == TINYPKG_OK && !redo) {
+        f = fopen(marker, "w");
+        if (!f || fclose(f) != 0) {
+            log_error("snapshot_sync", strerror(errno));
+            ret = TINYPKG_ERR;
+        }
+    }
+
+    for (int i = 0; ret == TINYPKG_OK && i < (nsteps ? nsteps : 1); i++) {
+        const char *from = nsteps ? steps[i].from : NULL;
+        const char *to = nsteps ? steps[i].to : h.id;
+        struct paths step = { NULL, 0, 0 };
+
+        bytes += nsteps ? steps[i].size : h.size;
+        ret = apply(dests[i], from, to, redo, &step);
+        for (size_t k = 0; ret == TINYPKG_OK && k < step.count; k++) {
+            ret = paths_add(&changed, step.v[k]);
+        }
+        /* Steps from nowhere (a first sync) have nothing to patch an index with */
+        if (ret == TINYPKG_OK && (from || st.id[0]) &&
+            journal_add(from ? from : st.id, to, &step) != TINYPKG_OK) {
+            log_warn("Could not record the snapshot's changes; the next index update is a full one");
+        }
+        paths_free(&step);
+    }
+    for (int i = 0; i < (nsteps ? nsteps : 1); i++) {
+        unlink(dests[i]);
+    }
+
+    if (ret == TINYPKG_OK) {
+        snprintf(st.id, sizeof(st.id), "%s", h.id);
+        ret = state_save(&st);
+    }
+    if (ret == TINYPKG_OK) {
+        unlink(marker);
+    }
+    if (ret == TINYPKG_OK) {
+        printf("✓ Repository at snapshot %.12s: %zu files changed, %.1f KiB fetched\n",
+               h.id, changed.count, bytes / 1024.0);
+    }
+    paths_free(&changed);
+    return ret;
+}
@@ -0,0 +1,646 @@
+/*
+ * store.c - Content-addressed file store shared by installed prefixes
+ *
+ * In store mode every regular file of a package's PKG prefix is hashed and
+ * kept once under ~/.cache/tinypkg/store/objects/<aa>/<rest>[.x], then
+ * hardlinked (or reflinked) back into the prefix. Identical locale data,
+ * terminfo entries and docs shipped by several packages share one inode.
+ * An object's link count is its reference count: one for the store, one
+ * per prefix holding it. store_sweep() drops objects only the store holds,
+ * once gc has evicted the prefixes that used them.
+ *
+ * Installed files are never hardlinked to an object, since a chmod or an
+ * in-place write there would reach every prefix sharing it; install uses
+ * store_clone_file(), which only shares blocks copy-on-write.
+ *
+ * Hashing runs on a small thread pool. A hash cache keyed by path, size
+ * and mtime lets unchanged files skip rehashing on later passes.
+ */
+
+#include "common.h"
+#include "store.h"
+#include "sha256.h"
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#define STORE_MAX_THREADS 16
+
+struct hash_job {
+    char path[PATH_MAX_LEN];
+    struct stat st;
+    char hash[SHA256_HEX_LEN];
+    int ok;
+};
+
+struct hc_entry {
+    char *path;
+    unsigned long long size;
+    long long mtime_s;
+    long mtime_ns;
+    char hash[SHA256_HEX_LEN];
+};
+
+struct hash_cache {
+    struct hc_entry *entries;
+    size_t count;
+    size_t sorted;      /* Entries [0, sorted) are ordered by path */
+    size_t cap;
+};
+
+struct hash_pool {
+    struct hash_job *jobs;
+    size_t count;
+    size_t next;
+    const struct hash_cache *cache;
+    size_t hashed;
+    pthread_mutex_t lock;
+};
+
+int store_enabled(void) {
+    const char *env = getenv(STORE_ENV);
+    return env && env[0] && strcmp(env, "0") != 0;
+}
+
+/* ============================================================================
+ * Hash cache (path, size, mtime) -> sha256
+ * ============================================================================
+ */
+
+static void hashcache_path(char *dst, size_t len) {
+    snprintf(dst, len, "%s/%s/hashcache", get_cache_path(), STORE_DIR);
+}
+
+static int hc_cmp(const void *a, const void *b) {
+    const struct hc_entry *ea = a;
+    const struct hc_entry *eb = b;
+    return strcmp(ea->path, eb->path);
+}
+
+static void hashcache_free(struct hash_cache *hc) {
+    for (size_t i = 0; i < hc->count; i++) {
+        free(hc->entries[i].path);
+    }
+    free(hc->entries);
+    memset(hc, 0, sizeof(*hc));
+}
+
+static struct hc_entry *hashcache_add(struct hash_cache *hc) {
+    if (hc->count == hc->cap) {
+        size_t new_cap = hc->cap ? hc->cap * 2 : 256;
+        struct hc_entry *p = realloc(hc->entries, new_cap * sizeof(*p));
+        if (!p) {
+            return NULL;
+        }
+        hc->entries = p;
+        hc->cap = new_cap;
+    }
+    memset(&hc->entries[hc->count], 0, sizeof(struct hc_entry));
+    return &hc->entries[hc->count++];
+}
+
+static void hashcache_load(struct hash_cache *hc) {
+    char path[PATH_MAX_LEN];
+    char *line = NULL;
+    size_t line_cap = 0;
+    FILE *f;
+
+    memset(hc, 0, sizeof(*hc));
+    hashcache_path(path, sizeof(path));
+
+    f = fopen(path, "r");
+    if (!f) {
+        return;
+    }
+
+    if (getline(&line, &line_cap, f) < 0 ||
+        strncmp(line, STORE_HASHCACHE_MAGIC, strlen(STORE_HASHCACHE_MAGIC)) != 0) {
+        free(line);
+        fclose(f);
+        return;
+    }
+
+    while (getline(&line, &line_cap, f) > 0) {
+        struct hc_entry tmp;
+        int off = 0;
+
+        line[strcspn(line, "\n")] = '\0';
+        memset(&tmp, 0, sizeof(tmp));
+        if (sscanf(line, "%64s %llu %lld %ld %n", tmp.hash, &tmp.size,
+                   &tmp.mtime_s, &tmp.mtime_ns, &off) != 4 || off == 0) {
+            continue;
+        }
+
+        struct hc_entry *e = hashcache_add(hc);
+        if (!e) {
+            break;
+        }
+        *e = tmp;
+        e->path = strdup(line + off);
+        if (!e->path) {
+            hc->count--;
+            break;
+        }
+    }
+
+    free(line);
+    fclose(f);
+
+    if (hc->count > 0) {
+        qsort(hc->entries, hc->count, sizeof(*hc->entries), hc_cmp);
+    }
+    hc->sorted = hc->count;
+}
+
+static int hashcache_save(const struct hash_cache *hc) {
+    char path[PATH_MAX_LEN];
+    char tmp_path[PATH_MAX_LEN + 8];
+    FILE *f;
+
+    hashcache_path(path, sizeof(path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    f = fopen(tmp_path, "w");
+    if (!f) {
+        return TINYPKG_ERR;
+    }
+
+    fprintf(f, "%s\n", STORE_HASHCACHE_MAGIC);
+    for (size_t i = 0; i < hc->count; i++) {
+        const struct hc_entry *e = &hc->entries[i];
+        fprintf(f, "%s %llu %lld %ld %s\n", e->hash, e->size,
+                e->mtime_s, e->mtime_ns, e->path);
+    }
+
+    if (fclose(f) != 0 || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return TINYPKG_ERR;
+    }
+    return TINYPKG_OK;
+}
+
+static const struct hc_entry *hashcache_find(const struct hash_cache *hc,
+                                             const char *path) {
+    struct hc_entry key;
+
+    if (hc->sorted == 0) {
+        return NULL;
+    }
+    key.path = (char *)path;
+    return bsearch(&key, hc->entries, hc->sorted, sizeof(key), hc_cmp);
+}
+
+/* ============================================================================
+ * Parallel hashing
+ * ============================================================================
+ */
+
+static int stat_matches(const struct hc_entry *e, const struct stat *st) {
+    return e->size == (unsigned long long)st->st_size &&
+           e->mtime_s == (long long)st->st_mtim.tv_sec &&
+           e->mtime_ns == (long)st->st_mtim.tv_nsec;
+}
+
+static void *hash_worker(void *arg) {
+    struct hash_pool *pool = arg;
+
+    for (;;) {
+        struct hash_job *job;
+        const struct hc_entry *cached;
+
+        pthread_mutex_lock(&pool->lock);
+        if (pool->next >= pool->count) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        job = &pool->jobs[pool->next++];
+        pthread_mutex_unlock(&pool->lock);
+
+        /* Unchanged since the last pass: reuse the recorded hash */
+        cached = hashcache_find(pool->cache, job->path);
+        if (cached && stat_matches(cached, &job->st)) {
+            memcpy(job->hash, cached->hash, SHA256_HEX_LEN);
+            job->ok = 1;
+            continue;
+        }
+
+        job->ok = sha256_file(job->path, job->hash) == TINYPKG_OK;
+
+        pthread_mutex_lock(&pool->lock);
+        pool->hashed++;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+/* Collect regular files below dir (symlinks are left alone) */
+static int collect_files(const char *dir, struct hash_job **jobs,
+                         size_t *count, size_t *cap) {
+    struct dirent *de;
+    DIR *d = opendir(dir);
+
+    if (!d) {
+        return TINYPKG_ERR;
+    }
+
+    while ((de = readdir(d)) != NULL) {
+        char path[PATH_MAX_LEN];
+        struct stat st;
+
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        if (snprintf(path, sizeof(path), "%s/%s", dir, de->d_name)
+            >= (int)sizeof(path)) {
+            continue;
+        }
+        if (lstat(path, &st) != 0) {
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            collect_files(path, jobs, count, cap);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+            continue;
+        }
+
+        if (*count == *cap) {
+            size_t new_cap = *cap ? *cap * 2 : 256;
+            struct hash_job *p = realloc(*jobs, new_cap * sizeof(*p));
+            if (!p) {
+                closedir(d);
+                return TINYPKG_ERR;
+            }
+            *jobs = p;
+            *cap = new_cap;
+        }
+
+        struct hash_job *job = &(*jobs)[(*count)++];
+        memset(job, 0, sizeof(*job));
+        memcpy(job->path, path, sizeof(job->path));
+        job->st = st;
+    }
+
+    closedir(d);
+    return TINYPKG_OK;
+}
+
+static void hash_all(struct hash_pool *pool) {
+    pthread_t threads[STORE_MAX_THREADS];
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = (ncpu > 0) ? (int)ncpu : 1;
+    int started = 0;
+
+    if (nthreads > STORE_MAX_THREADS) {
+        nthreads = STORE_MAX_THREADS;
+    }
+    if ((size_t)nthreads > pool->count) {
+        nthreads = pool->count > 0 ? (int)pool->count : 1;
+    }
+
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, hash_worker, pool) != 0) {
+            break;
+        }
+        started++;
+    }
+
+    if (started == 0) {
+        hash_worker(pool);  /* No threads available: hash inline */
+    }
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/* ============================================================================
+ * Linking
+ * ============================================================================
+ */
+
+/* Clone src onto dst via a reflink (copy-on-write filesystems only) */
+static int reflink_file(const char *src, const char *dst) {
+#ifdef FICLONE
+    int in, out, ret;
+
+    in = open(src, O_RDONLY);
+    if (in < 0) {
+        return TINYPKG_ERR;
+    }
+    out = open(dst, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (out < 0) {
+        close(in);
+        return TINYPKG_ERR;
+    }
+
+    ret = ioctl(out, FICLONE, in);
+    close(in);
+    close(out);
+
+    if (ret != 0) {
+        unlink(dst);
+        return TINYPKG_ERR;
+    }
+    return TINYPKG_OK;
+#else
+    (void)src;
+    (void)dst;
+    return TINYPKG_ERR;
+#endif
+}
+
+/* Atomically replace dst with a link to src */
+int store_link_file(const char *src, const char *dst) {
+    char tmp[PATH_MAX_LEN + 16];
+    struct stat st;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tpk-link", dst) >= (int)sizeof(tmp)) {
+        return TINYPKG_ERR;
+    }
+    unlink(tmp);
+
+    if (link(src, tmp) != 0) {
+        /* Cross-device or link count exhausted: try a reflink instead */
+        if (reflink_file(src, tmp) != TINYPKG_OK) {
+            return TINYPKG_ERR;
+        }
+        if (stat(src, &st) == 0) {
+            chmod(tmp, st.st_mode & 07777);
+        }
+    }
+
+    if (rename(tmp, dst) != 0) {
+        unlink(tmp);
+        return TINYPKG_ERR;
+    }
+    return TINYPKG_OK;
+}
+
+/* Reflink src onto dst (atomically replacing it), or fail */
+int store_clone_file(const char *src, const char *dst) {
+    char tmp[PATH_MAX_LEN + 16];
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tpk-link", dst) >= (int)sizeof(tmp)) {
+        return TINYPKG_ERR;
+    }
+    unlink(tmp);
+
+    if (reflink_file(src, tmp) != TINYPKG_OK) {
+        return TINYPKG_ERR;
+    }
+    if (rename(tmp, dst) != 0) {
+        unlink(tmp);
+        return TINYPKG_ERR;
+    }
+    return TINYPKG_OK;
+}
+
+/* Objects are keyed by content and executable bit, and kept read-only */
+static void object_path(char *dst, size_t len, const char *hash, mode_t mode) {
+    snprintf(dst, len, "%s/%s/objects/%.2s/%s%s", get_cache_path(), STORE_DIR,
+             hash, hash + 2, (mode & 0111) ? ".x" : "");
+}
+
+/*
+ * Put one file into the store. Returns the bytes saved by sharing an
+ * existing object, 0 if the file became a new object, -1 on failure.
+ */
+static long long store_one(const struct hash_job *job) {
+    char obj[PATH_MAX_LEN];
+    char obj_dir[PATH_MAX_LEN];
+    struct stat obj_st;
+
+    object_path(obj, sizeof(obj), job->hash, job->st.st_mode);
+
+    if (stat(obj, &obj_st) != 0) {
+        /* First copy of this content: the file itself becomes the object */
+        memcpy(obj_dir, obj, sizeof(obj_dir));
+        *strrchr(obj_dir, '/') = '\0';
+        if (mkdir_p(obj_dir) != TINYPKG_OK) {
+            return -1;
+        }
+        if (link(job->path, obj) != 0) {
+            return -1;
+        }
+        chmod(obj, job->st.st_mode & 0555);
+        return 0;
+    }
+
+    if (obj_st.st_ino == job->st.st_ino && obj_st.st_dev == job->st.st_dev) {
+        return 0;   /* Already shared */
+    }
+
+    if (store_link_file(obj, job->path) != TINYPKG_OK) {
+        return -1;
+    }
+    return (long long)job->st.st_size;
+}
+
+/* ============================================================================
+ * Public API
+ * ============================================================================
+ */
+
+int store_ingest(const char *name) {
+    char prefix[PATH_MAX_LEN];
+    struct hash_pool pool;
+    struct hash_cache hc;
+    struct hash_job *jobs = NULL;
+    size_t count = 0, cap = 0;
+    unsigned long long total = 0, saved = 0;
+    size_t linked = 0, failed = 0;
+
+    if (!name || !is_valid_package_name(name)) {
+        log_error("store_ingest", "Invalid package name");
+        return TINYPKG_ERR;
+    }
+
+    snprintf(prefix, sizeof(prefix), "%s/%s/PKG", get_cache_path(), name);
+
+    if (collect_files(prefix, &jobs, &count, &cap) != TINYPKG_OK) {
+        log_error("store_ingest", "Could not read package prefix");
+        free(jobs);
+        return TINYPKG_ERR;
+    }
+
+    hashcache_load(&hc);
+
+    memset(&pool, 0, sizeof(pool));
+    pool.jobs = jobs;
+    pool.count = count;
+    pool.cache = &hc;
+    pthread_mutex_init(&pool.lock, NULL);
+    hash_all(&pool);
+    pthread_mutex_destroy(&pool.lock);
+
+    for (size_t i = 0; i < count; i++) {
+        struct hash_job *job = &jobs[i];
+        long long r;
+        struct stat st;
+        struct hc_entry *e;
+
+        total += (unsigned long long)job->st.st_size;
+        if (!job->ok) {
+            failed++;
+            continue;
+        }
+
+        r = store_one(job);
+        if (r < 0) {
+            failed++;
+            continue;
+        }
+        saved += (unsigned long long)r;
+        linked++;
+
+        /* Remember the post-link stat so the next pass skips this file */
+        if (stat(job->path, &st) != 0) {
+            continue;
+        }
+        e = (struct hc_entry *)hashcache_find(&hc, job->path);
+        if (!e) {
+            e = hashcache_add(&hc);
+            if (!e) {
+                continue;
+            }
+            e->path = strdup(job->path);
+            if (!e->path) {
+                hc.count--;
+                continue;
+            }
+        }
+        e->size = (unsigned long long)st.st_size;
+        e->mtime_s = (long long)st.st_mtim.tv_sec;
+        e->mtime_ns = (long)st.st_mtim.tv_nsec;
+        memcpy(e->hash, job->hash, SHA256_HEX_LEN);
+    }
+
+    if (hashcache_save(&hc) != TINYPKG_OK) {
+        log_warn("Could not save store hash cache");
+    }
+
+    printf("✓ Store: %s - %zu files (%zu hashed), %llu KB, %llu KB deduplicated\n",
+           name, linked, pool.hashed, total / 1024, saved / 1024);
+    if (failed > 0) {
+        fprintf(stderr, "Warning: %zu file(s) could not be stored\n", failed);
+    }
+
+    hashcache_free(&hc);
+    free(jobs);
+    return failed > 0 ? TINYPKG_ERR : TINYPKG_OK;
+}
+
+/* Sum a prefix: total bytes and bytes shared with another prefix */
+static void prefix_savings(const char *prefix, unsigned long long *total,
+                           unsigned long long *shared) {
+    struct hash_job *jobs = NULL;
+    size_t count = 0, cap = 0;
+
+    *total = 0;
+    *shared = 0;
+    collect_files(prefix, &jobs, &count, &cap);
+
+    for (size_t i = 0; i < count; i++) {
+        total[0] += (unsigned long long)jobs[i].st.st_size;
+        /* One link is the store object, one is this prefix */
+        if (jobs[i].st.st_nlink > 2) {
+            shared[0] += (unsigned long long)jobs[i].st.st_size;
+        }
+    }
+
+    free(jobs);
+}
+
+/* Drop a prefix before rebuilding so in-place writes never reach objects */
+int store_release(const char *name) {
+    char prefix[PATH_MAX_LEN];
+
+    if (!name || !is_valid_package_name(name)) {
+        return TINYPKG_ERR;
+    }
+
+    snprintf(prefix, sizeof(prefix), "%s/%s/PKG", get_cache_path(), name);
+    return remove_tree(prefix);
+}
+
+int store_sweep(unsigned long long *freed) {
+    char objects[PATH_MAX_LEN];
+    struct hash_job *jobs = NULL;
+    size_t count = 0, cap = 0, removed = 0;
+    int ret = TINYPKG_OK;
+
+    *freed = 0;
+    snprintf(objects, sizeof(objects), "%s/%s/objects", get_cache_path(), STORE_DIR);
+    if (access(objects, F_OK) != 0) {
+        return TINYPKG_OK;
+    }
+    if (collect_files(objects, &jobs, &count, &cap) != TINYPKG_OK) {
+        free(jobs);
+        return TINYPKG_ERR;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (jobs[i].st.st_nlink > 1) {
+            continue;
+        }
+        if (unlink(jobs[i].path) != 0) {
+            ret = TINYPKG_ERR;
+            continue;
+        }
+        *freed += (unsigned long long)jobs[i].st.st_blocks * 512;
+        removed++;
+        *strrchr(jobs[i].path, '/') = '\0';
+        rmdir(jobs[i].path);    /* Only once its last object is gone */
+    }
+
+    if (removed > 0) {
+        printf("Store: %zu unreferenced object%s removed (%llu KB)\n",
+               removed, removed == 1 ? "" : "s", *freed / 1024);
+    }
+    free(jobs);
+    return ret;
+}
+
+int store_report(void) {
+    struct dirent *de;
+    DIR *d = opendir(get_cache_path());
+    unsigned long long all_total = 0, all_shared = 0;
+
+    if (!d) {
+        log_error("store_report", "Cache directory not found");
+        return TINYPKG_ERR;
+    }
+
+    printf("%-20s %12s %12s\n", "Package", "Size (KB)", "Shared (KB)");
+
+    while ((de = readdir(d)) != NULL) {
+        char prefix[PATH_MAX_LEN];
+        unsigned long long total, shared;
+        struct stat st;
+
+        if (!is_valid_package_name(de->d_name)) {
+            continue;
+        }
+        if (snprintf(prefix, sizeof(prefix), "%s/%s/PKG",
+                     get_cache_path(), de->d_name) >= (int)sizeof(prefix) ||
+            stat(prefix, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            continue;
+        }
+
+        prefix_savings(prefix, &total, &shared);
+        printf("%-20s %12llu %12llu\n", de->d_name, total / 1024, shared / 1024);
+        all_total += total;
+        all_shared += shared;
+    }
+
+    closedir(d);
+    printf("%-20s %12llu %12llu\n", "Total", all_total / 1024, all_shared / 1024);
+    return TINYPKG_OK;
+}
@@ -0,0 +1,508 @@
+/*
+ * strip.c - Post-build stripping of ELF files with split debug info
+ *
+ * Many packages install unstripped binaries and libraries, which costs
+ * disk, page cache and start-up time. Between build and install this
+ * stage finds the ELF files in a PKG prefix that still carry a symbol
+ * table or debug sections (only their headers are read), and on a small
+ * thread pool for each one:
+ *
+ *   objcopy --only-keep-debug    debug info to debug/<pkg>/<path>.debug
+ *   strip --strip-unneeded       (--strip-debug for relocatable objects)
+ *   objcopy --add-gnu-debuglink  so debuggers find the split file
+ *
+ * Files already stripped are left alone, as are files of the other byte
+ * order. The stage is best effort: a file that fails keeps its symbols.
+ */
+
+#include "common.h"
+#include "strip.h"
+#include "gc.h"
+#include <dirent.h>
+#include <elf.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#define STRIP_MAX_THREADS 16
+#define STRIP_MAX_SHSTRTAB (1 << 20)
+
+struct strip_job {
+    char path[PATH_MAX_LEN];
+    char debug[PATH_MAX_LEN + 16];
+    unsigned long long before;
+    unsigned long long after;
+    unsigned long long debug_bytes;
+    int state;                      /* enum job_state */
+};
+
+enum job_state { JOB_SKIPPED, JOB_STRIPPED, JOB_FAILED };
+
+struct strip_pool {
+    struct strip_job *jobs;
+    size_t count;
+    size_t next;
+    int compress;
+    pthread_mutex_t lock;
+};
+
+/* What the ELF headers say about a file */
+struct elf_info {
+    int type;                       /* ET_EXEC, ET_DYN or ET_REL */
+    int strippable;                 /* Has .symtab or debug sections */
+    char build_id[129];             /* Hex, empty if none */
+};
+
+struct section {
+    uint32_t name;
+    uint32_t type;
+    uint64_t offset;
+    uint64_t size;
+};
+
+static int run_mode = -1;           /* -1: STRIP_ENV decides */
+
+void strip_use(int mode) {
+    run_mode = mode;
+}
+
+int strip_mode(void) {
+    const char *env;
+
+    if (run_mode >= 0) {
+        return run_mode;
+    }
+    env = getenv(STRIP_ENV);
+    if (!env || !*env || strcmp(env, "0") == 0) {
+        return STRIP_OFF;
+    }
+    return strcmp(env, "compress") == 0 ? STRIP_COMPRESS : STRIP_SPLIT;
+}
+
+/* ============================================================================
+ * ELF headers
+ * ============================================================================
+ */
+
+static int host_data(void) {
+    const union { uint16_t v; uint8_t b[2]; } u = { 1 };
+    return u.b[0] ? ELFDATA2LSB : ELFDATA2MSB;
+}
+
+static int read_at(int fd, void *buf, size_t len, uint64_t off) {
+    return pread(fd, buf, len, (off_t)off) == (ssize_t)len ? 0 : -1;
+}
+
+static int read_section(int fd, int is64, uint64_t off, struct section *s) {
+    if (is64) {
+        Elf64_Shdr sh;
+        if (read_at(fd, &sh, sizeof(sh), off) != 0) return -1;
+        s->name = sh.sh_name;
+        s->type = sh.sh_type;
+        s->offset = sh.sh_offset;
+        s->size = sh.sh_size;
+    } else {
+        Elf32_Shdr sh;
+        if (read_at(fd, &sh, sizeof(sh), off) != 0) return -1;
+        s->name = sh.sh_name;
+        s->type = sh.sh_type;
+        s->offset = sh.sh_offset;
+        s->size = sh.sh_size;
+    }
+    return 0;
+}
+
+/* NT_GNU_BUILD_ID note as hex; the note header is three words in both classes */
+static void read_build_id(int fd, const struct section *s, char *hex, size_t len) {
+    static const char digits[] = "0123456789abcdef";
+    unsigned char note[12 + 4 + 64];
+    uint32_t namesz, descsz, type;
+    size_t n, desc;
+
+    n = s->size < sizeof(note) ? (size_t)s->size : sizeof(note);
+    if (n < 16 || read_at(fd, note, n, s->offset) != 0) {
+        return;
+    }
+    memcpy(&namesz, note, 4);
+    memcpy(&descsz, note + 4, 4);
+    memcpy(&type, note + 8, 4);
+    desc = 12 + ((namesz + 3) & ~3u);
+    if (type != NT_GNU_BUILD_ID || descsz == 0 || desc + descsz > n ||
+        descsz * 2 + 1 > len) {
+        return;
+    }
+    for (uint32_t i = 0; i < descsz; i++) {
+        hex[i * 2] = digits[note[desc + i] >> 4];
+        hex[i * 2 + 1] = digits[note[desc + i] & 15];
+    }
+    hex[descsz * 2] = '\0';
+}
+
+/* 0 if path is an ELF file of our byte order that strip can handle */
+static int elf_probe(const char *path, struct elf_info *info) {
+    unsigned char ident[EI_NIDENT];
+    uint64_t shoff;
+    unsigned shnum, shentsize, shstrndx;
+    struct section strtab;
+    char *names = NULL;
+    int fd, is64, ret = -1;
+
+    memset(info, 0, sizeof(*info));
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (read_at(fd, ident, sizeof(ident), 0) != 0 ||
+        memcmp(ident, ELFMAG, SELFMAG) != 0 || ident[EI_DATA] != host_data() ||
+        (ident[EI_CLASS] != ELFCLASS32 && ident[EI_CLASS] != ELFCLASS64)) {
+        goto out;
+    }
+    is64 = ident[EI_CLASS] == ELFCLASS64;
+
+    if (is64) {
+        Elf64_Ehdr eh;
+        if (read_at(fd, &eh, sizeof(eh), 0) != 0) goto out;
+        info->type = eh.e_type;
+        shoff = eh.e_shoff;
+        shnum = eh.e_shnum;
+        shentsize = eh.e_shentsize;
+        shstrndx = eh.e_shstrndx;
+    } else {
+        Elf32_Ehdr eh;
+        if (read_at(fd, &eh, sizeof(eh), 0) != 0) goto out;
+        info->type = eh.e_type;
+        shoff = eh.e_shoff;
+        shnum = eh.e_shnum;
+        shentsize = eh.e_shentsize;
+        shstrndx = eh.e_shstrndx;
+    }
+    if (info->type != ET_EXEC && info->type != ET_DYN && info->type != ET_REL) {
+        goto out;
+    }
+    ret = 0;
+
+    /* Extended section numbering and the like: let strip decide */
+    if (shnum == 0 || shstrndx >= shnum ||
+        read_section(fd, is64, shoff + (uint64_t)shstrndx * shentsize, &strtab) != 0 ||
+        strtab.size == 0 || strtab.size > STRIP_MAX_SHSTRTAB ||
+        !(names = calloc(1, (size_t)strtab.size + 1)) ||
+        read_at(fd, names, (size_t)strtab.size, strtab.offset) != 0) {
+        info->strippable = 1;
+        goto out;
+    }
+
+    for (unsigned i = 0; i < shnum; i++) {
+        struct section s;
+        const char *name;
+
+        if (read_section(fd, is64, shoff + (uint64_t)i * shentsize, &s) != 0 ||
+            s.name >= strtab.size) {
+            continue;
+        }
+        name = names + s.name;
+        if (strcmp(name, ".symtab") == 0 || strncmp(name, ".debug_", 7) == 0 ||
+            strncmp(name, ".zdebug_", 8) == 0) {
+            info->strippable = 1;
+        } else if (s.type == SHT_NOTE && strcmp(name, ".note.gnu.build-id") == 0) {
+            read_build_id(fd, &s, info->build_id, sizeof(info->build_id));
+        }
+    }
+
+out:
+    free(names);
+    close(fd);
+    return ret;
+}
+
+/* ============================================================================
+ * Stripping
+ * ============================================================================
+ */
+
+static unsigned long long file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (unsigned long long)st.st_size : 0;
+}
+
+/* debug/.build-id/xx/<rest>.debug -> the package's split file */
+static void link_build_id(const char *build_id, const char *debug) {
+    char dir[PATH_MAX_LEN], link[PATH_MAX_LEN + 160];
+
+    if (strlen(build_id) < 4) {
+        return;
+    }
+    snprintf(dir, sizeof(dir), "%s/%s/.build-id/%.2s", get_cache_path(), STRIP_DEBUG_DIR,
+             build_id);
+    snprintf(link, sizeof(link), "%s/%s.debug", dir, build_id + 2);
+    if (mkdir_p(dir) != TINYPKG_OK) {
+        return;
+    }
+    unlink(link);
+    if (symlink(debug, link) != 0) {
+        log_warn("Could not link debug info by build ID");
+    }
+}
+
+static int strip_one(struct strip_job *job, int compress) {
+    struct elf_info info;
+    struct stat st;
+    char debuglink[PATH_MAX_LEN + 48];
+    char dir[PATH_MAX_LEN + 16];
+    char *slash;
+    int ret = TINYPKG_ERR;
+
+    if (elf_probe(job->path, &info) != 0 || !info.strippable ||
+        lstat(job->path, &st) != 0) {
+        job->state = JOB_SKIPPED;
+        return TINYPKG_OK;
+    }
+
+    snprintf(dir, sizeof(dir), "%s", job->debug);
+    slash = strrchr(dir, '/');
+    if (slash) *slash = '\0';
+    if (mkdir_p(dir) != TINYPKG_OK) {
+        job->state = JOB_FAILED;
+        return TINYPKG_ERR;
+    }
+
+    /* Installed files are often read-only */
+    if (!(st.st_mode & S_IWUSR) && chmod(job->path, st.st_mode | S_IWUSR) != 0) {
+        job->state = JOB_FAILED;
+        return TINYPKG_ERR;
+    }
+
+    job->before = (unsigned long long)st.st_size;
+    snprintf(debuglink, sizeof(debuglink), "--add-gnu-debuglink=%s", job->debug);
+    {
+        char *keep[] = { "objcopy", "--only-keep-debug", job->path, job->debug, NULL };
+        char *keep_z[] = { "objcopy", "--only-keep-debug", "--compress-debug-sections=zlib",
+                           job->path, job->debug, NULL };
+        char *strip[] = { "strip", info.type == ET_REL ? "--strip-debug" : "--strip-unneeded",
+                          job->path, NULL };
+        char *link[] = { "objcopy", debuglink, job->path, NULL };
+
+        if (safe_execute(compress ? keep_z : keep) == TINYPKG_OK &&
+            safe_execute(strip) == TINYPKG_OK && safe_execute(link) == TINYPKG_OK) {
+            ret = TINYPKG_OK;
+        }
+    }
+
+    if (!(st.st_mode & S_IWUSR)) {
+        chmod(job->path, st.st_mode);
+    }
+
+    job->after = file_size(job->path);
+    job->debug_bytes = file_size(job->debug);
+    if (ret == TINYPKG_OK && info.build_id[0]) {
+        link_build_id(info.build_id, job->debug);
+    }
+    job->state = ret == TINYPKG_OK ? JOB_STRIPPED : JOB_FAILED;
+    return ret;
+}
+
+static void *strip_worker(void *arg) {
+    struct strip_pool *pool = arg;
+
+    for (;;) {
+        struct strip_job *job;
+
+        pthread_mutex_lock(&pool->lock);
+        if (pool->next >= pool->count) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        job = &pool->jobs[pool->next++];
+        pthread_mutex_unlock(&pool->lock);
+
+        strip_one(job, pool->compress);
+    }
+
+    return NULL;
+}
+
+static void strip_all(struct strip_pool *pool) {
+    pthread_t threads[STRIP_MAX_THREADS];
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = (ncpu > 0) ? (int)ncpu : 1;
+    int started = 0;
+
+    if (nthreads > STRIP_MAX_THREADS) {
+        nthreads = STRIP_MAX_THREADS;
+    }
+    if ((size_t)nthreads > pool->count) {
+        nthreads = pool->count > 0 ? (int)pool->count : 1;
+    }
+
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, strip_worker, pool) != 0) {
+            break;
+        }
+        started++;
+    }
+
+    if (started == 0) {
+        strip_worker(pool);     /* No threads available: strip inline */
+    }
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/* Regular files below dir that could be ELF, each inode once */
+static int collect_files(const char *dir, const char *prefix, const char *debug_dir,
+                         struct strip_job **jobs, size_t *count, size_t *cap,
+                         struct stat **seen, size_t *nseen) {
+    struct dirent *de;
+    DIR *d = opendir(dir);
+
+    if (!d) {
+        return TINYPKG_ERR;
+    }
+
+    while ((de = readdir(d)) != NULL) {
+        char path[PATH_MAX_LEN];
+        struct strip_job *job;
+        struct stat st;
+        size_t k;
+
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        if (snprintf(path, sizeof(path), "%s/%s", dir, de->d_name)
+            >= (int)sizeof(path)) {
+            continue;
+        }
+        if (lstat(path, &st) != 0) {
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            collect_files(path, prefix, debug_dir, jobs, count, cap, seen, nseen);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode) || st.st_size < (off_t)sizeof(Elf32_Ehdr)) {
+            continue;
+        }
+
+        /* Hardlinks share the inode: strip it once */
+        if (st.st_nlink > 1) {
+            struct stat *grown;
+
+            for (k = 0; k < *nseen; k++) {
+                if ((*seen)[k].st_dev == st.st_dev && (*seen)[k].st_ino == st.st_ino) {
+                    break;
+                }
+            }
+            if (k < *nseen) {
+                continue;
+            }
+            grown = realloc(*seen, (*nseen + 1) * sizeof(*grown));
+            if (!grown) {
+                closedir(d);
+                return TINYPKG_ERR;
+            }
+            *seen = grown;
+            (*seen)[(*nseen)++] = st;
+        }
+
+        if (*count == *cap) {
+            size_t new_cap = *cap ? *cap * 2 : 64;
+            struct strip_job *p = realloc(*jobs, new_cap * sizeof(*p));
+            if (!p) {
+                closedir(d);
+                return TINYPKG_ERR;
+            }
+            *jobs = p;
+            *cap = new_cap;
+        }
+
+        job = &(*jobs)[(*count)++];
+        memset(job, 0, sizeof(*job));
+        memcpy(job->path, path, sizeof(job->path));
+        snprintf(job->debug, sizeof(job->debug), "%s%s.debug", debug_dir,
+                 path + strlen(prefix));
+    }
+
+    closedir(d);
+    return TINYPKG_OK;
+}
+
+int strip_package(const char *name, struct strip_stats *stats) {
+    char prefix[PATH_MAX_LEN], debug_dir[PATH_MAX_LEN];
+    struct strip_job *jobs = NULL;
+    struct stat *seen = NULL;
+    struct strip_pool pool;
+    size_t count = 0, cap = 0, nseen = 0;
+    int ret;
+
+    memset(stats, 0, sizeof(*stats));
+    snprintf(prefix, sizeof(prefix), "%s/%s/PKG", get_tinypkg_dir(), name);
+    snprintf(debug_dir, sizeof(debug_dir), "%s/%s/%s", get_cache_path(), STRIP_DEBUG_DIR,
+             name);
+
+    /* Debug info of an earlier build no longer matches */
+    remove_tree(debug_dir);
+
+    ret = collect_files(prefix, prefix, debug_dir, &jobs, &count, &cap, &seen, &nseen);
+    free(seen);
+    if (ret != TINYPKG_OK) {
+        free(jobs);
+        log_error("strip_package", "Could not scan the prefix");
+        return TINYPKG_ERR;
+    }
+
+    memset(&pool, 0, sizeof(pool));
+    pool.jobs = jobs;
+    pool.count = count;
+    pool.compress = strip_mode() == STRIP_COMPRESS;
+    pthread_mutex_init(&pool.lock, NULL);
+    strip_all(&pool);
+    pthread_mutex_destroy(&pool.lock);
+
+    for (size_t i = 0; i < count; i++) {
+        if (jobs[i].state == JOB_FAILED) {
+            stats->failed++;
+        } else if (jobs[i].state == JOB_STRIPPED) {
+            stats->files++;
+            stats->before += jobs[i].before;
+            stats->after += jobs[i].after;
+            stats->debug += jobs[i].debug_bytes;
+        }
+    }
+    free(jobs);
+
+    gc_record(GC_KIND_DEBUG, name);
+    return stats->failed ? TINYPKG_ERR : TINYPKG_OK;
+}
+
+/* "512 KiB", "3.4 MiB" */
+static void format_size(unsigned long long bytes, char *buf, size_t len) {
+    if (bytes < (1ULL << 20)) {
+        snprintf(buf, len, "%llu KiB", (bytes + 1023) >> 10);
+    } else {
+        snprintf(buf, len, "%.1f MiB", bytes / 1048576.0);
+    }
+}
+
+void strip_print_stats(const char *name, const struct strip_stats *stats) {
+    unsigned long long saved = stats->before > stats->after ? stats->before - stats->after : 0;
+    char before[32], after[32], debug[32];
+
+    format_size(stats->before, before, sizeof(before));
+    format_size(stats->after, after, sizeof(after));
+    format_size(stats->debug, debug, sizeof(debug));
+
+    if (stats->files == 0) {
+        printf("%s: no unstripped ELF files\n", name);
+    } else {
+        printf("%s: stripped %d ELF file%s, %s -> %s (-%.0f%%), debug info %s in %s/%s/%s\n",
+               name, stats->files, stats->files == 1 ? "" : "s", before, after,
+               stats->before ? 100.0 * saved / stats->before : 0.0, debug,
+               get_cache_path(), STRIP_DEBUG_DIR, name);
+    }
+    if (stats->failed) {
+        fprintf(stderr, "Warning: %d file%s of %s kept their symbols\n", stats->failed,
+                stats->failed == 1 ? "" : "s", name);
+    }
+}
@@ -0,0 +1,1032 @@
+/*
+ * tpk.c - Binary package files: pack a built prefix, install from one
+ *
+ * Building once and unpacking everywhere else turns a long compile into a
+ * few seconds of I/O. Both directions stream: 'pack' writes the tar
+ * itself, hashing each file while it is copied into the compressor, and
+ * 'install' reads the decompressor's output, writing each member straight
+ * to its place in <cache>/<name>/PKG.new and hashing it on the way. Only
+ * when every hash matches .FILES is PKG.new swapped in for PKG. Nothing is
+ * extracted to a scratch directory and copied.
+ *
+ * The tar is the GNU flavour (long names as ././@LongLink members). The
+ * reader accepts what the writer produces plus plain ustar; members
+ * outside PKG/, absolute paths and ".." are refused, and symlinks are
+ * created last so no file is ever written through one.
+ */
+
+#include "common.h"
+#include "tpk.h"
+#include "build.h"
+#include "gc.h"
+#include "profile.h"
+#include "sha256.h"
+#include "store.h"
+#include <dirent.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+
+#define TAR_BLOCK 512
+#define TPK_META_MAX (1 << 20)      /* .TPKINFO and .MANIFEST */
+#define TPK_FILES_MAX (64 << 20)
+
+/* Regular files seen so far, with their hashes: becomes or checks .FILES */
+struct file_list {
+    char *text;
+    size_t len;
+    size_t cap;
+    size_t count;
+};
+
+/* Hardlinked inodes already written, by their member path */
+struct inode_seen {
+    dev_t dev;
+    ino_t ino;
+    char *path;
+};
+
+struct pack_state {
+    FILE *out;
+    struct file_list files;
+    struct inode_seen *seen;
+    size_t nseen;
+    int failed;
+};
+
+static int list_add(struct file_list *l, const char *hash, const char *path) {
+    size_t need = strlen(hash) + strlen(path) + 3;
+
+    if (l->len + need > l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 8192;
+        char *grown;
+
+        while (cap < l->len + need) cap *= 2;
+        grown = realloc(l->text, cap);
+        if (!grown) {
+            return TINYPKG_ERR;
+        }
+        l->text = grown;
+        l->cap = cap;
+    }
+    l->len += (size_t)sprintf(l->text + l->len, "%s %s\n", hash, path);
+    l->count++;
+    return TINYPKG_OK;
+}
+
+/* Hash listed for path; a hardlink's entry repeats its target's */
+static int list_hash(const struct file_list *l, const char *path, char hex[SHA256_HEX_LEN]) {
+    size_t plen = strlen(path);
+
+    for (const char *line = l->text; line && line < l->text + l->len;) {
+        const char *end = memchr(line, '\n', (size_t)(l->text + l->len - line));
+
+        if (!end) break;
+        if ((size_t)(end - line) == SHA256_HEX_LEN + plen &&
+            memcmp(line + SHA256_HEX_LEN, path, plen) == 0) {
+            memcpy(hex, line, SHA256_HEX_LEN - 1);
+            hex[SHA256_HEX_LEN - 1] = '\0';
+            return TINYPKG_OK;
+        }
+        line = end + 1;
+    }
+    return TINYPKG_NOT_FOUND;
+}
+
+/* The tree digest: sha256 of the list, i.e. of .FILES */
+static void list_digest(const struct file_list *l, char hex[SHA256_HEX_LEN]) {
+    uint8_t digest[SHA256_DIGEST_LEN];
+    struct sha256_ctx ctx;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, l->text ? l->text : "", l->len);
+    sha256_final(&ctx, digest);
+    sha256_to_hex(digest, hex);
+}
+
+/* Run argv with stdin from in_fd and stdout to out_fd */
+static pid_t spawn_filter(char *const argv[], int in_fd, int out_fd, int close_fd) {
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        if (close_fd >= 0) close(close_fd);
+        if ((in_fd != STDIN_FILENO && dup2(in_fd, STDIN_FILENO) < 0) ||
+            (out_fd != STDOUT_FILENO && dup2(out_fd, STDOUT_FILENO) < 0)) {
+            _exit(127);
+        }
+        execvp(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    return pid;
+}
+
+static int wait_filter(pid_t pid) {
+    int status;
+
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return TINYPKG_ERR;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? TINYPKG_OK : TINYPKG_ERR;
+}
+
+/* ============================================================================
+ * Tar writing
+ * ============================================================================
+ */
+
+/* Octal, or GNU base-256 for sizes past 8 GiB */
+static void tar_number(unsigned char *field, size_t len, unsigned long long v) {
+    if (len == 12 && v > 077777777777ULL) {
+        field[0] = 0x80;
+        for (size_t i = len - 1; i > 0; i--) {
+            field[i] = (unsigned char)(v & 0xff);
+            v >>= 8;
+        }
+        return;
+    }
+    for (size_t i = len - 1; i-- > 0;) {
+        field[i] = (unsigned char)('0' + (v & 7));
+        v >>= 3;
+    }
+    field[len - 1] = '\0';
+}
+
+/* A NULL stream only walks the tree, for tpk_digest() */
+static int tar_pad(FILE *out, unsigned long long size) {
+    static const char zeros[TAR_BLOCK];
+    size_t rem = (size_t)(size % TAR_BLOCK);
+
+    return !out || rem == 0 || fwrite(zeros, 1, TAR_BLOCK - rem, out) == TAR_BLOCK - rem
+           ? TINYPKG_OK : TINYPKG_ERR;
+}
+
+static int tar_header(FILE *out, const char *name, char type, unsigned mode,
+                      unsigned long long size, long long mtime, const char *link);
+
+/* ././@LongLink member carrying a name that does not fit 100 bytes */
+static int tar_long(FILE *out, char type, const char *name) {
+    size_t len = strlen(name) + 1;
+
+    if (tar_header(out, "././@LongLink", type, 0, len, 0, NULL) != TINYPKG_OK ||
+        fwrite(name, 1, len, out) != len) {
+        return TINYPKG_ERR;
+    }
+    return tar_pad(out, len);
+}
+
+static int tar_header(FILE *out, const char *name, char type, unsigned mode,
+                      unsigned long long size, long long mtime, const char *link) {
+    unsigned char h[TAR_BLOCK];
+    unsigned sum = 0;
+    size_t len = strlen(name);
+
+    if (!out) {
+        return TINYPKG_OK;
+    }
+    if (len >= 100 && tar_long(out, 'L', name) != TINYPKG_OK) {
+        return TINYPKG_ERR;
+    }
+    if (link && strlen(link) >= 100 && tar_long(out, 'K', link) != TINYPKG_OK) {
+        return TINYPKG_ERR;
+    }
+
+    memset(h, 0, sizeof(h));
+    memcpy(h, name, len < 100 ? len : 99);
+    tar_number(h + 100, 8, mode & 07777);
+    tar_number(h + 108, 8, 0);
+    tar_number(h + 116, 8, 0);
+    tar_number(h + 124, 12, size);
+    tar_number(h + 136, 12, mtime > 0 ? (unsigned long long)mtime : 0);
+    h[156] = (unsigned char)type;
+    if (link) {
+        len = strlen(link);
+        memcpy(h + 157, link, len < 100 ? len : 99);
+    }
+    memcpy(h + 257, "ustar  ", 8);     /* GNU magic and version */
+
+    memset(h + 148, ' ', 8);
+    for (size_t i = 0; i < sizeof(h); i++) {
+        sum += h[i];
+    }
+    tar_number(h + 148, 7, sum);
+
+    return fwrite(h, 1, sizeof(h), out) == sizeof(h) ? TINYPKG_OK : TINYPKG_ERR;
+}
+
+static int tar_text(FILE *out, const char *name, const char *text, size_t len) {
+    if (tar_header(out, name, '0', 0644, len, (long long)time(NULL), NULL) != TINYPKG_OK ||
+        fwrite(text, 1, len, out) != len) {
+        return TINYPKG_ERR;
+    }
+    return tar_pad(out, len);
+}
+
+/* Copy a regular file into the stream, hashing it on the way */
+static int tar_file(struct pack_state *ps, const char *path, const char *member,
+                    const struct stat *st) {
+    unsigned char buf[65536];
+    uint8_t digest[SHA256_DIGEST_LEN];
+    char hex[SHA256_HEX_LEN];
+    struct sha256_ctx ctx;
+    unsigned long long left = (unsigned long long)st->st_size;
+    FILE *in = fopen(path, "rb");
+
+    if (!in) {
+        log_error("tpk_pack", strerror(errno));
+        return TINYPKG_ERR;
+    }
+    if (tar_header(ps->out, member, '0', st->st_mode, left, st->st_mtime, NULL) != TINYPKG_OK) {
+        fclose(in);
+        return TINYPKG_ERR;
+    }
+
+    sha256_init(&ctx);
+    while (left > 0) {
+        size_t want = left < sizeof(buf) ? (size_t)left : sizeof(buf);
+        size_t n = fread(buf, 1, want, in);
+
+        /* A file that shrank mid-pack would corrupt the stream */
+        if (n != want || (ps->out && fwrite(buf, 1, n, ps->out) != n)) {
+            fclose(in);
+            log_error("tpk_pack", "File changed while packing");
+            return TINYPKG_ERR;
+        }
+        sha256_update(&ctx, buf, n);
+        left -= n;
+    }
+    fclose(in);
+
+    sha256_final(&ctx, digest);
+    sha256_to_hex(digest, hex);
+    if (list_add(&ps->files, hex, member) != TINYPKG_OK) {
+        return TINYPKG_ERR;
+    }
+    return tar_pad(ps->out, (unsigned long long)st->st_size);
+}
+
+/* Earlier member sharing this inode, if any; records it otherwise */
+static const char *inode_member(struct pack_state *ps, const struct stat *st,
+                                const char *member) {
+    struct inode_seen *grown;
+
+    for (size_t i = 0; i < ps->nseen; i++) {
+        if (ps->seen[i].dev == st->st_dev && ps->seen[i].ino == st->st_ino) {
+            return ps->seen[i].path;
+        }
+    }
+    grown = realloc(ps->seen, (ps->nseen + 1) * sizeof(*grown));
+    if (grown) {
+        ps->seen = grown;
+        ps->seen[ps->nseen].dev = st->st_dev;
+        ps->seen[ps->nseen].ino = st->st_ino;
+        ps->seen[ps->nseen].path = strdup(member);
+        if (ps->seen[ps->nseen].path) {
+            ps->nseen++;
+        }
+    }
+    return NULL;
+}
+
+/* Directory, then its entries in name order so packs are reproducible */
+static int tar_tree(struct pack_state *ps, const char *path, const char *member) {
+    struct dirent **names;
+    struct stat st;
+    int n;
+
+    if (lstat(path, &st) != 0) {
+        return TINYPKG_ERR;
+    }
+    if (tar_header(ps->out, member, '5', st.st_mode, 0, st.st_mtime, NULL) != TINYPKG_OK) {
+        return TINYPKG_ERR;
+    }
+
+    n = scandir(path, &names, NULL, alphasort);
+    if (n < 0) {
+        return TINYPKG_ERR;
+    }
+
+    for (int i = 0; i < n; i++) {
+        char child[PATH_MAX_LEN], child_member[PATH_MAX_LEN];
+        const char *d = names[i]->d_name;
+
+        if (ps->failed || strcmp(d, ".") == 0 || strcmp(d, "..") == 0 ||
+            snprintf(child, sizeof(child), "%s/%s", path, d) >= (int)sizeof(child) ||
+            snprintf(child_member, sizeof(child_member), "%s/%s", member, d)
+                >= (int)sizeof(child_member) ||
+            lstat(child, &st) != 0) {
+            free(names[i]);
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            if (tar_tree(ps, child, child_member) != TINYPKG_OK) ps->failed = 1;
+        } else if (S_ISLNK(st.st_mode)) {
+            char target[PATH_MAX_LEN];
+            ssize_t len = readlink(child, target, sizeof(target) - 1);
+
+            if (len < 0) {
+                ps->failed = 1;
+            } else {
+                target[len] = '\0';
+                if (tar_header(ps->out, child_member, '2', 0777, 0, st.st_mtime, target)
+                    != TINYPKG_OK) {
+                    ps->failed = 1;
+                }
+            }
+        } else if (S_ISREG(st.st_mode)) {
+            const char *first = st.st_nlink > 1 ? inode_member(ps, &st, child_member) : NULL;
+
+            if (first) {
+                char hex[SHA256_HEX_LEN];
+
+                if (tar_header(ps->out, child_member, '1', st.st_mode, 0, st.st_mtime, first)
+                    != TINYPKG_OK || list_hash(&ps->files, first, hex) != TINYPKG_OK ||
+                    list_add(&ps->files, hex, child_member) != TINYPKG_OK) {
+                    ps->failed = 1;
+                }
+            } else if (tar_file(ps, child, child_member, &st) != TINYPKG_OK) {
+                ps->failed = 1;
+            }
+        }
+        free(names[i]);
+    }
+    free(names);
+
+    return ps->failed ? TINYPKG_ERR : TINYPKG_OK;
+}
+
+int tpk_pack(const char *name, const char *out) {
+    char prefix[PATH_MAX_LEN], manifest_path[PATH_MAX_LEN];
+    char version[64], profile[32], key[128];
+    char dest[PATH_MAX_LEN], tmp[PATH_MAX_LEN + 8];
+    char info[1024];
+    char *manifest, *zstd[] = { "zstd", "-q", "-c", "-T0", NULL };
+    char *gzip[] = { "gzip", "-c", NULL };
+    struct pack_state ps;
+    struct utsname uts;
+    struct stat st;
+    size_t manifest_len = 0;
+    int pipefd[2], fd, ret = TINYPKG_ERR;
+    pid_t pid;
+
+    if (!name || !is_valid_package_name(name)) {
+        log_error("tpk_pack", "Invalid package name");
+        return TINYPKG_ERR;
+    }
+
+    snprintf(prefix, sizeof(prefix), "%s/%s/PKG", get_tinypkg_dir(), name);
+    if (stat(prefix, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Error: %s is not built. Run 'tinypkg build %s' first\n", name, name);
+        return TINYPKG_NOT_FOUND;
+    }
+    if (profile_built(name, version, sizeof(version), profile, sizeof(profile)) != TINYPKG_OK) {
+        log_error("tpk_pack", "Prefix predates build records; rebuild it first");
+        return TINYPKG_ERR;
+    }
+
+    profile_key(version, profile, key, sizeof(key));
+    if (out) {
+        snprintf(dest, sizeof(dest), "%s", out);
+    } else {
+        snprintf(dest, sizeof(dest), "%s-%s%s", name, key, TPK_EXT);
+    }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", dest);
+
+    uname(&uts);
+    snprintf(info, sizeof(info), "%s\nname %s\nversion %s\nprofile %s\narch %s\n",
+             TPK_MAGIC, name, version, profile, uts.machine);
+    snprintf(manifest_path, sizeof(manifest_path), "%s/repo/packages/%s/manifest.yaml",
+             get_cache_path(), name);
+    /* Left out, never cut short, past TPK_META_MAX */
+    manifest = slurp(manifest_path, TPK_META_MAX, &manifest_len);
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || pipe(pipefd) != 0) {
+        log_error("tpk_pack", strerror(errno));
+        if (fd >= 0) close(fd);
+        free(manifest);
+        return TINYPKG_ERR;
+    }
+
+    /* The compressor writes the file; we write the tar into it */
+    pid = spawn_filter(in_path("zstd") ? zstd : gzip, pipefd[0], fd, pipefd[1]);
+    close(pipefd[0]);
+    close(fd);
+    if (pid < 0) {
+        close(pipefd[1]);
+        free(manifest);
+        unlink(tmp);
+        return TINYPKG_ERR;
+    }
+
+    memset(&ps, 0, sizeof(ps));
+    ps.out = fdopen(pipefd[1], "wb");
+    if (ps.out &&
+        tar_text(ps.out, TPK_INFO, info, strlen(info)) == TINYPKG_OK &&
+        (!manifest || tar_text(ps.out, TPK_MANIFEST, manifest, manifest_len) == TINYPKG_OK) &&
+        tar_tree(&ps, prefix, "PKG") == TINYPKG_OK &&
+        tar_text(ps.out, TPK_FILES, ps.files.text ? ps.files.text : "", ps.files.len)
+            == TINYPKG_OK) {
+        static const char end[2 * TAR_BLOCK];
+        if (fwrite(end, 1, sizeof(end), ps.out) == sizeof(end)) {
+            ret = TINYPKG_OK;
+        }
+    }
+    if (ps.out) {
+        if (fclose(ps.out) != 0) ret = TINYPKG_ERR;
+    } else {
+        close(pipefd[1]);
+    }
+    if (wait_filter(pid) != TINYPKG_OK) {
+        ret = TINYPKG_ERR;
+    }
+
+    if (ret == TINYPKG_OK && rename(tmp, dest) != 0) {
+        log_error("tpk_pack", strerror(errno));
+        ret = TINYPKG_ERR;
+    }
+    if (ret != TINYPKG_OK) {
+        unlink(tmp);
+        fprintf(stderr, "Error: Failed to pack %s\n", name);
+    } else if (stat(dest, &st) == 0) {
+        printf("✓ Packed %s %s (%s): %zu files, %.1f MiB in %s\n", name, version, profile,
+               ps.files.count, st.st_size / 1048576.0, dest);
+    }
+
+    for (size_t i = 0; i < ps.nseen; i++) {
+        free(ps.seen[i].path);
+    }
+    free(ps.seen);
+    free(ps.files.text);
+    free(manifest);
+    return ret;
+}
+
+/* ============================================================================
+ * Tar reading
+ * ============================================================================
+ */
+
+struct unpack_state {
+    FILE *in;
+    char name[128];
+    char version[64];
+    char profile[32];
+    char dest[PATH_MAX_LEN];            /* <cache>/<name>/PKG.new */
+    struct file_list files;             /* Computed while writing */
+    char *expected;                     /* .FILES as received */
+    size_t expected_len;
+    char **links;                       /* Deferred symlinks: path, target pairs */
+    size_t nlinks;
+};
+
+static int read_exact(FILE *in, void *buf, size_t len) {
+    return fread(buf, 1, len, in) == len ? TINYPKG_OK : TINYPKG_ERR;
+}
+
+static int skip_data(FILE *in, unsigned long long size) {
+    char buf[TAR_BLOCK];
+    unsigned long long left = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+
+    while (left > 0) {
+        if (read_exact(in, buf, TAR_BLOCK) != TINYPKG_OK) return TINYPKG_ERR;
+        left -= TAR_BLOCK;
+    }
+    return TINYPKG_OK;
+}
+
+/* The zeros after size bytes of member data */
+static int skip_pad(FILE *in, unsigned long long size) {
+    char buf[TAR_BLOCK];
+    size_t rem = (size_t)(size % TAR_BLOCK);
+
+    return rem == 0 ? TINYPKG_OK : read_exact(in, buf, TAR_BLOCK - rem);
+}
+
+/* Member data of at most max bytes into a new string */
+static char *read_text(FILE *in, unsigned long long size, size_t max) {
+    char *buf;
+
+    if (size > max || !(buf = malloc((size_t)size + 1))) {
+        return NULL;
+    }
+    if (read_exact(in, buf, (size_t)size) != TINYPKG_OK ||
+        skip_pad(in, size) != TINYPKG_OK) {
+        free(buf);
+        return NULL;
+    }
+    buf[size] = '\0';
+    return buf;
+}
+
+static unsigned long long parse_number(const unsigned char *field, size_t len) {
+    unsigned long long v = 0;
+    size_t i = 0;
+
+    if (field[0] & 0x80) {
+        for (i = 1; i < len; i++) {
+            v = (v << 8) | field[i];
+        }
+        return v;
+    }
+    while (i < len && field[i] == ' ') i++;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) {
+        v = (v << 3) | (unsigned)(field[i] - '0');
+    }
+    return v;
+}
+
+static int header_ok(const unsigned char *h) {
+    unsigned sum = 0;
+
+    for (size_t i = 0; i < TAR_BLOCK; i++) {
+        sum += (i >= 148 && i < 156) ? ' ' : h[i];
+    }
+    return sum == parse_number(h + 148, 8);
+}
+
+/* "PKG/<rel>" with no absolute or ".." components; rel may be empty */
+static const char *member_rel(const char *member) {
+    const char *p;
+
+    if (strcmp(member, "PKG") == 0 || strcmp(member, "PKG/") == 0) {
+        return "";
+    }
+    if (strncmp(member, "PKG/", 4) != 0) {
+        return NULL;
+    }
+    for (p = member + 4; *p; ) {
+        size_t len = strcspn(p, "/");
+        if (len == 0 || (len == 2 && strncmp(p, "..", 2) == 0)) {
+            return NULL;
+        }
+        p += len + (p[len] == '/');
+    }
+    return member + 4;
+}
+
+static int parse_info(struct unpack_state *us, const char *text) {
+    struct utsname uts;
+    char arch[64] = "";
+    const char *line = text;
+
+    if (strncmp(text, TPK_MAGIC "\n", strlen(TPK_MAGIC) + 1) != 0) {
+        log_error("tpk_install", "Not a tinypkg package, or a newer format");
+        return TINYPKG_ERR;
+    }
+    while ((line = strchr(line, '\n')) != NULL) {
+        line++;
+        sscanf(line, "name %127s", us->name);
+        sscanf(line, "version %63s", us->version);
+        sscanf(line, "profile %31s", us->profile);
+        sscanf(line, "arch %63s", arch);
+    }
+
+    if (!is_valid_package_name(us->name) || !us->version[0] || !profile_find(us->profile)) {
+        log_error("tpk_install", "Package info is incomplete");
+        return TINYPKG_ERR;
+    }
+    uname(&uts);
+    if (strcmp(arch, uts.machine) != 0) {
+        fprintf(stderr, "Error: %s was built for %s, this is %s\n", us->name, arch,
+                uts.machine);
+        return TINYPKG_ERR;
+    }
+    return TINYPKG_OK;
+}
+
+/* Write one regular file member in place, hashing it */
+static int unpack_file(struct unpack_state *us, const char *member, const char *path,
+                       unsigned mode, unsigned long long size, long long mtime) {
+    unsigned char buf[65536];
+    uint8_t digest[SHA256_DIGEST_LEN];
+    char hex[SHA256_HEX_LEN];
+    struct sha256_ctx ctx;
+    struct timespec times[2];
+    unsigned long long left = size;
+    int fd;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, (mode & 07777) | S_IWUSR);
+    if (fd < 0) {
+        log_error("tpk_install", strerror(errno));
+        return TINYPKG_ERR;
+    }
+
+    sha256_init(&ctx);
+    while (left > 0) {
+        size_t n = left < sizeof(buf) ? (size_t)left : sizeof(buf);
+        if (read_exact(us->in, buf, n) != TINYPKG_OK || write(fd, buf, n) != (ssize_t)n) {
+            close(fd);
+            log_error("tpk_install", "Truncated package or write error");
+            return TINYPKG_ERR;
+        }
+        sha256_update(&ctx, buf, n);
+        left -= n;
+    }
+
+    times[0].tv_sec = times[1].tv_sec = (time_t)mtime;
+    times[0].tv_nsec = times[1].tv_nsec = 0;
+    futimens(fd, times);
+    if (!(mode & S_IWUSR)) {
+        fchmod(fd, mode & 07777);
+    }
+    if (close(fd) != 0) {
+        return TINYPKG_ERR;
+    }
+
+    sha256_final(&ctx, digest);
+    sha256_to_hex(digest, hex);
+    if (list_add(&us->files, hex, member) != TINYPKG_OK) {
+        return TINYPKG_ERR;
+    }
+    return skip_pad(us->in, size);
+}
+
+/* Every directory between dest and path must be a real directory */
+static int parents_safe(const char *dest, const char *rel) {
+    char path[PATH_MAX_LEN];
+    const char *slash = rel;
+    struct stat st;
+
+    while ((slash = strchr(slash, '/')) != NULL) {
+        snprintf(path, sizeof(path), "%s/%.*s", dest, (int)(slash - rel), rel);
+        if (lstat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            return 0;
+        }
+        slash++;
+    }
+    return 1;
+}
+
+static int make_parent(const char *path) {
+    char dir[PATH_MAX_LEN];
+    char *slash;
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    slash = strrchr(dir, '/');
+    if (!slash) {
+        return TINYPKG_OK;
+    }
+    *slash = '\0';
+    return mkdir_p(dir);
+}
+
+static int defer_link(struct unpack_state *us, const char *rel, const char *target) {
+    char **grown = realloc(us->links, (us->nlinks + 2) * sizeof(*grown));
+
+    if (!grown) {
+        return TINYPKG_ERR;
+    }
+    us->links = grown;
+    us->links[us->nlinks] = strdup(rel);
+    us->links[us->nlinks + 1] = strdup(target);
+    us->nlinks += 2;
+    return us->links[us->nlinks - 2] && us->links[us->nlinks - 1] ? TINYPKG_OK : TINYPKG_ERR;
+}
+
+/* One member; name and link are the full (possibly long) names */
+static int unpack_member(struct unpack_state *us, const unsigned char *h, const char *name,
+                         const char *linkname, int *members) {
+    unsigned long long size = parse_number(h + 124, 12);
+    unsigned mode = (unsigned)parse_number(h + 100, 8);
+    long long mtime = (long long)parse_number(h + 136, 12);
+    char type = (char)h[156];
+    char path[PATH_MAX_LEN + 8];
+    const char *rel;
+
+    /* .TPKINFO first: it says where everything else goes */
+    if ((*members)++ == 0) {
+        char *text = strcmp(name, TPK_INFO) == 0 ? read_text(us->in, size, TPK_META_MAX) : NULL;
+        int ret = text ? parse_info(us, text) : TINYPKG_ERR;
+
+        free(text);
+        if (ret != TINYPKG_OK) {
+            if (!text) log_error("tpk_install", "Not a tinypkg package");
+            return TINYPKG_ERR;
+        }
+        snprintf(us->dest, sizeof(us->dest), "%s/%s/PKG.new", get_tinypkg_dir(), us->name);
+        remove_tree(us->dest);
+        return mkdir_p(us->dest);
+    }
+
+    if (strcmp(name, TPK_FILES) == 0) {
+        free(us->expected);
+        us->expected = read_text(us->in, size, TPK_FILES_MAX);
+        us->expected_len = us->expected ? (size_t)size : 0;
+        return us->expected ? TINYPKG_OK : TINYPKG_ERR;
+    }
+
+    if (strcmp(name, TPK_MANIFEST) == 0) {
+        char *text = read_text(us->in, size, TPK_META_MAX);
+        char dst[PATH_MAX_LEN];
+        FILE *f;
+
+        if (!text) return TINYPKG_ERR;
+        snprintf(dst, sizeof(dst), "%s/%s/%s", get_tinypkg_dir(), us->name, TPK_MANIFEST_FILE);
+        f = fopen(dst, "w");
+        if (f) {
+            fputs(text, f);
+            fclose(f);
+        }
+        free(text);
+        return TINYPKG_OK;
+    }
+
+    rel = member_rel(name);
+    if (!rel) {
+        fprintf(stderr, "Error: Refusing package member '%s'\n", name);
+        return TINYPKG_ERR;
+    }
+    snprintf(path, sizeof(path), "%s%s%s", us->dest, *rel ? "/" : "", rel);
+
+    switch (type) {
+    case '0': case '\0': case '7':
+        if (make_parent(path) != TINYPKG_OK) return TINYPKG_ERR;
+        return unpack_file(us, name, path, mode, size, mtime);
+    case '5':
+        return mkdir_p(path) == TINYPKG_OK ? skip_data(us->in, size) : TINYPKG_ERR;
+    case '2':
+        return defer_link(us, rel, linkname) == TINYPKG_OK ? skip_data(us->in, size) : TINYPKG_ERR;
+    case '1': {
+        const char *target_rel = member_rel(linkname);
+        char target[PATH_MAX_LEN + 8];
+
+        if (!target_rel || !*target_rel) {
+            fprintf(stderr, "Error: Refusing hard link to '%s'\n", linkname);
+            return TINYPKG_ERR;
+        }
+        snprintf(target, sizeof(target), "%s/%s", us->dest, target_rel);
+        char hex[SHA256_HEX_LEN];
+
+        if (list_hash(&us->files, linkname, hex) != TINYPKG_OK) {
+            fprintf(stderr, "Error: Hard link to '%s' precedes it\n", linkname);
+            return TINYPKG_ERR;
+        }
+        if (make_parent(path) != TINYPKG_OK || link(target, path) != 0) {
+            log_error("tpk_install", strerror(errno));
+            return TINYPKG_ERR;
+        }
+        if (list_add(&us->files, hex, name) != TINYPKG_OK) {
+            return TINYPKG_ERR;
+        }
+        return skip_data(us->in, size);
+    }
+    default:
+        fprintf(stderr, "Warning: Skipping unsupported member '%s'\n", name);
+        return skip_data(us->in, size);
+    }
+}
+
+static int unpack_stream(struct unpack_state *us) {
+    unsigned char h[TAR_BLOCK];
+    char *long_name = NULL, *long_link = NULL;
+    int members = 0, ret = TINYPKG_ERR;
+
+    for (;;) {
+        char name[PATH_MAX_LEN], linkname[PATH_MAX_LEN];
+        unsigned long long size;
+        size_t i;
+
+        if (read_exact(us->in, h, sizeof(h)) != TINYPKG_OK) {
+            log_error("tpk_install", "Truncated package");
+            break;
+        }
+        for (i = 0; i < sizeof(h) && h[i] == 0; i++);
+        if (i == sizeof(h)) {
+            ret = members > 0 ? TINYPKG_OK : TINYPKG_ERR;   /* End of archive */
+            break;
+        }
+        if (!header_ok(h)) {
+            log_error("tpk_install", "Corrupt package (bad header checksum)");
+            break;
+        }
+        size = parse_number(h + 124, 12);
+
+        if (h[156] == 'L' || h[156] == 'K') {
+            char **dst = h[156] == 'L' ? &long_name : &long_link;
+            free(*dst);
+            *dst = read_text(us->in, size, PATH_MAX_LEN - 1);
+            if (!*dst) break;
+            continue;
+        }
+        if (h[156] == 'x' || h[156] == 'g') {
+            if (skip_data(us->in, size) != TINYPKG_OK) break;
+            continue;
+        }
+
+        /* POSIX ustar keeps long paths split into prefix and name */
+        if (long_name) {
+            snprintf(name, sizeof(name), "%s", long_name);
+        } else if (memcmp(h + 257, "ustar\0", 6) == 0 && h[345]) {
+            snprintf(name, sizeof(name), "%.155s/%.100s", (const char *)h + 345,
+                     (const char *)h);
+        } else {
+            snprintf(name, sizeof(name), "%.100s", (const char *)h);
+        }
+        if (long_link) {
+            snprintf(linkname, sizeof(linkname), "%s", long_link);
+        } else {
+            snprintf(linkname, sizeof(linkname), "%.100s", (const char *)h + 157);
+        }
+        free(long_name);
+        free(long_link);
+        long_name = long_link = NULL;
+
+        /* "./PKG/..." from hand-made archives */
+        if (unpack_member(us, h, strncmp(name, "./", 2) == 0 ? name + 2 : name, linkname,
+                          &members) != TINYPKG_OK) {
+            break;
+        }
+    }
+
+    free(long_name);
+    free(long_link);
+    return ret;
+}
+
+/* The hashes written must be exactly the ones the packer listed */
+static int verify_files(const struct unpack_state *us) {
+    if (!us->expected) {
+        log_error("tpk_install", "Package has no file list");
+        return TINYPKG_ERR;
+    }
+    if (us->expected_len != us->files.len ||
+        (us->files.len && memcmp(us->expected, us->files.text, us->files.len) != 0)) {
+        log_error("tpk_install", "Package contents do not match its file list");
+        return TINYPKG_ERR;
+    }
+    return TINYPKG_OK;
+}
+
+/* Symlinks last, and never beneath another symlink */
+static int create_links(const struct unpack_state *us) {
+    for (size_t i = 0; i < us->nlinks; i += 2) {
+        char path[PATH_MAX_LEN + 8];
+
+        snprintf(path, sizeof(path), "%s/%s", us->dest, us->links[i]);
+        if (make_parent(path) != TINYPKG_OK || !parents_safe(us->dest, us->links[i]) ||
+            symlink(us->links[i + 1], path) != 0) {
+            fprintf(stderr, "Error: Could not create link %s\n", us->links[i]);
+            return TINYPKG_ERR;
+        }
+    }
+    return TINYPKG_OK;
+}
+
+/* PKG.new becomes PKG */
+static int swap_prefix(const struct unpack_state *us) {
+    char prefix[PATH_MAX_LEN], old[PATH_MAX_LEN + 8];
+
+    snprintf(prefix, sizeof(prefix), "%s/%s/PKG", get_tinypkg_dir(), us->name);
+    snprintf(old, sizeof(old), "%s.old", prefix);
+
+    remove_tree(old);
+    if (rename(prefix, old) != 0 && errno != ENOENT) {
+        log_error("tpk_install", strerror(errno));
+        return TINYPKG_ERR;
+    }
+    if (rename(us->dest, prefix) != 0) {
+        log_error("tpk_install", strerror(errno));
+        rename(old, prefix);
+        return TINYPKG_ERR;
+    }
+    remove_tree(old);
+    return TINYPKG_OK;
+}
+
+int tpk_is_file(const char *arg) {
+    size_t len = strlen(arg), ext = strlen(TPK_EXT);
+    return strchr(arg, '/') != NULL || (len > ext && strcmp(arg + len - ext, TPK_EXT) == 0);
+}
+
+int tpk_digest(const char *name, char hex[SHA256_HEX_LEN]) {
+    char prefix[PATH_MAX_LEN];
+    struct pack_state ps;
+    int ret;
+
+    snprintf(prefix, sizeof(prefix), "%s/%s/PKG", get_tinypkg_dir(), name);
+    memset(&ps, 0, sizeof(ps));
+
+    ret = tar_tree(&ps, prefix, "PKG");
+    if (ret == TINYPKG_OK) {
+        list_digest(&ps.files, hex);
+    }
+
+    for (size_t i = 0; i < ps.nseen; i++) {
+        free(ps.seen[i].path);
+    }
+    free(ps.seen);
+    free(ps.files.text);
+    return ret;
+}
+
+int tpk_unpack(const char *path, struct tpk_info *info) {
+    char *zstd[] = { "zstd", "-q", "-d", "-c", "--", (char *)path, NULL };
+    char *gzip[] = { "gzip", "-d", "-c", "--", (char *)path, NULL };
+    unsigned char magic[4] = { 0 };
+    struct unpack_state us;
+    struct timespec t0, t1;
+    int pipefd[2], ret;
+    pid_t pid;
+    FILE *f;
+
+    f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", path, strerror(errno));
+        return TINYPKG_ERR;
+    }
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic)) {
+        magic[0] = 0;
+    }
+    fclose(f);
+
+    if (!(magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) &&
+        !(magic[0] == 0x1f && magic[1] == 0x8b)) {
+        fprintf(stderr, "Error: %s is not a package file\n", path);
+        return TINYPKG_ERR;
+    }
+    if (magic[0] == 0x28 && !in_path("zstd")) {
+        fprintf(stderr, "Error: %s is zstd-compressed; install zstd\n", path);
+        return TINYPKG_ERR;
+    }
+
+    if (pipe(pipefd) != 0) {
+        log_error("tpk_install", strerror(errno));
+        return TINYPKG_ERR;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pid = spawn_filter(magic[0] == 0x28 ? zstd : gzip, STDIN_FILENO, pipefd[1], pipefd[0]);
+    close(pipefd[1]);
+    if (pid < 0) {
+        close(pipefd[0]);
+        return TINYPKG_ERR;
+    }
+
+    memset(&us, 0, sizeof(us));
+    us.in = fdopen(pipefd[0], "rb");
+    ret = us.in ? unpack_stream(&us) : TINYPKG_ERR;
+
+    /* Stop a decompressor still writing after an error */
+    if (ret != TINYPKG_OK) {
+        kill(pid, SIGTERM);
+    }
+    if (us.in) {
+        fclose(us.in);
+    } else {
+        close(pipefd[0]);
+    }
+    if (wait_filter(pid) != TINYPKG_OK && ret == TINYPKG_OK) {
+        log_error("tpk_install", "Decompression failed");
+        ret = TINYPKG_ERR;
+    }
+
+    if (ret == TINYPKG_OK) ret = verify_files(&us);
+    if (ret == TINYPKG_OK) ret = create_links(&us);
+    if (ret == TINYPKG_OK) ret = swap_prefix(&us);
+
+    if (ret != TINYPKG_OK) {
+        if (us.dest[0]) remove_tree(us.dest);
+        fprintf(stderr, "Error: Failed to install %s\n", path);
+    } else {
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        printf("✓ Unpacked %s %s (%s): %zu files in %.2fs\n", us.name, us.version,
+               us.profile, us.files.count,
+               (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+        if (strcmp(us.profile, PROFILE_DEFAULT) != 0) {
+            printf("Note: built with the %s profile, tuned for the CPU it was built on\n",
+                   us.profile);
+        }
+
+        /* From here on it is the same as a prefix built locally */
+        profile_record_built(us.name, us.version, us.profile);
+        gc_record(GC_KIND_ARTIFACT, us.name);
+
+        if (info) {
+            snprintf(info->name, sizeof(info->name), "%s", us.name);
+            snprintf(info->version, sizeof(info->version), "%s", us.version);
+            snprintf(info->profile, sizeof(info->profile), "%s", us.profile);
+            list_digest(&us.files, info->digest);
+        }
+    }
+
+    for (size_t i = 0; i < us.nlinks; i++) {
+        free(us.links[i]);
+    }
+    free(us.links);
+    free(us.files.text);
+    free(us.expected);
+    return ret;
+}
+
+int tpk_install(const char *path) {
+    struct tpk_info info;
+
+    if (tpk_unpack(path, &info) != TINYPKG_OK) {
+        return TINYPKG_ERR;
+    }
+    if (store_enabled() && store_ingest(info.name) != TINYPKG_OK) {
+        log_warn("Store deduplication incomplete");
+    }
+    return install_package(info.name) == 0 ? TINYPKG_OK : TINYPKG_ERR;
+}
@@ -3,6 +3,9 @@
  * 
  * Reads from cached repository data (~/.cache/tinypkg/)
  * Performs searches and displays package metadata
+ *
+ * index.yaml and installed.db are parsed once into a catalog; the one-shot
+ * commands load it per call, the daemon and batch mode keep it resident.
  * 
  * IMPROVEMENTS:
  * - Centralized path management via common.c
@@ -12,6 +15,8 @@
 
 #include "common.h"
 #include "util.h"
+#include "build.h"
+#include "metrics.h"
 
 /* Convert string to lowercase for case-insensitive search */
 static char* strlower(char *dest, size_t dest_size, const char *str) {
@@ -26,248 +31,554 @@ static char* strlower(char *dest, size_t dest_size, const char *str) {
     return dest;
 }
 
-/* Search for packages matching term (case-insensitive) */
-int util_search(const char *term) {
+/* ============================================================================
+ * Catalog loading
+ * ============================================================================
+ */
+
+static const struct catalog *sort_cat;
+
+static int by_name_cmp(const void *a, const void *b) {
+    const size_t *ia = a;
+    const size_t *ib = b;
+    return strcmp(sort_cat->entries[*ia].name, sort_cat->entries[*ib].name);
+}
+
+static int installed_cmp(const void *a, const void *b) {
+    const struct installed_entry *ea = a;
+    const struct installed_entry *eb = b;
+    return strcmp(ea->name, eb->name);
+}
+
+/* Parse the packages: section of the cached index.yaml */
+static int catalog_load_index(struct catalog *cat) {
     char *cache = get_cache_path();
     char index_path[PATH_MAX_LEN];
+    char line[LINE_MAX_LEN];
+    struct catalog_entry *cur = NULL;
+    size_t cap = 0;
+    int in_packages = 0;
     FILE *f;
+
+    snprintf(index_path, PATH_MAX_LEN, "%s/index.yaml", cache);
+
+    f = fopen(index_path, "r");
+    if (!f) {
+        log_error("catalog_load", "Repository not synced - run 'tinypkg repo sync' first");
+        return TINYPKG_ERR;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        if (!in_packages) {
+            if (strncmp(line, "packages:", 9) == 0) {
+                in_packages = 1;
+            }
+            continue;
+        }
+
+        /* Package entry: 2-space indent, name followed by colon */
+        if (line[0] == ' ' && line[1] == ' ' && line[2] != ' ' &&
+            line[2] != '\n' && line[2] != '\0') {
+            if (cat->count == cap) {
+                size_t new_cap = cap ? cap * 2 : 64;
+                struct catalog_entry *p = realloc(cat->entries, new_cap * sizeof(*p));
+                if (!p) {
+                    log_error("catalog_load", strerror(errno));
+                    fclose(f);
+                    return TINYPKG_ERR;
+                }
+                cat->entries = p;
+                cap = new_cap;
+            }
+
+            cur = &cat->entries[cat->count];
+            memset(cur, 0, sizeof(*cur));
+            if (sscanf(line + 2, "%127[^:]:", cur->name) == 1) {
+                cat->count++;
+            } else {
+                cur = NULL;
+            }
+            continue;
+        }
+
+        /* Package properties: deeper indent */
+        if (cur && line[0] == ' ') {
+            char *p = line;
+            while (*p == ' ') p++;
+
+            if (strncmp(p, "version:", 8) == 0 || strncmp(p, "latest:", 7) == 0) {
+                sscanf(p, "%*[^:]:%*[ ]%63s", cur->version);
+            } else if (strncmp(p, "description:", 12) == 0) {
+                sscanf(p, "%*[^:]:%*[ ]%255[^\n]", cur->desc);
+            }
+            continue;
+        }
+
+        /* Any other top-level key ends the packages section */
+        if (line[0] != ' ' && line[0] != '\n' && line[0] != '#') {
+            in_packages = 0;
+            cur = NULL;
+        }
+    }
+
+    fclose(f);
+    return TINYPKG_OK;
+}
+
+/* Load installed.db ("<name> <version> [<profile>]" per line) */
+static int catalog_load_installed(struct catalog *cat) {
+    char db_path[PATH_MAX_LEN];
     char line[LINE_MAX_LEN];
-    char term_lower[128];
-    int found = 0;
-    struct stat st;
-    
-    if (!term || !term[0]) {
-        log_error("util_search", "Search term required");
+    size_t cap = 0;
+    FILE *f;
+
+    snprintf(db_path, PATH_MAX_LEN, "%s/installed.db", get_tinypkg_dir());
+
+    f = fopen(db_path, "r");
+    if (!f) {
+        return TINYPKG_OK;  /* Nothing installed yet */
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        struct installed_entry e;
+
+        memset(&e, 0, sizeof(e));
+        if (sscanf(line, "%127s %63s %31s", e.name, e.version, e.profile) < 1) {
+            continue;
+        }
+
+        if (cat->installed_count == cap) {
+            size_t new_cap = cap ? cap * 2 : 32;
+            struct installed_entry *p = realloc(cat->installed, new_cap * sizeof(*p));
+            if (!p) {
+                fclose(f);
+                return TINYPKG_ERR;
+            }
+            cat->installed = p;
+            cap = new_cap;
+        }
+        cat->installed[cat->installed_count++] = e;
+    }
+
+    fclose(f);
+
+    if (cat->installed_count > 0) {
+        qsort(cat->installed, cat->installed_count,
+              sizeof(*cat->installed), installed_cmp);
+    }
+    return TINYPKG_OK;
+}
+
+int catalog_load(struct catalog *cat) {
+    if (!cat) {
         return TINYPKG_ERR;
     }
-    
-    if (!cache) {
-        log_error("util_search", "Failed to get cache path");
+
+    memset(cat, 0, sizeof(*cat));
+
+    if (!get_cache_path()) {
+        log_error("catalog_load", "Failed to get cache path");
         return TINYPKG_ERR;
     }
-    
-    snprintf(index_path, PATH_MAX_LEN, "%s/index.yaml", cache);
-    
-    /* Check if cache exists */
-    if (stat(index_path, &st) != 0) {
-        log_error("util_search", "Repository not synced - run 'tinypkg repo sync' first");
+
+    if (catalog_load_index(cat) != TINYPKG_OK ||
+        catalog_load_installed(cat) != TINYPKG_OK) {
+        catalog_free(cat);
         return TINYPKG_ERR;
     }
-    
-    f = fopen(index_path, "r");
-    if (!f) {
-        log_error("util_search", "Could not open index");
+
+    /* Name lookup table; list output keeps index order */
+    if (cat->count > 0) {
+        cat->by_name = malloc(cat->count * sizeof(*cat->by_name));
+        if (!cat->by_name) {
+            catalog_free(cat);
+            return TINYPKG_ERR;
+        }
+        for (size_t i = 0; i < cat->count; i++) {
+            cat->by_name[i] = i;
+        }
+        sort_cat = cat;
+        qsort(cat->by_name, cat->count, sizeof(*cat->by_name), by_name_cmp);
+        sort_cat = NULL;
+    }
+
+    return TINYPKG_OK;
+}
+
+void catalog_free(struct catalog *cat) {
+    if (!cat) {
+        return;
+    }
+    for (size_t i = 0; i < cat->count; i++) {
+        free(cat->entries[i].manifest);
+    }
+    free(cat->entries);
+    free(cat->by_name);
+    free(cat->installed);
+    memset(cat, 0, sizeof(*cat));
+}
+
+static struct catalog_entry *catalog_find(const struct catalog *cat, const char *name) {
+    size_t lo = 0, hi = cat->count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        struct catalog_entry *e = &cat->entries[cat->by_name[mid]];
+        int c = strcmp(name, e->name);
+
+        if (c == 0) {
+            return e;
+        }
+        if (c < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return NULL;
+}
+
+/* ============================================================================
+ * Queries
+ * ============================================================================
+ */
+
+/* Search for packages matching term (case-insensitive) */
+int catalog_search(const struct catalog *cat, const char *term, FILE *out) {
+    char term_lower[128];
+    int found = 0;
+
+    if (!term || !term[0]) {
+        log_error("util_search", "Search term required");
         return TINYPKG_ERR;
     }
-    
+
     if (!strlower(term_lower, sizeof(term_lower), term)) {
         log_error("util_search", "Search term too long");
-        fclose(f);
         return TINYPKG_ERR;
     }
-    
-    printf("Searching for '%s'...\n\n", term);
-    
-    int in_packages = 0;
-    while (fgets(line, sizeof(line), f)) {
-        char *p = line;
-        
-        /* Skip leading whitespace */
-        while (*p && (*p == ' ' || *p == '\t')) p++;
-        
-        if (!in_packages && strncmp(p, "packages:", 9) == 0) {
-            in_packages = 1;
+
+    fprintf(out, "Searching for '%s'...\n\n", term);
+
+    for (size_t i = 0; i < cat->count; i++) {
+        const struct catalog_entry *e = &cat->entries[i];
+        char name_lower[128];
+
+        if (!strlower(name_lower, sizeof(name_lower), e->name)) {
             continue;
         }
-        
-        if (!in_packages) continue;
-        
-        /* Check for package name (2-space indent, followed by colon) */
-        if (line[0] == ' ' && line[1] == ' ' && line[2] != ' ' && line[2] != '\0') {
-            char name[128] = {0};
-            char version[64] = {0};
-            char desc[256] = {0};
-            char name_lower[128];
-            
-            if (sscanf(line + 2, "%127[^:]:", name) == 1) {
-                if (!strlower(name_lower, sizeof(name_lower), name)) {
-                    continue;
-                }
-                
-                /* Read following lines for version and description */
-                char next_line[LINE_MAX_LEN];
-                while (fgets(next_line, sizeof(next_line), f)) {
-                    if (next_line[0] != ' ' || next_line[1] != ' ' || next_line[2] == ' ') {
-                        break;
-                    }
-                    
-                    if (strstr(next_line, "version:")) {
-                        sscanf(next_line, "%*[^:]:%*[ ]%63s", version);
-                    }
-                    
-                    if (strstr(next_line, "description:")) {
-                        sscanf(next_line, "%*[^:]:%*[ ]%255[^\n]", desc);
-                    }
-                }
-                
-                /* Check if name or description matches search term */
-                if (strstr(name_lower, term_lower) || strstr(desc, term)) {
-                    printf(" %s (%s)\n", name, version[0] ? version : "unknown");
-                    if (desc[0]) {
-                        printf(" %s\n", desc);
-                    }
-                    printf("\n");
-                    found++;
-                }
+
+        /* Check if name or description matches search term */
+        if (strstr(name_lower, term_lower) || strstr(e->desc, term)) {
+            fprintf(out, " %s (%s)\n", e->name, e->version[0] ? e->version : "unknown");
+            if (e->desc[0]) {
+                fprintf(out, " %s\n", e->desc);
             }
+            fprintf(out, "\n");
+            found++;
         }
     }
-    
-    fclose(f);
-    
+
     if (found == 0) {
-        printf("No packages found matching '%s'\n", term);
+        fprintf(out, "No packages found matching '%s'\n", term);
         return TINYPKG_ERR;
-    } else {
-        printf("Found %d package(s)\n", found);
-        return TINYPKG_OK;
     }
+
+    fprintf(out, "Found %d package(s)\n", found);
+    return TINYPKG_OK;
 }
 
-/* Display detailed information about a package */
-int util_info(const char *name) {
+/* Read and format a manifest for display */
+static char *load_manifest_text(const char *name, int *status) {
     char *cache = get_cache_path();
     char manifest_path[PATH_MAX_LEN];
-    FILE *f;
     char line[LINE_MAX_LEN];
-    struct stat st;
-    
-    if (!name || !name[0]) {
-        log_error("util_info", "Package name required");
-        return TINYPKG_ERR;
-    }
-    
-    if (!is_valid_package_name(name)) {
-        log_error("util_info", "Invalid package name");
-        return TINYPKG_ERR;
-    }
-    
-    if (!cache) {
-        log_error("util_info", "Failed to get cache path");
-        return TINYPKG_ERR;
-    }
-    
-    snprintf(manifest_path, PATH_MAX_LEN, "%s/repo/packages/%s/manifest.yaml", 
+    char *text = NULL;
+    size_t text_len = 0;
+    FILE *f, *mem;
+
+    snprintf(manifest_path, PATH_MAX_LEN, "%s/repo/packages/%s/manifest.yaml",
              cache, name);
-    
-    /* Check if file exists first to avoid race condition */
-    if (stat(manifest_path, &st) != 0) {
-        log_error("util_info", "Package not found");
-        return TINYPKG_NOT_FOUND;
-    }
-    
+
     f = fopen(manifest_path, "r");
     if (!f) {
-        log_error("util_info", "Could not open manifest");
-        return TINYPKG_ERR;
+        log_error("util_info", "Package not found");
+        *status = TINYPKG_NOT_FOUND;
+        return NULL;
     }
-    
-    printf("\n=== Package Information: %s ===\n\n", name);
-    
+
+    mem = open_memstream(&text, &text_len);
+    if (!mem) {
+        fclose(f);
+        *status = TINYPKG_ERR;
+        return NULL;
+    }
+
     while (fgets(line, sizeof(line), f)) {
         /* Remove trailing newline */
         line[strcspn(line, "\n")] = 0;
-        
+
         /* Skip empty lines and comment lines */
         if (line[0] == '\0' || line[0] == '#') {
             continue;
         }
-        
+
         /* Format output */
-        if (strstr(line, ":")) {
-            printf("%s\n", line);
-        } else if (line[0] == ' ') {
-            printf("%s\n", line);
+        if (strstr(line, ":") || line[0] == ' ') {
+            fprintf(mem, "%s\n", line);
         }
     }
-    
+
     fclose(f);
-    printf("\n");
-    
-    return TINYPKG_OK;
+    fclose(mem);
+    *status = TINYPKG_OK;
+    return text;
 }
 
-/* List all available packages */
-int util_list(void) {
-    char *cache = get_cache_path();
-    char index_path[PATH_MAX_LEN];
-    FILE *f;
-    char line[LINE_MAX_LEN];
-    struct stat st;
-    
-    if (!cache) {
-        log_error("util_list", "Failed to get cache path");
+/* Display detailed information about a package */
+int catalog_info(struct catalog *cat, const char *name, FILE *out) {
+    struct catalog_entry *e;
+    char *text;
+    int status;
+
+    if (!name || !name[0]) {
+        log_error("util_info", "Package name required");
         return TINYPKG_ERR;
     }
-    
-    snprintf(index_path, PATH_MAX_LEN, "%s/index.yaml", cache);
-    
-    /* Check if cache exists */
-    if (stat(index_path, &st) != 0) {
-        log_error("util_list", "Repository not synced - run 'tinypkg repo sync' first");
+
+    if (!is_valid_package_name(name)) {
+        log_error("util_info", "Invalid package name");
         return TINYPKG_ERR;
     }
-    
-    f = fopen(index_path, "r");
-    if (!f) {
-        log_error("util_list", "Could not open index");
+
+    /* Indexed packages keep their formatted manifest after first use */
+    e = cat ? catalog_find(cat, name) : NULL;
+    if (e && e->manifest) {
+        text = e->manifest;
+    } else {
+        text = load_manifest_text(name, &status);
+        if (!text) {
+            return status;
+        }
+        if (e) {
+            e->manifest = text;
+        }
+    }
+
+    fprintf(out, "\n=== Package Information: %s ===\n\n", name);
+    fputs(text, out);
+    fprintf(out, "\n");
+
+    if (!e) {
+        free(text);
+    }
+    return TINYPKG_OK;
+}
+
+/* List all available packages */
+int catalog_list(const struct catalog *cat, FILE *out) {
+    fprintf(out, "\nAvailable Packages:\n");
+    fprintf(out, "===================\n\n");
+
+    for (size_t i = 0; i < cat->count; i++) {
+        const struct catalog_entry *e = &cat->entries[i];
+        fprintf(out, " %-20s %s\n", e->name, e->version[0] ? e->version : "unknown");
+    }
+
+    fprintf(out, "\n===================\n");
+    fprintf(out, "Total: %zu packages\n\n", cat->count);
+
+    return TINYPKG_OK;
+}
+
+/* Report whether a package is recorded in installed.db */
+int catalog_is_installed(const struct catalog *cat, const char *name, FILE *out) {
+    struct installed_entry key;
+    const struct installed_entry *e = NULL;
+
+    if (!name || !is_valid_package_name(name)) {
+        log_error("util_is_installed", "Invalid package name");
         return TINYPKG_ERR;
     }
-    
-    printf("\nAvailable Packages:\n");
-    printf("===================\n\n");
-    
-    int in_packages = 0;
-    int count = 0;
-    
-    while (fgets(line, sizeof(line), f)) {
-        if (!in_packages && strstr(line, "packages:")) {
-            in_packages = 1;
+
+    memset(&key, 0, sizeof(key));
+    strncpy(key.name, name, sizeof(key.name) - 1);
+    if (cat->installed_count > 0) {
+        e = bsearch(&key, cat->installed, cat->installed_count,
+                    sizeof(key), installed_cmp);
+    }
+
+    if (!e) {
+        fprintf(out, "%s is not installed\n", name);
+        return TINYPKG_NOT_FOUND;
+    }
+
+    fprintf(out, "%s %s%s%s\n", e->name, e->version[0] ? e->version : "unknown",
+            e->profile[0] ? " " : "", e->profile);
+    return TINYPKG_OK;
+}
+
+/* Run one named query (search, info, list, is-installed) */
+int catalog_dispatch(struct catalog *cat, const char *cmd, const char *arg, FILE *out) {
+    if (strcmp(cmd, "search") == 0) {
+        return catalog_search(cat, arg, out);
+    }
+    if (strcmp(cmd, "info") == 0) {
+        return catalog_info(cat, arg, out);
+    }
+    if (strcmp(cmd, "list") == 0) {
+        return catalog_list(cat, out);
+    }
+    if (strcmp(cmd, "is-installed") == 0) {
+        return catalog_is_installed(cat, arg, out);
+    }
+
+    log_error("catalog_dispatch", "Unknown command");
+    return TINYPKG_ERR;
+}
+
+/* ============================================================================
+ * Batch mode
+ * ============================================================================
+ */
+
+/* Commands catalog_dispatch() answers (metrics label only these) */
+static int is_query(const char *cmd) {
+    return strcmp(cmd, "search") == 0 || strcmp(cmd, "info") == 0 ||
+           strcmp(cmd, "list") == 0 || strcmp(cmd, "is-installed") == 0;
+}
+
+static const char *status_word(int status) {
+    if (status == TINYPKG_OK) return "ok";
+    if (status == TINYPKG_NOT_FOUND) return "not-found";
+    return "error";
+}
+
+/*
+ * Read "<cmd> <arg>" lines and answer each from one resident catalog.
+ * Every answer is one record:
+ *
+ *   <cmd>\t<arg>\t<ok|not-found|error>\n
+ *   <command output, including its diagnostics>
+ *   \x1e\n
+ */
+int util_batch(FILE *in, FILE *out) {
+    struct catalog cat;
+    char line[LINE_MAX_LEN];
+    int loaded;
+
+    loaded = catalog_load(&cat) == TINYPKG_OK;
+    if (!loaded) {
+        memset(&cat, 0, sizeof(cat));
+    }
+
+    while (fgets(line, sizeof(line), in)) {
+        char *cmd = line, *arg, *body = NULL;
+        size_t body_len = 0;
+        FILE *mem;
+        int status;
+
+        line[strcspn(line, "\r\n")] = '\0';
+        while (*cmd == ' ' || *cmd == '\t') cmd++;
+        if (*cmd == '\0' || *cmd == '#') {
             continue;
         }
-        
-        if (!in_packages) continue;
-        
-        /* Package entries: 2-space indent, name followed by colon */
-        if (line[0] == ' ' && line[1] == ' ' && line[2] != ' ' && line[2] != '\0') {
-            char name[128] = {0};
-            char version[64] = {0};
-            
-            if (sscanf(line + 2, "%127[^:]:", name) == 1) {
-                /* Try to get version from next lines */
-                char next_line[LINE_MAX_LEN];
-                
-                while (fgets(next_line, sizeof(next_line), f)) {
-                    if (next_line[0] != ' ' || next_line[1] != ' ' || next_line[2] == ' ') {
-                        break;
-                    }
-                    
-                    if (strstr(next_line, "version:")) {
-                        sscanf(next_line, "%*[^:]:%*[ ]%63s", version);
-                        break;
-                    }
-                }
-                
-                printf(" %-20s %s\n", name, version[0] ? version : "unknown");
-                count++;
+
+        arg = cmd + strcspn(cmd, " \t");
+        if (*arg) {
+            *arg++ = '\0';
+            while (*arg == ' ' || *arg == '\t') arg++;
+        }
+        for (size_t n = strlen(arg); n > 0 && (arg[n - 1] == ' ' || arg[n - 1] == '\t'); n--) {
+            arg[n - 1] = '\0';
+        }
+
+        mem = open_memstream(&body, &body_len);
+        if (!mem) {
+            catalog_free(&cat);
+            return TINYPKG_ERR;
+        }
+
+        /* Diagnostics belong to the record, not to the terminal */
+        log_redirect(mem, mem);
+        if (!loaded && strcmp(cmd, "info") != 0) {
+            log_error("util_batch", "Repository not synced - run 'tinypkg repo sync' first");
+            status = TINYPKG_ERR;
+        } else {
+            struct timespec t0;
+
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            status = catalog_dispatch(loaded ? &cat : NULL, cmd, arg, mem);
+            if (is_query(cmd)) {
+                metrics_observe(METRIC_QUERY_SECONDS, cmd, metrics_since(&t0));
             }
         }
+        log_redirect(NULL, NULL);
+        fclose(mem);
+
+        fprintf(out, "%s\t%s\t%s\n", cmd, arg, status_word(status));
+        fwrite(body, 1, body_len, out);
+        if (body_len > 0 && body[body_len - 1] != '\n') {
+            fputc('\n', out);
+        }
+        fprintf(out, "%c\n", BATCH_RECORD_SEP);
+        fflush(out);    /* Stream each answer as soon as it is ready */
+
+        free(body);
     }
-    
-    fclose(f);
-    
-    printf("\n===================\n");
-    printf("Total: %d packages\n\n", count);
-    
+
+    catalog_free(&cat);
     return TINYPKG_OK;
 }
+
+/* ============================================================================
+ * One-shot commands
+ * ============================================================================
+ */
+
+int util_search(const char *term) {
+    struct catalog cat;
+    int ret;
+
+    if (!term || !term[0]) {
+        log_error("util_search", "Search term required");
+        return TINYPKG_ERR;
+    }
+
+    if (catalog_load(&cat) != TINYPKG_OK) {
+        return TINYPKG_ERR;
+    }
+    ret = catalog_search(&cat, term, stdout);
+    catalog_free(&cat);
+    return ret;
+}
+
+int util_info(const char *name) {
+    /* A single lookup reads only the manifest, not the whole index */
+    return catalog_info(NULL, name, stdout);
+}
+
+int util_list(void) {
+    struct catalog cat;
+    int ret;
+
+    if (catalog_load(&cat) != TINYPKG_OK) {
+        return TINYPKG_ERR;
+    }
+    ret = catalog_list(&cat, stdout);
+    catalog_free(&cat);
+    return ret;
+}
+
+int util_is_installed(const char *name) {
+    struct catalog cat;
+    int ret;
+
+    memset(&cat, 0, sizeof(cat));
+    if (catalog_load_installed(&cat) != TINYPKG_OK) {
+        return TINYPKG_ERR;
+    }
+    ret = catalog_is_installed(&cat, name, stdout);
+    catalog_free(&cat);
+    return ret;
+}